@@ -56,11 +56,13 @@
 #include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <limits.h> /* INT_MAX */
 #include <string.h> /* memset */
 #include <stdarg.h>
 
+#ifndef QZSTD_SW_ONLY
 #ifdef INTREE
 #include "qat/cpa.h"
 #include "qat/cpa_dc.h"
@@ -72,24 +74,35 @@
 #include "icp_sal_poll.h"
 #include "icp_sal_user.h"
 #endif
+#endif
 
 #include "qatseqprod.h"
+#include "qatseqprod_sw.h"
 
+#ifndef QZSTD_SW_ONLY
 #ifdef INTREE
 #include "qat/qae_mem.h"
 #else
 #include "qae_mem.h"
 #endif
+#endif
 
 #define KB                             (1024)
 
 #define COMP_LVL_MINIMUM               (1)
 #define COMP_LVL_MAXIMUM               (12)
+#define COMP_LVL_HYBRID_MAXIMUM        (22)
 #define NUM_BLOCK_OF_RETRY_INTERVAL    (1000)
 
 #define MAX_GRAB_RETRY                 (10)
 #define MAX_SEND_REQUEST_RETRY         (5)
 #define MAX_DEVICES                    (256)
+/* Sessions only differ by hwLevel and minMatch, every setup gets a slot */
+#define MAX_INST_SESSIONS              (2 * COMP_LVL_MAXIMUM)
+#define MAX_NODES                      (8)
+#define STATE_CACHE_PER_THREAD         (4)
+#define STATE_POOL_MAX                 (64)
+#define MEM_HEADER_SZ                  (64)
 
 #define SECTION_NAME_SIZE              (32)
 
@@ -103,25 +116,258 @@
 
 #define LZ4MINMATCH 2
 
+/* CPU optimal parsing of hybrid levels */
+#define OPT_MINMATCH 3
+#define OPT_HASH_LOG 16
+#define OPT_REP_NUM 3
+#define OPT_BITCOST_ACCURACY 8
+#define OPT_BITCOST_MULTIPLIER (1 << OPT_BITCOST_ACCURACY)
+#define OPT_SEQ_COST (4 * OPT_BITCOST_MULTIPLIER)
+#define OPT_OFF_CODE_COST (2 * OPT_BITCOST_MULTIPLIER)
+#define OPT_ML_CODE_COST (2 * OPT_BITCOST_MULTIPLIER)
+#define OPT_MAX_CANDIDATES 64
+#define OPT_MAX_PRICE (1U << 30)
+#define POST_LIT_COST (6 * OPT_BITCOST_MULTIPLIER)
+
+/* Match finding in long literal runs */
+#define LIT_SEARCH_MINMATCH 4
+#define LIT_SEARCH_HASH_LOG 12
+#define LIT_SEARCH_BUCKET_LOG 2
+#define LIT_SEARCH_BUCKET_SIZE (1 << LIT_SEARCH_BUCKET_LOG)
+#define LIT_SEARCH_INSERT_STEP 8
+
+/* Long distance matching */
+#define LZ4S_MAX_OFFSET 65535
+#define LDM_MIN_MATCH 64
+#define LDM_HASH_LOG 16
+#define LDM_BUCKET_SIZE 4
+#define LDM_HASH_RATE_LOG 7
+#define LDM_MAX_MATCHES (ZSTD_BLOCKSIZE_MAX / LDM_MIN_MATCH)
+#define DICT_MINMATCH 4
+#define DICT_HASH_LOG 15
+#define DICT_BUCKET_LOG 2
+#define DICT_BUCKET_SIZE (1 << DICT_BUCKET_LOG)
+/* Upper bound of the header of a zstd dictionary: magic, dictID, the Huffman
+ * table, the three FSE tables and the repcodes */
+#define DICT_HEADER_MAX 384
+#define ADAPT_INTERVAL 16 /* Blocks between two decisions of the level controller */
+#define ADAPT_HEADROOM_PERCENT 20 /* Margin over the target needed to go up a level */
+#define ADAPT_RATIO_SCALE 1024
+#define ADAPT_RATIO_MIN_GAIN 4 /* In 1/ADAPT_RATIO_SCALE, gain needed to keep going up */
+#define ESTIMATE_SAMPLE_SIZE (64 * KB) /* Window of QAT, smaller samples miss matches */
+#define ESTIMATE_LEVEL 3 /* Level whose QAT session compresses the samples */
+#define ESTIMATE_BLOCK_HEADER 3
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5 /* The last literals of a block, no match may cover them */
+#define LZ4_MFLIMIT 12 /* The last match must start this far from the end of a block */
+#define LZ4_BLOCK_SIZE (64 * KB) /* Max block size of LZ4 frames written */
+#define LZ4F_MAGIC 0x184D2204U
+#define LZ4F_HEADER_SIZE 15 /* Magic, FLG, BD, content size and header checksum */
+#define LZ4F_BLOCK_UNCOMPRESSED 0x80000000U
+
 /* Max latency of polling in the worst condition */
 #define MAXTIMEOUT 2000000
 
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME32_4 0x27D4EB2FU
+#define XXH_PRIME32_5 0x165667B1U
+
 #define TIMESPENT(a, b) ((a.tv_sec * 1000000 + a.tv_usec) - (b.tv_sec * 1000000 + b.tv_usec))
 
+/** QZSTD_SeqProdParams_T:
+ *  Parameters of a sequence producer state, all zero by default
+ */
+typedef struct QZSTD_SeqProdParams_S {
+    int postOptimize;
+    int literalSearch; /* Min length of literal runs to search, 0: disabled */
+    int longDistance;
+    int blockChecksum;
+    int sequenceStats;
+} QZSTD_SeqProdParams_T;
+
+/** QZSTD_AdaptState_T:
+ *  State of the adaptive level controller, measured over ADAPT_INTERVAL blocks
+ */
+typedef struct QZSTD_AdaptState_S {
+    QZSTD_AdaptiveParams_T params;
+    int enabled;
+    int level; /* Effective compression level */
+    unsigned int blocks;
+    unsigned int congested; /* Blocks submitted while all instances were busy */
+    unsigned long long bytes;
+    unsigned long long blockUs; /* Time spent in the sequence producer */
+    unsigned int ratio[COMP_LVL_HYBRID_MAXIMUM + 1]; /* LZ4s produced / consumed of every level,
+                                                     * in 1/ADAPT_RATIO_SCALE, 0: unknown */
+} QZSTD_AdaptState_T;
+
+/** QZSTD_Xxh32_T:
+ *  Streaming XXH32 state
+ */
+typedef struct QZSTD_Xxh32_S {
+    unsigned long long totalLen;
+    unsigned int v[4];
+    unsigned char mem[16]; /* Input not hashed yet */
+    unsigned int memSize;
+} QZSTD_Xxh32_T;
+
+/** QZSTD_ChecksumState_T:
+ *  Block checksums of the current frame, kept when QZSTD_p_blockChecksum is set
+ */
+typedef struct QZSTD_ChecksumState_S {
+    QZSTD_blockChecksumCallback callback;
+    void *opaque;
+    unsigned int blockChecksum; /* Checksum of QAT of the current block */
+    int blockChecksumValid; /* 1: blockChecksum was returned by QAT */
+    QZSTD_Xxh32_T frame; /* Digest of the block records */
+    QZSTD_FrameChecksum_T info;
+} QZSTD_ChecksumState_T;
+
+/** QZSTD_StageTimer_T:
+ *  Stage times of the current block, kept while a callback is set
+ */
+typedef struct QZSTD_StageTimer_S {
+    QZSTD_stageTimesCallback callback;
+    void *opaque;
+    QZSTD_StageTimes_T times;
+    unsigned long long stamp; /* End of the last stage */
+} QZSTD_StageTimer_T;
+
+/** QZSTD_FrameState_T:
+ *  Frame started by QZSTD_beginFrame, long distance and dictionary matches are
+ *  only searched in its blocks
+ */
+typedef struct QZSTD_FrameState_S {
+    const unsigned char *src; /* Where zstd reads the frame from, NULL: unknown */
+    const unsigned char *prevEnd; /* End of the previous block, NULL before the first one */
+    unsigned long long pos; /* Frame position of the next block */
+    unsigned long long remaining; /* Bytes of the frame left, 0: no frame */
+    int sizeKnown; /* 0: the frame lasts until the next QZSTD_beginFrame */
+    int posKnown; /* 1: no block before the first one was skipped, pos is exact */
+    unsigned long long histPos; /* Frame position where the history starts */
+    const unsigned char *segSrc; /* Start of the contiguous segment of the current block */
+    unsigned long long segPos; /* Frame position of segSrc */
+    const unsigned char *prevSegSrc; /* Segment before the last wrap, NULL: none */
+    unsigned long long prevSegPos; /* Frame position of prevSegSrc, it ends at segPos */
+    unsigned long long prevSegLow; /* Lowest position of prevSegSrc not overwritten */
+} QZSTD_FrameState_T;
+
 /** QZSTD_Session_T:
- *  This structure contains all session parameters including a buffer used to store
- *  lz4s output for current session and other parameters
+ *  This structure contains all session parameters
  */
 typedef struct QZSTD_Session_S {
     int instHint; /*which instance we last used*/
-    unsigned char
-    *qatIntermediateBuf;  /* Buffer to store lz4s output for decoding */
+    QZSTD_customMem customMem; /* Allocator of this state */
     unsigned char reqPhyContMem; /* 1: QAT requires physically contiguous memory */
     CpaDcSessionSetupData
     sessionSetupData; /* Session set up data for this session */
     unsigned int failOffloadCnt; /* Failed offloading requests counter */
+    QZSTD_SeqProdParams_T params; /* Set by QZSTD_setSeqProdParameter */
+    struct QZSTD_OptWksp_S *optWksp; /* Workspace of hybrid levels, allocated on first use */
+    unsigned int *litSearchTable; /* Hash table of literal search, allocated on first use */
+    struct QZSTD_LdmState_S *ldm; /* Long distance matching state, allocated on first use */
+    struct QZSTD_DictIndex_S *dictIndex; /* Shared index of the referenced dictionary, NULL: none */
+    QZSTD_AdaptState_T adapt; /* Adaptive level controller */
+    QZSTD_ChecksumState_T checksum; /* Block checksums of the frame */
+    QZSTD_StageTimer_T stageTimer; /* Stage times of the current block */
+    QZSTD_FrameState_T frame; /* Frame started by QZSTD_beginFrame */
+    struct QZSTD_Session_S *next; /* Next state in the state pool */
 } QZSTD_Session_T;
 
+/** QZSTD_LdmEntry_T:
+ *  A position of the history in the long distance matching hash table
+ */
+typedef struct QZSTD_LdmEntry_S {
+    unsigned int pos; /* Position in the stream + 1, 0 for an empty entry */
+    unsigned int checksum; /* Bits of the rolling hash not used for the bucket */
+} QZSTD_LdmEntry_T;
+
+/** QZSTD_LdmMatch_T:
+ *  A long distance match found in the current block
+ */
+typedef struct QZSTD_LdmMatch_S {
+    unsigned int start; /* Position in the block */
+    unsigned int len;
+    unsigned int off;
+} QZSTD_LdmMatch_T;
+
+/** QZSTD_LdmState_T:
+ *  Long distance matching state, kept across the blocks of a frame
+ */
+typedef struct QZSTD_LdmState_S {
+    QZSTD_LdmEntry_T hashTable[1 << LDM_HASH_LOG][LDM_BUCKET_SIZE];
+    unsigned long long gearTab[256]; /* Gear table of the rolling hash */
+    unsigned int nextPos;   /* Stream position of the next block */
+    unsigned int frameBase; /* Stream position of the start of the frame */
+    QZSTD_LdmMatch_T matches[LDM_MAX_MATCHES];
+    unsigned int nbMatches;
+} QZSTD_LdmState_T;
+
+/** QZSTD_DictIndex_T:
+ *  Hash index of a dictionary referenced by QZSTD_refDict, shared by the states
+ *  referencing the same dictionary with the same allocator, and freed when the
+ *  last of them drops it
+ */
+typedef struct QZSTD_DictIndex_S {
+    const void *dict; /* Dictionary the index was built from */
+    size_t dictSize;
+    const unsigned char *content; /* Dictionary without its header, ends with the dictionary */
+    size_t contentSize;
+    QZSTD_customMem customMem; /* Allocator of the index */
+    unsigned int refCount; /* States referencing the index */
+    struct QZSTD_DictIndex_S *next; /* Next index of gProcess.dictIndexes */
+    unsigned int table[1 << (DICT_HASH_LOG + DICT_BUCKET_LOG)]; /* Content positions + 1 */
+} QZSTD_DictIndex_T;
+
+/** QZSTD_OptNode_T:
+ *  The cheapest known way to reach a position of the block in the optimal parse
+ */
+typedef struct QZSTD_OptNode_S {
+    unsigned int price;
+    unsigned int off;  /* Offset of the match ending here, 0 if reached by a literal */
+    unsigned int mlen; /* Length of the match ending here */
+    unsigned int rep[OPT_REP_NUM]; /* Repeat offsets after reaching here */
+} QZSTD_OptNode_T;
+
+/** QZSTD_OptCandidate_T:
+ *  A match found at the current position of the optimal parse
+ */
+typedef struct QZSTD_OptCandidate_S {
+    unsigned int off;
+    unsigned int len;
+    int repIdx; /* Index of the repeat offset, -1 if it's not a repeat offset */
+} QZSTD_OptCandidate_T;
+
+/** QZSTD_OptWksp_T:
+ *  Workspace of the CPU refinement pass of hybrid levels, sized for
+ *  ZSTD_BLOCKSIZE_MAX and kept by the sequence producer state
+ */
+typedef struct QZSTD_OptWksp_S {
+    unsigned int hashTable[1 << OPT_HASH_LOG]; /* Last position + 1 of every hash */
+    unsigned int chainTable[ZSTD_BLOCKSIZE_MAX]; /* Previous position + 1 of same hash */
+    QZSTD_OptNode_T nodes[ZSTD_BLOCKSIZE_MAX + 1];
+    unsigned int litPrice[256];
+} QZSTD_OptWksp_T;
+
+/** QZSTD_OptParams_T:
+ *  Search parameters of a hybrid level
+ */
+typedef struct QZSTD_OptParams_S {
+    unsigned int searchDepth;   /* Max positions visited in a hash chain */
+    unsigned int sufficientLen; /* Matches this long are taken without parsing */
+} QZSTD_OptParams_T;
+
+/** QZSTD_InstSession_T:
+ *  A QAT session that has been set up on an instance, identified by
+ *  its session setup data
+ */
+typedef struct QZSTD_InstSession_S {
+    CpaDcSessionSetupData sessionSetupData;
+    CpaDcSessionHandle cpaSessHandle;
+    unsigned char cpaSessSetup;
+} QZSTD_InstSession_T;
+
 /** QZSTD_Instance_T:
  *  This structure contains instance parameter, every session need to grab one
  *  instance to submit request
@@ -130,10 +376,11 @@ typedef struct QZSTD_Instance_S {
     CpaInstanceInfo2 instanceInfo;
     CpaDcInstanceCapabilities instanceCap;
     CpaStatus jobStatus;
-    CpaDcSessionSetupData sessionSetupData;
-    CpaDcSessionHandle cpaSessHandle;
+    QZSTD_InstSession_T sessions[MAX_INST_SESSIONS]; /* Sessions set up on this instance */
+    unsigned int nextSessEvict; /* Slot to replace when all sessions are in use */
     CpaDcRqResults res;
     Cpa32U buffMetaSize;
+    Cpa32U lz4sBound; /* LZ4s compress bound of ZSTD_BLOCKSIZE_MAX */
     CpaStatus instStartStatus;
     unsigned char reqPhyContMem; /* 1: QAT requires physically contiguous memory */
 
@@ -145,15 +392,111 @@ typedef struct QZSTD_Instance_S {
 
     unsigned int lock;
     unsigned char memSetup;
-    unsigned char cpaSessSetup;
     unsigned char dcInstSetup;
     unsigned int numRetries;
 
     unsigned int seqNumIn;
     unsigned int seqNumOut;
     int cbStatus;
+    struct QZSTD_PoolBuf_S *quarantine; /* Buffers of timed out requests */
 } QZSTD_Instance_T;
 
+/** QZSTD_PoolBuf_T:
+ *  A buffer to store lz4s output, taken from a buffer pool for the time
+ *  of one request
+ */
+typedef struct QZSTD_PoolBuf_S {
+    unsigned char *data;
+    Cpa32U size;
+    unsigned int seqNum; /* seqNumIn of the timed out request still writing it */
+    struct QZSTD_PoolBuf_S *next;
+} QZSTD_PoolBuf_T;
+
+/** QZSTD_BufPool_T:
+ *  Pool of lz4s output buffers shared by the instances on one NUMA node.
+ *  Every request holds one buffer while its instance is grabbed, so the pool
+ *  grows to the number of concurrent requests rather than the number of
+ *  sequence producer states.
+ */
+typedef struct QZSTD_BufPool_S {
+    unsigned int lock;
+    QZSTD_PoolBuf_T *freeList;
+    unsigned int numAllocated; /* Buffers allocated by this pool */
+    unsigned int numInUse;     /* Buffers currently taken from this pool */
+    unsigned int numQuarantined; /* Buffers in use by timed out requests */
+    unsigned int highWater;    /* Max number of buffers in use at the same time */
+    size_t allocatedBytes;
+} QZSTD_BufPool_T;
+
+/** QZSTD_PostOptStats_T:
+ *  Counters of the sequence post-optimizer
+ */
+typedef struct QZSTD_PostOptStats_S {
+    size_t seqsIn;
+    size_t seqsOut;
+    size_t extendedBytes;
+    size_t merged;
+    size_t pruned;
+    size_t prunedBytes;
+} QZSTD_PostOptStats_T;
+
+/** QZSTD_LitSearchStats_T:
+ *  Counters of the match finding in long literal runs
+ */
+typedef struct QZSTD_LitSearchStats_S {
+    size_t runs;
+    size_t runBytes;
+    size_t matches;
+    size_t matchBytes;
+} QZSTD_LitSearchStats_T;
+
+/** QZSTD_LdmStats_T:
+ *  Counters of long distance matching
+ */
+typedef struct QZSTD_LdmStats_S {
+    size_t matches;
+    size_t matchBytes;
+} QZSTD_LdmStats_T;
+
+/** QZSTD_DictStats_T:
+ *  Counters of the dictionary matches
+ */
+typedef struct QZSTD_DictStats_S {
+    size_t matches;
+    size_t matchBytes;
+} QZSTD_DictStats_T;
+
+/** QZSTD_Backend_T:
+ *  Entry points of the compression engine, QAT or the software engine
+ */
+typedef struct QZSTD_Backend_S {
+    int id; /* QZSTD_BACKEND_QAT or QZSTD_BACKEND_SW */
+    const char *name;
+    CpaStatus (*userStart)(const char *);
+    CpaStatus (*userStop)(void);
+    CpaStatus (*getNumInstances)(Cpa16U *);
+    CpaStatus (*getInstances)(Cpa16U, CpaInstanceHandle *);
+    CpaStatus (*instanceGetInfo2)(const CpaInstanceHandle, CpaInstanceInfo2 *);
+    CpaStatus (*queryCapabilities)(CpaInstanceHandle, CpaDcInstanceCapabilities *);
+    CpaStatus (*bufferListGetMetaSize)(const CpaInstanceHandle, Cpa32U, Cpa32U *);
+    CpaStatus (*getNumIntermediateBuffers)(CpaInstanceHandle, Cpa16U *);
+    CpaStatus (*setAddressTranslation)(const CpaInstanceHandle, CpaVirtualToPhysical);
+    CpaStatus (*startInstance)(CpaInstanceHandle, Cpa16U, CpaBufferList **);
+    CpaStatus (*stopInstance)(CpaInstanceHandle);
+    CpaStatus (*getSessionSize)(CpaInstanceHandle, CpaDcSessionSetupData *,
+                                Cpa32U *, Cpa32U *);
+    CpaStatus (*initSession)(CpaInstanceHandle, CpaDcSessionHandle,
+                             CpaDcSessionSetupData *, CpaBufferList *, CpaDcCallbackFn);
+    CpaStatus (*removeSession)(const CpaInstanceHandle, CpaDcSessionHandle);
+    CpaStatus (*lz4sCompressBound)(const CpaInstanceHandle, Cpa32U, Cpa32U *);
+    CpaStatus (*compressData2)(CpaInstanceHandle, CpaDcSessionHandle, CpaBufferList *,
+                               CpaBufferList *, CpaDcOpData *, CpaDcRqResults *, void *);
+    CpaStatus (*pollInstance)(CpaInstanceHandle, Cpa32U);
+    void *(*memAllocNUMA)(size_t, int, size_t);
+    void (*memFreeNUMA)(void **);
+    uint64_t (*virtToPhysNUMA)(void *);
+} QZSTD_Backend_T;
+
 /** QZSTD_ProcessData_T:
  *  Process data for controlling instance resource
  */
@@ -163,8 +506,42 @@ typedef struct QZSTD_ProcessData_S {
     QZSTD_Instance_T *qzstdInst;
     Cpa16U numInstances;
     pthread_mutex_t mutex;
+    QZSTD_BufPool_T bufPools[MAX_NODES][2]; /* Indexed by node and reqPhyContMem */
+    QZSTD_Session_T *statePool; /* Released sequence producer states */
+    QZSTD_DictIndex_T *dictIndexes; /* Dictionary indexes referenced by states */
+    pthread_mutex_t dictIndexMutex;
+    unsigned int statePoolSize; /* States in statePool, at most STATE_POOL_MAX */
+    unsigned int statePoolLock;
+    QZSTD_customMem customMem; /* Allocator of device resources */
+    size_t memBytes[2]; /* Bytes allocated, indexed by reqPhyContMem */
+    QZSTD_PostOptStats_T postOptStats;
+    QZSTD_LitSearchStats_T litSearchStats;
+    QZSTD_LdmStats_T ldmStats;
+    QZSTD_DictStats_T dictStats;
+    QZSTD_LevelProfile_T profiles[COMP_LVL_HYBRID_MAXIMUM + 1]; /* Indexed by level, hwLevel 0: default */
+    unsigned int profilesLock; /* Held to read or write profiles */
+    unsigned int inflight; /* Requests submitted to QAT and not polled yet */
+    size_t failedBlocks; /* Blocks the sequence producer returned an error for */
+    QZSTD_SeqStats_T seqStats; /* Sequences decoded with QZSTD_p_sequenceStats */
+    const QZSTD_Backend_T *backend; /* Engine the instances belong to */
 } QZSTD_ProcessData_T;
 
+/** QZSTD_MemHeader_T:
+ *  Stored in front of every allocation of QZSTD_callocMem
+ */
+typedef struct QZSTD_MemHeader_S {
+    size_t size;
+} QZSTD_MemHeader_T;
+
+/** QZSTD_StateCache_T:
+ *  Per-thread cache of released sequence producer states, which lets a thread
+ *  reuse its states without touching the process state pool
+ */
+typedef struct QZSTD_StateCache_S {
+    QZSTD_Session_T *states[STATE_CACHE_PER_THREAD];
+    unsigned int num;
+} QZSTD_StateCache_T;
+
 typedef struct QZSTD_InstanceList_S {
     QZSTD_Instance_T instance;
     CpaInstanceHandle dcInstHandle;
@@ -179,11 +556,69 @@ typedef struct QZSTD_Hardware_S {
 
 QZSTD_ProcessData_T gProcess = {
     .qzstdInitStatus = QZSTD_FAIL,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .dictIndexMutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* Search parameters of levels COMP_LVL_MAXIMUM + 1 to COMP_LVL_HYBRID_MAXIMUM */
+static const QZSTD_OptParams_T gOptParams[COMP_LVL_HYBRID_MAXIMUM - COMP_LVL_MAXIMUM] = {
+    { 4, 32 }, { 6, 48 }, { 8, 64 }, { 12, 96 }, { 16, 128 },
+    { 24, 192 }, { 32, 256 }, { 48, 384 }, { 64, 512 }, { 96, 999 }
+};
+
+static __thread QZSTD_StateCache_T tlsStateCache;
+static pthread_key_t gStateCacheKey;
+static pthread_once_t gStateCacheOnce = PTHREAD_ONCE_INIT;
+
+static void QZSTD_drainStatePool(void);
+
+/** QZSTD_Capture_T:
+ *  Record of the calls of qatSequenceProducer, see QZSTD_startCapture
+ */
+typedef struct QZSTD_Capture_S {
+    FILE *file; /* NULL: not capturing, read without the lock by the calls */
+    pthread_mutex_t mutex;
+    struct timespec start;
+    int hash;
+    unsigned int sampleBytes;
+    int fromEnv; /* Started by QZSTD_CAPTURE, stopped with the device */
+    unsigned long long records;
+} QZSTD_Capture_T;
+
+static QZSTD_Capture_T gCapture = {
     .mutex = PTHREAD_MUTEX_INITIALIZER
 };
+static unsigned int gCaptureThreads; /* Threads given an index in captures */
+static __thread unsigned int tlsCaptureThread; /* Index + 1, 0: not given yet */
 
+#ifndef QZSTD_SW_ONLY
 extern CpaStatus icp_adf_get_numDevices(Cpa32U *);
 
+static const QZSTD_Backend_T gQatBackend = {
+    QZSTD_BACKEND_QAT, "qat",
+    icp_sal_userStart, icp_sal_userStop,
+    cpaDcGetNumInstances, cpaDcGetInstances, cpaDcInstanceGetInfo2,
+    cpaDcQueryCapabilities, cpaDcBufferListGetMetaSize,
+    cpaDcGetNumIntermediateBuffers, cpaDcSetAddressTranslation,
+    cpaDcStartInstance, cpaDcStopInstance, cpaDcGetSessionSize,
+    cpaDcInitSession, cpaDcRemoveSession, cpaDcLZ4SCompressBound,
+    cpaDcCompressData2, icp_sal_DcPollInstance,
+    qaeMemAllocNUMA, qaeMemFreeNUMA, qaeVirtToPhysNUMA
+};
+#endif
+
+static const QZSTD_Backend_T gSwBackend = {
+    QZSTD_BACKEND_SW, "sw",
+    QZSTD_swUserStart, QZSTD_swUserStop,
+    QZSTD_swGetNumInstances, QZSTD_swGetInstances, QZSTD_swInstanceGetInfo2,
+    QZSTD_swQueryCapabilities, QZSTD_swBufferListGetMetaSize,
+    QZSTD_swGetNumIntermediateBuffers, QZSTD_swSetAddressTranslation,
+    QZSTD_swStartInstance, QZSTD_swStopInstance, QZSTD_swGetSessionSize,
+    QZSTD_swInitSession, QZSTD_swRemoveSession, QZSTD_swLZ4SCompressBound,
+    QZSTD_swCompressData2, QZSTD_swPollInstance,
+    QZSTD_swMemAllocNUMA, QZSTD_swMemFreeNUMA, QZSTD_swVirtToPhysNUMA
+};
+
 int debugLevel = DEBUGLEVEL;
 
 #define QZSTD_DEBUG_PRINT(...) fprintf(stderr, __VA_ARGS__)
@@ -209,17 +644,101 @@ const char *QZSTD_version(void)
     return QZSTD_VERSION;
 }
 
+/** QZSTD_callocMem:
+ *    Allocate ordinary or physically contiguous memory (initialized to zero) with
+ *  the allocator in cMem, the default allocator is used if it isn't set. A header
+ *  in front of the returned memory records its size for memory statistics.
+ */
+static void *QZSTD_callocMem(size_t size, unsigned char reqPhyContMem, int node,
+                             const QZSTD_customMem *cMem)
+{
+    unsigned char *ptr;
+    QZSTD_MemHeader_T header;
+    size_t allocSize = size + MEM_HEADER_SZ;
+
+    if (size > (size_t)(-1) - MEM_HEADER_SZ) {
+        return NULL;
+    }
+
+    if (!reqPhyContMem) {
+        if (NULL != cMem->customAlloc) {
+            ptr = (unsigned char *)cMem->customAlloc(cMem->opaque, allocSize);
+        } else {
+            ptr = (unsigned char *)malloc(allocSize);
+        }
+    } else {
+        if (NULL != cMem->customPinnedAlloc) {
+            ptr = (unsigned char *)cMem->customPinnedAlloc(cMem->opaque, allocSize,
+                    node, MEM_HEADER_SZ);
+        } else {
+            ptr = (unsigned char *)gProcess.backend->memAllocNUMA(allocSize, node, MEM_HEADER_SZ);
+        }
+    }
+    if (NULL == ptr) {
+        return NULL;
+    }
+    memset(ptr, 0, allocSize);
+
+    header.size = size;
+    memcpy(ptr, &header, sizeof(QZSTD_MemHeader_T));
+    __sync_fetch_and_add(&gProcess.memBytes[reqPhyContMem ? 1 : 0], size);
+    return ptr + MEM_HEADER_SZ;
+}
+
+/** QZSTD_freeMem:
+ *    Free memory allocated by QZSTD_callocMem with the same allocator
+ */
+static void QZSTD_freeMem(void *ptr, unsigned char reqPhyContMem,
+                          const QZSTD_customMem *cMem)
+{
+    QZSTD_MemHeader_T header;
+    void *allocPtr;
+
+    if (NULL == ptr) {
+        return;
+    }
+    allocPtr = (unsigned char *)ptr - MEM_HEADER_SZ;
+    memcpy(&header, allocPtr, sizeof(QZSTD_MemHeader_T));
+    __sync_fetch_and_sub(&gProcess.memBytes[reqPhyContMem ? 1 : 0], header.size);
+
+    if (!reqPhyContMem) {
+        if (NULL != cMem->customFree) {
+            cMem->customFree(cMem->opaque, allocPtr);
+        } else {
+            free(allocPtr);
+        }
+    } else {
+        if (NULL != cMem->customPinnedFree) {
+            cMem->customPinnedFree(cMem->opaque, allocPtr);
+        } else {
+            gProcess.backend->memFreeNUMA(&allocPtr);
+        }
+    }
+}
+
 /** QZSTD_calloc:
  *    This function is used to allocate contiguous or discontiguous memory(initialized to zero)
  *  according to parameter and return pointer to allocated memory
  */
 static void *QZSTD_calloc(size_t nb, size_t size, unsigned char reqPhyContMem)
 {
-    if (!reqPhyContMem) {
-        return calloc(nb, size);
-    } else {
-        return qaeMemAllocNUMA(nb * size, 0, 64);
+    if (0 != size && nb > (size_t)(-1) / size) {
+        return NULL;
+    }
+    return QZSTD_callocMem(nb * size, reqPhyContMem, 0, &gProcess.customMem);
+}
+
+/** QZSTD_callocOnNode:
+ *    Same as QZSTD_calloc, but physically contiguous memory is allocated on
+ *  the given NUMA node
+ */
+static void *QZSTD_callocOnNode(size_t nb, size_t size,
+                                unsigned char reqPhyContMem, int node)
+{
+    if (0 != size && nb > (size_t)(-1) / size) {
+        return NULL;
     }
+    return QZSTD_callocMem(nb * size, reqPhyContMem, node, &gProcess.customMem);
 }
 
 /** QZSTD_free:
@@ -228,13 +747,23 @@ static void *QZSTD_calloc(size_t nb, size_t size, unsigned char reqPhyContMem)
  */
 static void QZSTD_free(void *ptr, unsigned char reqPhyContMem)
 {
-    if (!reqPhyContMem) {
-        free(ptr);
-        ptr = NULL;
-    } else {
-        qaeMemFreeNUMA(&ptr);
-        ptr = NULL;
+    QZSTD_freeMem(ptr, reqPhyContMem, &gProcess.customMem);
+}
+
+/** QZSTD_isValidCustomMem:
+ *    The alloc and free functions of each kind of memory must be both set or
+ *  both NULL, physically contiguous memory also needs address translation.
+ */
+static int QZSTD_isValidCustomMem(const QZSTD_customMem *cMem)
+{
+    if ((NULL == cMem->customAlloc) != (NULL == cMem->customFree)) {
+        return 0;
     }
+    if ((NULL == cMem->customPinnedAlloc) != (NULL == cMem->customPinnedFree) ||
+        (NULL == cMem->customPinnedAlloc) != (NULL == cMem->customVirtToPhys)) {
+        return 0;
+    }
+    return 1;
 }
 
 /** QZSTD_virtToPhys:
@@ -242,7 +771,259 @@ static void QZSTD_free(void *ptr, unsigned char reqPhyContMem)
  */
 static __inline CpaPhysicalAddr QZSTD_virtToPhys(void *virtAddr)
 {
-    return (CpaPhysicalAddr)qaeVirtToPhysNUMA(virtAddr);
+    if (NULL != gProcess.customMem.customVirtToPhys) {
+        return (CpaPhysicalAddr)gProcess.customMem.customVirtToPhys(
+                   gProcess.customMem.opaque, virtAddr);
+    }
+    return (CpaPhysicalAddr)gProcess.backend->virtToPhysNUMA(virtAddr);
+}
+
+static QZSTD_BufPool_T *QZSTD_getBufPool(int i, int *node)
+{
+    *node = (int)gProcess.qzstdInst[i].instanceInfo.nodeAffinity;
+    if (*node < 0 || *node >= MAX_NODES) {
+        *node = 0;
+    }
+    return &gProcess.bufPools[*node][gProcess.qzstdInst[i].reqPhyContMem ? 1 : 0];
+}
+
+static void QZSTD_lockBufPool(QZSTD_BufPool_T *pool)
+{
+    while (__sync_lock_test_and_set(&pool->lock, 1)) {
+        ;
+    }
+}
+
+static void QZSTD_unlockBufPool(QZSTD_BufPool_T *pool)
+{
+    __sync_lock_release(&pool->lock);
+}
+
+static QZSTD_PoolBuf_T *QZSTD_allocPoolBuf(QZSTD_BufPool_T *pool, Cpa32U size,
+        unsigned char reqPhyContMem, int node)
+{
+    QZSTD_PoolBuf_T *buf = (QZSTD_PoolBuf_T *)QZSTD_calloc(1, sizeof(QZSTD_PoolBuf_T), 0);
+    if (NULL == buf) {
+        return NULL;
+    }
+    buf->data = (unsigned char *)QZSTD_callocOnNode(1, size, reqPhyContMem, node);
+    if (NULL == buf->data) {
+        QZSTD_free(buf, 0);
+        return NULL;
+    }
+    buf->size = size;
+
+    QZSTD_lockBufPool(pool);
+    pool->numAllocated++;
+    pool->allocatedBytes += size;
+    QZSTD_unlockBufPool(pool);
+    return buf;
+}
+
+static void QZSTD_freePoolBuf(QZSTD_BufPool_T *pool, QZSTD_PoolBuf_T *buf,
+                              unsigned char reqPhyContMem)
+{
+    QZSTD_lockBufPool(pool);
+    pool->numAllocated--;
+    pool->allocatedBytes -= buf->size;
+    QZSTD_unlockBufPool(pool);
+
+    QZSTD_free(buf->data, reqPhyContMem);
+    QZSTD_free(buf, 0);
+}
+
+/** QZSTD_acquirePoolBuf:
+ *    Take a lz4s output buffer which fits the compress bound of instance i
+ *  from its buffer pool, a new buffer is allocated if the pool is empty.
+ */
+static QZSTD_PoolBuf_T *QZSTD_acquirePoolBuf(int i)
+{
+    int node;
+    unsigned char reqPhyContMem = gProcess.qzstdInst[i].reqPhyContMem;
+    QZSTD_BufPool_T *pool = QZSTD_getBufPool(i, &node);
+    QZSTD_PoolBuf_T *buf;
+
+    QZSTD_lockBufPool(pool);
+    buf = pool->freeList;
+    if (NULL != buf) {
+        pool->freeList = buf->next;
+        buf->next = NULL;
+    }
+    QZSTD_unlockBufPool(pool);
+
+    if (NULL != buf && buf->size < gProcess.qzstdInst[i].lz4sBound) {
+        QZSTD_freePoolBuf(pool, buf, reqPhyContMem);
+        buf = NULL;
+    }
+    if (NULL == buf) {
+        buf = QZSTD_allocPoolBuf(pool, gProcess.qzstdInst[i].lz4sBound,
+                                 reqPhyContMem, node);
+        if (NULL == buf) {
+            return NULL;
+        }
+    }
+
+    QZSTD_lockBufPool(pool);
+    pool->numInUse++;
+    if (pool->numInUse > pool->highWater) {
+        pool->highWater = pool->numInUse;
+    }
+    QZSTD_unlockBufPool(pool);
+    return buf;
+}
+
+/** QZSTD_releasePoolBuf:
+ *    Give back a buffer taken by QZSTD_acquirePoolBuf
+ */
+static void QZSTD_releasePoolBuf(int i, QZSTD_PoolBuf_T *buf)
+{
+    int node;
+    QZSTD_BufPool_T *pool = QZSTD_getBufPool(i, &node);
+
+    QZSTD_lockBufPool(pool);
+    buf->next = pool->freeList;
+    pool->freeList = buf;
+    pool->numInUse--;
+    QZSTD_unlockBufPool(pool);
+}
+
+/** QZSTD_reclaimPoolBufs:
+ *    Give back the buffers of timed out requests on instance i whose responses
+ *  have been polled since, or all of them if force is set. The caller must
+ *  hold the instance lock.
+ */
+static void QZSTD_reclaimPoolBufs(int i, int force)
+{
+    QZSTD_Instance_T *qzstdInst = &gProcess.qzstdInst[i];
+    QZSTD_PoolBuf_T **prev = &qzstdInst->quarantine;
+    QZSTD_PoolBuf_T *buf;
+    int node;
+    QZSTD_BufPool_T *pool = QZSTD_getBufPool(i, &node);
+
+    while (NULL != (buf = *prev)) {
+        if (!force && (int)(qzstdInst->seqNumOut - buf->seqNum) < 0) {
+            prev = &buf->next;
+            continue;
+        }
+        *prev = buf->next;
+        QZSTD_lockBufPool(pool);
+        pool->numQuarantined--;
+        QZSTD_unlockBufPool(pool);
+        QZSTD_releasePoolBuf(i, buf);
+    }
+}
+
+/** QZSTD_putPoolBuf:
+ *    Give back the buffer of a request on instance i. If the request was
+ *  submitted and its response hasn't been polled, QAT may still write the
+ *  buffer, so it's kept in quarantine until the response comes. The caller
+ *  must hold the instance lock.
+ */
+static void QZSTD_putPoolBuf(int i, QZSTD_PoolBuf_T *buf, int submitted)
+{
+    QZSTD_Instance_T *qzstdInst = &gProcess.qzstdInst[i];
+    int node;
+    QZSTD_BufPool_T *pool;
+
+    QZSTD_reclaimPoolBufs(i, 0);
+    if (!submitted || qzstdInst->seqNumIn == qzstdInst->seqNumOut) {
+        QZSTD_releasePoolBuf(i, buf);
+        return;
+    }
+    pool = QZSTD_getBufPool(i, &node);
+    buf->seqNum = qzstdInst->seqNumIn;
+    buf->next = qzstdInst->quarantine;
+    qzstdInst->quarantine = buf;
+    QZSTD_lockBufPool(pool);
+    pool->numQuarantined++;
+    QZSTD_unlockBufPool(pool);
+    QZSTD_LOG(1, "Request on instance %d not answered, its buffer is kept\n", i);
+}
+
+/** QZSTD_fillBufPool:
+ *    Add one buffer for instance i to its buffer pool, so the first
+ *  request on that instance doesn't need to allocate it
+ */
+static void QZSTD_fillBufPool(int i)
+{
+    int node;
+    QZSTD_BufPool_T *pool = QZSTD_getBufPool(i, &node);
+    QZSTD_PoolBuf_T *buf;
+
+    buf = QZSTD_allocPoolBuf(pool, gProcess.qzstdInst[i].lz4sBound,
+                             gProcess.qzstdInst[i].reqPhyContMem, node);
+    if (NULL == buf) {
+        QZSTD_LOG(1, "Failed to allocate memory\n");
+        return;
+    }
+    QZSTD_lockBufPool(pool);
+    buf->next = pool->freeList;
+    pool->freeList = buf;
+    QZSTD_unlockBufPool(pool);
+}
+
+/** QZSTD_clearBufPools:
+ *    Free all buffers of the buffer pools
+ */
+static void QZSTD_clearBufPools(void)
+{
+    QZSTD_BufPool_T *pool;
+    QZSTD_PoolBuf_T *buf;
+    int node, j;
+
+    for (node = 0; node < MAX_NODES; node++) {
+        for (j = 0; j < 2; j++) {
+            pool = &gProcess.bufPools[node][j];
+            while (NULL != pool->freeList) {
+                buf = pool->freeList;
+                pool->freeList = buf->next;
+                QZSTD_freePoolBuf(pool, buf, (unsigned char)j);
+            }
+            pool->highWater = pool->numInUse;
+        }
+    }
+}
+
+void QZSTD_getStats(QZSTD_Stats_T *stats)
+{
+    QZSTD_BufPool_T *pool;
+    int node, j;
+
+    if (NULL == stats) {
+        return;
+    }
+    memset(stats, 0, sizeof(QZSTD_Stats_T));
+    for (node = 0; node < MAX_NODES; node++) {
+        for (j = 0; j < 2; j++) {
+            pool = &gProcess.bufPools[node][j];
+            QZSTD_lockBufPool(pool);
+            stats->bufPoolAllocated += pool->numAllocated;
+            stats->bufPoolInUse += pool->numInUse;
+            stats->bufPoolQuarantined += pool->numQuarantined;
+            stats->bufPoolHighWater += pool->highWater;
+            stats->bufPoolBytes += pool->allocatedBytes;
+            QZSTD_unlockBufPool(pool);
+        }
+    }
+    stats->memBytes = __sync_fetch_and_add(&gProcess.memBytes[0], 0);
+    stats->memPinnedBytes = __sync_fetch_and_add(&gProcess.memBytes[1], 0);
+    stats->statePoolStates = __sync_fetch_and_add(&gProcess.statePoolSize, 0);
+    stats->postOptSeqsIn = gProcess.postOptStats.seqsIn;
+    stats->postOptSeqsOut = gProcess.postOptStats.seqsOut;
+    stats->postOptExtendedBytes = gProcess.postOptStats.extendedBytes;
+    stats->postOptMerged = gProcess.postOptStats.merged;
+    stats->postOptPruned = gProcess.postOptStats.pruned;
+    stats->postOptPrunedBytes = gProcess.postOptStats.prunedBytes;
+    stats->litSearchRuns = gProcess.litSearchStats.runs;
+    stats->litSearchRunBytes = gProcess.litSearchStats.runBytes;
+    stats->litSearchMatches = gProcess.litSearchStats.matches;
+    stats->litSearchMatchBytes = gProcess.litSearchStats.matchBytes;
+    stats->ldmMatches = gProcess.ldmStats.matches;
+    stats->ldmMatchBytes = gProcess.ldmStats.matchBytes;
+    stats->dictMatches = gProcess.dictStats.matches;
+    stats->dictMatchBytes = gProcess.dictStats.matchBytes;
+    stats->failedBlocks = gProcess.failedBlocks;
+    stats->seqStats = gProcess.seqStats;
 }
 
 static QZSTD_InstanceList_T *QZSTD_getInstance(unsigned int devId,
@@ -293,7 +1074,7 @@ static void QZSTD_clearDevices(QZSTD_Hardware_T *qatHw)
     for (i = 0; i <= qatHw->maxDevId; i++) {
         QZSTD_InstanceList_T *inst = QZSTD_getInstance(i, qatHw);
         while (inst) {
-            free(inst);
+            QZSTD_free(inst, 0);
             inst = NULL;
             inst = QZSTD_getInstance(i, qatHw);
         }
@@ -313,48 +1094,74 @@ static void QZSTD_stopQat(void)
         NULL != gProcess.qzstdInst) {
         for (i = 0; i < gProcess.numInstances; i++) {
             if (0 != gProcess.qzstdInst[i].dcInstSetup) {
-                status = cpaDcStopInstance(gProcess.dcInstHandle[i]);
+                status = gProcess.backend->stopInstance(gProcess.dcInstHandle[i]);
                 if (CPA_STATUS_SUCCESS != status) {
                     QZSTD_LOG(1, "Stop instance failed, status=%d\n", status);
                 }
             }
         }
 
-        free(gProcess.dcInstHandle);
+        QZSTD_free(gProcess.dcInstHandle, 0);
         gProcess.dcInstHandle = NULL;
-        free(gProcess.qzstdInst);
+        QZSTD_free(gProcess.qzstdInst, 0);
         gProcess.qzstdInst = NULL;
     }
 
-    (void)icp_sal_userStop();
+    (void)gProcess.backend->userStop();
 
     gProcess.numInstances = (Cpa16U)0;
     gProcess.qzstdInitStatus = QZSTD_FAIL;
 }
 
-static void QZSTD_removeSession(int i)
+/** QZSTD_cpaRemoveSess:
+ *    Remove a session from instance i
+ *  If QAT fails to remove it, the session stays set up, its handle may still
+ *  be used by QAT.
+ */
+static int QZSTD_cpaRemoveSess(QZSTD_InstSession_T *instSess, int i)
 {
     unsigned char reqPhyContMem = gProcess.qzstdInst[i].reqPhyContMem;
+
+    /* Remove session */
+    if (CPA_STATUS_SUCCESS != gProcess.backend->removeSession(
+            gProcess.dcInstHandle[i], instSess->cpaSessHandle)) {
+        QZSTD_LOG(1, "cpaDcRemoveSession failed\n");
+        return QZSTD_FAIL;
+    }
+
+    QZSTD_free(instSess->cpaSessHandle, reqPhyContMem);
+    instSess->cpaSessHandle = NULL;
+    instSess->cpaSessSetup = 0;
+
+    return QZSTD_OK;
+}
+
+static void QZSTD_removeSession(int i)
+{
+    QZSTD_InstSession_T *instSess;
     int rc;
+    int j;
 
-    if (0 == gProcess.qzstdInst[i].cpaSessSetup) {
+    if (NULL == gProcess.dcInstHandle[i]) {
         return;
     }
 
-    /* Remove session */
-    if ((NULL != gProcess.dcInstHandle[i]) &&
-        (NULL != gProcess.qzstdInst[i].cpaSessHandle)) {
-        /* polling here if there still are some responses haven't beed polled
-        *  if didn't poll there response, cpaDcRemoveSession will raise error message
-        */
-        do {
-            rc = icp_sal_DcPollInstance(gProcess.dcInstHandle[i], 0);
-        } while (CPA_STATUS_SUCCESS == rc);
-        cpaDcRemoveSession(gProcess.dcInstHandle[i],
-                           gProcess.qzstdInst[i].cpaSessHandle);
-        QZSTD_free(gProcess.qzstdInst[i].cpaSessHandle, reqPhyContMem);
-        gProcess.qzstdInst[i].cpaSessHandle = NULL;
-        gProcess.qzstdInst[i].cpaSessSetup = 0;
+    /* polling here if there still are some responses haven't beed polled
+    *  if didn't poll there response, cpaDcRemoveSession will raise error message
+    */
+    do {
+        rc = gProcess.backend->pollInstance(gProcess.dcInstHandle[i], 0);
+    } while (CPA_STATUS_SUCCESS == rc);
+
+    /* Remove sessions */
+    for (j = 0; j < MAX_INST_SESSIONS; j++) {
+        instSess = &gProcess.qzstdInst[i].sessions[j];
+        if (0 == instSess->cpaSessSetup || NULL == instSess->cpaSessHandle) {
+            continue;
+        }
+        if (QZSTD_OK != QZSTD_cpaRemoveSess(instSess, i)) {
+            QZSTD_LOG(1, "Session %d of instance %d is left set up\n", j, i);
+        }
     }
 }
 
@@ -425,24 +1232,108 @@ static void QZSTD_cleanUpInstMem(int i)
     }
 }
 
+int QZSTD_startCapture(const QZSTD_CaptureOptions_T *options)
+{
+    QZSTD_CaptureHeader_T header;
+    FILE *file;
+
+    if (NULL == options || NULL == options->path || 0 == options->path[0]) {
+        return QZSTD_FAIL;
+    }
+    pthread_mutex_lock(&gCapture.mutex);
+    if (NULL != gCapture.file) {
+        QZSTD_LOG(1, "Capture is already running\n");
+        goto fail;
+    }
+    file = fopen(options->path, "wb");
+    if (NULL == file) {
+        QZSTD_LOG(1, "Cannot open capture file %s\n", options->path);
+        goto fail;
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = QZSTD_CAPTURE_MAGIC;
+    header.version = QZSTD_CAPTURE_VERSION;
+    header.recordSize = sizeof(QZSTD_CaptureRecord_T);
+    header.sampleBytes = options->sampleBytes;
+    header.hash = !!options->hash;
+    if (1 != fwrite(&header, sizeof(header), 1, file)) {
+        QZSTD_LOG(1, "Cannot write capture file %s\n", options->path);
+        fclose(file);
+        goto fail;
+    }
+    gCapture.hash = !!options->hash;
+    gCapture.sampleBytes = options->sampleBytes;
+    gCapture.fromEnv = 0;
+    gCapture.records = 0;
+    clock_gettime(CLOCK_MONOTONIC, &gCapture.start);
+    __atomic_store_n(&gCapture.file, file, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&gCapture.mutex);
+    QZSTD_LOG(2, "Capture started: %s\n", options->path);
+    return QZSTD_OK;
+
+fail:
+    pthread_mutex_unlock(&gCapture.mutex);
+    return QZSTD_FAIL;
+}
+
+void QZSTD_stopCapture(void)
+{
+    pthread_mutex_lock(&gCapture.mutex);
+    if (NULL != gCapture.file) {
+        fclose(gCapture.file);
+        __atomic_store_n(&gCapture.file, NULL, __ATOMIC_RELEASE);
+        QZSTD_LOG(2, "Capture stopped, %llu calls recorded\n", gCapture.records);
+    }
+    pthread_mutex_unlock(&gCapture.mutex);
+}
+
+/** QZSTD_startCaptureFromEnv:
+ *    Start the capture named by QZSTD_CAPTURE, unless one is running. A capture
+ *  failing to start doesn't fail the device.
+ */
+static void QZSTD_startCaptureFromEnv(void)
+{
+    QZSTD_CaptureOptions_T options;
+    const char *env;
+
+    memset(&options, 0, sizeof(options));
+    options.path = getenv("QZSTD_CAPTURE");
+    if (NULL == options.path || 0 == options.path[0] ||
+        NULL != __atomic_load_n(&gCapture.file, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    env = getenv("QZSTD_CAPTURE_HASH");
+    options.hash = NULL != env && 0 != atoi(env);
+    env = getenv("QZSTD_CAPTURE_SAMPLE");
+    options.sampleBytes = NULL != env ? (unsigned int)strtoul(env, NULL, 10) : 0;
+    if (QZSTD_OK == QZSTD_startCapture(&options)) {
+        gCapture.fromEnv = 1;
+    }
+}
+
 void QZSTD_stopQatDevice(void)
 {
+    if (gCapture.fromEnv) {
+        QZSTD_stopCapture();
+    }
     pthread_mutex_lock(&gProcess.mutex);
     if (QZSTD_OK == gProcess.qzstdInitStatus) {
         int i = 0;
 
         for (i = 0; i < gProcess.numInstances; i++) {
-            if (0 != gProcess.qzstdInst[i].cpaSessSetup) {
-                QZSTD_removeSession(i);
-            }
+            QZSTD_removeSession(i);
+            /* The responses left were polled by QZSTD_removeSession */
+            QZSTD_reclaimPoolBufs(i, 1);
             if (0 != gProcess.qzstdInst[i].memSetup) {
                 QZSTD_cleanUpInstMem(i);
             }
         }
+        QZSTD_clearBufPools();
         QZSTD_stopQat();
     }
+    QZSTD_drainStatePool();
     if (QZSTD_STARTED == gProcess.qzstdInitStatus) {
-        (void)icp_sal_userStop();
+        (void)gProcess.backend->userStop();
         gProcess.qzstdInitStatus = QZSTD_FAIL;
     }
     pthread_mutex_unlock(&gProcess.mutex);
@@ -495,7 +1386,8 @@ const char *QZSTD_getSectionName(void)
     return sectionName;
 }
 
-static int QZSTD_salUserStart(void)
+#ifndef QZSTD_SW_ONLY
+static int QZSTD_qatUserStart(void)
 {
 #ifndef INTREE
     Cpa32U pcieCount;
@@ -518,13 +1410,79 @@ static int QZSTD_salUserStart(void)
     }
 #endif
 
-    if (CPA_STATUS_SUCCESS != icp_sal_userStart(QZSTD_getSectionName())) {
+    gProcess.backend = &gQatBackend;
+    if (CPA_STATUS_SUCCESS != gProcess.backend->userStart(QZSTD_getSectionName())) {
         QZSTD_LOG(1, "icp_sal_userStart failed\n");
         return QZSTD_FAIL;
     }
 
     return QZSTD_OK;
 }
+#endif
+
+/** QZSTD_getBackendOption:
+ *    Backend to start, QZSTD_BACKEND_DEFAULT takes the QZSTD_BACKEND environment
+ *  variable, then QAT, or the software engine when built with SW_ONLY
+ *
+ * @retval int  QZSTD_BACKEND_QAT, QZSTD_BACKEND_SW or QZSTD_BACKEND_AUTO,
+ *              -1 if the backend is invalid.
+ */
+static int QZSTD_getBackendOption(const QZSTD_StartOptions_T *options)
+{
+    int backend = NULL != options ? options->backend : QZSTD_BACKEND_DEFAULT;
+    const char *env;
+
+    if (QZSTD_BACKEND_DEFAULT != backend) {
+        return backend >= QZSTD_BACKEND_QAT && backend <= QZSTD_BACKEND_AUTO ?
+               backend : -1;
+    }
+    env = getenv("QZSTD_BACKEND");
+    if (NULL == env || 0 == env[0]) {
+#ifdef QZSTD_SW_ONLY
+        return QZSTD_BACKEND_SW;
+#else
+        return QZSTD_BACKEND_QAT;
+#endif
+    }
+    if (0 == strcmp(env, "qat")) {
+        return QZSTD_BACKEND_QAT;
+    } else if (0 == strcmp(env, "sw")) {
+        return QZSTD_BACKEND_SW;
+    } else if (0 == strcmp(env, "auto")) {
+        return QZSTD_BACKEND_AUTO;
+    }
+    QZSTD_LOG(1, "Invalid QZSTD_BACKEND: %s\n", env);
+    return -1;
+}
+
+static int QZSTD_salUserStart(int backend)
+{
+    if (QZSTD_BACKEND_QAT == backend || QZSTD_BACKEND_AUTO == backend) {
+#ifdef QZSTD_SW_ONLY
+        if (QZSTD_BACKEND_QAT == backend) {
+            QZSTD_LOG(1, "Built with SW_ONLY, QAT backend is not available\n");
+            return QZSTD_FAIL;
+        }
+#else
+        if (QZSTD_OK == QZSTD_qatUserStart()) {
+            return QZSTD_OK;
+        }
+        if (QZSTD_BACKEND_QAT == backend) {
+            return QZSTD_FAIL;
+        }
+        QZSTD_LOG(1, "QAT is not available, falling back to the software engine\n");
+#endif
+    } else if (QZSTD_BACKEND_SW != backend) {
+        return QZSTD_FAIL;
+    }
+
+    gProcess.backend = &gSwBackend;
+    if (CPA_STATUS_SUCCESS != gProcess.backend->userStart(QZSTD_getSectionName())) {
+        QZSTD_LOG(1, "Start software engine failed\n");
+        return QZSTD_FAIL;
+    }
+    return QZSTD_OK;
+}
 
 static int QZSTD_getAndShuffleInstance(void)
 {
@@ -534,57 +1492,56 @@ static int QZSTD_getAndShuffleInstance(void)
     unsigned int instanceFound = 0;
     unsigned int instanceMatched = 0;
     QZSTD_InstanceList_T *newInst;
-    if (CPA_STATUS_SUCCESS != cpaDcGetNumInstances(&gProcess.numInstances)) {
+    if (CPA_STATUS_SUCCESS != gProcess.backend->getNumInstances(&gProcess.numInstances)) {
         QZSTD_LOG(1, "cpaDcGetNumInstances failed\n");
         goto exit;
     }
 
-    gProcess.dcInstHandle = (CpaInstanceHandle *)calloc(
-                                gProcess.numInstances, sizeof(CpaInstanceHandle));
-    gProcess.qzstdInst = (QZSTD_Instance_T *)calloc(gProcess.numInstances,
-                         sizeof(QZSTD_Instance_T));
+    gProcess.dcInstHandle = (CpaInstanceHandle *)QZSTD_calloc(
+                                gProcess.numInstances, sizeof(CpaInstanceHandle), 0);
+    gProcess.qzstdInst = (QZSTD_Instance_T *)QZSTD_calloc(gProcess.numInstances,
+                         sizeof(QZSTD_Instance_T), 0);
     if (NULL == gProcess.dcInstHandle || NULL == gProcess.qzstdInst) {
         QZSTD_LOG(1, "calloc for qzstdInst failed\n");
         goto exit;
     }
 
-    if (CPA_STATUS_SUCCESS != cpaDcGetInstances(
+    if (CPA_STATUS_SUCCESS != gProcess.backend->getInstances(
             gProcess.numInstances, gProcess.dcInstHandle)) {
         QZSTD_LOG(1, "cpaDcGetInstances failed\n");
         goto exit;
     }
 
-    qatHw = (QZSTD_Hardware_T *)calloc(1, sizeof(QZSTD_Hardware_T));
+    qatHw = (QZSTD_Hardware_T *)QZSTD_calloc(1, sizeof(QZSTD_Hardware_T), 0);
     if (NULL == qatHw) {
         QZSTD_LOG(1, "calloc for qatHw failed\n");
         goto exit;
     }
     for (i = 0; i < gProcess.numInstances; i++) {
-        newInst = (QZSTD_InstanceList_T *)calloc(1, sizeof(QZSTD_InstanceList_T));
+        newInst = (QZSTD_InstanceList_T *)QZSTD_calloc(1, sizeof(QZSTD_InstanceList_T), 0);
         if (NULL == newInst) {
             QZSTD_LOG(1, "calloc failed\n");
             goto exit;
         }
 
-        if (CPA_STATUS_SUCCESS != cpaDcInstanceGetInfo2(
+        if (CPA_STATUS_SUCCESS != gProcess.backend->instanceGetInfo2(
                 gProcess.dcInstHandle[i], &newInst->instance.instanceInfo)) {
             QZSTD_LOG(1, "cpaDcInstanceGetInfo2 failed\n");
-            free(newInst);
+            QZSTD_free(newInst, 0);
             newInst = NULL;
             goto exit;
         }
 
-        if (CPA_STATUS_SUCCESS != cpaDcQueryCapabilities(
+        if (CPA_STATUS_SUCCESS != gProcess.backend->queryCapabilities(
                 gProcess.dcInstHandle[i], &newInst->instance.instanceCap)) {
             QZSTD_LOG(1, "cpaDcQueryCapabilities failed\n");
-            free(newInst);
+            QZSTD_free(newInst, 0);
             newInst = NULL;
             goto exit;
         }
 
         newInst->instance.lock = 0;
         newInst->instance.memSetup = 0;
-        newInst->instance.cpaSessSetup = 0;
         newInst->instance.dcInstSetup = 0;
         newInst->instance.numRetries = 0;
         newInst->dcInstHandle = gProcess.dcInstHandle[i];
@@ -592,7 +1549,7 @@ static int QZSTD_getAndShuffleInstance(void)
         devId = newInst->instance.instanceInfo.physInstId.packageId;
         if (QZSTD_OK != QZSTD_setInstance(devId, newInst, qatHw)) {
             QZSTD_LOG(1, "QZSTD_setInstance on device %d failed\n", devId);
-            free(newInst);
+            QZSTD_free(newInst, 0);
             newInst = NULL;
             goto exit;
         }
@@ -610,7 +1567,7 @@ static int QZSTD_getAndShuffleInstance(void)
         /* check lz4s support */
         if (!newInst->instance.instanceCap.checksumXXHash32 ||
             !newInst->instance.instanceCap.statelessLZ4SCompression) {
-            free(newInst);
+            QZSTD_free(newInst, 0);
             newInst = NULL;
             continue;
         }
@@ -624,7 +1581,7 @@ static int QZSTD_getAndShuffleInstance(void)
         memcpy(&gProcess.qzstdInst[instanceMatched], &newInst->instance,
                sizeof(QZSTD_Instance_T));
         gProcess.dcInstHandle[instanceMatched] = newInst->dcInstHandle;
-        free(newInst);
+        QZSTD_free(newInst, 0);
         newInst = NULL;
         instanceMatched++;
     }
@@ -634,8 +1591,11 @@ static int QZSTD_getAndShuffleInstance(void)
         goto exit;
     }
 
+    /* Only expose the instances which support LZ4s */
+    gProcess.numInstances = (Cpa16U)instanceMatched;
+
     QZSTD_clearDevices(qatHw);
-    free(qatHw);
+    QZSTD_free(qatHw, 0);
     qatHw = NULL;
 
     return QZSTD_OK;
@@ -643,15 +1603,15 @@ static int QZSTD_getAndShuffleInstance(void)
 exit:
     if (qatHw) {
         QZSTD_clearDevices(qatHw);
-        free(qatHw);
+        QZSTD_free(qatHw, 0);
         qatHw = NULL;
     }
     if (NULL != gProcess.dcInstHandle) {
-        free(gProcess.dcInstHandle);
+        QZSTD_free(gProcess.dcInstHandle, 0);
         gProcess.dcInstHandle = NULL;
     }
     if (NULL != gProcess.qzstdInst) {
-        free(gProcess.qzstdInst);
+        QZSTD_free(gProcess.qzstdInst, 0);
         gProcess.qzstdInst = NULL;
     }
 
@@ -696,14 +1656,14 @@ static int QZSTD_allocInstMem(int i)
     interSz = INTER_SZ(srcSz);
 
     status =
-        cpaDcBufferListGetMetaSize(gProcess.dcInstHandle[i], 1,
+        gProcess.backend->bufferListGetMetaSize(gProcess.dcInstHandle[i], 1,
                                    &(gProcess.qzstdInst[i].buffMetaSize));
     if (CPA_STATUS_SUCCESS != status) {
         QZSTD_LOG(1, "cpaDcBufferListGetMetaSize failed\n");
         goto cleanup;
     }
 
-    status = cpaDcGetNumIntermediateBuffers(
+    status = gProcess.backend->getNumIntermediateBuffers(
                  gProcess.dcInstHandle[i], &(gProcess.qzstdInst[i].intermediateCnt));
     if (CPA_STATUS_SUCCESS != status) {
         QZSTD_LOG(1, "cpaDcGetNumIntermediateBuffers failed\n");
@@ -825,14 +1785,14 @@ static int QZSTD_startDcInstance(int i)
 {
     int rc = QZSTD_OK;
 
-    if (CPA_STATUS_SUCCESS != cpaDcSetAddressTranslation(
+    if (CPA_STATUS_SUCCESS != gProcess.backend->setAddressTranslation(
             gProcess.dcInstHandle[i], (CpaVirtualToPhysical)QZSTD_virtToPhys)) {
         QZSTD_LOG(1, "cpaDcSetAddressTranslation failed\n");
         rc = QZSTD_FAIL;
         goto done;
     }
 
-    gProcess.qzstdInst[i].instStartStatus = cpaDcStartInstance(
+    gProcess.qzstdInst[i].instStartStatus = gProcess.backend->startInstance(
             gProcess.dcInstHandle[i], gProcess.qzstdInst[i].intermediateCnt,
             gProcess.qzstdInst[i].intermediateBuffers);
     if (CPA_STATUS_SUCCESS != gProcess.qzstdInst[i].instStartStatus) {
@@ -841,6 +1801,15 @@ static int QZSTD_startDcInstance(int i)
         goto done;
     }
 
+    /* The compress bound only depends on the instance, calculate it once */
+    if (CPA_STATUS_SUCCESS != gProcess.backend->lz4sCompressBound(gProcess.dcInstHandle[i],
+            ZSTD_BLOCKSIZE_MAX, &gProcess.qzstdInst[i].lz4sBound)) {
+        QZSTD_LOG(1, "Failed to caculate compress bound\n");
+        (void)gProcess.backend->stopInstance(gProcess.dcInstHandle[i]);
+        rc = QZSTD_FAIL;
+        goto done;
+    }
+
     gProcess.qzstdInst[i].seqNumIn = 0;
     gProcess.qzstdInst[i].seqNumOut = 0;
     gProcess.qzstdInst[i].dcInstSetup = 1;
@@ -849,57 +1818,110 @@ done:
     return rc;
 }
 
-static int QZSTD_cpaInitSess(QZSTD_Session_T *sess, int i)
+/** QZSTD_setupInstance:
+ *    Allocate instance's buffers and start the DC instance if it hasn't
+ *  been done yet. The caller must hold the instance lock.
+ */
+static int QZSTD_setupInstance(int i)
+{
+    /* allocate instance's buffer */
+    if (0 == gProcess.qzstdInst[i].memSetup) {
+        if (QZSTD_OK != QZSTD_allocInstMem(i)) {
+            QZSTD_LOG(1, "Failed to allocate instance related memory\n");
+            return QZSTD_FAIL;
+        }
+    }
+
+    /* start Dc Instance */
+    if (0 == gProcess.qzstdInst[i].dcInstSetup) {
+        if (QZSTD_OK != QZSTD_startDcInstance(i)) {
+            QZSTD_LOG(1, "Failed to start DC instance\n");
+            return QZSTD_FAIL;
+        }
+    }
+    return QZSTD_OK;
+}
+
+static int QZSTD_cpaInitSess(QZSTD_InstSession_T *instSess, int i,
+                             CpaDcSessionSetupData *setupData)
 {
     Cpa32U sessionSize = 0;
     Cpa32U ctxSize = 0;
     unsigned char reqPhyContMem = gProcess.qzstdInst[i].reqPhyContMem;
 
     /*setup and start DC session*/
-    if (CPA_STATUS_SUCCESS != cpaDcGetSessionSize(gProcess.dcInstHandle[i],
-            &sess->sessionSetupData, &sessionSize, &ctxSize)) {
+    if (CPA_STATUS_SUCCESS != gProcess.backend->getSessionSize(gProcess.dcInstHandle[i],
+            setupData, &sessionSize, &ctxSize)) {
         QZSTD_LOG(1, "cpaDcGetSessionSize failed\n");
         return QZSTD_FAIL;
     }
 
-    gProcess.qzstdInst[i].cpaSessHandle = QZSTD_calloc(1, (size_t)(sessionSize),
-                                          reqPhyContMem);
-    if (NULL == gProcess.qzstdInst[i].cpaSessHandle) {
+    instSess->cpaSessHandle = QZSTD_calloc(1, (size_t)(sessionSize), reqPhyContMem);
+    if (NULL == instSess->cpaSessHandle) {
         QZSTD_LOG(1, "Failed to allocate memory\n");
         return QZSTD_FAIL;
     }
 
-    if (CPA_STATUS_SUCCESS != cpaDcInitSession(
-            gProcess.dcInstHandle[i], gProcess.qzstdInst[i].cpaSessHandle,
-            &sess->sessionSetupData, NULL, QZSTD_dcCallback)) {
+    if (CPA_STATUS_SUCCESS != gProcess.backend->initSession(
+            gProcess.dcInstHandle[i], instSess->cpaSessHandle,
+            setupData, NULL, QZSTD_dcCallback)) {
         QZSTD_LOG(1, "cpaDcInitSession failed\n");
-        QZSTD_free(gProcess.qzstdInst[i].cpaSessHandle, reqPhyContMem);
-        gProcess.qzstdInst[i].cpaSessHandle = NULL;
+        QZSTD_free(instSess->cpaSessHandle, reqPhyContMem);
+        instSess->cpaSessHandle = NULL;
         return QZSTD_FAIL;
     }
 
-    gProcess.qzstdInst[i].sessionSetupData = sess->sessionSetupData;
-    gProcess.qzstdInst[i].cpaSessSetup = 1;
+    instSess->sessionSetupData = *setupData;
+    instSess->cpaSessSetup = 1;
 
     return QZSTD_OK;
 }
 
-static int QZSTD_cpaUpdateSess(QZSTD_Session_T *sess, int i)
+/** QZSTD_getInstSession:
+ *    Find the session on instance i which was set up with setupData, or set
+ *  up a new one. Every setup QZSTD_initSetupData makes has a slot, but if all
+ *  session slots are in use, the oldest one is replaced, skipping the sessions
+ *  QAT fails to remove. The caller must hold the instance lock.
+ *
+ * @retval QZSTD_InstSession_T*  The session, or NULL on failure.
+ */
+static QZSTD_InstSession_T *QZSTD_getInstSession(int i,
+        CpaDcSessionSetupData *setupData)
 {
-    unsigned char reqPhyContMem = gProcess.qzstdInst[i].reqPhyContMem;
-    gProcess.qzstdInst[i].cpaSessSetup = 0;
+    QZSTD_Instance_T *qzstdInst = &gProcess.qzstdInst[i];
+    QZSTD_InstSession_T *instSess = NULL;
+    int j;
 
-    /* Remove session */
-    if (CPA_STATUS_SUCCESS != cpaDcRemoveSession(
-            gProcess.dcInstHandle[i], gProcess.qzstdInst[i].cpaSessHandle)) {
-        QZSTD_LOG(1, "cpaDcRemoveSession failed\n");
-        return QZSTD_FAIL;
+    for (j = 0; j < MAX_INST_SESSIONS; j++) {
+        if (0 == qzstdInst->sessions[j].cpaSessSetup) {
+            if (NULL == instSess) {
+                instSess = &qzstdInst->sessions[j];
+            }
+            continue;
+        }
+        if (0 == memcmp(setupData, &qzstdInst->sessions[j].sessionSetupData,
+                        sizeof(CpaDcSessionSetupData))) {
+            return &qzstdInst->sessions[j];
+        }
     }
 
-    QZSTD_free(gProcess.qzstdInst[i].cpaSessHandle, reqPhyContMem);
-    gProcess.qzstdInst[i].cpaSessHandle = NULL;
+    for (j = 0; NULL == instSess && j < MAX_INST_SESSIONS; j++) {
+        QZSTD_InstSession_T *oldest = &qzstdInst->sessions[qzstdInst->nextSessEvict];
+        qzstdInst->nextSessEvict = (qzstdInst->nextSessEvict + 1) % MAX_INST_SESSIONS;
+        if (QZSTD_OK == QZSTD_cpaRemoveSess(oldest, i)) {
+            instSess = oldest;
+        }
+    }
+    if (NULL == instSess) {
+        QZSTD_LOG(1, "Failed to remove sess\n");
+        return NULL;
+    }
 
-    return QZSTD_cpaInitSess(sess, i);
+    if (QZSTD_OK != QZSTD_cpaInitSess(instSess, i, setupData)) {
+        QZSTD_LOG(1, "Failed to init sess\n");
+        return NULL;
+    }
+    return instSess;
 }
 
 static int QZSTD_grabInstance(int hint)
@@ -932,37 +1954,351 @@ static void QZSTD_releaseInstance(int i)
     __sync_lock_release(&(gProcess.qzstdInst[i].lock));
 }
 
+static void QZSTD_lockProfiles(void)
+{
+    while (__sync_lock_test_and_set(&gProcess.profilesLock, 1)) {
+        ;
+    }
+}
+
+static void QZSTD_unlockProfiles(void)
+{
+    __sync_lock_release(&gProcess.profilesLock);
+}
+
+/** QZSTD_getProfile:
+ *    Profile of compressionLevel, levels without a profile offload the same
+ *  level to QAT, and hybrid levels are seeded by the highest level of QAT.
+ *  It's called for every block, so the table has its own spinlock rather than
+ *  gProcess.mutex, which is held while QAT starts.
+ */
+static QZSTD_LevelProfile_T QZSTD_getProfile(int compressionLevel)
+{
+    QZSTD_LevelProfile_T profile;
+
+    QZSTD_lockProfiles();
+    profile = gProcess.profiles[compressionLevel];
+    QZSTD_unlockProfiles();
+
+    if (0 == profile.hwLevel) {
+        memset(&profile, 0, sizeof(QZSTD_LevelProfile_T));
+        profile.hwLevel = compressionLevel > COMP_LVL_MAXIMUM ? COMP_LVL_MAXIMUM :
+                          compressionLevel;
+        profile.minMatch = 3;
+    }
+    return profile;
+}
+
+/** QZSTD_applyProfile:
+ *    Set the QAT parameters of profile in the session setup data
+ */
+static void QZSTD_applyProfile(CpaDcSessionSetupData *setupData,
+                               const QZSTD_LevelProfile_T *profile)
+{
+    setupData->compLevel = (CpaDcCompLvl)profile->hwLevel;
+    setupData->minMatch = 4 == profile->minMatch ? CPA_DC_MIN_4_BYTE_MATCH :
+                          CPA_DC_MIN_3_BYTE_MATCH;
+}
+
+/** QZSTD_initSetupData:
+ *    Fill the session setup data used for offloading compressionLevel
+ */
+static void QZSTD_initSetupData(CpaDcSessionSetupData *setupData,
+                                int compressionLevel)
+{
+    QZSTD_LevelProfile_T profile = QZSTD_getProfile(compressionLevel);
+
+    memset(setupData, 0, sizeof(CpaDcSessionSetupData));
+    setupData->compType = CPA_DC_LZ4S;
+    setupData->autoSelectBestHuffmanTree = CPA_DC_ASB_ENABLED;
+    setupData->sessDirection = CPA_DC_DIR_COMPRESS;
+    setupData->sessState = CPA_DC_STATELESS;
+    setupData->checksum = CPA_DC_XXHASH32;
+    setupData->huffType = CPA_DC_HT_STATIC;
+    QZSTD_applyProfile(setupData, &profile);
+}
+
+/** QZSTD_isValidProfile:
+ *    Check the fields of a level profile
+ */
+static int QZSTD_isValidProfile(const QZSTD_LevelProfile_T *profile)
+{
+    return profile->hwLevel >= COMP_LVL_MINIMUM &&
+           profile->hwLevel <= COMP_LVL_MAXIMUM &&
+           (3 == profile->minMatch || 4 == profile->minMatch) &&
+           (0 == profile->postOptimize || 1 == profile->postOptimize) &&
+           profile->literalSearch >= 0 &&
+           profile->searchForExternalRepcodes >= 0 &&
+           profile->searchForExternalRepcodes <= 2;
+}
+
+/** QZSTD_readProfileFile:
+ *    Read a level profile table, levels not in the file get the default profile
+ *  Every line is "level hwLevel minMatch postOptimize literalSearch
+ *  searchForExternalRepcodes", text after '#' is ignored.
+ */
+static int QZSTD_readProfileFile(const char *fileName,
+                                 QZSTD_LevelProfile_T *profiles)
+{
+    char line[256];
+    int lineNb = 0;
+    int rc = QZSTD_OK;
+    FILE *file = fopen(fileName, "r");
+
+    if (NULL == file) {
+        QZSTD_LOG(1, "Cannot open profile file: %s\n", fileName);
+        return QZSTD_FAIL;
+    }
+    memset(profiles, 0, sizeof(QZSTD_LevelProfile_T) * (COMP_LVL_HYBRID_MAXIMUM + 1));
+    while (NULL != fgets(line, sizeof(line), file)) {
+        QZSTD_LevelProfile_T profile;
+        char *comment = strchr(line, '#');
+        char extra;
+        int level, n;
+
+        lineNb++;
+        if (NULL != comment) {
+            *comment = '\0';
+        }
+        memset(&profile, 0, sizeof(QZSTD_LevelProfile_T));
+        n = sscanf(line, "%d %d %d %d %d %d %c", &level, &profile.hwLevel,
+                   &profile.minMatch, &profile.postOptimize, &profile.literalSearch,
+                   &profile.searchForExternalRepcodes, &extra);
+        if (n <= 0) {
+            continue;
+        }
+        if (6 != n || level < COMP_LVL_MINIMUM || level > COMP_LVL_HYBRID_MAXIMUM ||
+            !QZSTD_isValidProfile(&profile)) {
+            QZSTD_LOG(1, "Invalid profile at line %d of %s\n", lineNb, fileName);
+            rc = QZSTD_FAIL;
+            break;
+        }
+        profiles[level] = profile;
+    }
+    fclose(file);
+    return rc;
+}
+
+/** QZSTD_loadProfileFile:
+ *    Replace the level profile table by the one in fileName, the table is
+ *  left unchanged if the file is invalid
+ */
+static int QZSTD_loadProfileFile(const char *fileName)
+{
+    QZSTD_LevelProfile_T profiles[COMP_LVL_HYBRID_MAXIMUM + 1];
+
+    if (QZSTD_OK != QZSTD_readProfileFile(fileName, profiles)) {
+        return QZSTD_FAIL;
+    }
+    QZSTD_lockProfiles();
+    memcpy(gProcess.profiles, profiles, sizeof(gProcess.profiles));
+    QZSTD_unlockProfiles();
+    QZSTD_LOG(2, "Loaded level profiles from %s\n", fileName);
+    return QZSTD_OK;
+}
+
+int QZSTD_loadLevelProfiles(const char *fileName)
+{
+    if (NULL == fileName) {
+        return QZSTD_FAIL;
+    }
+    return QZSTD_loadProfileFile(fileName);
+}
+
+int QZSTD_setLevelProfile(int level, const QZSTD_LevelProfile_T *profile)
+{
+    if (level < COMP_LVL_MINIMUM || level > COMP_LVL_HYBRID_MAXIMUM ||
+        (NULL != profile && !QZSTD_isValidProfile(profile))) {
+        return QZSTD_FAIL;
+    }
+    QZSTD_lockProfiles();
+    if (NULL != profile) {
+        gProcess.profiles[level] = *profile;
+    } else {
+        memset(&gProcess.profiles[level], 0, sizeof(QZSTD_LevelProfile_T));
+    }
+    QZSTD_unlockProfiles();
+    return QZSTD_OK;
+}
+
+int QZSTD_getLevelProfile(int level, QZSTD_LevelProfile_T *profile)
+{
+    if (level < COMP_LVL_MINIMUM || level > COMP_LVL_HYBRID_MAXIMUM ||
+        NULL == profile) {
+        return QZSTD_FAIL;
+    }
+    *profile = QZSTD_getProfile(level);
+    return QZSTD_OK;
+}
+
 static void QZSTD_setupSess(QZSTD_Session_T *zstdSess)
 {
     zstdSess->instHint = -1;
-    zstdSess->sessionSetupData.compType = CPA_DC_LZ4S;
-    zstdSess->sessionSetupData.autoSelectBestHuffmanTree = CPA_DC_ASB_ENABLED;
-    zstdSess->sessionSetupData.sessDirection = CPA_DC_DIR_COMPRESS;
-    zstdSess->sessionSetupData.sessState = CPA_DC_STATELESS;
-    zstdSess->sessionSetupData.checksum = CPA_DC_XXHASH32;
-    zstdSess->sessionSetupData.huffType = CPA_DC_HT_STATIC;
-    zstdSess->sessionSetupData.minMatch = CPA_DC_MIN_3_BYTE_MATCH;
+    QZSTD_initSetupData(&zstdSess->sessionSetupData, COMP_LVL_MINIMUM);
     zstdSess->failOffloadCnt = 0;
 }
 
-int QZSTD_startQatDevice(void)
+/** QZSTD_WarmUpArgs_T:
+ *  Arguments of a warm-up thread, one thread sets up all instances of a device
+ */
+typedef struct QZSTD_WarmUpArgs_S {
+    pthread_t thread;
+    unsigned int devId;
+    const QZSTD_StartOptions_T *options;
+} QZSTD_WarmUpArgs_T;
+
+static void *QZSTD_warmUpDevice(void *args)
+{
+    QZSTD_WarmUpArgs_T *warmUpArgs = (QZSTD_WarmUpArgs_T *)args;
+    const QZSTD_StartOptions_T *options = warmUpArgs->options;
+    CpaDcSessionSetupData setupData;
+    unsigned int j;
+    int i;
+
+    for (i = 0; i < gProcess.numInstances; i++) {
+        if (gProcess.qzstdInst[i].instanceInfo.physInstId.packageId !=
+            warmUpArgs->devId) {
+            continue;
+        }
+        /* Skip the instance if it is being used */
+        if (0 != __sync_lock_test_and_set(&(gProcess.qzstdInst[i].lock), 1)) {
+            continue;
+        }
+
+        if (QZSTD_OK != QZSTD_setupInstance(i)) {
+            QZSTD_LOG(1, "Failed to warm up instance %d\n", i);
+            QZSTD_releaseInstance(i);
+            continue;
+        }
+        QZSTD_fillBufPool(i);
+
+        for (j = 0; NULL != options->levels && j < options->nbLevels; j++) {
+            if (options->levels[j] < COMP_LVL_MINIMUM ||
+                options->levels[j] > COMP_LVL_HYBRID_MAXIMUM) {
+                continue;
+            }
+            QZSTD_initSetupData(&setupData, options->levels[j]);
+            if (NULL == QZSTD_getInstSession(i, &setupData)) {
+                QZSTD_LOG(1, "Failed to create session of level %d on instance %d\n",
+                          options->levels[j], i);
+            }
+        }
+        QZSTD_releaseInstance(i);
+    }
+    return NULL;
+}
+
+/** QZSTD_warmUpInstances:
+ *    Set up all instances with one thread per device, so devices are
+ *  initialized in parallel
+ */
+static void QZSTD_warmUpInstances(const QZSTD_StartOptions_T *options)
+{
+    QZSTD_WarmUpArgs_T *warmUpArgs;
+    unsigned int nbDevices = 0;
+    unsigned int devId;
+    unsigned int j;
+    int i;
+
+    warmUpArgs = (QZSTD_WarmUpArgs_T *)QZSTD_calloc(gProcess.numInstances,
+                 sizeof(QZSTD_WarmUpArgs_T), 0);
+    if (NULL == warmUpArgs) {
+        QZSTD_LOG(1, "calloc for warmUpArgs failed\n");
+        return;
+    }
+
+    for (i = 0; i < gProcess.numInstances; i++) {
+        devId = gProcess.qzstdInst[i].instanceInfo.physInstId.packageId;
+        for (j = 0; j < nbDevices; j++) {
+            if (warmUpArgs[j].devId == devId) {
+                break;
+            }
+        }
+        if (j < nbDevices) {
+            continue;
+        }
+        warmUpArgs[nbDevices].devId = devId;
+        warmUpArgs[nbDevices].options = options;
+        if (0 != pthread_create(&warmUpArgs[nbDevices].thread, NULL,
+                                QZSTD_warmUpDevice, &warmUpArgs[nbDevices])) {
+            QZSTD_LOG(1, "Failed to create warm-up thread, device: %u\n", devId);
+            (void)QZSTD_warmUpDevice(&warmUpArgs[nbDevices]);
+            warmUpArgs[nbDevices].options = NULL;
+        }
+        nbDevices++;
+    }
+
+    for (j = 0; j < nbDevices; j++) {
+        if (NULL != warmUpArgs[j].options) {
+            pthread_join(warmUpArgs[j].thread, NULL);
+        }
+    }
+    QZSTD_free(warmUpArgs, 0);
+}
+
+int QZSTD_startQatDeviceEx(const QZSTD_StartOptions_T *options)
 {
+    if (NULL != options && !QZSTD_isValidCustomMem(&options->customMem)) {
+        QZSTD_LOG(1, "Invalid custom allocator\n");
+        return QZSTD_FAIL;
+    }
+
     pthread_mutex_lock(&gProcess.mutex);
 
     if (QZSTD_FAIL == gProcess.qzstdInitStatus) {
-        gProcess.qzstdInitStatus = QZSTD_OK == QZSTD_salUserStart() ? QZSTD_STARTED :
-                                   QZSTD_FAIL;
+        const char *profileFile = NULL != options ? options->profileFile : NULL;
+
+        if (NULL == profileFile) {
+            profileFile = getenv("QZSTD_PROFILE_FILE");
+        }
+        if (NULL != profileFile && 0 != profileFile[0] &&
+            QZSTD_OK != QZSTD_loadProfileFile(profileFile)) {
+            pthread_mutex_unlock(&gProcess.mutex);
+            return QZSTD_FAIL;
+        }
+        QZSTD_startCaptureFromEnv();
+
+        /* The allocator can only be changed while no device memory is allocated */
+        if (NULL != options) {
+            gProcess.customMem = options->customMem;
+        } else {
+            memset(&gProcess.customMem, 0, sizeof(QZSTD_customMem));
+        }
+        gProcess.qzstdInitStatus = QZSTD_OK == QZSTD_salUserStart(
+                                       QZSTD_getBackendOption(options)) ?
+                                   QZSTD_STARTED : QZSTD_FAIL;
     }
 
     if (QZSTD_STARTED == gProcess.qzstdInitStatus) {
         gProcess.qzstdInitStatus = QZSTD_OK == QZSTD_getAndShuffleInstance() ?
                                    QZSTD_OK : QZSTD_STARTED;
     }
+
+    if (QZSTD_OK == gProcess.qzstdInitStatus && NULL != options &&
+        options->eagerInit) {
+        QZSTD_warmUpInstances(options);
+    }
     QZSTD_LOG(2, "InitStatus: %d\n", gProcess.qzstdInitStatus);
     pthread_mutex_unlock(&gProcess.mutex);
     return gProcess.qzstdInitStatus;
 }
 
+int QZSTD_startQatDevice(void)
+{
+    return QZSTD_startQatDeviceEx(NULL);
+}
+
+int QZSTD_getBackend(void)
+{
+    int backend;
+
+    pthread_mutex_lock(&gProcess.mutex);
+    backend = QZSTD_FAIL != gProcess.qzstdInitStatus && NULL != gProcess.backend ?
+              gProcess.backend->id : QZSTD_BACKEND_DEFAULT;
+    pthread_mutex_unlock(&gProcess.mutex);
+    return backend;
+}
+
 static unsigned isLittleEndian(void)
 {
     const union {
@@ -989,47 +2325,623 @@ static unsigned short readLE16(const void *memPtr)
     }
 }
 
-void *QZSTD_createSeqProdState(void)
+static unsigned int readLE32(const void *memPtr)
+{
+    const unsigned char *p = (const unsigned char *)memPtr;
+    unsigned int val;
+
+    if (isLittleEndian()) {
+        memcpy(&val, memPtr, sizeof(val));
+        return val;
+    }
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+           ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static inline unsigned int QZSTD_rotl32(unsigned int x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+static inline unsigned int QZSTD_xxh32Round(unsigned int acc, unsigned int input)
+{
+    acc += input * XXH_PRIME32_2;
+    return QZSTD_rotl32(acc, 13) * XXH_PRIME32_1;
+}
+
+static void QZSTD_xxh32Reset(QZSTD_Xxh32_T *state)
+{
+    memset(state, 0, sizeof(QZSTD_Xxh32_T));
+    state->v[0] = XXH_PRIME32_1 + XXH_PRIME32_2;
+    state->v[1] = XXH_PRIME32_2;
+    state->v[2] = 0;
+    state->v[3] = 0U - XXH_PRIME32_1;
+}
+
+static void QZSTD_xxh32Update(QZSTD_Xxh32_T *state, const void *input,
+                              size_t len)
+{
+    const unsigned char *p = (const unsigned char *)input;
+    const unsigned char *const end = p + len;
+
+    state->totalLen += len;
+    if (state->memSize + len < 16) {
+        memcpy(state->mem + state->memSize, p, len);
+        state->memSize += (unsigned int)len;
+        return;
+    }
+    if (state->memSize) {
+        int k;
+        memcpy(state->mem + state->memSize, p, 16 - state->memSize);
+        p += 16 - state->memSize;
+        for (k = 0; k < 4; k++) {
+            state->v[k] = QZSTD_xxh32Round(state->v[k], readLE32(state->mem + 4 * k));
+        }
+        state->memSize = 0;
+    }
+    while (p + 16 <= end) {
+        state->v[0] = QZSTD_xxh32Round(state->v[0], readLE32(p));
+        state->v[1] = QZSTD_xxh32Round(state->v[1], readLE32(p + 4));
+        state->v[2] = QZSTD_xxh32Round(state->v[2], readLE32(p + 8));
+        state->v[3] = QZSTD_xxh32Round(state->v[3], readLE32(p + 12));
+        p += 16;
+    }
+    if (p < end) {
+        memcpy(state->mem, p, (size_t)(end - p));
+        state->memSize = (unsigned int)(end - p);
+    }
+}
+
+static unsigned int QZSTD_xxh32Digest(const QZSTD_Xxh32_T *state)
+{
+    const unsigned char *p = state->mem;
+    const unsigned char *const end = p + state->memSize;
+    unsigned int h;
+
+    if (state->totalLen >= 16) {
+        h = QZSTD_rotl32(state->v[0], 1) + QZSTD_rotl32(state->v[1], 7) +
+            QZSTD_rotl32(state->v[2], 12) + QZSTD_rotl32(state->v[3], 18);
+    } else {
+        h = state->v[2] + XXH_PRIME32_5;
+    }
+    h += (unsigned int)state->totalLen;
+    while (p + 4 <= end) {
+        h = QZSTD_rotl32(h + readLE32(p) * XXH_PRIME32_3, 17) * XXH_PRIME32_4;
+        p += 4;
+    }
+    while (p < end) {
+        h = QZSTD_rotl32(h + (*p) * XXH_PRIME32_5, 11) * XXH_PRIME32_1;
+        p++;
+    }
+    h ^= h >> 15;
+    h *= XXH_PRIME32_2;
+    h ^= h >> 13;
+    h *= XXH_PRIME32_3;
+    h ^= h >> 16;
+    return h;
+}
+
+/** QZSTD_checksumReset:
+ *    Start the block checksums of a new frame, the callback is kept
+ */
+static void QZSTD_checksumReset(QZSTD_ChecksumState_T *checksum)
+{
+    QZSTD_xxh32Reset(&checksum->frame);
+    memset(&checksum->info, 0, sizeof(QZSTD_FrameChecksum_T));
+    checksum->blockChecksumValid = 0;
+}
+
+/** QZSTD_checksumBlock:
+ *    Add the checksum of a block to the frame digest, hashing it on CPU when
+ *  QAT didn't return one
+ */
+static void QZSTD_checksumBlock(QZSTD_ChecksumState_T *checksum,
+                                const void *src, size_t srcSize)
 {
-    QZSTD_Session_T *zstdSess = (QZSTD_Session_T *)calloc(1,
-                                sizeof(QZSTD_Session_T));
+    unsigned char record[8];
+    unsigned int blockChecksum = checksum->blockChecksum;
+    int k;
+
+    if (!checksum->blockChecksumValid) {
+        QZSTD_Xxh32_T block;
+        QZSTD_xxh32Reset(&block);
+        QZSTD_xxh32Update(&block, src, srcSize);
+        blockChecksum = QZSTD_xxh32Digest(&block);
+        checksum->info.nbCpuBlocks++;
+    }
+    for (k = 0; k < 4; k++) {
+        record[k] = (unsigned char)(blockChecksum >> (8 * k));
+        record[4 + k] = (unsigned char)((unsigned int)srcSize >> (8 * k));
+    }
+    QZSTD_xxh32Update(&checksum->frame, record, sizeof(record));
+    checksum->info.digest = QZSTD_xxh32Digest(&checksum->frame);
+    checksum->info.lastChecksum = blockChecksum;
+    checksum->info.nbBlocks++;
+    checksum->info.size += srcSize;
+    if (NULL != checksum->callback) {
+        checksum->callback(checksum->opaque, src, srcSize, blockChecksum,
+                           checksum->blockChecksumValid);
+    }
+}
+
+void *QZSTD_createSeqProdState_advanced(QZSTD_customMem customMem)
+{
+    QZSTD_Session_T *zstdSess;
+
+    if (!QZSTD_isValidCustomMem(&customMem)) {
+        QZSTD_LOG(1, "Invalid custom allocator\n");
+        return NULL;
+    }
+    zstdSess = (QZSTD_Session_T *)QZSTD_callocMem(sizeof(QZSTD_Session_T), 0, 0,
+               &customMem);
+    if (NULL == zstdSess) {
+        QZSTD_LOG(1, "Failed to allocate memory\n");
+        return NULL;
+    }
     QZSTD_setupSess(zstdSess);
+    zstdSess->customMem = customMem;
     return (void *)zstdSess;
 }
 
+void *QZSTD_createSeqProdState(void)
+{
+    QZSTD_customMem customMem;
+
+    memset(&customMem, 0, sizeof(QZSTD_customMem));
+    return QZSTD_createSeqProdState_advanced(customMem);
+}
+
+/** QZSTD_putDictIndex:
+ *    Drop a reference to a dictionary index, the last one frees it
+ */
+static void QZSTD_putDictIndex(QZSTD_DictIndex_T *dictIndex)
+{
+    QZSTD_DictIndex_T **prev;
+
+    if (NULL == dictIndex) {
+        return;
+    }
+    pthread_mutex_lock(&gProcess.dictIndexMutex);
+    if (0 != --dictIndex->refCount) {
+        pthread_mutex_unlock(&gProcess.dictIndexMutex);
+        return;
+    }
+    for (prev = &gProcess.dictIndexes; *prev != dictIndex; prev = &(*prev)->next) {
+        ;
+    }
+    *prev = dictIndex->next;
+    pthread_mutex_unlock(&gProcess.dictIndexMutex);
+    QZSTD_freeMem(dictIndex, 0, &dictIndex->customMem);
+}
+
 void QZSTD_freeSeqProdState(void *sequenceProducerState)
 {
     QZSTD_Session_T *zstdSess = (QZSTD_Session_T *)sequenceProducerState;
     if (zstdSess) {
-        if (zstdSess->qatIntermediateBuf) {
-            QZSTD_free(zstdSess->qatIntermediateBuf, zstdSess->reqPhyContMem);
-            zstdSess->qatIntermediateBuf = NULL;
-        }
-        free(zstdSess);
+        QZSTD_customMem customMem = zstdSess->customMem;
+        QZSTD_freeMem(zstdSess->optWksp, 0, &customMem);
+        QZSTD_freeMem(zstdSess->litSearchTable, 0, &customMem);
+        QZSTD_freeMem(zstdSess->ldm, 0, &customMem);
+        QZSTD_putDictIndex(zstdSess->dictIndex);
+        QZSTD_freeMem(zstdSess, 0, &customMem);
         zstdSess = NULL;
     }
 }
 
-static size_t QZSTD_decLz4s(ZSTD_Sequence *outSeqs, size_t outSeqsCapacity,
-                            unsigned char *lz4sBuff, unsigned int lz4sBufSize)
+/** QZSTD_ldmReset:
+ *    Forget the history, called at the start of every frame. Entries of the
+ *  old history are left in the table but are older than the history of the
+ *  frame, and every match is checked against the content anyway.
+ */
+static void QZSTD_ldmReset(QZSTD_LdmState_T *ldm)
 {
-    unsigned char *ip = lz4sBuff;
-    unsigned char *endip = lz4sBuff + lz4sBufSize;
-    unsigned int histLiteralLen = 0;
+    ldm->frameBase = ldm->nextPos;
+    ldm->nbMatches = 0;
+}
 
-    size_t seqsIdx = 0;
+int QZSTD_setSeqProdParameter(void *sequenceProducerState,
+                              QZSTD_SeqProdParam_e param, int value)
+{
+    QZSTD_Session_T *zstdSess = (QZSTD_Session_T *)sequenceProducerState;
 
-    while (ip < endip && lz4sBufSize > 0) {
-        size_t length = 0;
-        size_t offset = 0;
-        size_t literalLen = 0, matchlen = 0;
-        /* get literal length */
-        unsigned const token = *ip++;
-        if ((length = (token >> ML_BITS)) == RUN_MASK) {
-            unsigned s;
-            do {
-                s = *ip++;
-                length += s;
+    if (NULL == zstdSess) {
+        return QZSTD_FAIL;
+    }
+    switch (param) {
+    case QZSTD_p_postOptimize:
+        if (value != 0 && value != 1) {
+            return QZSTD_FAIL;
+        }
+        zstdSess->params.postOptimize = value;
+        break;
+    case QZSTD_p_literalSearch:
+        if (value < 0) {
+            return QZSTD_FAIL;
+        }
+        zstdSess->params.literalSearch = value;
+        break;
+    case QZSTD_p_longDistance:
+        if (value != 0 && value != 1) {
+            return QZSTD_FAIL;
+        }
+        zstdSess->params.longDistance = value;
+        break;
+    case QZSTD_p_blockChecksum:
+        if (value != 0 && value != 1) {
+            return QZSTD_FAIL;
+        }
+        /* Setting it starts a new frame */
+        QZSTD_checksumReset(&zstdSess->checksum);
+        zstdSess->params.blockChecksum = value;
+        break;
+    case QZSTD_p_sequenceStats:
+        if (value != 0 && value != 1) {
+            return QZSTD_FAIL;
+        }
+        zstdSess->params.sequenceStats = value;
+        break;
+    default:
+        QZSTD_LOG(1, "Unknown parameter: %d\n", param);
+        return QZSTD_FAIL;
+    }
+    return QZSTD_OK;
+}
+
+int QZSTD_setBlockChecksumCallback(void *sequenceProducerState,
+                                   QZSTD_blockChecksumCallback callback, void *opaque)
+{
+    QZSTD_Session_T *zstdSess = (QZSTD_Session_T *)sequenceProducerState;
+
+    if (NULL == zstdSess) {
+        return QZSTD_FAIL;
+    }
+    zstdSess->checksum.callback = callback;
+    zstdSess->checksum.opaque = opaque;
+    return QZSTD_OK;
+}
+
+int QZSTD_setStageTimesCallback(void *sequenceProducerState,
+                                QZSTD_stageTimesCallback callback, void *opaque)
+{
+    QZSTD_Session_T *zstdSess = (QZSTD_Session_T *)sequenceProducerState;
+
+    if (NULL == zstdSess) {
+        return QZSTD_FAIL;
+    }
+    zstdSess->stageTimer.callback = callback;
+    zstdSess->stageTimer.opaque = opaque;
+    return QZSTD_OK;
+}
+
+int QZSTD_getFrameChecksum(void *sequenceProducerState,
+                           QZSTD_FrameChecksum_T *frameChecksum)
+{
+    QZSTD_Session_T *zstdSess = (QZSTD_Session_T *)sequenceProducerState;
+
+    if (NULL == zstdSess || NULL == frameChecksum ||
+        !zstdSess->params.blockChecksum) {
+        return QZSTD_FAIL;
+    }
+    *frameChecksum = zstdSess->checksum.info;
+    return QZSTD_OK;
+}
+
+int QZSTD_setAdaptiveLevel(void *sequenceProducerState,
+                           const QZSTD_AdaptiveParams_T *params)
+{
+    QZSTD_Session_T *zstdSess = (QZSTD_Session_T *)sequenceProducerState;
+
+    if (NULL == zstdSess) {
+        return QZSTD_FAIL;
+    }
+    if (NULL == params) {
+        memset(&zstdSess->adapt, 0, sizeof(QZSTD_AdaptState_T));
+        return QZSTD_OK;
+    }
+    if (params->minLevel < COMP_LVL_MINIMUM || params->maxLevel < params->minLevel ||
+        params->maxLevel > COMP_LVL_HYBRID_MAXIMUM ||
+        (0 == params->targetMBps && 0 == params->targetLatencyUs)) {
+        return QZSTD_FAIL;
+    }
+    memset(&zstdSess->adapt, 0, sizeof(QZSTD_AdaptState_T));
+    zstdSess->adapt.params = *params;
+    zstdSess->adapt.level = params->minLevel;
+    zstdSess->adapt.enabled = 1;
+    return QZSTD_OK;
+}
+
+int QZSTD_getAdaptiveLevel(void *sequenceProducerState)
+{
+    QZSTD_Session_T *zstdSess = (QZSTD_Session_T *)sequenceProducerState;
+
+    if (NULL == zstdSess || !zstdSess->adapt.enabled) {
+        return 0;
+    }
+    return zstdSess->adapt.level;
+}
+
+/** QZSTD_adaptUpdate:
+ *    Account a block in the level controller, and move the level every
+ *  ADAPT_INTERVAL blocks. The level goes down when the throughput or latency
+ *  target is missed. It goes up when there is enough headroom, unless QAT
+ *  is congested or the next level is known not to improve the ratio. Levels
+ *  only select another cached QAT session, no session is torn down.
+ */
+static void QZSTD_adaptUpdate(QZSTD_AdaptState_T *adapt, size_t srcSize,
+                              unsigned long long blockUs, unsigned int ratio, int congested)
+{
+    const QZSTD_AdaptiveParams_T *params = &adapt->params;
+    unsigned long long mbps, latencyUs;
+    int tooSlow, headroom;
+    int level = adapt->level;
+
+    adapt->blocks++;
+    adapt->bytes += srcSize;
+    adapt->blockUs += blockUs;
+    adapt->congested += congested ? 1 : 0;
+    if (0 != ratio) {
+        /* Moving average over about 8 blocks */
+        adapt->ratio[level] = 0 == adapt->ratio[level] ? ratio :
+                              (adapt->ratio[level] * 7 + ratio) / 8;
+    }
+    if (adapt->blocks < ADAPT_INTERVAL) {
+        return;
+    }
+
+    /* Bytes per us are MB/s */
+    mbps = adapt->bytes / (adapt->blockUs ? adapt->blockUs : 1);
+    latencyUs = adapt->blockUs / adapt->blocks;
+    tooSlow = (params->targetMBps && mbps < params->targetMBps) ||
+              (params->targetLatencyUs && latencyUs > params->targetLatencyUs);
+    headroom = (!params->targetMBps ||
+                mbps * 100 > (unsigned long long)params->targetMBps * (100 + ADAPT_HEADROOM_PERCENT)) &&
+               (!params->targetLatencyUs ||
+                latencyUs * (100 + ADAPT_HEADROOM_PERCENT) < (unsigned long long)params->targetLatencyUs * 100);
+
+    if (tooSlow && level > params->minLevel) {
+        adapt->level--;
+    } else if (headroom && level < params->maxLevel &&
+               adapt->congested * 2 < adapt->blocks &&
+               (0 == adapt->ratio[level + 1] ||
+                adapt->ratio[level + 1] + ADAPT_RATIO_MIN_GAIN <= adapt->ratio[level])) {
+        adapt->level++;
+    }
+    QZSTD_LOG(2, "Adaptive level: %d -> %d, %llu MB/s, latency: %llu us\n",
+              level, adapt->level, mbps, latencyUs);
+    adapt->blocks = 0;
+    adapt->congested = 0;
+    adapt->bytes = 0;
+    adapt->blockUs = 0;
+}
+
+static void QZSTD_lockStatePool(void)
+{
+    while (__sync_lock_test_and_set(&gProcess.statePoolLock, 1)) {
+        ;
+    }
+}
+
+static void QZSTD_unlockStatePool(void)
+{
+    __sync_lock_release(&gProcess.statePoolLock);
+}
+
+/** QZSTD_poolState:
+ *    Put a released state in the process state pool, or free it if the pool
+ *  is full
+ */
+static void QZSTD_poolState(QZSTD_Session_T *zstdSess)
+{
+    int pooled = 0;
+
+    QZSTD_lockStatePool();
+    if (gProcess.statePoolSize < STATE_POOL_MAX) {
+        zstdSess->next = gProcess.statePool;
+        gProcess.statePool = zstdSess;
+        gProcess.statePoolSize++;
+        pooled = 1;
+    }
+    QZSTD_unlockStatePool();
+    if (!pooled) {
+        QZSTD_freeSeqProdState(zstdSess);
+    }
+}
+
+/** QZSTD_flushStateCache:
+ *    Move the states cached by a thread to the process state pool, it's
+ *  called when the thread exits.
+ */
+static void QZSTD_flushStateCache(void *cache)
+{
+    QZSTD_StateCache_T *stateCache = (QZSTD_StateCache_T *)cache;
+
+    while (stateCache->num > 0) {
+        QZSTD_poolState(stateCache->states[--stateCache->num]);
+    }
+}
+
+/** QZSTD_drainStatePool:
+ *    Free the states of the process state pool and of the cache of the calling
+ *  thread, called when QAT is stopped. Other threads free theirs when they exit
+ *  if the pool is full.
+ */
+static void QZSTD_drainStatePool(void)
+{
+    QZSTD_Session_T *zstdSess;
+
+    while (tlsStateCache.num > 0) {
+        QZSTD_freeSeqProdState(tlsStateCache.states[--tlsStateCache.num]);
+    }
+    QZSTD_lockStatePool();
+    zstdSess = gProcess.statePool;
+    gProcess.statePool = NULL;
+    gProcess.statePoolSize = 0;
+    QZSTD_unlockStatePool();
+    while (NULL != zstdSess) {
+        QZSTD_Session_T *next = zstdSess->next;
+        QZSTD_freeSeqProdState(zstdSess);
+        zstdSess = next;
+    }
+}
+
+static void QZSTD_initStateCacheKey(void)
+{
+    if (0 != pthread_key_create(&gStateCacheKey, QZSTD_flushStateCache)) {
+        QZSTD_LOG(1, "pthread_key_create failed\n");
+    }
+}
+
+void *QZSTD_acquireSeqProdState(void)
+{
+    QZSTD_Session_T *zstdSess = NULL;
+
+    if (tlsStateCache.num > 0) {
+        return (void *)tlsStateCache.states[--tlsStateCache.num];
+    }
+
+    QZSTD_lockStatePool();
+    if (NULL != gProcess.statePool) {
+        zstdSess = gProcess.statePool;
+        gProcess.statePool = zstdSess->next;
+        gProcess.statePoolSize--;
+        zstdSess->next = NULL;
+    }
+    QZSTD_unlockStatePool();
+
+    if (NULL == zstdSess) {
+        return QZSTD_createSeqProdState();
+    }
+    return (void *)zstdSess;
+}
+
+void QZSTD_releaseSeqProdState(void *sequenceProducerState)
+{
+    QZSTD_Session_T *zstdSess = (QZSTD_Session_T *)sequenceProducerState;
+    QZSTD_customMem customMem;
+
+    if (NULL == zstdSess) {
+        return;
+    }
+    /* The pool only holds states of the default allocator */
+    if (NULL != zstdSess->customMem.customAlloc) {
+        QZSTD_freeSeqProdState(zstdSess);
+        return;
+    }
+    zstdSess->failOffloadCnt = 0;
+    memset(&zstdSess->params, 0, sizeof(QZSTD_SeqProdParams_T));
+    memset(&zstdSess->adapt, 0, sizeof(QZSTD_AdaptState_T));
+    memset(&zstdSess->checksum, 0, sizeof(QZSTD_ChecksumState_T));
+    memset(&zstdSess->stageTimer, 0, sizeof(QZSTD_StageTimer_T));
+    memset(&zstdSess->frame, 0, sizeof(QZSTD_FrameState_T));
+    /* Workspaces of the features are large, they're allocated again on use */
+    customMem = zstdSess->customMem;
+    QZSTD_freeMem(zstdSess->optWksp, 0, &customMem);
+    QZSTD_freeMem(zstdSess->ldm, 0, &customMem);
+    QZSTD_putDictIndex(zstdSess->dictIndex);
+    zstdSess->optWksp = NULL;
+    zstdSess->ldm = NULL;
+    zstdSess->dictIndex = NULL;
+
+    if (tlsStateCache.num < STATE_CACHE_PER_THREAD) {
+        /* Register the cache, so it's flushed to the state pool when the thread exits */
+        if (0 == tlsStateCache.num) {
+            pthread_once(&gStateCacheOnce, QZSTD_initStateCacheKey);
+            (void)pthread_setspecific(gStateCacheKey, &tlsStateCache);
+        }
+        tlsStateCache.states[tlsStateCache.num++] = zstdSess;
+        return;
+    }
+    QZSTD_poolState(zstdSess);
+}
+
+/** QZSTD_countSeq:
+ *    Count a sequence with a match in seqStats
+ */
+static inline void QZSTD_countSeq(QZSTD_SeqStats_T *seqStats, size_t litLength,
+                                  size_t matchLength, size_t offset)
+{
+    seqStats->sequences++;
+    seqStats->literalBytes += litLength;
+    seqStats->matchBytes += matchLength;
+    seqStats->matches3 += 3 == matchLength;
+    seqStats->matchLengthHist[31 - __builtin_clz((unsigned int)matchLength)]++;
+    /* Offset 0 of a sequence given to QZSTD_addSeqStats counts in bucket 0 */
+    seqStats->offsetHist[31 - __builtin_clz((unsigned int)offset | 1)]++;
+}
+
+void QZSTD_addSeqStats(QZSTD_SeqStats_T *seqStats, const ZSTD_Sequence *seqs,
+                       size_t nbSeqs)
+{
+    size_t i;
+
+    if (NULL == seqStats || NULL == seqs) {
+        return;
+    }
+    for (i = 0; i < nbSeqs; i++) {
+        if (seqs[i].matchLength) {
+            QZSTD_countSeq(seqStats, seqs[i].litLength, seqs[i].matchLength,
+                           seqs[i].offset);
+            continue;
+        }
+        seqStats->literalBytes += seqs[i].litLength;
+        seqStats->blocks += 0 == seqs[i].offset;
+    }
+}
+
+/** QZSTD_mergeSeqStats:
+ *    Add the statistics of a block to the process-wide statistics
+ */
+static void QZSTD_mergeSeqStats(const QZSTD_SeqStats_T *blockStats)
+{
+    QZSTD_SeqStats_T *seqStats = &gProcess.seqStats;
+    int b;
+
+    __sync_fetch_and_add(&seqStats->blocks, blockStats->blocks);
+    __sync_fetch_and_add(&seqStats->sequences, blockStats->sequences);
+    __sync_fetch_and_add(&seqStats->literalBytes, blockStats->literalBytes);
+    __sync_fetch_and_add(&seqStats->matchBytes, blockStats->matchBytes);
+    __sync_fetch_and_add(&seqStats->matches3, blockStats->matches3);
+    for (b = 0; b < QZSTD_SEQ_STATS_BUCKETS; b++) {
+        if (blockStats->matchLengthHist[b]) {
+            __sync_fetch_and_add(&seqStats->matchLengthHist[b],
+                                 blockStats->matchLengthHist[b]);
+        }
+        if (blockStats->offsetHist[b]) {
+            __sync_fetch_and_add(&seqStats->offsetHist[b], blockStats->offsetHist[b]);
+        }
+    }
+}
+
+/** QZSTD_decLz4s:
+ *    Decode the lz4s output of QAT to zstd sequences
+ *  matchLenBase is added to the match length fields, it depends on the
+ *  min match of the session.
+ *  Matches with offsets beyond windowSize are turned into literals, so any
+ *  window size can be used with QAT.
+ *  The sequences are counted in seqStats unless it's NULL.
+ */
+static size_t QZSTD_decLz4s(ZSTD_Sequence *outSeqs, size_t outSeqsCapacity,
+                            unsigned char *lz4sBuff, unsigned int lz4sBufSize,
+                            size_t windowSize, size_t matchLenBase,
+                            QZSTD_SeqStats_T *seqStats)
+{
+    unsigned char *ip = lz4sBuff;
+    unsigned char *endip = lz4sBuff + lz4sBufSize;
+    unsigned int histLiteralLen = 0;
+
+    size_t seqsIdx = 0;
+
+    while (ip < endip && lz4sBufSize > 0) {
+        size_t length = 0;
+        size_t offset = 0;
+        size_t literalLen = 0, matchlen = 0;
+        /* get literal length */
+        unsigned const token = *ip++;
+        if ((length = (token >> ML_BITS)) == RUN_MASK) {
+            unsigned s;
+            do {
+                s = *ip++;
+                length += s;
             } while (s == 255);
         }
         literalLen = length;
@@ -1041,6 +2953,10 @@ static size_t QZSTD_decLz4s(ZSTD_Sequence *outSeqs, size_t outSeqsCapacity,
             outSeqs[seqsIdx].matchLength = matchlen;
             QZSTD_LOG(3, "Last sequence, literalLen: %lu, offset: %lu, matchlen: %lu\n",
                       literalLen, offset, matchlen);
+            if (NULL != seqStats) {
+                seqStats->literalBytes += literalLen;
+                seqStats->blocks++;
+            }
             break;
         }
 
@@ -1057,9 +2973,18 @@ static size_t QZSTD_decLz4s(ZSTD_Sequence *outSeqs, size_t outSeqsCapacity,
                 length += s;
             } while (s == 255);
         }
-        if (length != 0) {
-            length += LZ4MINMATCH;
-            matchlen = (unsigned short)length;
+        if (length != 0 && 0 == offset) {
+            QZSTD_LOG(1, "Invalid offset 0 of a match\n");
+            return ZSTD_SEQUENCE_PRODUCER_ERROR;
+        }
+        if (length != 0 && offset > windowSize) {
+            /* Out of the window, keep the match as literals */
+            length += matchLenBase;
+            QZSTD_LOG(3, "Offset %lu is out of window, matchlen: %lu\n", offset, length);
+            histLiteralLen += literalLen + length;
+        } else if (length != 0) {
+            length += matchLenBase;
+            matchlen = length;
             literalLen += histLiteralLen;
 
             /* update ZSTD_Sequence */
@@ -1068,6 +2993,9 @@ static size_t QZSTD_decLz4s(ZSTD_Sequence *outSeqs, size_t outSeqsCapacity,
             outSeqs[seqsIdx].matchLength = matchlen;
             QZSTD_LOG(3, "sequence, literalLen: %lu, offset: %lu, matchlen: %lu\n",
                       literalLen, offset, matchlen);
+            if (NULL != seqStats) {
+                QZSTD_countSeq(seqStats, literalLen, matchlen, offset);
+            }
             histLiteralLen = 0;
             ++seqsIdx;
             if (seqsIdx >= (outSeqsCapacity - 1)) {
@@ -1090,6 +3018,1106 @@ static size_t QZSTD_decLz4s(ZSTD_Sequence *outSeqs, size_t outSeqsCapacity,
     return ++seqsIdx;
 }
 
+static inline unsigned int QZSTD_highbit32(unsigned int val)
+{
+    return 31 - (unsigned int)__builtin_clz(val);
+}
+
+/** QZSTD_count:
+ *    Return the length of the common prefix of pIn and pMatch, pIn stops
+ *  at pInLimit
+ */
+static size_t QZSTD_count(const unsigned char *pIn, const unsigned char *pMatch,
+                          const unsigned char *const pInLimit)
+{
+    const unsigned char *const pStart = pIn;
+
+    while (pIn + sizeof(size_t) <= pInLimit) {
+        size_t diff;
+        size_t inVal, matchVal;
+        memcpy(&inVal, pIn, sizeof(size_t));
+        memcpy(&matchVal, pMatch, sizeof(size_t));
+        diff = inVal ^ matchVal;
+        if (diff) {
+            if (isLittleEndian()) {
+                pIn += (size_t)__builtin_ctzll((unsigned long long)diff) >> 3;
+            } else {
+                pIn += (size_t)__builtin_clzll((unsigned long long)diff) >> 3;
+            }
+            return (size_t)(pIn - pStart);
+        }
+        pIn += sizeof(size_t);
+        pMatch += sizeof(size_t);
+    }
+    while (pIn < pInLimit && *pMatch == *pIn) {
+        pIn++;
+        pMatch++;
+    }
+    return (size_t)(pIn - pStart);
+}
+
+static inline unsigned int QZSTD_hash4(const unsigned char *p)
+{
+    unsigned int val;
+    memcpy(&val, p, sizeof(val));
+    return (val * 2654435761U) >> (32 - OPT_HASH_LOG);
+}
+
+/** QZSTD_fracWeight:
+ *    Approximation of log2(val + 1), with OPT_BITCOST_ACCURACY fractional bits
+ */
+static inline unsigned int QZSTD_fracWeight(unsigned int val)
+{
+    unsigned int hb = QZSTD_highbit32(val + 1);
+    return hb * OPT_BITCOST_MULTIPLIER +
+           (((val + 1) << OPT_BITCOST_ACCURACY) >> hb);
+}
+
+/** QZSTD_optMatchPrice:
+ *    Estimated bits of a sequence to encode a match, in fractional bits
+ */
+static inline unsigned int QZSTD_optMatchPrice(unsigned int off,
+        unsigned int mlen, int repIdx)
+{
+    unsigned int mlBase = mlen - OPT_MINMATCH;
+    unsigned int price = OPT_SEQ_COST + OPT_OFF_CODE_COST + OPT_ML_CODE_COST;
+
+    if (repIdx < 0) {
+        price += QZSTD_highbit32(off + OPT_REP_NUM) * OPT_BITCOST_MULTIPLIER;
+    }
+    if (mlBase >= 32) {
+        price += (QZSTD_highbit32(mlBase) - 4) * OPT_BITCOST_MULTIPLIER;
+    }
+    return price;
+}
+
+/** QZSTD_optInitPrices:
+ *    Price literals by their frequency in the block
+ */
+static void QZSTD_optInitPrices(QZSTD_OptWksp_T *wksp,
+                                const unsigned char *src, size_t srcSize)
+{
+    unsigned int count[256];
+    unsigned int totalWeight;
+    size_t pos;
+    int b;
+
+    for (b = 0; b < 256; b++) {
+        count[b] = 1;
+    }
+    for (pos = 0; pos < srcSize; pos++) {
+        count[src[pos]]++;
+    }
+    totalWeight = QZSTD_fracWeight((unsigned int)srcSize + 256);
+    for (b = 0; b < 256; b++) {
+        wksp->litPrice[b] = totalWeight - QZSTD_fracWeight(count[b]);
+    }
+}
+
+static inline void QZSTD_optInsertHash(QZSTD_OptWksp_T *wksp,
+                                       const unsigned char *src, size_t pos)
+{
+    unsigned int h = QZSTD_hash4(src + pos);
+    wksp->chainTable[pos] = wksp->hashTable[h];
+    wksp->hashTable[h] = (unsigned int)pos + 1;
+}
+
+/** QZSTD_optAddCandidate:
+ *    Add a match of offset off at pos if it's longer than the last candidate,
+ *  so candidates are sorted by increasing length
+ */
+static inline unsigned int QZSTD_optAddCandidate(QZSTD_OptCandidate_T *cands,
+        unsigned int nbCands, const unsigned char *src, size_t srcSize,
+        size_t pos, unsigned int off, int repIdx)
+{
+    unsigned int bestLen = nbCands ? cands[nbCands - 1].len : OPT_MINMATCH - 1;
+    size_t len;
+
+    if (nbCands >= OPT_MAX_CANDIDATES || pos + bestLen >= srcSize ||
+        src[pos + bestLen] != src[pos + bestLen - off]) {
+        return nbCands;
+    }
+    len = QZSTD_count(src + pos, src + pos - off, src + srcSize);
+    if (len > bestLen) {
+        cands[nbCands].off = off;
+        cands[nbCands].len = (unsigned int)len;
+        cands[nbCands].repIdx = repIdx;
+        nbCands++;
+    }
+    return nbCands;
+}
+
+/** QZSTD_optUpdateRep:
+ *    Repeat offsets after a match of offset off
+ */
+static inline void QZSTD_optUpdateRep(unsigned int *newRep,
+                                      const unsigned int *rep, unsigned int off)
+{
+    if (off == rep[0]) {
+        memcpy(newRep, rep, sizeof(unsigned int) * OPT_REP_NUM);
+    } else if (off == rep[1]) {
+        newRep[0] = rep[1];
+        newRep[1] = rep[0];
+        newRep[2] = rep[2];
+    } else {
+        newRep[0] = off;
+        newRep[1] = rep[0];
+        newRep[2] = rep[1];
+    }
+}
+
+/** QZSTD_optimalParse:
+ *    Refine the sequences QAT produced for hybrid levels
+ *  The matches of QAT are used as seeds of a forward optimal parse over the
+ *  whole block. At every position, the candidates are the repeat offsets, the
+ *  offset of the QAT sequence covering the position, and the matches found in
+ *  a hash chain of 4-byte hashes. Each candidate is extended as far as it
+ *  matches, then every length of it is priced with a simple bit cost model.
+ *  The cheapest path is written back to outSeqs.
+ *
+ * @retval size_t   Number of sequences, or ZSTD_SEQUENCE_PRODUCER_ERROR.
+ */
+static size_t QZSTD_optimalParse(QZSTD_Session_T *zstdSess,
+                                 ZSTD_Sequence *outSeqs, size_t nbSeqs, size_t outSeqsCapacity,
+                                 const unsigned char *src, size_t srcSize,
+                                 int compressionLevel, size_t windowSize)
+{
+    const QZSTD_OptParams_T *params =
+        &gOptParams[compressionLevel - COMP_LVL_MAXIMUM - 1];
+    QZSTD_OptCandidate_T cands[OPT_MAX_CANDIDATES];
+    QZSTD_OptWksp_T *wksp;
+    QZSTD_OptNode_T *nodes;
+    size_t seedIdx = 0, seedStart = 0; /* QAT sequence covering pos, and its start */
+    size_t pos, end, seqIdx;
+    unsigned int maxOff = windowSize < srcSize ? (unsigned int)windowSize :
+                          (unsigned int)srcSize;
+    unsigned int nbMatches = 0, litLength = 0;
+
+    if (srcSize > ZSTD_BLOCKSIZE_MAX) {
+        return ZSTD_SEQUENCE_PRODUCER_ERROR;
+    }
+    if (NULL == zstdSess->optWksp) {
+        zstdSess->optWksp = (QZSTD_OptWksp_T *)QZSTD_callocMem(
+                                sizeof(QZSTD_OptWksp_T), 0, 0, &zstdSess->customMem);
+        if (NULL == zstdSess->optWksp) {
+            QZSTD_LOG(1, "Failed to allocate memory\n");
+            return ZSTD_SEQUENCE_PRODUCER_ERROR;
+        }
+    }
+    wksp = zstdSess->optWksp;
+    nodes = wksp->nodes;
+
+    memset(wksp->hashTable, 0, sizeof(wksp->hashTable));
+    QZSTD_optInitPrices(wksp, src, srcSize);
+    nodes[0].price = 0;
+    nodes[0].off = 0;
+    nodes[0].mlen = 0;
+    nodes[0].rep[0] = 1;
+    nodes[0].rep[1] = 4;
+    nodes[0].rep[2] = 8;
+    for (pos = 1; pos <= srcSize; pos++) {
+        nodes[pos].price = OPT_MAX_PRICE;
+    }
+
+    for (pos = 0; pos < srcSize; pos++) {
+        QZSTD_OptNode_T *node = &nodes[pos];
+        unsigned int nbCands = 0, prevLen = OPT_MINMATCH - 1;
+        unsigned int price, c, len, r;
+
+        /* A literal */
+        price = node->price + wksp->litPrice[src[pos]];
+        if (price < nodes[pos + 1].price) {
+            nodes[pos + 1].price = price;
+            nodes[pos + 1].off = 0;
+            nodes[pos + 1].mlen = 0;
+            memcpy(nodes[pos + 1].rep, node->rep, sizeof(node->rep));
+        }
+        if (pos + 4 > srcSize) {
+            continue;
+        }
+
+        /* Repeat offsets */
+        for (r = 0; r < OPT_REP_NUM; r++) {
+            if (node->rep[r] > 0 && node->rep[r] <= pos && node->rep[r] <= maxOff) {
+                nbCands = QZSTD_optAddCandidate(cands, nbCands, src, srcSize, pos,
+                                                node->rep[r], (int)r);
+            }
+        }
+
+        /* The QAT sequence covering pos, including its literals so the match
+         * can be extended backwards */
+        while (seedIdx < nbSeqs &&
+               pos >= seedStart + outSeqs[seedIdx].litLength + outSeqs[seedIdx].matchLength) {
+            seedStart += outSeqs[seedIdx].litLength + outSeqs[seedIdx].matchLength;
+            seedIdx++;
+        }
+        if (seedIdx < nbSeqs && outSeqs[seedIdx].offset > 0 &&
+            outSeqs[seedIdx].offset <= pos && outSeqs[seedIdx].offset <= maxOff) {
+            nbCands = QZSTD_optAddCandidate(cands, nbCands, src, srcSize, pos,
+                                            outSeqs[seedIdx].offset, -1);
+        }
+
+        /* Hash chain */
+        {
+            unsigned int matchPos = wksp->hashTable[QZSTD_hash4(src + pos)];
+            unsigned int depth = params->searchDepth;
+            while (matchPos > 0 && depth-- > 0) {
+                unsigned int off = (unsigned int)pos - (matchPos - 1);
+                if (off > maxOff) {
+                    break;
+                }
+                nbCands = QZSTD_optAddCandidate(cands, nbCands, src, srcSize, pos,
+                                                off, -1);
+                if (nbCands > 0 && cands[nbCands - 1].len >= params->sufficientLen) {
+                    break;
+                }
+                matchPos = wksp->chainTable[matchPos - 1];
+            }
+        }
+        QZSTD_optInsertHash(wksp, src, pos);
+
+        if (nbCands == 0) {
+            continue;
+        }
+
+        /* Long enough match, take it and skip the positions it covers */
+        if (cands[nbCands - 1].len >= params->sufficientLen) {
+            QZSTD_OptCandidate_T *cand = &cands[nbCands - 1];
+            size_t next = pos + cand->len;
+            price = node->price + QZSTD_optMatchPrice(cand->off, cand->len, cand->repIdx);
+            if (price < nodes[next].price) {
+                nodes[next].price = price;
+                nodes[next].off = cand->off;
+                nodes[next].mlen = cand->len;
+                QZSTD_optUpdateRep(nodes[next].rep, node->rep, cand->off);
+            }
+            for (pos = pos + 1; pos < next; pos++) {
+                if (pos + 4 <= srcSize) {
+                    QZSTD_optInsertHash(wksp, src, pos);
+                }
+            }
+            pos = next - 1;
+            continue;
+        }
+
+        /* Price every length of the candidates */
+        for (c = 0; c < nbCands; c++) {
+            for (len = prevLen + 1; len <= cands[c].len; len++) {
+                price = node->price +
+                        QZSTD_optMatchPrice(cands[c].off, len, cands[c].repIdx);
+                if (price < nodes[pos + len].price) {
+                    nodes[pos + len].price = price;
+                    nodes[pos + len].off = cands[c].off;
+                    nodes[pos + len].mlen = len;
+                    QZSTD_optUpdateRep(nodes[pos + len].rep, node->rep, cands[c].off);
+                }
+            }
+            prevLen = cands[c].len;
+        }
+    }
+
+    /* Count the matches of the cheapest path */
+    for (end = srcSize; end > 0;) {
+        if (nodes[end].mlen > 0) {
+            nbMatches++;
+            end -= nodes[end].mlen;
+        } else {
+            end--;
+        }
+    }
+    if (nbMatches + 1 > outSeqsCapacity) {
+        QZSTD_LOG(1, "Sequence exceed capacity\n");
+        return ZSTD_SEQUENCE_PRODUCER_ERROR;
+    }
+
+    /* Write the path backwards, the last sequence only has literals */
+    seqIdx = nbMatches;
+    outSeqs[seqIdx].offset = 0;
+    outSeqs[seqIdx].matchLength = 0;
+    outSeqs[seqIdx].rep = 0;
+    for (end = srcSize; end > 0;) {
+        if (nodes[end].mlen > 0) {
+            outSeqs[seqIdx].litLength = litLength;
+            seqIdx--;
+            outSeqs[seqIdx].offset = nodes[end].off;
+            outSeqs[seqIdx].matchLength = nodes[end].mlen;
+            outSeqs[seqIdx].rep = 0;
+            litLength = 0;
+            end -= nodes[end].mlen;
+        } else {
+            litLength++;
+            end--;
+        }
+    }
+    outSeqs[seqIdx].litLength = litLength;
+
+    QZSTD_LOG(2, "Refined %lu sequences into %u sequences\n", nbSeqs,
+              nbMatches + 1);
+    return nbMatches + 1;
+}
+
+/** QZSTD_litSearchInsert:
+ *    Insert the positions in [from, to) which are multiples of
+ *  LIT_SEARCH_INSERT_STEP, so the table covers the whole block
+ */
+static inline void QZSTD_litSearchInsert(unsigned int *table,
+        const unsigned char *src, size_t srcSize, size_t from, size_t to)
+{
+    size_t pos = (from + LIT_SEARCH_INSERT_STEP - 1) & ~(size_t)(LIT_SEARCH_INSERT_STEP - 1);
+
+    for (; pos < to && pos + LIT_SEARCH_MINMATCH <= srcSize;
+         pos += LIT_SEARCH_INSERT_STEP) {
+        unsigned int *bucket = table + ((size_t)QZSTD_hash4(src + pos) >>
+                                        (OPT_HASH_LOG - LIT_SEARCH_HASH_LOG) << LIT_SEARCH_BUCKET_LOG);
+        memmove(bucket + 1, bucket, sizeof(unsigned int) * (LIT_SEARCH_BUCKET_SIZE - 1));
+        bucket[0] = (unsigned int)pos + 1;
+    }
+}
+
+/** QZSTD_searchLiterals:
+ *    Find matches in the long literal runs QAT left
+ *  Literal runs of at least minRunLen bytes are searched with a
+ *  small bucketed hash table, which stays in cache. One position out of
+ *  LIT_SEARCH_INSERT_STEP is inserted, so the table covers the whole block, and
+ *  matches are extended backwards to where they start. The matches found split the literal runs, the sequences are moved to
+ *  the end of outSeqs first so they can be rewritten from the start.
+ *
+ * @retval size_t   Number of sequences, or ZSTD_SEQUENCE_PRODUCER_ERROR.
+ */
+static size_t QZSTD_searchLiterals(QZSTD_Session_T *zstdSess,
+                                   ZSTD_Sequence *outSeqs, size_t nbSeqs, size_t outSeqsCapacity,
+                                   const unsigned char *src, size_t srcSize, size_t windowSize,
+                                   int minRunLen)
+{
+    unsigned int *table;
+    size_t base = outSeqsCapacity - nbSeqs;
+    size_t r, w = 0, pos = 0, p;
+    size_t maxOff = windowSize < srcSize ? windowSize : srcSize;
+    size_t runs = 0, runBytes = 0, matches = 0, matchBytes = 0;
+
+    if (NULL == zstdSess->litSearchTable) {
+        zstdSess->litSearchTable = (unsigned int *)QZSTD_callocMem(
+                                       sizeof(unsigned int) << (LIT_SEARCH_HASH_LOG + LIT_SEARCH_BUCKET_LOG),
+                                       0, 0, &zstdSess->customMem);
+        if (NULL == zstdSess->litSearchTable) {
+            QZSTD_LOG(1, "Failed to allocate memory\n");
+            return ZSTD_SEQUENCE_PRODUCER_ERROR;
+        }
+    }
+    table = zstdSess->litSearchTable;
+    memset(table, 0, sizeof(unsigned int) << (LIT_SEARCH_HASH_LOG +
+            LIT_SEARCH_BUCKET_LOG));
+    memmove(outSeqs + base, outSeqs, nbSeqs * sizeof(ZSTD_Sequence));
+
+    for (r = 0; r < nbSeqs; r++) {
+        ZSTD_Sequence seq = outSeqs[base + r];
+        size_t litEnd = pos + seq.litLength;
+        size_t anchor = pos;
+
+        if (seq.litLength >= (unsigned int)minRunLen) {
+            runs++;
+            runBytes += seq.litLength;
+            p = pos;
+            while (p + LIT_SEARCH_MINMATCH <= litEnd) {
+                unsigned int *bucket = table + ((size_t)QZSTD_hash4(src + p) >>
+                                                (OPT_HASH_LOG - LIT_SEARCH_HASH_LOG) << LIT_SEARCH_BUCKET_LOG);
+                size_t bestLen = 0, bestOff = 0, start;
+                unsigned int k;
+
+                for (k = 0; k < LIT_SEARCH_BUCKET_SIZE && bucket[k] > 0; k++) {
+                    size_t off = p - (bucket[k] - 1);
+                    size_t len;
+                    if (off > maxOff) {
+                        continue;
+                    }
+                    len = QZSTD_count(src + p, src + p - off, src + litEnd);
+                    if (len > bestLen) {
+                        bestLen = len;
+                        bestOff = off;
+                    }
+                }
+                QZSTD_litSearchInsert(table, src, srcSize, p, p + 1);
+
+                /* Keep the write position behind the sequences not read yet */
+                if (bestLen < LIT_SEARCH_MINMATCH || w >= base + r ||
+                    QZSTD_optMatchPrice((unsigned int)bestOff, (unsigned int)bestLen, -1) >
+                    bestLen * POST_LIT_COST) {
+                    p++;
+                    continue;
+                }
+
+                /* Extend backwards into the literals not taken yet */
+                start = p;
+                while (start > anchor && start > bestOff &&
+                       src[start - 1] == src[start - 1 - bestOff]) {
+                    start--;
+                    bestLen++;
+                }
+                outSeqs[w].litLength = (unsigned int)(start - anchor);
+                outSeqs[w].offset = (unsigned int)bestOff;
+                outSeqs[w].matchLength = (unsigned int)bestLen;
+                outSeqs[w].rep = 0;
+                w++;
+                matches++;
+                matchBytes += bestLen;
+
+                QZSTD_litSearchInsert(table, src, srcSize, p + 1, start + bestLen);
+                p = start + bestLen;
+                anchor = p;
+            }
+            QZSTD_litSearchInsert(table, src, srcSize, p, litEnd);
+        } else {
+            QZSTD_litSearchInsert(table, src, srcSize, pos, litEnd);
+        }
+
+        outSeqs[w].litLength = (unsigned int)(litEnd - anchor);
+        outSeqs[w].offset = seq.offset;
+        outSeqs[w].matchLength = seq.matchLength;
+        outSeqs[w].rep = 0;
+        w++;
+        QZSTD_litSearchInsert(table, src, srcSize, litEnd, litEnd + seq.matchLength);
+        pos = litEnd + seq.matchLength;
+    }
+
+    __sync_fetch_and_add(&gProcess.litSearchStats.runs, runs);
+    __sync_fetch_and_add(&gProcess.litSearchStats.runBytes, runBytes);
+    __sync_fetch_and_add(&gProcess.litSearchStats.matches, matches);
+    __sync_fetch_and_add(&gProcess.litSearchStats.matchBytes, matchBytes);
+    return w;
+}
+
+/** QZSTD_postOptimize:
+ *    Improve the sequences decoded from the lz4s output of QAT in place
+ *  Matches are extended backwards into their literals and forwards into the
+ *  literals of the next sequence, a match that continues the previous match
+ *  with the same offset is merged into it, and matches which cost more bits
+ *  than their bytes as literals are turned into literals.
+ *
+ * @retval size_t   Number of sequences after optimizing.
+ */
+static size_t QZSTD_postOptimize(ZSTD_Sequence *seqs, size_t nbSeqs,
+                                 const unsigned char *src)
+{
+    unsigned int rep[OPT_REP_NUM] = { 1, 4, 8 };
+    unsigned int newRep[OPT_REP_NUM];
+    size_t r, w = 0, pos = 0;
+    size_t extended = 0, merged = 0, pruned = 0, prunedBytes = 0;
+    unsigned int pendingLit = 0; /* Literals of pruned matches */
+
+    for (r = 0; r + 1 < nbSeqs; r++) {
+        unsigned int litLength = seqs[r].litLength + pendingLit;
+        unsigned int off = seqs[r].offset;
+        unsigned int matchLength = seqs[r].matchLength;
+        size_t matchStart = pos + litLength;
+        size_t ext;
+        int repIdx = -1;
+        unsigned int k;
+
+        pendingLit = 0;
+
+        /* Extend backwards into the literals */
+        while (litLength > 0 && matchStart > off &&
+               src[matchStart - 1] == src[matchStart - 1 - off]) {
+            litLength--;
+            matchLength++;
+            matchStart--;
+            extended++;
+        }
+
+        /* Extend forwards into the literals of the next sequence */
+        ext = QZSTD_count(src + matchStart + matchLength,
+                          src + matchStart + matchLength - off,
+                          src + matchStart + matchLength + seqs[r + 1].litLength);
+        matchLength += (unsigned int)ext;
+        seqs[r + 1].litLength -= (unsigned int)ext;
+        extended += ext;
+
+        /* Merge into the previous match if it continues it */
+        if (0 == litLength && w > 0 && seqs[w - 1].offset == off) {
+            seqs[w - 1].matchLength += matchLength;
+            pos = matchStart + matchLength;
+            merged++;
+            continue;
+        }
+
+        /* Turn the match into literals if they are cheaper */
+        for (k = 0; k < OPT_REP_NUM; k++) {
+            if (off == rep[k]) {
+                repIdx = (int)k;
+                break;
+            }
+        }
+        if (QZSTD_optMatchPrice(off, matchLength, repIdx) >
+            matchLength * POST_LIT_COST) {
+            pendingLit = litLength + matchLength;
+            pruned++;
+            prunedBytes += matchLength;
+            continue;
+        }
+
+        QZSTD_optUpdateRep(newRep, rep, off);
+        memcpy(rep, newRep, sizeof(rep));
+        seqs[w].litLength = litLength;
+        seqs[w].offset = off;
+        seqs[w].matchLength = matchLength;
+        seqs[w].rep = 0;
+        w++;
+        pos = matchStart + matchLength;
+    }
+
+    /* The last sequence only has literals */
+    seqs[w].litLength = seqs[nbSeqs - 1].litLength + pendingLit;
+    seqs[w].offset = 0;
+    seqs[w].matchLength = 0;
+    seqs[w].rep = 0;
+    w++;
+
+    __sync_fetch_and_add(&gProcess.postOptStats.seqsIn, nbSeqs);
+    __sync_fetch_and_add(&gProcess.postOptStats.seqsOut, w);
+    __sync_fetch_and_add(&gProcess.postOptStats.extendedBytes, extended);
+    __sync_fetch_and_add(&gProcess.postOptStats.merged, merged);
+    __sync_fetch_and_add(&gProcess.postOptStats.pruned, pruned);
+    __sync_fetch_and_add(&gProcess.postOptStats.prunedBytes, prunedBytes);
+    return w;
+}
+
+/** QZSTD_ldmInit:
+ *    Allocate the long distance matching state on first use, and fill the
+ *  gear table of the rolling hash
+ */
+static QZSTD_LdmState_T *QZSTD_ldmInit(QZSTD_Session_T *zstdSess)
+{
+    QZSTD_LdmState_T *ldm = zstdSess->ldm;
+    unsigned long long seed = 0x9E3779B97F4A7C15ULL;
+    int b;
+
+    if (NULL != ldm) {
+        return ldm;
+    }
+    ldm = (QZSTD_LdmState_T *)QZSTD_callocMem(sizeof(QZSTD_LdmState_T), 0, 0,
+            &zstdSess->customMem);
+    if (NULL == ldm) {
+        QZSTD_LOG(1, "Failed to allocate memory\n");
+        return NULL;
+    }
+    /* splitmix64 */
+    for (b = 0; b < 256; b++) {
+        unsigned long long z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        ldm->gearTab[b] = z ^ (z >> 31);
+    }
+    zstdSess->ldm = ldm;
+    return ldm;
+}
+
+/** QZSTD_frameAddress:
+ *    Return where the frame position is in memory, NULL if it's not in the
+ *  history of the frame or was overwritten
+ */
+static inline const unsigned char *QZSTD_frameAddress(const QZSTD_FrameState_T
+        *frame, unsigned long long pos)
+{
+    if (pos < frame->histPos) {
+        return NULL;
+    }
+    if (pos >= frame->segPos) {
+        return frame->segSrc + (pos - frame->segPos);
+    }
+    if (NULL != frame->prevSegSrc && pos >= frame->prevSegLow) {
+        return frame->prevSegSrc + (pos - frame->prevSegPos);
+    }
+    return NULL;
+}
+
+/** QZSTD_frameCount:
+ *    QZSTD_count for a match at a frame position, which continues from the
+ *  segment before the wrap into the current one
+ */
+static size_t QZSTD_frameCount(const QZSTD_FrameState_T *frame,
+                               const unsigned char *pIn, const unsigned char *pInLimit,
+                               unsigned long long matchPos, const unsigned char *pMatch)
+{
+    const unsigned char *matchEnd;
+    const unsigned char *limit = pInLimit;
+    size_t len;
+
+    if (matchPos >= frame->segPos) {
+        return QZSTD_count(pIn, pMatch, pInLimit);
+    }
+    matchEnd = frame->prevSegSrc + (frame->segPos - frame->prevSegPos);
+    if ((size_t)(matchEnd - pMatch) < (size_t)(pInLimit - pIn)) {
+        limit = pIn + (matchEnd - pMatch);
+    }
+    len = QZSTD_count(pIn, pMatch, limit);
+    if (pMatch + len != matchEnd) {
+        return len;
+    }
+    return len + QZSTD_count(pIn + len, frame->segSrc, pInLimit);
+}
+
+/** QZSTD_ldmFindMatches:
+ *    Find long matches of the block in the history of the frame
+ *  The history is the previous blocks of the frame, which are still in memory
+ *  before src, or in the segment before the last wrap of the window buffer of
+ *  zstd. A gear rolling hash of LDM_MIN_MATCH bytes selects about one position
+ *  out of 2^LDM_HASH_RATE_LOG, those positions are looked up and inserted in a
+ *  bucketed hash table. Stream positions wrap around at 2^32, entries of older
+ *  frames may still alias into the history, but every candidate is compared
+ *  with the content at its frame position. Only matches at offsets beyond the
+ *  reach of LZ4s are kept.
+ */
+static void QZSTD_ldmFindMatches(QZSTD_Session_T *zstdSess,
+                                 const unsigned char *src, size_t srcSize, size_t blockPos,
+                                 size_t windowSize)
+{
+    QZSTD_LdmState_T *ldm = QZSTD_ldmInit(zstdSess);
+    const QZSTD_FrameState_T *frame = &zstdSess->frame;
+    const unsigned long long stopMask = ((1ULL << LDM_HASH_RATE_LOG) - 1) <<
+                                        (64 - LDM_HASH_RATE_LOG);
+    unsigned long long hash = 0;
+    unsigned int streamPos;
+    size_t histSize = blockPos - (size_t)frame->histPos; /* History before the block */
+    size_t i, anchor = 0; /* End of the last match found in the block */
+
+    if (NULL == ldm) {
+        return;
+    }
+    ldm->nbMatches = 0;
+    streamPos = ldm->frameBase + (unsigned int)blockPos;
+    ldm->nextPos = streamPos + (unsigned int)srcSize;
+
+    for (i = 0; i < srcSize; i++) {
+        unsigned int start, bucketIdx, checksum, k;
+        QZSTD_LdmEntry_T *bucket;
+        size_t bestLen = 0, bestOff = 0, bestStart = 0;
+
+        hash = (hash << 1) + ldm->gearTab[src[i]];
+        if (i + 1 < LDM_MIN_MATCH || (hash & stopMask) != 0) {
+            continue;
+        }
+        start = (unsigned int)(i + 1 - LDM_MIN_MATCH);
+        bucketIdx = (unsigned int)(hash >> (64 - LDM_HASH_RATE_LOG - LDM_HASH_LOG)) &
+                    ((1U << LDM_HASH_LOG) - 1);
+        checksum = (unsigned int)(hash >> 8);
+        bucket = ldm->hashTable[bucketIdx];
+
+        for (k = 0; k < LDM_BUCKET_SIZE && start >= anchor; k++) {
+            size_t off, len, back = 0;
+            unsigned long long matchPos;
+            const unsigned char *match;
+            if (0 == bucket[k].pos || bucket[k].checksum != checksum) {
+                continue;
+            }
+            off = (unsigned int)(streamPos + start - (bucket[k].pos - 1));
+            if (off <= LZ4S_MAX_OFFSET || off > windowSize || off > histSize + start) {
+                continue;
+            }
+            matchPos = blockPos + start - off;
+            match = QZSTD_frameAddress(frame, matchPos);
+            if (NULL == match) {
+                continue;
+            }
+            len = QZSTD_frameCount(frame, src + start, src + srcSize, matchPos, match);
+            /* Extend backwards, within the block and the history */
+            while (start - back > anchor && matchPos - back > frame->histPos) {
+                const unsigned char *prev = QZSTD_frameAddress(frame, matchPos - back - 1);
+                if (NULL == prev || src[start - back - 1] != *prev) {
+                    break;
+                }
+                back++;
+            }
+            if (len + back > bestLen) {
+                bestLen = len + back;
+                bestOff = off;
+                bestStart = start - back;
+            }
+        }
+
+        memmove(bucket + 1, bucket, sizeof(QZSTD_LdmEntry_T) * (LDM_BUCKET_SIZE - 1));
+        bucket[0].pos = streamPos + start + 1;
+        bucket[0].checksum = checksum;
+
+        if (bestLen >= LDM_MIN_MATCH && ldm->nbMatches < LDM_MAX_MATCHES) {
+            QZSTD_LdmMatch_T *m = &ldm->matches[ldm->nbMatches++];
+            m->start = (unsigned int)bestStart;
+            m->len = (unsigned int)bestLen;
+            m->off = (unsigned int)bestOff;
+            anchor = bestStart + bestLen;
+        }
+    }
+}
+
+/** QZSTD_ldmEmit:
+ *    Write a match at start of the block, literals since *cur go with it
+ */
+static inline void QZSTD_ldmEmit(ZSTD_Sequence *outSeqs, size_t *w, size_t *cur,
+                                 size_t start, size_t len, unsigned int off)
+{
+    outSeqs[*w].litLength = (unsigned int)(start - *cur);
+    outSeqs[*w].offset = off;
+    outSeqs[*w].matchLength = (unsigned int)len;
+    outSeqs[*w].rep = 0;
+    (*w)++;
+    *cur = start + len;
+}
+
+/** QZSTD_ldmMergeMatches:
+ *    Merge the long distance matches into the sequences of the block
+ *  Long distance matches take precedence: a sequence overlapping one is cut
+ *  to the parts outside it, keeping its offset, and parts shorter than
+ *  OPT_MINMATCH become literals. The sequences are moved to the end of outSeqs
+ *  to be rewritten from the start.
+ *
+ * @retval size_t   Number of sequences.
+ */
+static size_t QZSTD_ldmMergeMatches(QZSTD_Session_T *zstdSess,
+                                    ZSTD_Sequence *outSeqs, size_t nbSeqs, size_t outSeqsCapacity,
+                                    size_t srcSize)
+{
+    QZSTD_LdmState_T *ldm = zstdSess->ldm;
+    size_t nbMatches, base, r, j = 0, w = 0, cur = 0, pos = 0, matchBytes = 0;
+
+    if (NULL == ldm || 0 == ldm->nbMatches) {
+        return nbSeqs;
+    }
+    /* Every long distance match adds at most two sequences, keep the write
+     * position behind the sequences not read yet */
+    nbMatches = ldm->nbMatches;
+    if (nbMatches > (outSeqsCapacity - nbSeqs) / 2) {
+        nbMatches = (outSeqsCapacity - nbSeqs) / 2;
+    }
+    base = outSeqsCapacity - nbSeqs;
+    memmove(outSeqs + base, outSeqs, nbSeqs * sizeof(ZSTD_Sequence));
+
+    for (r = 0; r < nbSeqs; r++) {
+        ZSTD_Sequence seq = outSeqs[base + r];
+        size_t ms = pos + seq.litLength;
+        size_t me = ms + seq.matchLength;
+
+        pos = me;
+        if (0 == seq.matchLength) {
+            continue;
+        }
+        while (j < nbMatches && ldm->matches[j].start < me) {
+            QZSTD_LdmMatch_T *m = &ldm->matches[j];
+            if (ms < cur) {
+                ms = cur;
+            }
+            if (m->start > ms && m->start - ms >= OPT_MINMATCH) {
+                QZSTD_ldmEmit(outSeqs, &w, &cur, ms, m->start - ms, seq.offset);
+            }
+            QZSTD_ldmEmit(outSeqs, &w, &cur, m->start, m->len, m->off);
+            matchBytes += m->len;
+            j++;
+        }
+        if (ms < cur) {
+            ms = cur;
+        }
+        if (me > ms && me - ms >= OPT_MINMATCH) {
+            QZSTD_ldmEmit(outSeqs, &w, &cur, ms, me - ms, seq.offset);
+        }
+    }
+    for (; j < nbMatches; j++) {
+        QZSTD_ldmEmit(outSeqs, &w, &cur, ldm->matches[j].start, ldm->matches[j].len,
+                      ldm->matches[j].off);
+        matchBytes += ldm->matches[j].len;
+    }
+
+    /* The last sequence only has literals */
+    outSeqs[w].litLength = (unsigned int)(srcSize - cur);
+    outSeqs[w].offset = 0;
+    outSeqs[w].matchLength = 0;
+    outSeqs[w].rep = 0;
+    w++;
+
+    __sync_fetch_and_add(&gProcess.ldmStats.matches, nbMatches);
+    __sync_fetch_and_add(&gProcess.ldmStats.matchBytes, matchBytes);
+    return w;
+}
+
+/** QZSTD_getDictIndex:
+ *    Take a reference to the index of a dictionary, it's built if no state
+ *  with the same allocator references the dictionary yet
+ *
+ * @retval QZSTD_DictIndex_T*   The index, or NULL on failure.
+ */
+static QZSTD_DictIndex_T *QZSTD_getDictIndex(const void *dict, size_t dictSize,
+        const QZSTD_customMem *customMem)
+{
+    QZSTD_DictIndex_T *dictIndex;
+    size_t headerSize = 0;
+    size_t pos;
+    unsigned int magic;
+
+    pthread_mutex_lock(&gProcess.dictIndexMutex);
+    for (dictIndex = gProcess.dictIndexes; NULL != dictIndex; dictIndex = dictIndex->next) {
+        if (dict == dictIndex->dict && dictSize == dictIndex->dictSize &&
+            0 == memcmp(customMem, &dictIndex->customMem, sizeof(QZSTD_customMem))) {
+            dictIndex->refCount++;
+            goto exit;
+        }
+    }
+
+    /* Like ZSTD_dct_auto, the header of a zstd dictionary is not content.
+     * Offsets count from the end of the dictionary, so skipping an upper
+     * bound of the header is enough */
+    memcpy(&magic, dict, sizeof(magic));
+    if (ZSTD_MAGIC_DICTIONARY == (isLittleEndian() ? magic :
+                                  __builtin_bswap32(magic))) {
+        headerSize = dictSize < DICT_HEADER_MAX ? dictSize : DICT_HEADER_MAX;
+    }
+    if (dictSize - headerSize > UINT_MAX - 1) {
+        QZSTD_LOG(1, "Dictionary is too large: %lu\n", dictSize);
+        goto exit;
+    }
+    dictIndex = (QZSTD_DictIndex_T *)QZSTD_callocMem(sizeof(QZSTD_DictIndex_T), 0, 0,
+                customMem);
+    if (NULL == dictIndex) {
+        QZSTD_LOG(1, "Failed to allocate memory\n");
+        goto exit;
+    }
+    dictIndex->dict = dict;
+    dictIndex->dictSize = dictSize;
+    dictIndex->content = (const unsigned char *)dict + headerSize;
+    dictIndex->contentSize = dictSize - headerSize;
+    dictIndex->customMem = *customMem;
+    dictIndex->refCount = 1;
+
+    /* Later positions stay in the buckets, their offsets are smaller */
+    for (pos = 0; pos + DICT_MINMATCH <= dictIndex->contentSize; pos++) {
+        unsigned int *bucket = dictIndex->table + ((size_t)QZSTD_hash4(
+                                   dictIndex->content + pos) >> (OPT_HASH_LOG - DICT_HASH_LOG) << DICT_BUCKET_LOG);
+        memmove(bucket + 1, bucket, sizeof(unsigned int) * (DICT_BUCKET_SIZE - 1));
+        bucket[0] = (unsigned int)pos + 1;
+    }
+    dictIndex->next = gProcess.dictIndexes;
+    gProcess.dictIndexes = dictIndex;
+
+exit:
+    pthread_mutex_unlock(&gProcess.dictIndexMutex);
+    return dictIndex;
+}
+
+int QZSTD_refDict(void *sequenceProducerState, const void *dict,
+                  size_t dictSize)
+{
+    QZSTD_Session_T *zstdSess = (QZSTD_Session_T *)sequenceProducerState;
+    QZSTD_DictIndex_T *dictIndex;
+
+    if (NULL == zstdSess) {
+        return QZSTD_FAIL;
+    }
+    /* The frame may have used the previous dictionary */
+    memset(&zstdSess->frame, 0, sizeof(QZSTD_FrameState_T));
+    dictIndex = zstdSess->dictIndex;
+    if (NULL != dictIndex && dict == dictIndex->dict && dictSize == dictIndex->dictSize) {
+        return QZSTD_OK;
+    }
+    QZSTD_putDictIndex(dictIndex);
+    zstdSess->dictIndex = NULL;
+    /* zstd ignores dictionaries smaller than 8 bytes */
+    if (NULL == dict || dictSize < 8) {
+        return QZSTD_OK;
+    }
+    zstdSess->dictIndex = QZSTD_getDictIndex(dict, dictSize, &zstdSess->customMem);
+    return NULL == zstdSess->dictIndex ? QZSTD_FAIL : QZSTD_OK;
+}
+
+int QZSTD_beginFrame(void *sequenceProducerState, const void *frameSrc,
+                     unsigned long long frameSize)
+{
+    QZSTD_Session_T *zstdSess = (QZSTD_Session_T *)sequenceProducerState;
+
+    if (NULL == zstdSess) {
+        return QZSTD_FAIL;
+    }
+    memset(&zstdSess->frame, 0, sizeof(QZSTD_FrameState_T));
+    if (ZSTD_CONTENTSIZE_ERROR == frameSize) {
+        QZSTD_LOG(1, "Invalid frame size\n");
+        return QZSTD_FAIL;
+    }
+    zstdSess->frame.src = (const unsigned char *)frameSrc;
+    zstdSess->frame.remaining = frameSize;
+    zstdSess->frame.sizeKnown = ZSTD_CONTENTSIZE_UNKNOWN != frameSize;
+    if (NULL != zstdSess->ldm) {
+        QZSTD_ldmReset(zstdSess->ldm);
+    }
+    return QZSTD_OK;
+}
+
+/** QZSTD_frameBlock:
+ *    Check the block is the next one of the frame started by QZSTD_beginFrame
+ *  zstd doesn't pass blocks smaller than 7 bytes to the sequence producer, they
+ *  show as a gap before the block within the window buffer and are counted in
+ *  the frame position. When streaming, zstd copies the input into its window
+ *  buffer and wraps back to the start of the buffer once more than a window has
+ *  been written, the segment before the wrap stays in the history until it's
+ *  overwritten. Any other block not following the previous one, or a block
+ *  beyond the frame size, ends a frame of known size. A frame of unknown size restarts its
+ *  history instead, without the dictionary since the position is lost. A
+ *  skipped first block only shows if zstd reads the frame from the frameSrc
+ *  given, otherwise the position is exact only for a single block.
+ *
+ * @retval 1    The block is in the frame, *blockPos is its frame position.
+ * @retval 0    No frame.
+ */
+static int QZSTD_frameBlock(QZSTD_FrameState_T *frame, const unsigned char *src,
+                            size_t srcSize, size_t windowSize, size_t *blockPos)
+{
+    const unsigned char *srcEnd = src + srcSize;
+    size_t bufSize = windowSize + ZSTD_BLOCKSIZE_MAX; /* Window buffer of zstd */
+    size_t skipped = 0;
+
+    if (0 == frame->remaining) {
+        return 0;
+    }
+    if (NULL == frame->prevEnd) {
+        frame->posKnown = src == frame->src ||
+                          (frame->sizeKnown && srcSize == frame->remaining);
+        frame->segSrc = src;
+    } else if (src == frame->prevEnd) {
+        /* Next block of the segment */
+    } else if (src > frame->prevEnd && (size_t)(srcEnd - frame->segSrc) <= bufSize) {
+        skipped = (size_t)(src - frame->prevEnd);
+    } else if (src >= frame->segSrc && src < frame->prevEnd &&
+               (size_t)(srcEnd - frame->segSrc) <= bufSize &&
+               (size_t)(frame->prevEnd - frame->segSrc) > windowSize) {
+        /* zstd wrapped its window buffer, a shorter segment would mean blocks
+         * were skipped before the wrap, of unknown size */
+        frame->prevSegSrc = frame->segSrc;
+        frame->prevSegPos = frame->segPos;
+        frame->prevSegLow = frame->segPos;
+        frame->segPos = frame->pos;
+        skipped = (size_t)(src - frame->segSrc);
+    } else if (frame->sizeKnown) {
+        memset(frame, 0, sizeof(QZSTD_FrameState_T));
+        return 0;
+    } else {
+        frame->posKnown = 0;
+        frame->histPos = frame->pos;
+        frame->segSrc = src;
+        frame->segPos = frame->pos;
+        frame->prevSegSrc = NULL;
+    }
+    if (frame->sizeKnown) {
+        if (skipped + srcSize > frame->remaining) {
+            memset(frame, 0, sizeof(QZSTD_FrameState_T));
+            return 0;
+        }
+        frame->remaining -= skipped + srcSize;
+    }
+    frame->pos += skipped;
+    *blockPos = (size_t)frame->pos;
+    /* The block overwrites the start of the segment before the wrap */
+    if (NULL != frame->prevSegSrc && srcEnd > frame->prevSegSrc) {
+        unsigned long long low = frame->prevSegPos + (unsigned long long)(srcEnd -
+                                 frame->prevSegSrc);
+        if (low > frame->segPos) {
+            low = frame->segPos;
+        }
+        if (low > frame->prevSegLow) {
+            frame->prevSegLow = low;
+        }
+    }
+    frame->pos += srcSize;
+    frame->prevEnd = srcEnd;
+    return 1;
+}
+
+/** QZSTD_searchDict:
+ *    Find matches in the referenced dictionary for the literal runs
+ *  The decoder puts the dictionary content right before the frame, so the
+ *  offsets reach back over the previous blocks of the frame. The dictionary
+ *  is only reachable while the frame is within the window. The sequences are
+ *  moved to the end of outSeqs to be rewritten from the start.
+ *
+ * @retval size_t   Number of sequences.
+ */
+static size_t QZSTD_searchDict(QZSTD_Session_T *zstdSess,
+                               ZSTD_Sequence *outSeqs, size_t nbSeqs, size_t outSeqsCapacity,
+                               const unsigned char *src, size_t blockPos, size_t windowSize)
+{
+    QZSTD_DictIndex_T *dictIndex = zstdSess->dictIndex;
+    const unsigned char *content = dictIndex->content;
+    size_t contentSize = dictIndex->contentSize;
+    size_t base = outSeqsCapacity - nbSeqs;
+    size_t r, w = 0, pos = 0, p;
+    size_t matches = 0, matchBytes = 0;
+
+    memmove(outSeqs + base, outSeqs, nbSeqs * sizeof(ZSTD_Sequence));
+
+    for (r = 0; r < nbSeqs; r++) {
+        ZSTD_Sequence seq = outSeqs[base + r];
+        size_t litEnd = pos + seq.litLength;
+        size_t anchor = pos;
+
+        p = pos;
+        /* Keep the write position behind the sequences not read yet */
+        while (p + DICT_MINMATCH <= litEnd && w < base + r) {
+            unsigned int *bucket = dictIndex->table + ((size_t)QZSTD_hash4(src + p) >>
+                                   (OPT_HASH_LOG - DICT_HASH_LOG) << DICT_BUCKET_LOG);
+            size_t bestLen = 0, bestIdx = 0, start, off;
+            unsigned int k;
+
+            for (k = 0; k < DICT_BUCKET_SIZE && bucket[k] > 0; k++) {
+                size_t idx = bucket[k] - 1;
+                size_t limit = litEnd - p;
+                size_t len;
+                if (contentSize - idx < limit) {
+                    limit = contentSize - idx;
+                }
+                len = QZSTD_count(src + p, content + idx, src + p + limit);
+                if (len > bestLen) {
+                    bestLen = len;
+                    bestIdx = idx;
+                }
+            }
+            if (bestLen < DICT_MINMATCH) {
+                p++;
+                continue;
+            }
+
+            /* Extend backwards into the literals not taken yet */
+            start = p;
+            while (start > anchor && bestIdx > 0 &&
+                   src[start - 1] == content[bestIdx - 1]) {
+                start--;
+                bestIdx--;
+                bestLen++;
+            }
+            off = blockPos + start + contentSize - bestIdx;
+            if ((off > windowSize && blockPos + start + bestLen > windowSize) ||
+                off > UINT_MAX ||
+                QZSTD_optMatchPrice((unsigned int)off, (unsigned int)bestLen, -1) >
+                bestLen * POST_LIT_COST) {
+                p++;
+                continue;
+            }
+            outSeqs[w].litLength = (unsigned int)(start - anchor);
+            outSeqs[w].offset = (unsigned int)off;
+            outSeqs[w].matchLength = (unsigned int)bestLen;
+            outSeqs[w].rep = 0;
+            w++;
+            matches++;
+            matchBytes += bestLen;
+            p = start + bestLen;
+            anchor = p;
+        }
+
+        outSeqs[w].litLength = (unsigned int)(litEnd - anchor);
+        outSeqs[w].offset = seq.offset;
+        outSeqs[w].matchLength = seq.matchLength;
+        outSeqs[w].rep = 0;
+        w++;
+        pos = litEnd + seq.matchLength;
+    }
+
+    __sync_fetch_and_add(&gProcess.dictStats.matches, matches);
+    __sync_fetch_and_add(&gProcess.dictStats.matchBytes, matchBytes);
+    return w;
+}
+
 static inline void QZSTD_castConstPointer(unsigned char **dest,
         const void **src)
 {
@@ -1103,7 +4131,28 @@ static inline int QZSTD_isTimeOut(struct timeval timeStart,
     return timeSpent > MAXTIMEOUT ? 1 : 0;
 }
 
-size_t qatSequenceProducer(
+/** QZSTD_stageMark:
+ *    End a stage of the block, adding its time to stage unless it's NULL
+ *  Nothing is timed while no stage times callback is set.
+ */
+static inline void QZSTD_stageMark(QZSTD_StageTimer_T *timer,
+                                   unsigned long long *stage)
+{
+    struct timespec now;
+    unsigned long long ns;
+
+    if (NULL == timer->callback) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+    if (NULL != stage) {
+        *stage += ns - timer->stamp;
+    }
+    timer->stamp = ns;
+}
+
+static size_t QZSTD_produceSequences(
     void *sequenceProducerState, ZSTD_Sequence *outSeqs, size_t outSeqsCapacity,
     const void *src, size_t srcSize,
     const void *dict, size_t dictSize,
@@ -1118,20 +4167,39 @@ size_t qatSequenceProducer(
     struct timeval timeStart;
     struct timeval timeNow;
     QZSTD_Session_T *zstdSess = (QZSTD_Session_T *)sequenceProducerState;
+    QZSTD_InstSession_T *instSess = NULL;
+    QZSTD_PoolBuf_T *poolBuf = NULL;
     Cpa32U intermediateBufLen = 0;
+    size_t blockPos = 0;
+    int inFrame;
+    QZSTD_LevelProfile_T profile;
+    struct timeval blockStart;
+    unsigned int lz4sRatio = 0;
+    int congested = 0;
+    QZSTD_SeqStats_T blockStats;
+    int submitted = 0;
+
+    /* The level controller overrides the level of the CCtx */
+    if (zstdSess->adapt.enabled) {
+        compressionLevel = zstdSess->adapt.level;
+        (void)gettimeofday(&blockStart, NULL);
+    }
+
+    /* Count the block even if it fails, zstd may compress it with fallback */
+    inFrame = QZSTD_frameBlock(&zstdSess->frame, (const unsigned char *)src, srcSize,
+                               windowSize, &blockPos);
 
-    if (windowSize < (srcSize < 32 * KB ? srcSize : 32 * KB) || dictSize > 0 ||
-        dict) {
+    if (dictSize > 0 || dict) {
         QZSTD_LOG(2,
-                  "Currently not use windowsSize and not support dictionary, windowsSize: %lu, srcSize: %lu, dictSize: %lu\n",
+                  "Currently not support dictionary, windowsSize: %lu, srcSize: %lu, dictSize: %lu\n",
                   windowSize, srcSize, dictSize);
         return ZSTD_SEQUENCE_PRODUCER_ERROR;
     }
 
-    /* QAT only support L1-L12 */
+    /* QAT only support L1-L12, L13-L22 are seeded by QAT and refined by CPU */
     if (compressionLevel < COMP_LVL_MINIMUM ||
-        compressionLevel > COMP_LVL_MAXIMUM) {
-        QZSTD_LOG(1, "Only can offload L1-L12 to QAT, current compression level: %d\n"
+        compressionLevel > COMP_LVL_HYBRID_MAXIMUM) {
+        QZSTD_LOG(1, "Only can offload L1-L22 to QAT, current compression level: %d\n"
                   , compressionLevel);
         return ZSTD_SEQUENCE_PRODUCER_ERROR;
     }
@@ -1151,9 +4219,12 @@ size_t qatSequenceProducer(
         }
     }
 
-    zstdSess->sessionSetupData.compLevel = (CpaDcCompLvl)compressionLevel;
+    profile = QZSTD_getProfile(compressionLevel);
+    QZSTD_applyProfile(&zstdSess->sessionSetupData, &profile);
 
+    QZSTD_stageMark(&zstdSess->stageTimer, NULL);
     i = QZSTD_grabInstance(zstdSess->instHint);
+    QZSTD_stageMark(&zstdSess->stageTimer, &zstdSess->stageTimer.times.grabNs);
     if (-1 == i) {
         QZSTD_LOG(1, "Failed to grab instance\n");
         return ZSTD_SEQUENCE_PRODUCER_ERROR;
@@ -1162,61 +4233,27 @@ size_t qatSequenceProducer(
     zstdSess->instHint = i;
     zstdSess->reqPhyContMem = gProcess.qzstdInst[i].reqPhyContMem;
 
-    /* allocate instance's buffer */
-    if (0 == gProcess.qzstdInst[i].memSetup) {
-        if (QZSTD_OK != QZSTD_allocInstMem(i)) {
-            QZSTD_LOG(1, "Failed to allocate instance related memory\n");
-            rc = ZSTD_SEQUENCE_PRODUCER_ERROR;
-            goto exit;
-        }
-    }
-
-    /* start Dc Instance */
-    if (0 == gProcess.qzstdInst[i].dcInstSetup) {
-        if (QZSTD_OK != QZSTD_startDcInstance(i)) {
-            QZSTD_LOG(1, "Failed to start DC instance\n");
-            rc = ZSTD_SEQUENCE_PRODUCER_ERROR;
-            goto exit;
-        }
-    }
-
-    /* init cpaSessHandle */
-    if (0 == gProcess.qzstdInst[i].cpaSessSetup) {
-        if (QZSTD_OK != QZSTD_cpaInitSess(zstdSess, i)) {
-            QZSTD_LOG(1, "Failed to init sess\n");
-            rc = ZSTD_SEQUENCE_PRODUCER_ERROR;
-            goto exit;
-        }
-    }
-
-    /* update cpaSessHandle if need */
-    if (0 != memcmp(&zstdSess->sessionSetupData,
-                    &gProcess.qzstdInst[i].sessionSetupData,
-                    sizeof(CpaDcSessionSetupData))) {
-        if (QZSTD_OK != QZSTD_cpaUpdateSess(zstdSess, i)) {
-            QZSTD_LOG(1, "Failed to update sess\n");
-            rc = ZSTD_SEQUENCE_PRODUCER_ERROR;
-            goto exit;
-        }
+    /* allocate instance's buffer and start Dc Instance */
+    if (QZSTD_OK != QZSTD_setupInstance(i)) {
+        rc = ZSTD_SEQUENCE_PRODUCER_ERROR;
+        goto exit;
     }
 
-    if (CPA_STATUS_SUCCESS != cpaDcLZ4SCompressBound(gProcess.dcInstHandle[i],
-            ZSTD_BLOCKSIZE_MAX, &intermediateBufLen)) {
-        QZSTD_LOG(1, "Failed to caculate compress bound\n");
+    /* find or init the cpaSessHandle of current setup data */
+    instSess = QZSTD_getInstSession(i, &zstdSess->sessionSetupData);
+    if (NULL == instSess) {
         rc = ZSTD_SEQUENCE_PRODUCER_ERROR;
         goto exit;
     }
 
-    /* Allocate intermediate buffer for storing lz4s format compressed by QAT */
-    if (NULL == zstdSess->qatIntermediateBuf) {
-        zstdSess->qatIntermediateBuf =
-            (unsigned char *)QZSTD_calloc(1, intermediateBufLen,
-                                          zstdSess->reqPhyContMem);
-        if (NULL == zstdSess->qatIntermediateBuf) {
-            QZSTD_LOG(1, "Failed to allocate memory");
-            rc = ZSTD_SEQUENCE_PRODUCER_ERROR;
-            goto exit;
-        }
+    intermediateBufLen = gProcess.qzstdInst[i].lz4sBound;
+
+    /* Take a buffer for storing lz4s format compressed by QAT */
+    poolBuf = QZSTD_acquirePoolBuf(i);
+    if (NULL == poolBuf) {
+        QZSTD_LOG(1, "Failed to allocate memory");
+        rc = ZSTD_SEQUENCE_PRODUCER_ERROR;
+        goto exit;
     }
 
     if (zstdSess->reqPhyContMem) {
@@ -1225,8 +4262,7 @@ size_t qatSequenceProducer(
         QZSTD_castConstPointer(&(gProcess.qzstdInst[i].srcBuffer->pBuffers->pData),
                                &src);
     }
-    gProcess.qzstdInst[i].destBuffer->pBuffers->pData =
-        (Cpa8U *)zstdSess->qatIntermediateBuf;
+    gProcess.qzstdInst[i].destBuffer->pBuffers->pData = (Cpa8U *)poolBuf->data;
 
     gProcess.qzstdInst[i].srcBuffer->pBuffers->dataLenInBytes = srcSize;
     gProcess.qzstdInst[i].destBuffer->pBuffers->dataLenInBytes =
@@ -1242,13 +4278,14 @@ size_t qatSequenceProducer(
 
     do {
         /* Submit request to QAT */
-        qrc = cpaDcCompressData2(gProcess.dcInstHandle[i],
-                                 gProcess.qzstdInst[i].cpaSessHandle,
+        qrc = gProcess.backend->compressData2(gProcess.dcInstHandle[i],
+                                 instSess->cpaSessHandle,
                                  gProcess.qzstdInst[i].srcBuffer,
                                  gProcess.qzstdInst[i].destBuffer, &opData,
                                  &gProcess.qzstdInst[i].res, (void *)&gProcess.qzstdInst[i]);
         retry_cnt--;
     } while (CPA_STATUS_RETRY == qrc && retry_cnt > 0);
+    QZSTD_stageMark(&zstdSess->stageTimer, &zstdSess->stageTimer.times.submitNs);
 
     if (CPA_STATUS_SUCCESS != qrc) {
         QZSTD_LOG(1, "Failed to submit request, status: %d\n", qrc);
@@ -1257,12 +4294,22 @@ size_t qatSequenceProducer(
     }
 
     gProcess.qzstdInst[i].seqNumIn++;
+    submitted = 1;
+    /* All instances busy, a higher level would slow down the other threads */
+    congested = __sync_add_and_fetch(&gProcess.inflight, 1) >= gProcess.numInstances &&
+                gProcess.numInstances > 1;
+
+    /* Find long distance matches on CPU while QAT compresses the block */
+    if (zstdSess->params.longDistance && inFrame) {
+        QZSTD_ldmFindMatches(zstdSess, (const unsigned char *)src, srcSize, blockPos,
+                             windowSize);
+    }
 
     (void)gettimeofday(&timeStart, NULL);
 
     do {
         /* Poll responses */
-        qrc = icp_sal_DcPollInstance(gProcess.dcInstHandle[i], 0);
+        qrc = gProcess.backend->pollInstance(gProcess.dcInstHandle[i], 0);
         (void)gettimeofday(&timeNow, NULL);
         if (QZSTD_isTimeOut(timeStart, timeNow)) {
             QZSTD_LOG(1, "Polling time out\n");
@@ -1270,6 +4317,8 @@ size_t qatSequenceProducer(
         }
     } while (CPA_STATUS_RETRY == qrc || (CPA_STATUS_SUCCESS == qrc &&
                                          gProcess.qzstdInst[i].seqNumIn != gProcess.qzstdInst[i].seqNumOut));
+    __sync_sub_and_fetch(&gProcess.inflight, 1);
+    QZSTD_stageMark(&zstdSess->stageTimer, &zstdSess->stageTimer.times.waitNs);
 
     if (CPA_STATUS_FAIL == qrc) {
         gProcess.qzstdInst[i].seqNumOut++;
@@ -1305,6 +4354,10 @@ size_t qatSequenceProducer(
               srcSize, gProcess.qzstdInst[i].res.consumed,
               gProcess.qzstdInst[i].res.produced);
 
+    /* Checksum of the source computed by QAT with the compression */
+    zstdSess->checksum.blockChecksum = gProcess.qzstdInst[i].res.checksum;
+    zstdSess->checksum.blockChecksumValid = 1;
+
     /* If source data is uncompressed, create one sequence */
     if (CPA_TRUE == gProcess.qzstdInst[i].res.dataUncompressed) {
         outSeqs[0].litLength = srcSize;
@@ -1312,14 +4365,29 @@ size_t qatSequenceProducer(
         outSeqs[0].matchLength = 0;
         rc = 1;
     } else {
-        rc = QZSTD_decLz4s(outSeqs, outSeqsCapacity, zstdSess->qatIntermediateBuf,
-                           gProcess.qzstdInst[i].res.produced);
+        lz4sRatio = (unsigned int)((unsigned long long)gProcess.qzstdInst[i].res.produced *
+                                   ADAPT_RATIO_SCALE / srcSize);
+        if (zstdSess->params.sequenceStats) {
+            memset(&blockStats, 0, sizeof(blockStats));
+        }
+        rc = QZSTD_decLz4s(outSeqs, outSeqsCapacity, poolBuf->data,
+                           gProcess.qzstdInst[i].res.produced, windowSize,
+                           4 == profile.minMatch ? LZ4MINMATCH + 1 : LZ4MINMATCH,
+                           zstdSess->params.sequenceStats ? &blockStats : NULL);
     }
     if (rc >= (outSeqsCapacity - 1) || ZSTD_SEQUENCE_PRODUCER_ERROR == rc) {
         QZSTD_LOG(1, "Decode error\n");
         rc = ZSTD_SEQUENCE_PRODUCER_ERROR;
         goto error;
     }
+    if (zstdSess->params.sequenceStats) {
+        /* A block QAT didn't compress is counted as literals */
+        if (CPA_TRUE == gProcess.qzstdInst[i].res.dataUncompressed) {
+            memset(&blockStats, 0, sizeof(blockStats));
+            QZSTD_addSeqStats(&blockStats, outSeqs, rc);
+        }
+        QZSTD_mergeSeqStats(&blockStats);
+    }
     QZSTD_LOG(2, "Produced %lu sequences\n", rc);
 
 error:
@@ -1330,7 +4398,734 @@ error:
     gProcess.qzstdInst[i].destBuffer->pBuffers->pData = NULL;
 
 exit:
+    if (NULL != poolBuf) {
+        QZSTD_putPoolBuf(i, poolBuf, submitted);
+    }
     /* release QAT instance */
     QZSTD_releaseInstance(i);
+
+    /* Refine the sequences of hybrid levels without holding the instance */
+    if (ZSTD_SEQUENCE_PRODUCER_ERROR != rc &&
+        compressionLevel > COMP_LVL_MAXIMUM) {
+        rc = QZSTD_optimalParse(zstdSess, outSeqs, rc, outSeqsCapacity,
+                                (const unsigned char *)src, srcSize,
+                                compressionLevel, windowSize);
+    } else if (ZSTD_SEQUENCE_PRODUCER_ERROR != rc) {
+        /* Parameters of the state take precedence over the level profile */
+        int literalSearch = zstdSess->params.literalSearch > 0 ?
+                            zstdSess->params.literalSearch : profile.literalSearch;
+        if (literalSearch > 0) {
+            rc = QZSTD_searchLiterals(zstdSess, outSeqs, rc, outSeqsCapacity,
+                                      (const unsigned char *)src, srcSize, windowSize,
+                                      literalSearch);
+        }
+        if (ZSTD_SEQUENCE_PRODUCER_ERROR != rc &&
+            (zstdSess->params.postOptimize || profile.postOptimize)) {
+            rc = QZSTD_postOptimize(outSeqs, rc, (const unsigned char *)src);
+        }
+    }
+    /* Dictionary matches mostly cover the literals left by QAT */
+    if (ZSTD_SEQUENCE_PRODUCER_ERROR != rc && inFrame && zstdSess->frame.posKnown &&
+        NULL != zstdSess->dictIndex && blockPos < windowSize) {
+        rc = QZSTD_searchDict(zstdSess, outSeqs, rc, outSeqsCapacity,
+                              (const unsigned char *)src, blockPos, windowSize);
+    }
+    if (ZSTD_SEQUENCE_PRODUCER_ERROR != rc && zstdSess->params.longDistance && inFrame) {
+        rc = QZSTD_ldmMergeMatches(zstdSess, outSeqs, rc, outSeqsCapacity, srcSize);
+    }
+    if (ZSTD_SEQUENCE_PRODUCER_ERROR != rc && zstdSess->adapt.enabled) {
+        (void)gettimeofday(&timeNow, NULL);
+        QZSTD_adaptUpdate(&zstdSess->adapt, srcSize,
+                          (unsigned long long)TIMESPENT(timeNow, blockStart),
+                          compressionLevel <= COMP_LVL_MAXIMUM ? lz4sRatio : 0, congested);
+    }
+    QZSTD_stageMark(&zstdSess->stageTimer, &zstdSess->stageTimer.times.decodeNs);
+    return rc;
+}
+
+/** QZSTD_captureCall:
+ *    Record a call of qatSequenceProducer which started at callStart
+ */
+static void QZSTD_captureCall(const struct timespec *callStart, const void *src,
+                              size_t srcSize, int level, size_t dictSize,
+                              size_t windowSize, int failed)
+{
+    QZSTD_CaptureRecord_T record;
+    struct timespec now;
+    QZSTD_Xxh32_T xxh;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(&record, 0, sizeof(record));
+    record.latencyNs = (now.tv_sec - callStart->tv_sec) * 1000000000ULL +
+                       now.tv_nsec - callStart->tv_nsec;
+    record.windowSize = windowSize;
+    record.srcSize = (unsigned int)srcSize;
+    record.level = level;
+    record.dictSize = (unsigned int)dictSize;
+    record.failed = failed;
+    if (0 == tlsCaptureThread) {
+        tlsCaptureThread = __sync_add_and_fetch(&gCaptureThreads, 1);
+    }
+    record.thread = tlsCaptureThread - 1;
+
+    pthread_mutex_lock(&gCapture.mutex);
+    if (NULL == gCapture.file) {
+        goto exit;
+    }
+    if (gCapture.hash) {
+        QZSTD_xxh32Reset(&xxh);
+        QZSTD_xxh32Update(&xxh, src, srcSize);
+        record.hash = QZSTD_xxh32Digest(&xxh);
+    }
+    record.sampleSize = (unsigned int)(srcSize < gCapture.sampleBytes ?
+                                       srcSize : gCapture.sampleBytes);
+    /* Calls started before the capture are recorded at its start */
+    if (callStart->tv_sec > gCapture.start.tv_sec ||
+        (callStart->tv_sec == gCapture.start.tv_sec &&
+         callStart->tv_nsec > gCapture.start.tv_nsec)) {
+        record.timeNs = (callStart->tv_sec - gCapture.start.tv_sec) * 1000000000ULL +
+                        callStart->tv_nsec - gCapture.start.tv_nsec;
+    }
+    if (1 != fwrite(&record, sizeof(record), 1, gCapture.file) ||
+        (record.sampleSize &&
+         1 != fwrite(src, record.sampleSize, 1, gCapture.file))) {
+        QZSTD_LOG(1, "Cannot write capture file, capture stopped\n");
+        fclose(gCapture.file);
+        __atomic_store_n(&gCapture.file, NULL, __ATOMIC_RELEASE);
+        goto exit;
+    }
+    gCapture.records++;
+exit:
+    pthread_mutex_unlock(&gCapture.mutex);
+}
+
+size_t qatSequenceProducer(
+    void *sequenceProducerState, ZSTD_Sequence *outSeqs, size_t outSeqsCapacity,
+    const void *src, size_t srcSize,
+    const void *dict, size_t dictSize,
+    int compressionLevel,
+    size_t windowSize)
+{
+    QZSTD_Session_T *zstdSess = (QZSTD_Session_T *)sequenceProducerState;
+    QZSTD_StageTimer_T *timer = &zstdSess->stageTimer;
+    unsigned long long start = 0;
+    struct timespec callStart;
+    int capturing = NULL != __atomic_load_n(&gCapture.file, __ATOMIC_ACQUIRE);
+    size_t rc;
+
+    if (capturing) {
+        clock_gettime(CLOCK_MONOTONIC, &callStart);
+    }
+    if (NULL != timer->callback) {
+        memset(&timer->times, 0, sizeof(QZSTD_StageTimes_T));
+        QZSTD_stageMark(timer, NULL);
+        start = timer->stamp;
+    }
+    if (zstdSess->params.blockChecksum) {
+        /* The block is in the frame even if QAT fails, zstd may compress it with fallback */
+        zstdSess->checksum.blockChecksumValid = 0;
+    }
+    rc = QZSTD_produceSequences(sequenceProducerState, outSeqs, outSeqsCapacity,
+                                src, srcSize, dict, dictSize, compressionLevel,
+                                windowSize);
+    if (zstdSess->params.blockChecksum) {
+        QZSTD_checksumBlock(&zstdSess->checksum, src, srcSize);
+    }
+    if (ZSTD_SEQUENCE_PRODUCER_ERROR == rc) {
+        __sync_fetch_and_add(&gProcess.failedBlocks, 1);
+    }
+    if (NULL != timer->callback) {
+        QZSTD_stageMark(timer, NULL);
+        timer->times.totalNs = timer->stamp - start;
+        timer->times.srcSize = srcSize;
+        timer->times.failed = ZSTD_SEQUENCE_PRODUCER_ERROR == rc;
+        timer->callback(timer->opaque, &timer->times);
+    }
+    if (capturing) {
+        QZSTD_captureCall(&callStart, src, srcSize, compressionLevel, dictSize,
+                          windowSize, ZSTD_SEQUENCE_PRODUCER_ERROR == rc);
+    }
     return rc;
 }
+
+/** QZSTD_Request_T:
+ *  A block of the one-shot APIs in flight on a QAT instance, the APIs submit a
+ *  block on every free instance and wait for them in order
+ */
+typedef struct QZSTD_Request_S {
+    int inst;
+    const unsigned char *src;
+    size_t size;
+    QZSTD_PoolBuf_T *poolBuf;
+    int submitted;
+} QZSTD_Request_T;
+
+/** QZSTD_estimateSeqBytes:
+ *    Estimate the size zstd would encode a block to from its sequences, without
+ *  entropy coding it. Literals are priced by their order-0 entropy, matches by
+ *  the price model of the optimal parser.
+ */
+static size_t QZSTD_estimateSeqBytes(const ZSTD_Sequence *seqs, size_t nbSeqs,
+                                     const unsigned char *src, size_t srcSize)
+{
+    unsigned int rep[OPT_REP_NUM] = { 1, 4, 8 };
+    unsigned int count[256];
+    unsigned long long seqBits = 0, litBits = 0;
+    unsigned int totalWeight, nbSymbols = 0;
+    size_t r, pos = 0, nbLiterals = 0, estimate;
+    int b;
+
+    memset(count, 0, sizeof(count));
+    for (r = 0; r < nbSeqs; r++) {
+        unsigned int litLength = seqs[r].litLength;
+        unsigned int off = seqs[r].offset;
+        int repIdx = -1;
+        unsigned int k;
+
+        for (k = 0; k < litLength; k++) {
+            count[src[pos + k]]++;
+        }
+        nbLiterals += litLength;
+        pos += litLength + seqs[r].matchLength;
+        if (0 == seqs[r].matchLength) {
+            continue;
+        }
+        if (litLength >= 16) {
+            seqBits += (QZSTD_highbit32(litLength) - 3) * OPT_BITCOST_MULTIPLIER;
+        }
+        for (k = 0; k < OPT_REP_NUM; k++) {
+            if (rep[k] == off) {
+                repIdx = (int)k;
+                break;
+            }
+        }
+        seqBits += QZSTD_optMatchPrice(off, seqs[r].matchLength, repIdx);
+        if (0 != repIdx) {
+            for (k = (repIdx < 0 ? OPT_REP_NUM : (unsigned int)repIdx) - 1; k > 0; k--) {
+                rep[k] = rep[k - 1];
+            }
+            rep[0] = off;
+        }
+    }
+    if (pos != srcSize) {
+        return srcSize + ESTIMATE_BLOCK_HEADER;
+    }
+
+    totalWeight = QZSTD_fracWeight((unsigned int)nbLiterals);
+    for (b = 0; b < 256; b++) {
+        if (count[b]) {
+            litBits += (unsigned long long)count[b] *
+                       (totalWeight - QZSTD_fracWeight(count[b]));
+            nbSymbols++;
+        }
+    }
+    /* Literals may be stored raw, the Huffman table takes about 4 bits a symbol */
+    litBits = litBits / OPT_BITCOST_MULTIPLIER / 8 + nbSymbols / 2;
+    estimate = (litBits < nbLiterals ? (size_t)litBits : nbLiterals) +
+               (size_t)(seqBits / OPT_BITCOST_MULTIPLIER / 8) + ESTIMATE_BLOCK_HEADER;
+    return estimate < srcSize ? estimate : srcSize + ESTIMATE_BLOCK_HEADER;
+}
+
+/** QZSTD_submitRequest:
+ *    Submit a block to the QAT instance grabbed for it
+ */
+static int QZSTD_submitRequest(QZSTD_Request_T *req,
+                               CpaDcSessionSetupData *setupData)
+{
+    int i = req->inst;
+    int retry_cnt = MAX_SEND_REQUEST_RETRY;
+    const void *reqSrc = req->src;
+    int qrc;
+    CpaDcOpData opData;
+    QZSTD_InstSession_T *instSess;
+
+    if (QZSTD_OK != QZSTD_setupInstance(i)) {
+        return QZSTD_FAIL;
+    }
+    instSess = QZSTD_getInstSession(i, setupData);
+    if (NULL == instSess) {
+        return QZSTD_FAIL;
+    }
+    req->poolBuf = QZSTD_acquirePoolBuf(i);
+    if (NULL == req->poolBuf) {
+        QZSTD_LOG(1, "Failed to allocate memory");
+        return QZSTD_FAIL;
+    }
+
+    if (gProcess.qzstdInst[i].reqPhyContMem) {
+        memcpy(gProcess.qzstdInst[i].srcBuffer->pBuffers->pData, req->src,
+               req->size);
+    } else {
+        QZSTD_castConstPointer(&(gProcess.qzstdInst[i].srcBuffer->pBuffers->pData),
+                               &reqSrc);
+    }
+    gProcess.qzstdInst[i].destBuffer->pBuffers->pData = (Cpa8U *)req->poolBuf->data;
+    gProcess.qzstdInst[i].srcBuffer->pBuffers->dataLenInBytes = req->size;
+    gProcess.qzstdInst[i].destBuffer->pBuffers->dataLenInBytes =
+        gProcess.qzstdInst[i].lz4sBound;
+
+    memset(&opData, 0, sizeof(CpaDcOpData));
+    opData.inputSkipData.skipMode = CPA_DC_SKIP_DISABLED;
+    opData.outputSkipData.skipMode = CPA_DC_SKIP_DISABLED;
+    opData.compressAndVerify = CPA_TRUE;
+    opData.flushFlag = CPA_DC_FLUSH_FINAL;
+
+    do {
+        qrc = gProcess.backend->compressData2(gProcess.dcInstHandle[i], instSess->cpaSessHandle,
+                                 gProcess.qzstdInst[i].srcBuffer,
+                                 gProcess.qzstdInst[i].destBuffer, &opData,
+                                 &gProcess.qzstdInst[i].res, (void *)&gProcess.qzstdInst[i]);
+        retry_cnt--;
+    } while (CPA_STATUS_RETRY == qrc && retry_cnt > 0);
+
+    if (CPA_STATUS_SUCCESS != qrc) {
+        QZSTD_LOG(1, "Failed to submit request, status: %d\n", qrc);
+        return QZSTD_FAIL;
+    }
+    gProcess.qzstdInst[i].seqNumIn++;
+    __sync_add_and_fetch(&gProcess.inflight, 1);
+    req->submitted = 1;
+    return QZSTD_OK;
+}
+
+/** QZSTD_waitRequest:
+ *    Poll the instance of a submitted block until its result comes back
+ *
+ * @retval QZSTD_OK     The LZ4s output of the block is in its pool buffer.
+ * @retval QZSTD_FAIL   QAT failed or timed out.
+ */
+static int QZSTD_waitRequest(QZSTD_Request_T *req)
+{
+    int i = req->inst;
+    int qrc;
+    struct timeval timeStart;
+    struct timeval timeNow;
+    CpaDcRqResults *res = &gProcess.qzstdInst[i].res;
+
+    (void)gettimeofday(&timeStart, NULL);
+    do {
+        qrc = gProcess.backend->pollInstance(gProcess.dcInstHandle[i], 0);
+        (void)gettimeofday(&timeNow, NULL);
+        if (QZSTD_isTimeOut(timeStart, timeNow)) {
+            QZSTD_LOG(1, "Polling time out\n");
+            break;
+        }
+    } while (CPA_STATUS_RETRY == qrc || (CPA_STATUS_SUCCESS == qrc &&
+                                         gProcess.qzstdInst[i].seqNumIn != gProcess.qzstdInst[i].seqNumOut));
+    __sync_sub_and_fetch(&gProcess.inflight, 1);
+
+    if (CPA_STATUS_FAIL == qrc) {
+        gProcess.qzstdInst[i].seqNumOut++;
+    }
+    if (CPA_STATUS_SUCCESS != qrc || gProcess.qzstdInst[i].cbStatus == QZSTD_FAIL ||
+        res->consumed < req->size || res->produced == 0 ||
+        res->produced > gProcess.qzstdInst[i].lz4sBound ||
+        CPA_STATUS_SUCCESS != res->status) {
+        QZSTD_LOG(1, "QAT result error, polling status: %d, res.status: %d\n",
+                  qrc, res->status);
+        return QZSTD_FAIL;
+    }
+    return QZSTD_OK;
+}
+
+/** QZSTD_releaseRequest:
+ *    Give back the buffer and the instance of a block
+ */
+static void QZSTD_releaseRequest(QZSTD_Request_T *req)
+{
+    int i = req->inst;
+
+    if (!gProcess.qzstdInst[i].reqPhyContMem && gProcess.qzstdInst[i].memSetup) {
+        gProcess.qzstdInst[i].srcBuffer->pBuffers->pData = NULL;
+    }
+    if (gProcess.qzstdInst[i].memSetup) {
+        gProcess.qzstdInst[i].destBuffer->pBuffers->pData = NULL;
+    }
+    if (NULL != req->poolBuf) {
+        QZSTD_putPoolBuf(i, req->poolBuf, req->submitted);
+    }
+    QZSTD_releaseInstance(i);
+    memset(req, 0, sizeof(QZSTD_Request_T));
+}
+
+/** QZSTD_estimateCollect:
+ *    Wait for the result of a submitted sample and estimate its compressed size
+ *
+ * @retval size_t   Estimated compressed size, 0 if QAT failed.
+ */
+static size_t QZSTD_estimateCollect(QZSTD_Request_T *sample,
+                                    ZSTD_Sequence *seqs, size_t seqsCapacity,
+                                    size_t matchLenBase)
+{
+    CpaDcRqResults *res = &gProcess.qzstdInst[sample->inst].res;
+    size_t nbSeqs;
+
+    if (QZSTD_OK != QZSTD_waitRequest(sample)) {
+        return 0;
+    }
+    if (CPA_TRUE == res->dataUncompressed) {
+        return sample->size + ESTIMATE_BLOCK_HEADER;
+    }
+    nbSeqs = QZSTD_decLz4s(seqs, seqsCapacity, sample->poolBuf->data,
+                           res->produced, ESTIMATE_SAMPLE_SIZE, matchLenBase, NULL);
+    if (ZSTD_SEQUENCE_PRODUCER_ERROR == nbSeqs) {
+        return 0;
+    }
+    return QZSTD_estimateSeqBytes(seqs, nbSeqs, sample->src, sample->size);
+}
+
+double QZSTD_estimateRatio(const void *src, size_t srcSize, size_t budget)
+{
+    const unsigned char *ip = (const unsigned char *)src;
+    QZSTD_Request_T *samples = NULL;
+    CpaDcSessionSetupData setupData;
+    QZSTD_LevelProfile_T profile = QZSTD_getProfile(ESTIMATE_LEVEL);
+    ZSTD_Sequence *seqs = NULL;
+    size_t seqsCapacity = ESTIMATE_SAMPLE_SIZE / OPT_MINMATCH + 2;
+    size_t sampleSize, nbSamples, next = 0;
+    unsigned long long sampledBytes = 0, estimatedBytes = 0;
+    int fullScan;
+    int n, k, failed = 0;
+
+    if (NULL == src || 0 == srcSize || gProcess.qzstdInitStatus != QZSTD_OK) {
+        return 0;
+    }
+
+    /* Sample the whole source if the budget allows, spread the samples otherwise */
+    sampleSize = srcSize < ESTIMATE_SAMPLE_SIZE ? srcSize : ESTIMATE_SAMPLE_SIZE;
+    fullScan = srcSize <= budget;
+    nbSamples = fullScan ? (srcSize + sampleSize - 1) / sampleSize : budget / sampleSize;
+    if (0 == nbSamples) {
+        nbSamples = 1;
+    }
+
+    QZSTD_initSetupData(&setupData, ESTIMATE_LEVEL);
+    seqs = (ZSTD_Sequence *)QZSTD_calloc(seqsCapacity, sizeof(ZSTD_Sequence), 0);
+    samples = (QZSTD_Request_T *)QZSTD_calloc(gProcess.numInstances,
+              sizeof(QZSTD_Request_T), 0);
+    if (NULL == seqs || NULL == samples) {
+        QZSTD_LOG(1, "Failed to allocate memory\n");
+        failed = 1;
+        goto exit;
+    }
+
+    while (next < nbSamples && !failed) {
+        /* Submit a sample on every instance free, then collect them */
+        for (n = 0; n < gProcess.numInstances && next < nbSamples; n++) {
+            size_t start = fullScan ? next * sampleSize :
+                           (nbSamples > 1 ? (srcSize - sampleSize) * next / (nbSamples - 1) : 0);
+            int i = QZSTD_grabInstance(n);
+            if (-1 == i) {
+                break;
+            }
+            samples[n].inst = i;
+            samples[n].src = ip + start;
+            samples[n].size = srcSize - start < sampleSize ? srcSize - start : sampleSize;
+            if (QZSTD_OK != QZSTD_submitRequest(&samples[n], &setupData)) {
+                QZSTD_releaseRequest(&samples[n]);
+                failed = 1;
+                break;
+            }
+            next++;
+        }
+        if (0 == n) {
+            QZSTD_LOG(1, "Failed to grab instance\n");
+            failed = 1;
+        }
+        for (k = 0; k < n; k++) {
+            size_t estimate = samples[k].submitted ?
+                              QZSTD_estimateCollect(&samples[k], seqs, seqsCapacity,
+                                                    4 == profile.minMatch ? LZ4MINMATCH + 1 : LZ4MINMATCH) : 0;
+            if (0 == estimate) {
+                failed = 1;
+            }
+            sampledBytes += samples[k].size;
+            estimatedBytes += estimate;
+            QZSTD_releaseRequest(&samples[k]);
+        }
+    }
+
+exit:
+    QZSTD_free(seqs, 0);
+    QZSTD_free(samples, 0);
+    if (failed || 0 == sampledBytes) {
+        return 0;
+    }
+    return (double)estimatedBytes / (double)sampledBytes;
+}
+
+static unsigned char *QZSTD_lz4WriteLen(unsigned char *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/** QZSTD_lz4EmitSequence:
+ *    Write a LZ4 sequence, a match length of 0 writes the last literals
+ *
+ * @retval unsigned char*   End of the sequence, NULL if it doesn't fit.
+ */
+static unsigned char *QZSTD_lz4EmitSequence(unsigned char *op, unsigned char *oend,
+        const unsigned char *lit, size_t litLength,
+        unsigned int off, size_t matchLength)
+{
+    size_t mlBase = matchLength ? matchLength - LZ4_MINMATCH : 0;
+    size_t need = 1 + litLength + (litLength >= RUN_MASK ? (litLength - RUN_MASK) / 255 + 1 : 0) +
+                  (matchLength ? 2 + (mlBase >= ML_MASK ? (mlBase - ML_MASK) / 255 + 1 : 0) : 0);
+    unsigned char *token = op++;
+
+    if ((size_t)(oend - token) < need) {
+        return NULL;
+    }
+    *token = (unsigned char)((litLength >= RUN_MASK ? RUN_MASK : litLength) << ML_BITS);
+    if (litLength >= RUN_MASK) {
+        op = QZSTD_lz4WriteLen(op, litLength - RUN_MASK);
+    }
+    memcpy(op, lit, litLength);
+    op += litLength;
+    if (0 == matchLength) {
+        return op;
+    }
+    *op++ = (unsigned char)off;
+    *op++ = (unsigned char)(off >> 8);
+    *token |= (unsigned char)(mlBase >= ML_MASK ? ML_MASK : mlBase);
+    if (mlBase >= ML_MASK) {
+        op = QZSTD_lz4WriteLen(op, mlBase - ML_MASK);
+    }
+    return op;
+}
+
+/** QZSTD_lz4EncodeBlock:
+ *    Encode the sequences decoded from the LZ4s output of QAT as a LZ4 block
+ *  LZ4 needs 4-byte matches, and the end of a block to be literals: the last
+ *  match must start LZ4_MFLIMIT bytes before the end and leave the last
+ *  LZ4_LASTLITERALS bytes. Matches breaking these rules are shortened or turned
+ *  into literals, which are merged with the literals around them.
+ *
+ * @retval size_t   Size of the block, 0 if it doesn't fit in dstCapacity.
+ */
+static size_t QZSTD_lz4EncodeBlock(const ZSTD_Sequence *seqs, size_t nbSeqs,
+                                   const unsigned char *src, size_t srcSize,
+                                   unsigned char *dst, size_t dstCapacity)
+{
+    unsigned char *op = dst;
+    unsigned char *const oend = dst + dstCapacity;
+    size_t r, pos = 0, anchor = 0;
+
+    for (r = 0; r < nbSeqs; r++) {
+        size_t matchStart = pos + seqs[r].litLength;
+        size_t matchLength = seqs[r].matchLength;
+
+        pos = matchStart + matchLength;
+        if (matchLength < LZ4_MINMATCH || matchStart + LZ4_MFLIMIT > srcSize) {
+            continue;
+        }
+        if (matchStart + matchLength > srcSize - LZ4_LASTLITERALS) {
+            matchLength = srcSize - LZ4_LASTLITERALS - matchStart;
+        }
+        op = QZSTD_lz4EmitSequence(op, oend, src + anchor, matchStart - anchor,
+                                   seqs[r].offset, matchLength);
+        if (NULL == op) {
+            return 0;
+        }
+        anchor = matchStart + matchLength;
+    }
+    op = QZSTD_lz4EmitSequence(op, oend, src + anchor, srcSize - anchor, 0, 0);
+    if (NULL == op) {
+        return 0;
+    }
+    return (size_t)(op - dst);
+}
+
+/** QZSTD_lz4Collect:
+ *    Wait for the LZ4s output of a block and convert it to a LZ4 block
+ *
+ * @retval size_t   Size of the LZ4 block, 0 if it doesn't fit in dstCapacity.
+ * @retval ZSTD_SEQUENCE_PRODUCER_ERROR     QAT failed.
+ */
+static size_t QZSTD_lz4Collect(QZSTD_Request_T *req, ZSTD_Sequence *seqs,
+                               size_t seqsCapacity, unsigned char *dst,
+                               size_t dstCapacity)
+{
+    CpaDcRqResults *res = &gProcess.qzstdInst[req->inst].res;
+    size_t nbSeqs = 0;
+
+    if (QZSTD_OK != QZSTD_waitRequest(req)) {
+        return ZSTD_SEQUENCE_PRODUCER_ERROR;
+    }
+    /* Uncompressed data is encoded as literals */
+    if (CPA_TRUE != res->dataUncompressed) {
+        nbSeqs = QZSTD_decLz4s(seqs, seqsCapacity, req->poolBuf->data,
+                               res->produced, LZ4S_MAX_OFFSET, LZ4MINMATCH + 1, NULL);
+        if (ZSTD_SEQUENCE_PRODUCER_ERROR == nbSeqs) {
+            return ZSTD_SEQUENCE_PRODUCER_ERROR;
+        }
+    }
+    return QZSTD_lz4EncodeBlock(seqs, nbSeqs, req->src, req->size, dst, dstCapacity);
+}
+
+/** QZSTD_lz4Compress:
+ *    Compress src to LZ4 blocks of blockSize with QAT, the blocks are
+ *  submitted on every free instance and written in order. In a frame, every
+ *  block has its size before it and is stored uncompressed if it doesn't
+ *  shrink; otherwise src is a single block.
+ */
+static int QZSTD_lz4Compress(unsigned char *dst, size_t dstCapacity,
+                             size_t *dstSize, const unsigned char *src,
+                             size_t srcSize, int compressionLevel,
+                             int framed)
+{
+    unsigned char *op = dst;
+    unsigned char *const oend = dst + dstCapacity;
+    QZSTD_Request_T *reqs = NULL;
+    CpaDcSessionSetupData setupData;
+    ZSTD_Sequence *seqs = NULL;
+    size_t blockSize = framed ? LZ4_BLOCK_SIZE : srcSize;
+    size_t seqsCapacity = blockSize / LZ4_MINMATCH + 2;
+    size_t nbBlocks = framed ? (srcSize + blockSize - 1) / blockSize : 1;
+    size_t next = 0;
+    int n, k, failed = 0;
+
+    if (gProcess.qzstdInitStatus != QZSTD_OK ||
+        compressionLevel < COMP_LVL_MINIMUM || compressionLevel > COMP_LVL_MAXIMUM) {
+        return QZSTD_FAIL;
+    }
+
+    /* LZ4 has no 3-byte matches */
+    QZSTD_initSetupData(&setupData, compressionLevel);
+    setupData.minMatch = CPA_DC_MIN_4_BYTE_MATCH;
+    seqs = (ZSTD_Sequence *)QZSTD_calloc(seqsCapacity, sizeof(ZSTD_Sequence), 0);
+    reqs = (QZSTD_Request_T *)QZSTD_calloc(gProcess.numInstances,
+                                           sizeof(QZSTD_Request_T), 0);
+    if (NULL == seqs || NULL == reqs) {
+        QZSTD_LOG(1, "Failed to allocate memory\n");
+        failed = 1;
+        goto exit;
+    }
+
+    while (next < nbBlocks && !failed) {
+        for (n = 0; n < gProcess.numInstances && next < nbBlocks; n++) {
+            int i = QZSTD_grabInstance(n);
+            if (-1 == i) {
+                break;
+            }
+            reqs[n].inst = i;
+            reqs[n].src = src + next * blockSize;
+            reqs[n].size = srcSize - next * blockSize < blockSize ?
+                           srcSize - next * blockSize : blockSize;
+            if (QZSTD_OK != QZSTD_submitRequest(&reqs[n], &setupData)) {
+                QZSTD_releaseRequest(&reqs[n]);
+                failed = 1;
+                break;
+            }
+            next++;
+        }
+        if (0 == n) {
+            QZSTD_LOG(1, "Failed to grab instance\n");
+            failed = 1;
+        }
+        for (k = 0; k < n; k++) {
+            size_t cSize = ZSTD_SEQUENCE_PRODUCER_ERROR;
+            size_t headerSize = framed ? 4 : 0;
+            size_t capacity = (size_t)(oend - op) - headerSize;
+            /* A block of a frame is only compressed if it shrinks */
+            if (framed && capacity > reqs[k].size - 1) {
+                capacity = reqs[k].size - 1;
+            }
+            if (reqs[k].submitted && !failed && (size_t)(oend - op) >= headerSize) {
+                cSize = QZSTD_lz4Collect(&reqs[k], seqs, seqsCapacity, op + headerSize,
+                                         capacity);
+            } else if (reqs[k].submitted) {
+                (void)QZSTD_waitRequest(&reqs[k]);
+            }
+            if (framed && 0 == cSize && (size_t)(oend - op) >= headerSize + reqs[k].size) {
+                /* Store the block if it doesn't shrink */
+                memcpy(op + headerSize, reqs[k].src, reqs[k].size);
+                cSize = reqs[k].size | LZ4F_BLOCK_UNCOMPRESSED;
+            }
+            if (0 == cSize || ZSTD_SEQUENCE_PRODUCER_ERROR == cSize) {
+                failed = 1;
+            } else {
+                if (framed) {
+                    op[0] = (unsigned char)cSize;
+                    op[1] = (unsigned char)(cSize >> 8);
+                    op[2] = (unsigned char)(cSize >> 16);
+                    op[3] = (unsigned char)(cSize >> 24);
+                }
+                op += headerSize + (cSize & ~(size_t)LZ4F_BLOCK_UNCOMPRESSED);
+            }
+            QZSTD_releaseRequest(&reqs[k]);
+        }
+    }
+
+exit:
+    QZSTD_free(seqs, 0);
+    QZSTD_free(reqs, 0);
+    if (failed) {
+        return QZSTD_FAIL;
+    }
+    *dstSize = (size_t)(op - dst);
+    return QZSTD_OK;
+}
+
+size_t QZSTD_lz4FrameBound(size_t srcSize)
+{
+    size_t nbBlocks = (srcSize + LZ4_BLOCK_SIZE - 1) / LZ4_BLOCK_SIZE;
+    return LZ4F_HEADER_SIZE + srcSize + nbBlocks * 4 + 4;
+}
+
+int QZSTD_compressLz4Block(void *dst, size_t dstCapacity, size_t *dstSize,
+                           const void *src, size_t srcSize, int compressionLevel)
+{
+    if (NULL == dst || NULL == dstSize || NULL == src || 0 == srcSize ||
+        srcSize > ZSTD_BLOCKSIZE_MAX) {
+        return QZSTD_FAIL;
+    }
+    return QZSTD_lz4Compress((unsigned char *)dst, dstCapacity, dstSize,
+                             (const unsigned char *)src, srcSize, compressionLevel, 0);
+}
+
+int QZSTD_compressLz4Frame(void *dst, size_t dstCapacity, size_t *dstSize,
+                           const void *src, size_t srcSize, int compressionLevel)
+{
+    unsigned char *op = (unsigned char *)dst;
+    QZSTD_Xxh32_T headerHash;
+    size_t blocksSize = 0;
+    int k;
+
+    if (NULL == dst || NULL == dstSize || (NULL == src && srcSize > 0) ||
+        dstCapacity < LZ4F_HEADER_SIZE + 4) {
+        return QZSTD_FAIL;
+    }
+
+    /* Version 01, independent blocks, content size, 64KB blocks */
+    for (k = 0; k < 4; k++) {
+        op[k] = (unsigned char)(LZ4F_MAGIC >> (8 * k));
+    }
+    op[4] = 0x40 | 0x20 | 0x08;
+    op[5] = 0x40;
+    for (k = 0; k < 8; k++) {
+        op[6 + k] = (unsigned char)((unsigned long long)srcSize >> (8 * k));
+    }
+    QZSTD_xxh32Reset(&headerHash);
+    QZSTD_xxh32Update(&headerHash, op + 4, LZ4F_HEADER_SIZE - 5);
+    op[LZ4F_HEADER_SIZE - 1] = (unsigned char)(QZSTD_xxh32Digest(&headerHash) >> 8);
+    op += LZ4F_HEADER_SIZE;
+
+    if (srcSize > 0 &&
+        QZSTD_OK != QZSTD_lz4Compress(op, dstCapacity - LZ4F_HEADER_SIZE - 4, &blocksSize,
+                                      (const unsigned char *)src, srcSize, compressionLevel, 1)) {
+        return QZSTD_FAIL;
+    }
+    op += blocksSize;
+
+    /* End mark */
+    memset(op, 0, 4);
+    op += 4;
+    *dstSize = (size_t)(op - (unsigned char *)dst);
+    return QZSTD_OK;
+}
@@ -86,20 +86,24 @@ const char *QZSTD_version(void);
  * @param src                    An input buffer for the sequence producer to parse.
  * @param srcSize                The size of input buffer which is guaranteed to be <= ZSTD_BLOCKSIZE_MAX.
  * @param dict                   Dict buffer for sequence producer to reference. Currently, it's a NULL pointer,
- *                               and will be supported in the future.
+ *                               reference the dictionary with QZSTD_refDict instead.
  * @param dictSize               The size of dict. Currently, zstd will always pass zero into sequence producer.
- * @param compressionLevel       Zstd compression level, only support L1-L12.
- * @param windowSize             Representing the maximum allowed offset for sequences
+ * @param compressionLevel       Zstd compression level, only support L1-L22.
+ * @param windowSize             Representing the maximum allowed offset for sequences. Matches of QAT
+ *                               beyond it are emitted as literals, so any ZSTD_c_windowLog works.
  *
  * @retval size_t                Return number of sequences QAT sequence producer produced
  *                               or error code: ZSTD_SEQUENCE_PRODUCER_ERROR.
  * *** LIMITATIONS ***
- *  - Only support compression level from L1 to L12.
+ *  - Only support compression level from L1 to L22. L1-L12 are offloaded to QAT. For L13-L22,
+ *    the sequences of QAT L12 seed an optimal parse on CPU, which extends the matches of QAT,
+ *    adds matches found in a hash chain and picks the cheapest sequences by estimated bit cost.
+ *    The refinement uses a workspace of about 4MB per sequence producer state.
  *  - ZSTD sequence producer only support zstd compression API which respect advanced parameters.
- *  - The ZSTD_c_enableLongDistanceMatching cParam is not currently supported. Compression will fail
- *    if it is enabled and tries to compress with qatsequenceproducer.
- *  - Dictionaries are not currently supported. Compression will not fail if the user references
- *    a dictionary, but the dictionary won't have any effect.
+ *  - The ZSTD_c_enableLongDistanceMatching cParam is not supported by zstd with a sequence producer.
+ *    Compression will fail if it is enabled, set QZSTD_p_longDistance instead.
+ *  - zstd doesn't pass dictionaries to the sequence producer. A dictionary referenced in the CCtx
+ *    has no effect on the sequences unless it's also referenced by QZSTD_refDict.
  *  - Stream history is not currently supported. All advanced ZSTD compression APIs, including
  *    streaming APIs, work with qatsequenceproducer, but each block is treated as an independent
  *    chunk without history from previous blocks.
@@ -129,6 +133,167 @@ size_t qatSequenceProducer(
  */
 int QZSTD_startQatDevice(void);
 
+/** QZSTD_pinnedAllocFunction:
+ *  Allocate physically contiguous memory on the NUMA node, aligned to alignment
+ */
+typedef void *(*QZSTD_pinnedAllocFunction)(void *opaque, size_t size, int node,
+        size_t alignment);
+
+/** QZSTD_virtToPhysFunction:
+ *  Convert the virtual address of physically contiguous memory to physical
+ */
+typedef unsigned long long (*QZSTD_virtToPhysFunction)(void *opaque, void *virtAddr);
+
+/** QZSTD_customMem:
+ *  Custom allocator of QAT sequence producer
+ *  Ordinary memory (instance descriptors, sequence producer states) is allocated
+ *  with customAlloc/customFree. Physically contiguous memory (buffers and sessions
+ *  submitted to QAT, only used when the instance requires it) is allocated with
+ *  customPinnedAlloc/customPinnedFree, and customVirtToPhys gives its physical
+ *  address. Every pair must be set together, NULL means the default allocator:
+ *  malloc/free, and USDM for physically contiguous memory.
+ */
+typedef struct {
+    ZSTD_allocFunction customAlloc;
+    ZSTD_freeFunction customFree;
+    QZSTD_pinnedAllocFunction customPinnedAlloc;
+    ZSTD_freeFunction customPinnedFree;
+    QZSTD_virtToPhysFunction customVirtToPhys;
+    void *opaque;
+} QZSTD_customMem;
+
+/** QZSTD_Backend_e:
+ *  Engine producing LZ4s for the sequence producer
+ */
+typedef enum {
+    QZSTD_BACKEND_DEFAULT = 0, /* QZSTD_BACKEND environment variable ("qat", "sw" or
+                                * "auto"), QAT if it isn't set */
+    QZSTD_BACKEND_QAT = 1,     /* QAT device */
+    QZSTD_BACKEND_SW = 2,      /* Software engine running on the CPU, for development
+                                * and testing without QAT hardware */
+    QZSTD_BACKEND_AUTO = 3     /* QAT, the software engine if QAT fails to start */
+} QZSTD_Backend_e;
+
+/** QZSTD_StartOptions_T:
+ *  Options for starting QAT device with QZSTD_startQatDeviceEx
+ */
+typedef struct {
+    int eagerInit;           /* 1: set up all instances when starting QAT device,
+                              * 0: set up every instance on its first request */
+    const int *levels;       /* Compression levels to create QAT sessions for when
+                              * eagerInit is 1, NULL for none */
+    unsigned int nbLevels;   /* Number of compression levels in levels */
+    QZSTD_customMem customMem; /* Allocator of device resources, only applied
+                              * when QAT device is not started yet */
+    const char *profileFile; /* Level profile table loaded when QAT device is not
+                              * started yet, NULL to use the QZSTD_PROFILE_FILE
+                              * environment variable if it's set */
+    int backend;             /* QZSTD_Backend_e, QZSTD_BACKEND_DEFAULT to use the
+                              * QZSTD_BACKEND environment variable if it's set */
+} QZSTD_StartOptions_T;
+
+/** QZSTD_startQatDeviceEx:
+ *    Start QAT device with options
+ *  By default, the buffers, DC instance and session of every instance are set up
+ *  by the first request submitted to it, which adds latency to the first requests.
+ *  With eagerInit, all instances are set up when starting QAT device, using one
+ *  thread per device, and sessions are created for the given compression levels.
+ *
+ * @param options   Start options, NULL is the same as QZSTD_startQatDevice.
+ *
+ * @retval          Same as QZSTD_startQatDevice, QZSTD_FAIL if customMem is invalid.
+ */
+int QZSTD_startQatDeviceEx(const QZSTD_StartOptions_T *options);
+
+/** QZSTD_getBackend:
+ *    Backend the QAT device was started with
+ *
+ * @retval int  QZSTD_BACKEND_QAT or QZSTD_BACKEND_SW, QZSTD_BACKEND_DEFAULT if the
+ *              QAT device isn't started.
+ */
+int QZSTD_getBackend(void);
+
+/** QZSTD_SwEngineParams_T:
+ *  Parameters of the software engine, a 0 field takes its environment variable
+ *  or default
+ */
+typedef struct {
+    unsigned int numInstances; /* Instances, QZSTD_SW_INSTANCES, default 4 */
+    unsigned int latencyUs;    /* Time from submission until a response can be
+                                * polled, QZSTD_SW_LATENCY_US, default 0 */
+    unsigned int queueDepth;   /* Requests in flight per instance before submission
+                                * returns retry, QZSTD_SW_QUEUE_DEPTH, default 64 */
+} QZSTD_SwEngineParams_T;
+
+/** QZSTD_setSwEngineParams:
+ *    Set the parameters of the software engine, applied when it's started
+ *
+ * @param params    Parameters, NULL to reset all of them to 0.
+ *
+ * @retval QZSTD_OK     Parameters are set.
+ * @retval QZSTD_FAIL   The software engine is running, or a parameter is invalid.
+ */
+int QZSTD_setSwEngineParams(const QZSTD_SwEngineParams_T *params);
+
+/** QZSTD_SwDelay_e:
+ *  Distribution of the delay injected into the responses of the software engine
+ */
+typedef enum {
+    QZSTD_SW_DELAY_NONE = 0,
+    QZSTD_SW_DELAY_UNIFORM = 1,     /* Uniform between 0 and twice the mean */
+    QZSTD_SW_DELAY_EXPONENTIAL = 2, /* Exponential */
+    QZSTD_SW_DELAY_PARETO = 3       /* Pareto with shape 2, heavy tail */
+} QZSTD_SwDelay_e;
+
+/** QZSTD_SwFaultParams_T:
+ *  Faults injected by the software engine, to exercise the timeout, retry and
+ *  error paths of the sequence producer
+ */
+typedef struct {
+    int delayDist;             /* QZSTD_SwDelay_e, delay added to every response */
+    unsigned int delayUs;      /* Mean of the delay */
+    unsigned int retryPpm;     /* Submissions returning retry, per million */
+    unsigned int failPpm;      /* Responses reporting a failure, per million */
+    unsigned int stallInstance; /* Instance whose responses are held for stallUs */
+    unsigned int stallUs;      /* 0: no instance stalled */
+    unsigned int seed;         /* Seed of the random faults, 0: 1 */
+} QZSTD_SwFaultParams_T;
+
+/** QZSTD_parseSwFaults:
+ *    Parse a fault profile of comma separated items: "delay=uniform:US",
+ *  "delay=exp:US", "delay=pareto:US", "retry=PPM", "fail=PPM",
+ *  "stall=INSTANCE:US" and "seed=N", "none" for no faults.
+ *  The QZSTD_SW_FAULTS environment variable takes the same format.
+ *
+ * @retval QZSTD_OK     The profile is parsed into params.
+ * @retval QZSTD_FAIL   The profile is invalid.
+ */
+int QZSTD_parseSwFaults(const char *spec, QZSTD_SwFaultParams_T *params);
+
+/** QZSTD_setSwFaultParams:
+ *    Set the faults injected by the software engine, applied to the requests
+ *  submitted afterwards, also while the engine is running
+ *
+ * @param params    Faults, NULL to disable fault injection.
+ */
+void QZSTD_setSwFaultParams(const QZSTD_SwFaultParams_T *params);
+
+/** QZSTD_SwFaultStats_T:
+ *  Counters of the faults injected by the software engine since it started
+ */
+typedef struct {
+    size_t submitted; /* Requests accepted */
+    size_t retries;   /* Submissions rejected with retry */
+    size_t failures;  /* Responses reporting a failure */
+    size_t stalled;   /* Responses of the stalled instance */
+    size_t delayUs;   /* Delay injected, summed over the responses */
+} QZSTD_SwFaultStats_T;
+
+/** QZSTD_getSwFaultStats:
+ *    Get the counters of the injected faults
+ */
+void QZSTD_getSwFaultStats(QZSTD_SwFaultStats_T *stats);
+
 /** QZSTD_stopQatDevice:
  *    Stop QAT device
  *  This function is used to free hardware resources. Users need to call this
@@ -144,12 +309,510 @@ void QZSTD_stopQatDevice(void);
  */
 void *QZSTD_createSeqProdState(void);
 
+/** QZSTD_createSeqProdState_advanced:
+ *    Create sequence producer state with custom allocator
+ *  Only customAlloc, customFree and opaque of customMem are used. The state is
+ *  freed by QZSTD_freeSeqProdState with the same allocator.
+ *
+ * @retval void*    The sequence producer state, or NULL on failure.
+ */
+void *QZSTD_createSeqProdState_advanced(QZSTD_customMem customMem);
+
 /** QZSTD_freeSeqProdState:
  *    Free sequence producer state qatSequenceProducer used
  *  After all compression jobs are finished, users must free the sequence producer state.
  */
 void QZSTD_freeSeqProdState(void *sequenceProducerState);
 
+/** QZSTD_SeqProdParam_e:
+ *  Parameters of a sequence producer state
+ */
+typedef enum {
+    QZSTD_p_postOptimize = 1, /* 1: post-optimize the sequences of QAT, 0: disabled (default).
+                               * Matches are extended backwards and forwards into literals,
+                               * a match continuing the previous one with the same offset is
+                               * merged into it, and matches costing more bits than their
+                               * literals are dropped. Fewer sequences also speed up the
+                               * sequence encoding of zstd. Not used by L13-L22, which are
+                               * already refined by the optimal parse. */
+    QZSTD_p_literalSearch = 2, /* Min length of the literal runs of QAT to search for matches on
+                               * CPU, 0: disabled (default). A small hash table of the block
+                               * finds matches QAT missed in long literal runs, which costs far
+                               * less than a software match finder. Runs before the
+                               * post-optimizer. Not used by L13-L22. */
+    QZSTD_p_longDistance = 3,  /* 1: find long matches beyond the 64KB reach of QAT, 0: disabled
+                               * (default). A rolling hash table of the previous blocks of the
+                               * frame is kept by the state, and matches of at least 64 bytes
+                               * found in it replace the sequences of QAT they overlap. The
+                               * previous blocks must still be in memory, in the input or in
+                               * the window buffer of zstd when streaming, which is the case
+                               * for the compression APIs of zstd. Matches are only searched
+                               * in a frame started by QZSTD_beginFrame. Use it instead of
+                               * ZSTD_c_enableLongDistanceMatching, which zstd doesn't support
+                               * with a sequence producer, and don't enable
+                               * ZSTD_c_validateSequences, which rejects offsets into previous
+                               * blocks. */
+    QZSTD_p_blockChecksum = 4, /* 1: keep the XXH32 checksum QAT computes over every block and
+                               * a digest of the frame, 0: disabled (default). Blocks QAT
+                               * didn't compress are hashed on CPU. See
+                               * QZSTD_getFrameChecksum. Setting this parameter starts a new
+                               * frame, so it must be set before compressing every frame. */
+    QZSTD_p_sequenceStats = 5  /* 1: count the sequences decoded from the LZ4s output of every
+                               * block in seqStats of QZSTD_getStats, 0: disabled (default).
+                               * They are the matches QAT found, before literal search,
+                               * post-optimizer, long distance and dictionary matches. */
+} QZSTD_SeqProdParam_e;
+
+/** QZSTD_setSeqProdParameter:
+ *    Set a parameter of a sequence producer state
+ *  Parameters are reset to default when the state is released to the state pool.
+ *
+ * @retval QZSTD_OK     The parameter is set.
+ * @retval QZSTD_FAIL   Unknown parameter or invalid value.
+ */
+int QZSTD_setSeqProdParameter(void *sequenceProducerState,
+                              QZSTD_SeqProdParam_e param, int value);
+
+/** QZSTD_refDict:
+ *    Reference a dictionary for the frames compressed with a sequence producer state
+ *  zstd doesn't pass its dictionary to the sequence producer, so the dictionary
+ *  loaded into the CCtx, by ZSTD_CCtx_refCDict or ZSTD_CCtx_loadDictionary, must
+ *  also be referenced here. Matches found in the dictionary on CPU are merged
+ *  with the sequences of QAT, mostly covering the literals QAT left. The
+ *  dictionary is interpreted like ZSTD_dct_auto, and it's referenced, not
+ *  copied, so it must stay unchanged in memory while in use.
+ *
+ *  A hash index of the dictionary is built once and shared by all the states
+ *  referencing the same dictionary, at the same address and with the same
+ *  allocator, so referencing it from more states or again is cheap. The index
+ *  is freed when no state references it anymore. The dictionary is only used
+ *  in a frame started by QZSTD_beginFrame, and referencing one ends the current
+ *  frame, so call it before QZSTD_beginFrame. Pass NULL to stop using the
+ *  dictionary; it's also dropped when the state is released to the state pool
+ *  or freed.
+ *
+ * @retval QZSTD_OK     The dictionary is referenced.
+ * @retval QZSTD_FAIL   Dictionary too large or out of memory.
+ */
+int QZSTD_refDict(void *sequenceProducerState, const void *dict,
+                  size_t dictSize);
+
+/** QZSTD_beginFrame:
+ *    Start a frame of frameSize bytes with a sequence producer state
+ *  Long distance and dictionary matches reach before the current block, but
+ *  zstd doesn't tell the sequence producer where a frame starts, and doesn't
+ *  pass it blocks smaller than 7 bytes. Both are only searched in the frame
+ *  started here, so call it before compressing every frame, after setting the
+ *  parameters and referencing the dictionary. The frame ends once frameSize
+ *  bytes have gone through the sequence producer, or at the first block that
+ *  isn't found after the previous one in the input or in the window buffer of
+ *  zstd, and nothing reaches beyond it. When streaming, frameSize can be
+ *  ZSTD_CONTENTSIZE_UNKNOWN: the frame then lasts until the next call, which
+ *  must come before the next frame, and a block not found after the previous
+ *  one only restarts the history.
+ *
+ *  Dictionary offsets also depend on the position of the block in the frame,
+ *  which is only known if zstd reads the frame from frameSrc, as ZSTD_compress2
+ *  does, or if the frame is a single block. Otherwise the dictionary isn't used
+ *  in the frame. frameSrc can be NULL if the input isn't in one buffer.
+ *
+ * @retval QZSTD_OK     The frame is started.
+ * @retval QZSTD_FAIL   Invalid state, or frameSize is ZSTD_CONTENTSIZE_ERROR.
+ */
+int QZSTD_beginFrame(void *sequenceProducerState, const void *frameSrc,
+                     unsigned long long frameSize);
+
+/** QZSTD_acquireSeqProdState:
+ *    Take a sequence producer state from the state pool
+ *  For short-lived CCtxs, acquiring and releasing states avoids creating a new
+ *  state for every compression job, and keeps the instance the state used last.
+ *  Released states are cached per thread first, then in a process-wide pool of
+ *  at most 64 states, which is freed by QZSTD_stopQatDevice. A new state is
+ *  created if there is no released state. This function is thread-safe.
+ *
+ * @retval void*    The sequence producer state, or NULL on failure.
+ */
+void *QZSTD_acquireSeqProdState(void);
+
+/** QZSTD_releaseSeqProdState:
+ *    Give back a sequence producer state taken by QZSTD_acquireSeqProdState
+ *  The state must not be used by any CCtx after it's released. States cached by
+ *  a thread are moved to the process-wide pool when the thread exits, and freed
+ *  if the pool is full. The workspaces of the hybrid levels, long distance
+ *  matching and the dictionary are freed on release. A state created by
+ *  QZSTD_createSeqProdState_advanced is freed instead of pooled.
+ */
+void QZSTD_releaseSeqProdState(void *sequenceProducerState);
+
+#define QZSTD_SEQ_STATS_BUCKETS 32
+
+/** QZSTD_SeqStats_T:
+ *  Statistics of sequences, showing the quality of the matches found
+ *  Histogram bucket b counts the values in [2^b, 2^(b+1)).
+ */
+typedef struct {
+    size_t blocks;         /* Blocks counted */
+    size_t sequences;      /* Sequences with a match */
+    size_t literalBytes;   /* Bytes not covered by matches */
+    size_t matchBytes;     /* Bytes covered by matches */
+    size_t matches3;       /* Matches of 3 bytes */
+    size_t matchLengthHist[QZSTD_SEQ_STATS_BUCKETS];
+    size_t offsetHist[QZSTD_SEQ_STATS_BUCKETS];
+} QZSTD_SeqStats_T;
+
+/** QZSTD_addSeqStats:
+ *    Count sequences in seqStats
+ *  Sequences without match end a block if their offset is 0, like the block
+ *  delimiters of ZSTD_generateSequences. This gives statistics of another match
+ *  finder to compare with the seqStats of QZSTD_getStats.
+ */
+void QZSTD_addSeqStats(QZSTD_SeqStats_T *seqStats, const ZSTD_Sequence *seqs,
+                       size_t nbSeqs);
+
+/** QZSTD_Stats_T:
+ *  Process-wide statistics of QAT sequence producer
+ *  The lz4s output of QAT is stored in buffers taken from per NUMA node pools,
+ *  one buffer per request in flight. The pool counters are summed over all nodes.
+ */
+typedef struct {
+    size_t bufPoolAllocated;   /* Number of lz4s buffers allocated by the pools */
+    size_t bufPoolInUse;       /* Number of lz4s buffers currently in use */
+    size_t bufPoolQuarantined; /* lz4s buffers of timed out requests, in use until
+                                * QAT answers them */
+    size_t bufPoolHighWater;   /* Max number of lz4s buffers in use at the same time */
+    size_t bufPoolBytes;       /* Bytes of lz4s buffers allocated by the pools */
+    size_t memBytes;           /* Bytes of ordinary memory currently allocated */
+    size_t memPinnedBytes;     /* Bytes of physically contiguous memory currently allocated */
+    size_t statePoolStates;    /* Released states in the process-wide state pool */
+    size_t postOptSeqsIn;      /* Sequences given to the post-optimizer */
+    size_t postOptSeqsOut;     /* Sequences left by the post-optimizer */
+    size_t postOptExtendedBytes; /* Literal bytes covered by extending matches */
+    size_t postOptMerged;      /* Matches merged into the previous match */
+    size_t postOptPruned;      /* Matches turned into literals */
+    size_t postOptPrunedBytes; /* Bytes of the matches turned into literals */
+    size_t litSearchRuns;      /* Literal runs searched for matches */
+    size_t litSearchRunBytes;  /* Bytes of the literal runs searched */
+    size_t litSearchMatches;   /* Matches found in literal runs */
+    size_t litSearchMatchBytes; /* Bytes of the matches found in literal runs */
+    size_t ldmMatches;         /* Long distance matches merged into the sequences */
+    size_t ldmMatchBytes;      /* Bytes of the long distance matches */
+    size_t dictMatches;        /* Dictionary matches found for literal runs */
+    size_t dictMatchBytes;     /* Bytes of the dictionary matches */
+    size_t failedBlocks;       /* Blocks the sequence producer returned an error for,
+                                * compressed by zstd if fallback is enabled */
+    QZSTD_SeqStats_T seqStats; /* Sequences of QAT, counted for the states with
+                                * QZSTD_p_sequenceStats */
+} QZSTD_Stats_T;
+
+/** QZSTD_getStats:
+ *    Get statistics of QAT sequence producer
+ *
+ * @param stats     Filled with current statistics.
+ */
+void QZSTD_getStats(QZSTD_Stats_T *stats);
+
+/** QZSTD_AdaptiveParams_T:
+ *  Range and target of the adaptive level controller
+ */
+typedef struct {
+    int minLevel;     /* Lowest level the controller uses, 1 - 22 */
+    int maxLevel;     /* Highest level the controller uses, 1 - 22 */
+    unsigned int targetMBps;      /* Input throughput to sustain with this state in MB/s,
+                                   * 0: no throughput target */
+    unsigned int targetLatencyUs; /* Max average latency of a block in us,
+                                   * 0: no latency target */
+} QZSTD_AdaptiveParams_T;
+
+/** QZSTD_setAdaptiveLevel:
+ *    Let a sequence producer state choose the compression level to meet a target
+ *  The controller measures the throughput and latency of the blocks produced
+ *  with the state, counting the time spent in the sequence producer but not the
+ *  entropy coding of zstd, and moves the level within [minLevel, maxLevel]: down when
+ *  the target is missed, up when there is headroom left. It doesn't go up while
+ *  all QAT instances are busy, nor to a level whose LZ4s ratio, measured from
+ *  the QAT results, is no better. It starts from minLevel. Switching levels
+ *  only selects another QAT session cached on the instance.
+ *
+ *  The target applies to one state; for an aggregate target, divide it over the
+ *  compressing threads. While enabled, the level of the CCtx is ignored by the
+ *  sequence producer, zstd still uses it for its own parameters. Pass NULL to
+ *  disable; it's also disabled when the state is released to the state pool.
+ *
+ * @retval QZSTD_OK     The controller is enabled or disabled.
+ * @retval QZSTD_FAIL   Invalid range, or no target.
+ */
+int QZSTD_setAdaptiveLevel(void *sequenceProducerState,
+                           const QZSTD_AdaptiveParams_T *params);
+
+/** QZSTD_getAdaptiveLevel:
+ *    Get the level currently chosen by the adaptive level controller
+ *
+ * @retval int  The level, or 0 if the controller is disabled.
+ */
+int QZSTD_getAdaptiveLevel(void *sequenceProducerState);
+
+/** QZSTD_LevelProfile_T:
+ *  How a zstd compression level is compressed by QAT sequence producer
+ *  By default, level L is offloaded to QAT at level L with 3-byte min match,
+ *  hybrid levels are seeded by QAT level 12, and the options of the plugin
+ *  follow the parameters of the sequence producer state.
+ */
+typedef struct {
+    int hwLevel;      /* QAT compression level, 1 - 12 */
+    int minMatch;     /* Min match length of QAT, 3 or 4 */
+    int postOptimize; /* 1: post-optimize the sequences like QZSTD_p_postOptimize */
+    int literalSearch; /* Like QZSTD_p_literalSearch, 0: disabled */
+    int searchForExternalRepcodes; /* Suggested ZSTD_c_searchForExternalRepcodes,
+                                    * 0: auto, 1: enable, 2: disable. zstd parameters
+                                    * can't be set by the plugin, the application
+                                    * applies it to the CCtx. */
+} QZSTD_LevelProfile_T;
+
+/** QZSTD_setLevelProfile:
+ *    Set the profile of a compression level, NULL to restore the default
+ *  Profiles are process wide. They can be changed while compressing, every
+ *  block reads the profile of its level once, so a change applies from the
+ *  next block. The options of a sequence producer state set with
+ *  QZSTD_setSeqProdParameter take precedence over the options of the profile.
+ *
+ * @retval QZSTD_OK     The profile is set.
+ * @retval QZSTD_FAIL   Invalid level or profile.
+ */
+int QZSTD_setLevelProfile(int level, const QZSTD_LevelProfile_T *profile);
+
+/** QZSTD_getLevelProfile:
+ *    Get the profile used for a compression level
+ *
+ * @retval QZSTD_OK     The profile is filled.
+ * @retval QZSTD_FAIL   Invalid level.
+ */
+int QZSTD_getLevelProfile(int level, QZSTD_LevelProfile_T *profile);
+
+/** QZSTD_loadLevelProfiles:
+ *    Replace all level profiles by the table in a file
+ *  Every line of the file is "level hwLevel minMatch postOptimize literalSearch
+ *  searchForExternalRepcodes", text after '#' is ignored, and levels not in the
+ *  file get the default profile. The calibrate tool writes such tables. The
+ *  profiles are left unchanged if the file is invalid.
+ *
+ * @retval QZSTD_OK     The profiles are loaded.
+ * @retval QZSTD_FAIL   The file can't be read or is invalid.
+ */
+int QZSTD_loadLevelProfiles(const char *fileName);
+
+/** QZSTD_blockChecksumCallback:
+ *    Called with the XXH32 checksum (seed 0) of every block passed to the
+ *  sequence producer while QZSTD_p_blockChecksum is enabled, before the block is
+ *  entropy coded by zstd.
+ *
+ * @param opaque        Pointer given to QZSTD_setBlockChecksumCallback.
+ * @param src           The block.
+ * @param srcSize       Size of the block.
+ * @param checksum      XXH32 of the block.
+ * @param computedByQat 1: computed by QAT along with the compression,
+ *                      0: computed on CPU because QAT didn't compress the block.
+ */
+typedef void (*QZSTD_blockChecksumCallback)(void *opaque, const void *src,
+        size_t srcSize, unsigned int checksum, int computedByQat);
+
+/** QZSTD_setBlockChecksumCallback:
+ *    Set the function called with the checksum of every block, NULL to remove it
+ *  It's called from the compressing thread; it's removed when the state is
+ *  released to the state pool.
+ *
+ * @retval QZSTD_OK     The callback is set.
+ * @retval QZSTD_FAIL   Invalid state.
+ */
+int QZSTD_setBlockChecksumCallback(void *sequenceProducerState,
+                                   QZSTD_blockChecksumCallback callback, void *opaque);
+
+/** QZSTD_FrameChecksum_T:
+ *  Checksums of the blocks passed to the sequence producer since the frame started
+ *  The digest is the XXH32 (seed 0) of a record per block, in order, made of the
+ *  checksum then the size of the block, both 32 bits little endian. zstd doesn't
+ *  pass blocks shorter than 7 bytes to the sequence producer, so size can be less
+ *  than the content size of the frame when it ends with such a block.
+ */
+typedef struct {
+    unsigned int digest;        /* Digest of the block checksums */
+    unsigned int lastChecksum;  /* XXH32 of the last block */
+    unsigned int nbBlocks;      /* Blocks in the digest */
+    unsigned int nbCpuBlocks;   /* Blocks hashed on CPU */
+    unsigned long long size;    /* Bytes of the blocks in the digest */
+} QZSTD_FrameChecksum_T;
+
+/** QZSTD_getFrameChecksum:
+ *    Get the checksums of the current frame
+ *  The checksum of QAT comes for free with the compression, so an application
+ *  can verify its data end to end, e.g. against the checksums of the blocks after
+ *  decompression, without hashing it again on CPU.
+ *
+ * @retval QZSTD_OK     The checksums are filled.
+ * @retval QZSTD_FAIL   QZSTD_p_blockChecksum is disabled, or invalid state.
+ */
+int QZSTD_getFrameChecksum(void *sequenceProducerState,
+                           QZSTD_FrameChecksum_T *frameChecksum);
+
+/** QZSTD_StageTimes_T:
+ *  Time the sequence producer spent on a block, by stage, in nanoseconds
+ */
+typedef struct {
+    unsigned long long grabNs;   /* Waiting for a free instance */
+    unsigned long long submitNs; /* Instance and session setup, copy of the source
+                                  * to pinned memory, submission and its retries */
+    unsigned long long waitNs;   /* Polling until QAT responds, includes the long
+                                  * distance match search overlapped with it */
+    unsigned long long decodeNs; /* LZ4s decoding and refinement of the sequences
+                                  * on CPU */
+    unsigned long long totalNs;  /* The whole call of the sequence producer */
+    size_t srcSize;
+    int failed;                  /* 1: the sequence producer returned an error */
+} QZSTD_StageTimes_T;
+
+/** QZSTD_stageTimesCallback:
+ *    Called with the stage times of every block passed to the sequence producer,
+ *  from the compressing thread, after the sequences are produced. The time zstd
+ *  spends on the block afterwards isn't included.
+ */
+typedef void (*QZSTD_stageTimesCallback)(void *opaque,
+        const QZSTD_StageTimes_T *times);
+
+/** QZSTD_setStageTimesCallback:
+ *    Set the function called with the stage times of every block, NULL to remove it
+ *  The stages are only timed while a callback is set; it's removed when the state
+ *  is released to the state pool.
+ *
+ * @retval QZSTD_OK     The callback is set.
+ * @retval QZSTD_FAIL   Invalid state.
+ */
+int QZSTD_setStageTimesCallback(void *sequenceProducerState,
+                                QZSTD_stageTimesCallback callback, void *opaque);
+
+/** QZSTD_estimateRatio:
+ *    Estimate how well data compresses, without compressing it
+ *  Blocks sampled across src are compressed by QAT in parallel, one per free
+ *  instance, and the compressed size of zstd is estimated from the LZ4s sequences
+ *  of QAT: literals by their entropy, matches by the cost of their offset and
+ *  lengths. zstd entropy coding isn't run, so it costs a fraction of a trial
+ *  compression. The estimate is for the default level; the samples don't see
+ *  matches across samples or beyond 64KB, so the ratio of levels with long
+ *  windows on redundant data is overestimated.
+ *  QAT must be started with QZSTD_startQatDevice.
+ *
+ * @param src       Data to estimate.
+ * @param srcSize   Size of src.
+ * @param budget    Max bytes of src to compress, src is sampled if it's larger.
+ *                  At least one 64KB sample is compressed.
+ *
+ * @retval double   Estimated compressed size / srcSize, about 1 for
+ *                  incompressible data, or 0 if QAT failed.
+ */
+double QZSTD_estimateRatio(const void *src, size_t srcSize, size_t budget);
+
+/** QZSTD_lz4FrameBound:
+ *    Max size of the LZ4 frame written by QZSTD_compressLz4Frame for srcSize
+ */
+size_t QZSTD_lz4FrameBound(size_t srcSize);
+
+/** QZSTD_compressLz4Frame:
+ *    Compress src to a LZ4 frame with QAT
+ *  The LZ4s output of QAT is converted to LZ4 blocks, so one accelerator serves
+ *  zstd and LZ4. The frame has independent blocks of 64KB, submitted on every
+ *  free QAT instance in parallel, and the content size, but no checksums.
+ *  Blocks which don't shrink are stored uncompressed. Any LZ4 frame decoder
+ *  can decompress it. QAT must be started with QZSTD_startQatDevice.
+ *
+ * @param dstCapacity       At least QZSTD_lz4FrameBound(srcSize) never fails
+ *                          for lack of space.
+ * @param dstSize           Filled with the size of the frame.
+ * @param compressionLevel  Level of QAT, 1 - 12, mapped by the level profiles.
+ *
+ * @retval QZSTD_OK     The frame is written.
+ * @retval QZSTD_FAIL   Invalid parameters, dst is too small, or QAT failed; the
+ *                      caller can compress src in software.
+ */
+int QZSTD_compressLz4Frame(void *dst, size_t dstCapacity, size_t *dstSize,
+                           const void *src, size_t srcSize, int compressionLevel);
+
+/** QZSTD_compressLz4Block:
+ *    Compress src to a single LZ4 block with QAT, without frame
+ *  The block can be decompressed by LZ4_decompress_safe. srcSize is at most
+ *  128KB, and the block may be larger than src for incompressible data.
+ *
+ * @retval QZSTD_OK     The block is written, dstSize is filled.
+ * @retval QZSTD_FAIL   Invalid parameters, dst is too small, or QAT failed.
+ */
+int QZSTD_compressLz4Block(void *dst, size_t dstCapacity, size_t *dstSize,
+                           const void *src, size_t srcSize, int compressionLevel);
+
+/** QZSTD_CAPTURE_MAGIC:
+ *    First four bytes of a capture file, "QZCP" in little endian
+ */
+#define QZSTD_CAPTURE_MAGIC   0x50435A51U
+#define QZSTD_CAPTURE_VERSION 1
+
+/** QZSTD_CaptureHeader_T:
+ *    Header of a capture file, followed by a QZSTD_CaptureRecord_T for every call
+ *  of qatSequenceProducer, each one followed by the sampleSize first bytes of its
+ *  block. The fields are in the byte order of the capturing host.
+ */
+typedef struct QZSTD_CaptureHeader_S {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int recordSize;  /* sizeof(QZSTD_CaptureRecord_T) */
+    unsigned int sampleBytes; /* Max bytes of block sampled per record */
+    unsigned int hash;        /* 1: records have the XXH32 of their block */
+    unsigned int reserved;
+} QZSTD_CaptureHeader_T;
+
+/** QZSTD_CaptureRecord_T:
+ *    A call of qatSequenceProducer
+ */
+typedef struct QZSTD_CaptureRecord_S {
+    unsigned long long timeNs;     /* Start of the call since the capture started */
+    unsigned long long latencyNs;  /* Time spent in qatSequenceProducer */
+    unsigned long long windowSize;
+    unsigned int srcSize;
+    int level;
+    unsigned int dictSize;
+    unsigned int thread;           /* Index of the calling thread, in order of first call */
+    unsigned int hash;             /* XXH32 of the block, 0 unless hashed */
+    unsigned int sampleSize;       /* Bytes of the block following the record */
+    unsigned int failed;           /* 1: the sequence producer returned an error */
+    unsigned int reserved;
+} QZSTD_CaptureRecord_T;
+
+/** QZSTD_CaptureOptions_T:
+ *    Options of QZSTD_startCapture
+ */
+typedef struct QZSTD_CaptureOptions_S {
+    const char *path;         /* Capture file, truncated */
+    int hash;                 /* 1: record the XXH32 of every block */
+    unsigned int sampleBytes; /* Record the first bytes of every block, 0: none */
+} QZSTD_CaptureOptions_T;
+
+/** QZSTD_startCapture:
+ *    Record the metadata of every call of qatSequenceProducer to a file
+ *  Calls of all threads are recorded, with their size, level, window, start time,
+ *  thread and latency, and optionally a hash or a sample of the block, for the
+ *  replay tool to re-drive them. Recording a call costs a lock and a buffered
+ *  write, plus hashing or copying the block if requested.
+ *  The capture is also started by QZSTD_startQatDevice when the environment
+ *  variable QZSTD_CAPTURE names a file, with QZSTD_CAPTURE_HASH=1 and
+ *  QZSTD_CAPTURE_SAMPLE=bytes as options; it's then stopped by
+ *  QZSTD_stopQatDevice.
+ *
+ * @retval QZSTD_OK     The capture is started.
+ * @retval QZSTD_FAIL   Invalid options, a capture is running, or the file can't
+ *                      be written.
+ */
+int QZSTD_startCapture(const QZSTD_CaptureOptions_T *options);
+
+/** QZSTD_stopCapture:
+ *    Stop recording and close the capture file
+ */
+void QZSTD_stopCapture(void);
+
 #endif /* QATSEQPROD_H */
 
 #if defined (__cplusplus)
@@ -0,0 +1,890 @@
+/***************************************************************************
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2007-2023 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***************************************************************************/
+
+/**
+ *****************************************************************************
+ *      Software LZ4s engine
+ *  Stands in for QAT on CPU: every instance compresses the requests submitted
+ *  to it into LZ4s when they are submitted, and the responses are returned by
+ *  polling once the configured latency has passed, in submission order.
+ *  Delays, retries, failed responses and a stalled instance can be injected
+ *  to test how the sequence producer copes with a misbehaving device.
+ *****************************************************************************/
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "qatseqprod.h"
+#include "qatseqprod_sw.h"
+
+#define SW_DEFAULT_INSTANCES    (4)
+#define SW_MAX_INSTANCES        (256)
+#define SW_DEFAULT_QUEUE_DEPTH  (64)
+#define SW_HASH_LOG             (15)
+#define SW_WINDOW_SIZE          (64 * 1024) /* LZ4s offsets are 16 bits */
+#define SW_MAX_OFFSET           (SW_WINDOW_SIZE - 1)
+#define SW_META_SIZE            (64)
+#define SW_PPM                  (1000000)
+#define SW_LN2                  (0.69314718055994530942)
+
+#define LZ4S_ML_BITS 4
+#define LZ4S_ML_MASK ((1U << LZ4S_ML_BITS) - 1)
+#define LZ4S_RUN_MASK ((1U << (8 - LZ4S_ML_BITS)) - 1)
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME32_4 0x27D4EB2FU
+#define XXH_PRIME32_5 0x165667B1U
+
+/** QZSTD_SwSession_T:
+ *  Session of the software engine, stored in the session memory of the caller
+ */
+typedef struct QZSTD_SwSession_S {
+    CpaDcSessionSetupData setupData;
+    CpaDcCallbackFn callback;
+} QZSTD_SwSession_T;
+
+/** QZSTD_SwResponse_T:
+ *  A response waiting in the queue of an instance
+ */
+typedef struct QZSTD_SwResponse_S {
+    void *callbackTag;
+    CpaDcCallbackFn callback;
+    CpaStatus status; /* Status given to the callback */
+    unsigned long long readyNs; /* Time the response can be polled */
+} QZSTD_SwResponse_T;
+
+/** QZSTD_SwInstance_T:
+ *  An instance of the software engine, its lock covers the queue and the
+ *  match finder tables
+ */
+typedef struct QZSTD_SwInstance_S {
+    unsigned int id;
+    int started;
+    pthread_mutex_t lock;
+    QZSTD_SwResponse_T *queue; /* Ring of queueDepth responses */
+    unsigned int head;
+    unsigned int count;
+    unsigned long long rngState; /* Random faults of the instance */
+    unsigned int hashTable[1 << SW_HASH_LOG]; /* Positions + 1 */
+    unsigned int chainTable[SW_WINDOW_SIZE];  /* Previous position + 1 with the same hash */
+} QZSTD_SwInstance_T;
+
+/** QZSTD_SwEngine_T:
+ *  Process data of the software engine
+ */
+typedef struct QZSTD_SwEngine_S {
+    QZSTD_SwEngineParams_T params; /* Set by QZSTD_setSwEngineParams */
+    QZSTD_SwEngineParams_T active; /* Parameters of the running engine */
+    QZSTD_SwInstance_T *instances;
+    int started;
+    QZSTD_SwFaultParams_T faults; /* Guarded by gSwFaultLock */
+    int faultsSet; /* Faults set by QZSTD_setSwFaultParams, else QZSTD_SW_FAULTS */
+    QZSTD_SwFaultStats_T faultStats;
+} QZSTD_SwEngine_T;
+
+static QZSTD_SwEngine_T gSwEngine;
+static pthread_mutex_t gSwFaultLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long QZSTD_swNowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+static unsigned int QZSTD_swRead32(const Cpa8U *p)
+{
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+           ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static inline unsigned int QZSTD_swRotl32(unsigned int x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+/** QZSTD_swXxh32:
+ *    XXH32 of the source with seed 0, the checksum QAT returns with LZ4s
+ */
+static unsigned int QZSTD_swXxh32(const Cpa8U *p, size_t len)
+{
+    const Cpa8U *const end = p + len;
+    unsigned int h;
+
+    if (len >= 16) {
+        unsigned int v1 = XXH_PRIME32_1 + XXH_PRIME32_2;
+        unsigned int v2 = XXH_PRIME32_2;
+        unsigned int v3 = 0;
+        unsigned int v4 = 0U - XXH_PRIME32_1;
+        const Cpa8U *const limit = end - 16;
+
+        do {
+            v1 = QZSTD_swRotl32(v1 + QZSTD_swRead32(p) * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
+            v2 = QZSTD_swRotl32(v2 + QZSTD_swRead32(p + 4) * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
+            v3 = QZSTD_swRotl32(v3 + QZSTD_swRead32(p + 8) * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
+            v4 = QZSTD_swRotl32(v4 + QZSTD_swRead32(p + 12) * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
+            p += 16;
+        } while (p <= limit);
+        h = QZSTD_swRotl32(v1, 1) + QZSTD_swRotl32(v2, 7) +
+            QZSTD_swRotl32(v3, 12) + QZSTD_swRotl32(v4, 18);
+    } else {
+        h = XXH_PRIME32_5;
+    }
+    h += (unsigned int)len;
+    while (p + 4 <= end) {
+        h = QZSTD_swRotl32(h + QZSTD_swRead32(p) * XXH_PRIME32_3, 17) * XXH_PRIME32_4;
+        p += 4;
+    }
+    while (p < end) {
+        h = QZSTD_swRotl32(h + (*p) * XXH_PRIME32_5, 11) * XXH_PRIME32_1;
+        p++;
+    }
+    h ^= h >> 15;
+    h *= XXH_PRIME32_2;
+    h ^= h >> 13;
+    h *= XXH_PRIME32_3;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline unsigned int QZSTD_swHash(const Cpa8U *p, unsigned int minMatch)
+{
+    unsigned int val = QZSTD_swRead32(p);
+
+    if (3 == minMatch) {
+        val &= 0xFFFFFF;
+    }
+    return (val * 2654435761U) >> (32 - SW_HASH_LOG);
+}
+
+static inline void QZSTD_swInsert(QZSTD_SwInstance_T *inst, const Cpa8U *src,
+                                  size_t pos, unsigned int minMatch)
+{
+    unsigned int h = QZSTD_swHash(src + pos, minMatch);
+
+    inst->chainTable[pos & (SW_WINDOW_SIZE - 1)] = inst->hashTable[h];
+    inst->hashTable[h] = (unsigned int)pos + 1;
+}
+
+/** QZSTD_swFindMatch:
+ *    Longest match at pos among the positions with the same hash, following
+ *  at most maxAttempts links of the hash chain
+ */
+static size_t QZSTD_swFindMatch(QZSTD_SwInstance_T *inst, const Cpa8U *src,
+                                size_t srcSize, size_t pos, unsigned int minMatch,
+                                unsigned int maxAttempts, size_t *offset)
+{
+    unsigned int cand = inst->hashTable[QZSTD_swHash(src + pos, minMatch)];
+    size_t bestLen = 0;
+
+    while (0 != cand && maxAttempts-- > 0) {
+        size_t candPos = cand - 1;
+        size_t len = 0;
+
+        if (pos - candPos > SW_MAX_OFFSET) {
+            break;
+        }
+        while (pos + len < srcSize && src[candPos + len] == src[pos + len]) {
+            len++;
+        }
+        if (len >= minMatch && len > bestLen) {
+            bestLen = len;
+            *offset = pos - candPos;
+        }
+        cand = inst->chainTable[candPos & (SW_WINDOW_SIZE - 1)];
+    }
+    return bestLen;
+}
+
+static Cpa8U *QZSTD_swWriteLen(Cpa8U *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (Cpa8U)len;
+    return op;
+}
+
+/** QZSTD_swEmit:
+ *    Write a LZ4s sequence, matchField is the match length minus (minMatch - 1),
+ *  0 for the last literals
+ *
+ * @retval Cpa8U*   End of the sequence, NULL if it doesn't fit.
+ */
+static Cpa8U *QZSTD_swEmit(Cpa8U *op, const Cpa8U *oend, const Cpa8U *lit,
+                           size_t litLength, size_t offset, size_t matchField)
+{
+    Cpa8U *token = op++;
+
+    if ((size_t)(oend - token) < 1 + litLength + litLength / 255 + 1 + 2 +
+        matchField / 255 + 1) {
+        return NULL;
+    }
+    *token = (Cpa8U)((litLength >= LZ4S_RUN_MASK ? LZ4S_RUN_MASK : litLength) << LZ4S_ML_BITS);
+    if (litLength >= LZ4S_RUN_MASK) {
+        op = QZSTD_swWriteLen(op, litLength - LZ4S_RUN_MASK);
+    }
+    memcpy(op, lit, litLength);
+    op += litLength;
+    if (0 == matchField) {
+        return op;
+    }
+    *op++ = (Cpa8U)offset;
+    *op++ = (Cpa8U)(offset >> 8);
+    *token |= (Cpa8U)(matchField >= LZ4S_ML_MASK ? LZ4S_ML_MASK : matchField);
+    if (matchField >= LZ4S_ML_MASK) {
+        op = QZSTD_swWriteLen(op, matchField - LZ4S_ML_MASK);
+    }
+    return op;
+}
+
+/** QZSTD_swCompressLz4s:
+ *    Compress src to LZ4s with a hash chain match finder, the chain is searched
+ *  deeper at higher levels, and levels 6 and above defer a match by one byte
+ *  when the next position has a longer match.
+ *
+ * @retval size_t   Size of the LZ4s output, 0 if it doesn't fit in dstCapacity.
+ */
+static size_t QZSTD_swCompressLz4s(QZSTD_SwInstance_T *inst, const Cpa8U *src,
+                                   size_t srcSize, Cpa8U *dst, size_t dstCapacity,
+                                   int level, unsigned int minMatch)
+{
+    const Cpa8U *const oend = dst + dstCapacity;
+    Cpa8U *op = dst;
+    unsigned int maxAttempts = 1U << ((level - 1) / 2);
+    size_t pos = 0, anchor = 0;
+
+    memset(inst->hashTable, 0, sizeof(inst->hashTable));
+    while (pos + 4 <= srcSize) {
+        size_t offset = 0;
+        size_t len = QZSTD_swFindMatch(inst, src, srcSize, pos, minMatch,
+                                       maxAttempts, &offset);
+        size_t end;
+
+        if (0 == len) {
+            QZSTD_swInsert(inst, src, pos, minMatch);
+            pos++;
+            continue;
+        }
+        if (level >= 6 && pos + 5 <= srcSize) {
+            size_t nextOffset = 0;
+            size_t nextLen;
+            QZSTD_swInsert(inst, src, pos, minMatch);
+            nextLen = QZSTD_swFindMatch(inst, src, srcSize, pos + 1, minMatch,
+                                        maxAttempts, &nextOffset);
+            if (nextLen > len + 1) {
+                pos++;
+                len = nextLen;
+                offset = nextOffset;
+            }
+        }
+        op = QZSTD_swEmit(op, oend, src + anchor, pos - anchor, offset,
+                          len - (minMatch - 1));
+        if (NULL == op) {
+            return 0;
+        }
+        end = pos + len;
+        while (pos < end && pos + 4 <= srcSize) {
+            QZSTD_swInsert(inst, src, pos, minMatch);
+            pos++;
+        }
+        pos = end;
+        anchor = pos;
+    }
+    op = QZSTD_swEmit(op, oend, src + anchor, srcSize - anchor, 0, 0);
+    if (NULL == op) {
+        return 0;
+    }
+    return (size_t)(op - dst);
+}
+
+/** QZSTD_swRandom:
+ *    xorshift64* generator of the instance, called with the instance locked
+ */
+static unsigned long long QZSTD_swRandom(QZSTD_SwInstance_T *inst)
+{
+    unsigned long long x = inst->rngState;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    inst->rngState = x;
+    return x * 2685821657736338717ULL;
+}
+
+/** QZSTD_swUnit:
+ *    Uniform random number in (0, 1]
+ */
+static double QZSTD_swUnit(QZSTD_SwInstance_T *inst)
+{
+    return (double)((QZSTD_swRandom(inst) >> 11) + 1) / (double)(1ULL << 53);
+}
+
+/** QZSTD_swLn:
+ *    Natural logarithm of x in (0, 1], without depending on libm
+ */
+static double QZSTD_swLn(double x)
+{
+    double z, z2, term, sum = 0;
+    int k = 0, n;
+
+    while (x < 0.5) {
+        x *= 2;
+        k++;
+    }
+    /* ln(x) = 2 * atanh((x - 1) / (x + 1)), |z| <= 1/3 converges quickly */
+    z = (x - 1) / (x + 1);
+    z2 = z * z;
+    term = z;
+    for (n = 1; n < 30; n += 2) {
+        sum += term / n;
+        term *= z2;
+    }
+    return 2 * sum - k * SW_LN2;
+}
+
+static double QZSTD_swSqrt(double x)
+{
+    double r = x > 1 ? x : 1;
+    int n;
+
+    for (n = 0; n < 64; n++) {
+        r = 0.5 * (r + x / r);
+    }
+    return r;
+}
+
+/** QZSTD_swSampleDelayUs:
+ *    Delay of a response drawn from the distribution of the faults
+ */
+static unsigned long long QZSTD_swSampleDelayUs(QZSTD_SwInstance_T *inst,
+        const QZSTD_SwFaultParams_T *faults)
+{
+    double mean = (double)faults->delayUs;
+
+    switch (faults->delayDist) {
+    case QZSTD_SW_DELAY_UNIFORM:
+        return (unsigned long long)(2 * mean * QZSTD_swUnit(inst));
+    case QZSTD_SW_DELAY_EXPONENTIAL:
+        return (unsigned long long)(-mean * QZSTD_swLn(QZSTD_swUnit(inst)));
+    case QZSTD_SW_DELAY_PARETO:
+        /* Scale mean / 2 gives the mean with shape 2 */
+        return (unsigned long long)(mean / 2 / QZSTD_swSqrt(QZSTD_swUnit(inst)));
+    default:
+        return 0;
+    }
+}
+
+/** QZSTD_swHit:
+ *    Whether a fault of probability ppm per million happens
+ */
+static int QZSTD_swHit(QZSTD_SwInstance_T *inst, unsigned int ppm)
+{
+    return 0 != ppm && QZSTD_swRandom(inst) % SW_PPM < ppm;
+}
+
+/** QZSTD_swParseUInt:
+ *    Parse a decimal number at *s, moving *s after it
+ */
+static int QZSTD_swParseUInt(const char **s, unsigned int *value)
+{
+    char *end;
+    unsigned long v = strtoul(*s, &end, 10);
+
+    if (end == *s || v > 0xFFFFFFFFUL) {
+        return QZSTD_FAIL;
+    }
+    *value = (unsigned int)v;
+    *s = end;
+    return QZSTD_OK;
+}
+
+static int QZSTD_swParseItem(const char **s, QZSTD_SwFaultParams_T *params)
+{
+    static const char *const dists[] = { "uniform:", "exp:", "pareto:" };
+    const char *p = *s;
+    int d;
+
+    if (0 == strncmp(p, "none", 4)) {
+        *s = p + 4;
+        return QZSTD_OK;
+    } else if (0 == strncmp(p, "delay=", 6)) {
+        p += 6;
+        for (d = 0; d < 3; d++) {
+            if (0 == strncmp(p, dists[d], strlen(dists[d]))) {
+                params->delayDist = QZSTD_SW_DELAY_UNIFORM + d;
+                p += strlen(dists[d]);
+                break;
+            }
+        }
+        if (3 == d) {
+            return QZSTD_FAIL;
+        }
+        *s = p;
+        return QZSTD_swParseUInt(s, &params->delayUs);
+    } else if (0 == strncmp(p, "retry=", 6)) {
+        *s = p + 6;
+        return QZSTD_swParseUInt(s, &params->retryPpm);
+    } else if (0 == strncmp(p, "fail=", 5)) {
+        *s = p + 5;
+        return QZSTD_swParseUInt(s, &params->failPpm);
+    } else if (0 == strncmp(p, "stall=", 6)) {
+        *s = p + 6;
+        if (QZSTD_OK != QZSTD_swParseUInt(s, &params->stallInstance) || ':' != **s) {
+            return QZSTD_FAIL;
+        }
+        (*s)++;
+        return QZSTD_swParseUInt(s, &params->stallUs);
+    } else if (0 == strncmp(p, "seed=", 5)) {
+        *s = p + 5;
+        return QZSTD_swParseUInt(s, &params->seed);
+    }
+    return QZSTD_FAIL;
+}
+
+int QZSTD_parseSwFaults(const char *spec, QZSTD_SwFaultParams_T *params)
+{
+    QZSTD_SwFaultParams_T parsed;
+
+    if (NULL == spec || NULL == params) {
+        return QZSTD_FAIL;
+    }
+    memset(&parsed, 0, sizeof(QZSTD_SwFaultParams_T));
+    while (0 != *spec) {
+        if (QZSTD_OK != QZSTD_swParseItem(&spec, &parsed) ||
+            (',' != *spec && 0 != *spec)) {
+            return QZSTD_FAIL;
+        }
+        if (',' == *spec && 0 == *++spec) {
+            return QZSTD_FAIL;
+        }
+    }
+    if (parsed.retryPpm > SW_PPM || parsed.failPpm > SW_PPM) {
+        return QZSTD_FAIL;
+    }
+    *params = parsed;
+    return QZSTD_OK;
+}
+
+void QZSTD_setSwFaultParams(const QZSTD_SwFaultParams_T *params)
+{
+    pthread_mutex_lock(&gSwFaultLock);
+    if (NULL != params) {
+        gSwEngine.faults = *params;
+    } else {
+        memset(&gSwEngine.faults, 0, sizeof(QZSTD_SwFaultParams_T));
+    }
+    gSwEngine.faultsSet = 1;
+    pthread_mutex_unlock(&gSwFaultLock);
+}
+
+void QZSTD_getSwFaultStats(QZSTD_SwFaultStats_T *stats)
+{
+    if (NULL == stats) {
+        return;
+    }
+    stats->submitted = __sync_fetch_and_add(&gSwEngine.faultStats.submitted, 0);
+    stats->retries = __sync_fetch_and_add(&gSwEngine.faultStats.retries, 0);
+    stats->failures = __sync_fetch_and_add(&gSwEngine.faultStats.failures, 0);
+    stats->stalled = __sync_fetch_and_add(&gSwEngine.faultStats.stalled, 0);
+    stats->delayUs = __sync_fetch_and_add(&gSwEngine.faultStats.delayUs, 0);
+}
+
+/** QZSTD_swEnvParam:
+ *    Value of a numeric environment variable, def if it isn't set
+ */
+static unsigned int QZSTD_swEnvParam(const char *name, unsigned int def)
+{
+    const char *value = getenv(name);
+
+    if (NULL == value || 0 == value[0]) {
+        return def;
+    }
+    return (unsigned int)strtoul(value, NULL, 10);
+}
+
+int QZSTD_setSwEngineParams(const QZSTD_SwEngineParams_T *params)
+{
+    if (gSwEngine.started) {
+        return QZSTD_FAIL;
+    }
+    if (NULL == params) {
+        memset(&gSwEngine.params, 0, sizeof(QZSTD_SwEngineParams_T));
+        return QZSTD_OK;
+    }
+    if (params->numInstances > SW_MAX_INSTANCES) {
+        return QZSTD_FAIL;
+    }
+    gSwEngine.params = *params;
+    return QZSTD_OK;
+}
+
+CpaStatus QZSTD_swUserStart(const char *pProcessName)
+{
+    QZSTD_SwEngineParams_T *active = &gSwEngine.active;
+    unsigned int seed;
+    unsigned int i;
+
+    (void)pProcessName;
+    if (gSwEngine.started) {
+        return CPA_STATUS_SUCCESS;
+    }
+
+    /* Parameters not set by the API come from the environment */
+    *active = gSwEngine.params;
+    if (0 == active->numInstances) {
+        active->numInstances = QZSTD_swEnvParam("QZSTD_SW_INSTANCES", SW_DEFAULT_INSTANCES);
+    }
+    if (0 == active->latencyUs) {
+        active->latencyUs = QZSTD_swEnvParam("QZSTD_SW_LATENCY_US", 0);
+    }
+    if (0 == active->queueDepth) {
+        active->queueDepth = QZSTD_swEnvParam("QZSTD_SW_QUEUE_DEPTH", SW_DEFAULT_QUEUE_DEPTH);
+    }
+    if (0 == active->numInstances || active->numInstances > SW_MAX_INSTANCES ||
+        0 == active->queueDepth) {
+        return CPA_STATUS_INVALID_PARAM;
+    }
+
+    pthread_mutex_lock(&gSwFaultLock);
+    if (!gSwEngine.faultsSet && NULL != getenv("QZSTD_SW_FAULTS") &&
+        QZSTD_OK != QZSTD_parseSwFaults(getenv("QZSTD_SW_FAULTS"), &gSwEngine.faults)) {
+        pthread_mutex_unlock(&gSwFaultLock);
+        return CPA_STATUS_INVALID_PARAM;
+    }
+    seed = 0 != gSwEngine.faults.seed ? gSwEngine.faults.seed : 1;
+    pthread_mutex_unlock(&gSwFaultLock);
+    memset(&gSwEngine.faultStats, 0, sizeof(QZSTD_SwFaultStats_T));
+
+    gSwEngine.instances = (QZSTD_SwInstance_T *)calloc(active->numInstances,
+                          sizeof(QZSTD_SwInstance_T));
+    if (NULL == gSwEngine.instances) {
+        return CPA_STATUS_RESOURCE;
+    }
+    for (i = 0; i < active->numInstances; i++) {
+        gSwEngine.instances[i].id = i;
+        gSwEngine.instances[i].rngState = ((unsigned long long)seed << 32) ^
+                                          (0x9E3779B97F4A7C15ULL * (i + 1));
+        pthread_mutex_init(&gSwEngine.instances[i].lock, NULL);
+        gSwEngine.instances[i].queue = (QZSTD_SwResponse_T *)calloc(active->queueDepth,
+                                       sizeof(QZSTD_SwResponse_T));
+        if (NULL == gSwEngine.instances[i].queue) {
+            gSwEngine.started = 1;
+            (void)QZSTD_swUserStop();
+            return CPA_STATUS_RESOURCE;
+        }
+    }
+    gSwEngine.started = 1;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swUserStop(void)
+{
+    unsigned int i;
+
+    if (!gSwEngine.started) {
+        return CPA_STATUS_SUCCESS;
+    }
+    for (i = 0; i < gSwEngine.active.numInstances; i++) {
+        pthread_mutex_destroy(&gSwEngine.instances[i].lock);
+        free(gSwEngine.instances[i].queue);
+    }
+    free(gSwEngine.instances);
+    gSwEngine.instances = NULL;
+    gSwEngine.started = 0;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swGetNumInstances(Cpa16U *pNumInstances)
+{
+    if (!gSwEngine.started) {
+        return CPA_STATUS_FAIL;
+    }
+    *pNumInstances = (Cpa16U)gSwEngine.active.numInstances;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swGetInstances(Cpa16U numInstances,
+                               CpaInstanceHandle *dcInstances)
+{
+    Cpa16U i;
+
+    if (!gSwEngine.started || numInstances > gSwEngine.active.numInstances) {
+        return CPA_STATUS_INVALID_PARAM;
+    }
+    for (i = 0; i < numInstances; i++) {
+        dcInstances[i] = (CpaInstanceHandle)&gSwEngine.instances[i];
+    }
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swInstanceGetInfo2(const CpaInstanceHandle instanceHandle,
+                                   CpaInstanceInfo2 *pInstanceInfo2)
+{
+    (void)instanceHandle;
+    /* All instances are on one device, and use ordinary memory */
+    memset(pInstanceInfo2, 0, sizeof(CpaInstanceInfo2));
+    pInstanceInfo2->requiresPhysicallyContiguousMemory = CPA_FALSE;
+    pInstanceInfo2->isPolled = CPA_TRUE;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swQueryCapabilities(CpaInstanceHandle dcInstance,
+                                    CpaDcInstanceCapabilities *pInstanceCapabilities)
+{
+    (void)dcInstance;
+    memset(pInstanceCapabilities, 0, sizeof(CpaDcInstanceCapabilities));
+    pInstanceCapabilities->statelessLZ4SCompression = CPA_TRUE;
+    pInstanceCapabilities->checksumXXHash32 = CPA_TRUE;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swBufferListGetMetaSize(const CpaInstanceHandle instanceHandle,
+                                        Cpa32U numBuffers, Cpa32U *pSizeInBytes)
+{
+    (void)instanceHandle;
+    (void)numBuffers;
+    *pSizeInBytes = SW_META_SIZE;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swGetNumIntermediateBuffers(CpaInstanceHandle instanceHandle,
+        Cpa16U *pNumBuffers)
+{
+    (void)instanceHandle;
+    *pNumBuffers = 0;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swSetAddressTranslation(const CpaInstanceHandle instanceHandle,
+                                        CpaVirtualToPhysical virtual2Physical)
+{
+    (void)instanceHandle;
+    (void)virtual2Physical;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swStartInstance(CpaInstanceHandle instanceHandle,
+                                Cpa16U numBuffers, CpaBufferList **pIntermediateBuffers)
+{
+    (void)numBuffers;
+    (void)pIntermediateBuffers;
+    ((QZSTD_SwInstance_T *)instanceHandle)->started = 1;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swStopInstance(CpaInstanceHandle instanceHandle)
+{
+    ((QZSTD_SwInstance_T *)instanceHandle)->started = 0;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swGetSessionSize(CpaInstanceHandle dcInstance,
+                                 CpaDcSessionSetupData *pSessionData,
+                                 Cpa32U *pSessionSize, Cpa32U *pContextSize)
+{
+    (void)dcInstance;
+    (void)pSessionData;
+    *pSessionSize = sizeof(QZSTD_SwSession_T);
+    *pContextSize = 0;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swInitSession(CpaInstanceHandle dcInstance,
+                              CpaDcSessionHandle pSessionHandle,
+                              CpaDcSessionSetupData *pSessionData,
+                              CpaBufferList *pContextBuffer,
+                              CpaDcCallbackFn callbackFn)
+{
+    QZSTD_SwSession_T *sess = (QZSTD_SwSession_T *)pSessionHandle;
+
+    (void)dcInstance;
+    (void)pContextBuffer;
+    /* Only stateless LZ4s compression, like the sequence producer uses */
+    if (NULL == sess || CPA_DC_LZ4S != pSessionData->compType ||
+        CPA_DC_DIR_COMPRESS != pSessionData->sessDirection ||
+        CPA_DC_STATELESS != pSessionData->sessState ||
+        pSessionData->compLevel < CPA_DC_L1 || pSessionData->compLevel > CPA_DC_L12) {
+        return CPA_STATUS_INVALID_PARAM;
+    }
+    sess->setupData = *pSessionData;
+    sess->callback = callbackFn;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swRemoveSession(const CpaInstanceHandle dcInstance,
+                                CpaDcSessionHandle pSessionHandle)
+{
+    (void)dcInstance;
+    (void)pSessionHandle;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swLZ4SCompressBound(const CpaInstanceHandle dcInstance,
+                                    Cpa32U inputSize, Cpa32U *outputSize)
+{
+    (void)dcInstance;
+    /* A match costs at least the 3 bytes it covers, so the output only grows by
+     * the literal length bytes, at most one for every 15 literals + 3 bytes */
+    *outputSize = inputSize + inputSize / 16 + 64;
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swCompressData2(CpaInstanceHandle dcInstance,
+                                CpaDcSessionHandle pSessionHandle,
+                                CpaBufferList *pSrcBuff, CpaBufferList *pDestBuff,
+                                CpaDcOpData *pOpData, CpaDcRqResults *pResults,
+                                void *callbackTag)
+{
+    QZSTD_SwInstance_T *inst = (QZSTD_SwInstance_T *)dcInstance;
+    QZSTD_SwSession_T *sess = (QZSTD_SwSession_T *)pSessionHandle;
+    QZSTD_SwResponse_T *response;
+    QZSTD_SwFaultParams_T faults;
+    unsigned long long delayUs;
+    const Cpa8U *src = pSrcBuff->pBuffers->pData;
+    Cpa32U srcSize = pSrcBuff->pBuffers->dataLenInBytes;
+    size_t produced;
+
+    if (!inst->started || CPA_DC_FLUSH_FINAL != pOpData->flushFlag) {
+        return CPA_STATUS_FAIL;
+    }
+
+    pthread_mutex_lock(&gSwFaultLock);
+    faults = gSwEngine.faults;
+    pthread_mutex_unlock(&gSwFaultLock);
+
+    pthread_mutex_lock(&inst->lock);
+    if (inst->count >= gSwEngine.active.queueDepth ||
+        QZSTD_swHit(inst, faults.retryPpm)) {
+        pthread_mutex_unlock(&inst->lock);
+        __sync_fetch_and_add(&gSwEngine.faultStats.retries, 1);
+        return CPA_STATUS_RETRY;
+    }
+
+    produced = QZSTD_swCompressLz4s(inst, src, srcSize, pDestBuff->pBuffers->pData,
+                                    pDestBuff->pBuffers->dataLenInBytes,
+                                    (int)sess->setupData.compLevel,
+                                    CPA_DC_MIN_4_BYTE_MATCH == sess->setupData.minMatch ? 4 : 3);
+    memset(pResults, 0, sizeof(CpaDcRqResults));
+    pResults->status = 0 == produced ? CPA_DC_OVERFLOW : CPA_DC_OK;
+    pResults->produced = (Cpa32U)produced;
+    pResults->consumed = 0 == produced ? 0 : srcSize;
+    if (CPA_DC_XXHASH32 == sess->setupData.checksum) {
+        pResults->checksum = QZSTD_swXxh32(src, srcSize);
+    }
+    pResults->endOfLastBlock = CPA_TRUE;
+    pResults->dataUncompressed = CPA_FALSE;
+
+    response = &inst->queue[(inst->head + inst->count) % gSwEngine.active.queueDepth];
+    response->callbackTag = callbackTag;
+    response->callback = sess->callback;
+    response->status = CPA_STATUS_SUCCESS;
+    if (QZSTD_swHit(inst, faults.failPpm)) {
+        response->status = CPA_STATUS_FAIL;
+        __sync_fetch_and_add(&gSwEngine.faultStats.failures, 1);
+    }
+    delayUs = QZSTD_swSampleDelayUs(inst, &faults);
+    if (0 != faults.stallUs && inst->id == faults.stallInstance) {
+        delayUs += faults.stallUs;
+        __sync_fetch_and_add(&gSwEngine.faultStats.stalled, 1);
+    }
+    __sync_fetch_and_add(&gSwEngine.faultStats.delayUs, (size_t)delayUs);
+    __sync_fetch_and_add(&gSwEngine.faultStats.submitted, 1);
+    response->readyNs = QZSTD_swNowNs() +
+                        ((unsigned long long)gSwEngine.active.latencyUs + delayUs) * 1000;
+    inst->count++;
+    pthread_mutex_unlock(&inst->lock);
+    return CPA_STATUS_SUCCESS;
+}
+
+CpaStatus QZSTD_swPollInstance(CpaInstanceHandle instanceHandle,
+                               Cpa32U responseQuota)
+{
+    QZSTD_SwInstance_T *inst = (QZSTD_SwInstance_T *)instanceHandle;
+    unsigned long long now = QZSTD_swNowNs();
+    Cpa32U polled = 0;
+
+    while (0 == responseQuota || polled < responseQuota) {
+        QZSTD_SwResponse_T response;
+
+        pthread_mutex_lock(&inst->lock);
+        if (0 == inst->count || inst->queue[inst->head].readyNs > now) {
+            pthread_mutex_unlock(&inst->lock);
+            break;
+        }
+        response = inst->queue[inst->head];
+        inst->head = (inst->head + 1) % gSwEngine.active.queueDepth;
+        inst->count--;
+        pthread_mutex_unlock(&inst->lock);
+
+        if (NULL != response.callback) {
+            response.callback(response.callbackTag, response.status);
+        }
+        polled++;
+    }
+    return 0 == polled ? CPA_STATUS_RETRY : CPA_STATUS_SUCCESS;
+}
+
+void *QZSTD_swMemAllocNUMA(size_t size, int node, size_t phys_alignment_byte)
+{
+    void *ptr = NULL;
+
+    (void)node;
+    if (phys_alignment_byte < sizeof(void *)) {
+        phys_alignment_byte = sizeof(void *);
+    }
+    if (0 != posix_memalign(&ptr, phys_alignment_byte, size)) {
+        return NULL;
+    }
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void QZSTD_swMemFreeNUMA(void **ptr)
+{
+    if (NULL != ptr) {
+        free(*ptr);
+        *ptr = NULL;
+    }
+}
+
+uint64_t QZSTD_swVirtToPhysNUMA(void *pVirtAddress)
+{
+    return (uint64_t)(uintptr_t)pVirtAddress;
+}
@@ -0,0 +1,261 @@
+/***************************************************************************
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2007-2023 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***************************************************************************/
+
+#ifndef QATSEQPROD_SW_H
+#define QATSEQPROD_SW_H
+
+/**
+ * Software LZ4s engine
+ *  Implements the part of the QAT API used by QAT sequence producer on CPU:
+ *  instances, sessions, LZ4s compression and polling of responses. Its entry
+ *  points have the signatures of the QAT API they stand in for, the sequence
+ *  producer calls them through the same backend table as QAT.
+ *
+ *  Built with QZSTD_SW_ONLY, the plugin doesn't depend on the QAT driver
+ *  at all, and this header provides the types of the QAT API it uses.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef QZSTD_SW_ONLY
+
+typedef uint8_t Cpa8U;
+typedef uint16_t Cpa16U;
+typedef uint32_t Cpa32U;
+typedef int32_t Cpa32S;
+typedef uint64_t Cpa64U;
+
+typedef enum _CpaBoolean {
+    CPA_FALSE = 0,
+    CPA_TRUE = 1
+} CpaBoolean;
+
+typedef Cpa32S CpaStatus;
+#define CPA_STATUS_SUCCESS (0)
+#define CPA_STATUS_FAIL (-1)
+#define CPA_STATUS_RETRY (-2)
+#define CPA_STATUS_RESOURCE (-3)
+#define CPA_STATUS_INVALID_PARAM (-4)
+
+typedef void *CpaInstanceHandle;
+typedef void *CpaDcSessionHandle;
+typedef Cpa64U CpaPhysicalAddr;
+typedef CpaPhysicalAddr (*CpaVirtualToPhysical)(void *pVirtualAddr);
+
+typedef struct _CpaFlatBuffer {
+    Cpa32U dataLenInBytes;
+    Cpa8U *pData;
+} CpaFlatBuffer;
+
+typedef struct _CpaBufferList {
+    Cpa32U numBuffers;
+    CpaFlatBuffer *pBuffers;
+    void *pUserData;
+    void *pPrivateMetaData;
+} CpaBufferList;
+
+typedef struct _CpaPhysicalInstanceId {
+    Cpa16U packageId;
+    Cpa16U acceleratorId;
+    Cpa16U executionEngineId;
+    Cpa16U busAddress;
+} CpaPhysicalInstanceId;
+
+typedef struct _CpaInstanceInfo2 {
+    CpaPhysicalInstanceId physInstId;
+    Cpa32U nodeAffinity;
+    CpaBoolean requiresPhysicallyContiguousMemory;
+    CpaBoolean isPolled;
+} CpaInstanceInfo2;
+
+typedef enum _CpaDcCompType {
+    CPA_DC_DEFLATE = 3,
+    CPA_DC_LZ4,
+    CPA_DC_LZ4S
+} CpaDcCompType;
+
+typedef enum _CpaDcCompLvl {
+    CPA_DC_L1 = 1, CPA_DC_L2, CPA_DC_L3, CPA_DC_L4, CPA_DC_L5, CPA_DC_L6,
+    CPA_DC_L7, CPA_DC_L8, CPA_DC_L9, CPA_DC_L10, CPA_DC_L11, CPA_DC_L12
+} CpaDcCompLvl;
+
+typedef enum _CpaDcHuffType {
+    CPA_DC_HT_STATIC = 0,
+    CPA_DC_HT_PRECOMP,
+    CPA_DC_HT_FULL_DYNAMIC
+} CpaDcHuffType;
+
+typedef enum _CpaDcAutoSelectBest {
+    CPA_DC_ASB_DISABLED = 0,
+    CPA_DC_ASB_ENABLED = 4
+} CpaDcAutoSelectBest;
+
+typedef enum _CpaDcSessionDir {
+    CPA_DC_DIR_COMPRESS = 0,
+    CPA_DC_DIR_DECOMPRESS,
+    CPA_DC_DIR_COMBINED
+} CpaDcSessionDir;
+
+typedef enum _CpaDcSessionState {
+    CPA_DC_STATEFUL = 0,
+    CPA_DC_STATELESS
+} CpaDcSessionState;
+
+typedef enum _CpaDcChecksum {
+    CPA_DC_NONE = 0,
+    CPA_DC_CRC32,
+    CPA_DC_ADLER32,
+    CPA_DC_CRC32_ADLER32,
+    CPA_DC_XXHASH32
+} CpaDcChecksum;
+
+typedef enum _CpaDcCompMinMatch {
+    CPA_DC_MIN_3_BYTE_MATCH = 0,
+    CPA_DC_MIN_4_BYTE_MATCH
+} CpaDcCompMinMatch;
+
+typedef enum _CpaDcFlush {
+    CPA_DC_FLUSH_NONE = 0,
+    CPA_DC_FLUSH_FINAL,
+    CPA_DC_FLUSH_SYNC,
+    CPA_DC_FLUSH_FULL
+} CpaDcFlush;
+
+typedef enum _CpaDcSkipMode {
+    CPA_DC_SKIP_DISABLED = 0,
+    CPA_DC_SKIP_AT_START,
+    CPA_DC_SKIP_AT_END,
+    CPA_DC_SKIP_STRIDE
+} CpaDcSkipMode;
+
+typedef enum _CpaDcReqStatus {
+    CPA_DC_OK = 0,
+    CPA_DC_OVERFLOW = -11
+} CpaDcReqStatus;
+
+typedef struct _CpaDcSessionSetupData {
+    CpaDcCompLvl compLevel;
+    CpaDcCompType compType;
+    CpaDcHuffType huffType;
+    CpaDcAutoSelectBest autoSelectBestHuffmanTree;
+    CpaDcSessionDir sessDirection;
+    CpaDcSessionState sessState;
+    CpaDcCompMinMatch minMatch;
+    CpaDcChecksum checksum;
+} CpaDcSessionSetupData;
+
+typedef struct _CpaDcRqResults {
+    CpaDcReqStatus status;
+    Cpa32U produced;
+    Cpa32U consumed;
+    Cpa32U checksum;
+    CpaBoolean endOfLastBlock;
+    CpaBoolean dataUncompressed;
+} CpaDcRqResults;
+
+typedef struct _CpaDcSkipData {
+    CpaDcSkipMode skipMode;
+    Cpa32U skipLength;
+    Cpa32U strideLength;
+    Cpa32U firstSkipOffset;
+} CpaDcSkipData;
+
+typedef struct _CpaDcOpData {
+    CpaDcFlush flushFlag;
+    CpaBoolean compressAndVerify;
+    CpaBoolean compressAndVerifyAndRecover;
+    CpaBoolean integrityCrcCheck;
+    CpaDcSkipData inputSkipData;
+    CpaDcSkipData outputSkipData;
+} CpaDcOpData;
+
+typedef struct _CpaDcInstanceCapabilities {
+    CpaBoolean statelessLZ4SCompression;
+    CpaBoolean checksumXXHash32;
+} CpaDcInstanceCapabilities;
+
+typedef void (*CpaDcCallbackFn)(void *callbackTag, CpaStatus status);
+
+#elif defined(INTREE)
+#include "qat/cpa.h"
+#include "qat/cpa_dc.h"
+#else
+#include "cpa.h"
+#include "cpa_dc.h"
+#endif
+
+CpaStatus QZSTD_swUserStart(const char *pProcessName);
+CpaStatus QZSTD_swUserStop(void);
+CpaStatus QZSTD_swGetNumInstances(Cpa16U *pNumInstances);
+CpaStatus QZSTD_swGetInstances(Cpa16U numInstances,
+                               CpaInstanceHandle *dcInstances);
+CpaStatus QZSTD_swInstanceGetInfo2(const CpaInstanceHandle instanceHandle,
+                                   CpaInstanceInfo2 *pInstanceInfo2);
+CpaStatus QZSTD_swQueryCapabilities(CpaInstanceHandle dcInstance,
+                                    CpaDcInstanceCapabilities *pInstanceCapabilities);
+CpaStatus QZSTD_swBufferListGetMetaSize(const CpaInstanceHandle instanceHandle,
+                                        Cpa32U numBuffers, Cpa32U *pSizeInBytes);
+CpaStatus QZSTD_swGetNumIntermediateBuffers(CpaInstanceHandle instanceHandle,
+        Cpa16U *pNumBuffers);
+CpaStatus QZSTD_swSetAddressTranslation(const CpaInstanceHandle instanceHandle,
+                                        CpaVirtualToPhysical virtual2Physical);
+CpaStatus QZSTD_swStartInstance(CpaInstanceHandle instanceHandle,
+                                Cpa16U numBuffers, CpaBufferList **pIntermediateBuffers);
+CpaStatus QZSTD_swStopInstance(CpaInstanceHandle instanceHandle);
+CpaStatus QZSTD_swGetSessionSize(CpaInstanceHandle dcInstance,
+                                 CpaDcSessionSetupData *pSessionData,
+                                 Cpa32U *pSessionSize, Cpa32U *pContextSize);
+CpaStatus QZSTD_swInitSession(CpaInstanceHandle dcInstance,
+                              CpaDcSessionHandle pSessionHandle,
+                              CpaDcSessionSetupData *pSessionData,
+                              CpaBufferList *pContextBuffer,
+                              CpaDcCallbackFn callbackFn);
+CpaStatus QZSTD_swRemoveSession(const CpaInstanceHandle dcInstance,
+                                CpaDcSessionHandle pSessionHandle);
+CpaStatus QZSTD_swLZ4SCompressBound(const CpaInstanceHandle dcInstance,
+                                    Cpa32U inputSize, Cpa32U *outputSize);
+CpaStatus QZSTD_swCompressData2(CpaInstanceHandle dcInstance,
+                                CpaDcSessionHandle pSessionHandle,
+                                CpaBufferList *pSrcBuff, CpaBufferList *pDestBuff,
+                                CpaDcOpData *pOpData, CpaDcRqResults *pResults,
+                                void *callbackTag);
+CpaStatus QZSTD_swPollInstance(CpaInstanceHandle instanceHandle,
+                               Cpa32U responseQuota);
+void *QZSTD_swMemAllocNUMA(size_t size, int node, size_t phys_alignment_byte);
+void QZSTD_swMemFreeNUMA(void **ptr);
+uint64_t QZSTD_swVirtToPhysNUMA(void *pVirtAddress);
+
+#endif /* QATSEQPROD_SW_H */
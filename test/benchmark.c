@@ -33,11 +33,17 @@
  *
  ***************************************************************************/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* pthread_attr_setaffinity_np */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#include <math.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -47,6 +53,8 @@
 #ifndef ZSTD_STATIC_LINKING_ONLY
 #define ZSTD_STATIC_LINKING_ONLY
 #endif
+/* ZSTD_generateSequences gives the sequences of the software match finder */
+#define ZSTD_DISABLE_DEPRECATE_WARNINGS
 #include "zstd.h"
 #include "zstd_errors.h"
 #include "qatseqprod.h"
@@ -59,11 +67,28 @@
 #define ZSTD_AUTO     0
 #define ZSTD_ENABLED  1
 #define ZSTD_DISABLED 2
+#define MAX_FAULT_PROFILES 16
+#define STAGE_NUM 5
+#define FLUSH_CONTINUE 0 /* One frame for the input */
+#define FLUSH_BUFFER   1 /* Flush after every input buffer */
+#define FLUSH_FRAME    2 /* End a frame after every input buffer */
+#define MAX_THREADS 2048
+#define MAX_SWEEP_VALUES 64
+#define MAX_BASELINE_POINTS 4096
+#define MAX_NUMA_NODES 64
+#define DEFAULT_TOLERANCE 5 /* Percent of change flagged as regression */
+#define DEFAULT_DURATION 10 /* Seconds of the open loop */
+#define HDR_SUB_BITS 7 /* 128 sub-buckets per power of two, under 1% error */
+#define HDR_SUB_COUNT (1 << HDR_SUB_BITS)
+#define HDR_BUCKET_NUM ((64 - HDR_SUB_BITS + 1) * HDR_SUB_COUNT)
 
 
 #ifndef MIN
 #define MIN(a,b) ((a)<(b)?(a):(b))
 #endif
+#ifndef MAX
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#endif
 
 #define DISPLAY(...)  fprintf(stderr, __VA_ARGS__)
 
@@ -74,10 +99,31 @@
 typedef struct {
     size_t chunkSize; /* the max chunk size of ZSTD_compress2 */
     size_t srcSize;  /* Input file size */
-    unsigned cLevel; /* Compression Level 1 - 12 */
+    unsigned cLevel; /* Compression Level 1 - 22 */
     unsigned nbIterations; /* Number test loops, default is 1 */
     char benchMode; /* 0: software compression, 1: QAT compression*/
     char searchForExternalRepcodes; /* 0: auto 1: enable, 2: disable */
+    char postOptimize; /* 1: enable QZSTD_p_postOptimize */
+    unsigned literalSearch; /* Value of QZSTD_p_literalSearch, 0: disabled */
+    char longDistance; /* 1: enable QZSTD_p_longDistance */
+    unsigned targetMBps; /* Target of the adaptive level controller, 0: disabled */
+    char fallback; /* 1: compress the blocks QAT failed on with zstd */
+    char stageTimes; /* 1: time the stages of the sequence producer */
+    char sequenceStats; /* 1: enable QZSTD_p_sequenceStats */
+    char streaming; /* 1: compress with ZSTD_compressStream2 instead of chunks */
+    size_t inBufferMin; /* Input buffer sizes of streaming, random between min and max */
+    size_t inBufferMax;
+    size_t outBufferSize; /* Output buffer size of streaming */
+    unsigned flushPolicy; /* FLUSH_CONTINUE, FLUSH_BUFFER or FLUSH_FRAME */
+    char pinThreads; /* 1: pin every thread to a CPU */
+    char bindNuma; /* 1: bind the threads to the NUMA nodes in turn */
+    unsigned targetRate; /* Open loop requests per second over all threads, 0: closed loop */
+    char poisson; /* 1: Poisson arrivals of the open loop, 0: constant */
+    unsigned duration; /* Seconds of the open loop */
+    unsigned dropUs; /* Drop requests not started # us after arrival, 0: never */
+    int nbThreads; /* Threads of the run, set by runThreads */
+    const unsigned char *dictBuffer; /* Dictionary, NULL: no dictionary */
+    size_t dictSize;
     const unsigned char *srcBuffer; /* Input data point */
 } threadArgs_t;
 
@@ -96,6 +142,82 @@ typedef struct {
 static HistogramStat_t compHistogram;
 static pthread_barrier_t g_threadBarrier1, g_threadBarrier2;
 static size_t g_threadNum = 0;
+static pthread_mutex_t g_resultMutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_totalCSize = 0; /* Compressed size summed over threads */
+static double g_totalCompSpeed = 0; /* Compression throughput summed over threads */
+static size_t g_totalCompCpuNanosec = 0; /* CPU time of the compression loops */
+static size_t g_totalCompNanosec = 0; /* Wall time of the compression loops */
+
+/* Histogram of values with a relative error under 1 / HDR_SUB_COUNT at any magnitude */
+typedef struct {
+    size_t counts[HDR_BUCKET_NUM];
+    size_t num;
+    size_t sum;
+    size_t max;
+} HdrHistogram_t;
+
+/* Per block: grab, submit, wait and decode in the sequence producer, then zstd.
+ * Stages take from tens of ns to ms, so they need the resolution of HDR */
+static HdrHistogram_t stageHistograms[STAGE_NUM];
+static const char *const stageNames[STAGE_NUM] = { "grab", "submit", "wait", "decode", "zstd" };
+
+/* Results of the open loop summed over threads */
+static HdrHistogram_t g_responseHdr; /* From the intended start of the requests */
+static HdrHistogram_t g_serviceHdr; /* From the actual start of the requests */
+static size_t g_openCompleted = 0, g_openDropped = 0, g_openFailed = 0;
+static size_t g_openBytes = 0;
+static size_t g_openElapsedNanosec = 0; /* Longest run of a thread */
+
+/* Values of a swept option, "#[-#][,...]", ranges step by one or by doubling */
+typedef struct {
+    unsigned values[MAX_SWEEP_VALUES];
+    int count;
+} sweepList_t;
+
+/* Fields of a point of the sweep, in the order of the JSON and CSV output */
+typedef enum {
+    SWEEP_THREADS = 0,
+    SWEEP_CHUNK,
+    SWEEP_LEVEL,
+    SWEEP_REPCODES,
+    SWEEP_COMP_MBPS,
+    SWEEP_RATIO,
+    SWEEP_P50,
+    SWEEP_P99,
+    SWEEP_P999,
+    SWEEP_CPU,
+    SWEEP_FIELDS
+} sweepField_e;
+
+#define SWEEP_KEYS (SWEEP_REPCODES + 1) /* Fields identifying a point */
+
+typedef struct {
+    const char *name;
+    int precision;
+    int better; /* Gated against the baseline, 1: higher is better, -1: lower is better */
+} sweepFieldInfo_t;
+
+static const sweepFieldInfo_t sweepFields[SWEEP_FIELDS] = {
+    { "threads",    0,  0 },
+    { "chunkSize",  0,  0 },
+    { "level",      0,  0 },
+    { "repcodes",   0,  0 },
+    { "compMBps",   1,  1 },
+    { "ratio",      5, -1 },
+    { "p50Us",      2, -1 },
+    { "p99Us",      2, -1 },
+    { "p999Us",     2,  0 },
+    { "cpuMsPerMB", 3, -1 },
+};
+
+typedef struct {
+    double values[SWEEP_FIELDS];
+} sweepPoint_t;
+
+/* CPUs the benchmark may run on, and those of every NUMA node among them */
+static cpu_set_t g_allowedCpus;
+static cpu_set_t g_nodeCpus[MAX_NUMA_NODES];
+static int g_nbNodes = 0;
 
 static void initHistorgram(HistogramStat_t *historgram)
 {
@@ -173,12 +295,37 @@ static int usage(const char *exe)
     DISPLAY("Usage:\n");
     DISPLAY("      %s [arg] filename\n", exe);
     DISPLAY("Options:\n");
-    DISPLAY("    -t#       Set maximum threads [1 - 128] (default: 1)\n");
+    DISPLAY("    -t#       Set maximum threads [1 - 128] (default: 1), a list or range to sweep, e.g. 1-16 or 1,3,6\n");
     DISPLAY("    -l#       Set iteration loops [1 - 1000000](default: 1)\n");
-    DISPLAY("    -c#       Set chunk size (default: 32K)\n");
-    DISPLAY("    -E#       Auto/enable/disable searchForExternalRepcodes(0: auto; 1: enable; 2: disable; default: auto)\n");
-    DISPLAY("    -L#       Set compression level [1 - 12] (default: 1)\n");
+    DISPLAY("    -c#       Set chunk size (default: 32K), a list or range to sweep, e.g. 4K-128K\n");
+    DISPLAY("    -E#       Auto/enable/disable searchForExternalRepcodes(0: auto; 1: enable; 2: disable; default: auto), a list or range to sweep\n");
+    DISPLAY("    -L#       Set compression level [1 - 22] (default: 1), a list or range to sweep, e.g. 1-9\n");
     DISPLAY("    -m#       Benchmark mode, 0: software compression; 1:QAT compression(default: 1) \n");
+    DISPLAY("    -r        Enable long distance matching of QAT sequence producer, use with large chunk size\n");
+    DISPLAY("    -D file   Compress every chunk with the dictionary in file\n");
+    DISPLAY("    -T#       Adapt the level between 1 and -L to sustain # MB/s per thread, 0: disable (default: 0)\n");
+    DISPLAY("    -S#       Search literal runs of at least # bytes for matches on CPU, 0: disable (default: 0)\n");
+    DISPLAY("    -e#       Estimate the compression ratio with QAT from # KB of samples before benchmarking\n");
+    DISPLAY("    -O#       Sequence post-optimizer, 0: disable; 1: enable; 2: compare disabled and enabled (default: 0)\n");
+    DISPLAY("    -s        Streaming mode, compress the file with ZSTD_compressStream2, verified as it goes\n");
+    DISPLAY("    -I#[-#]   Input buffer size of streaming, random between the two sizes if a range (default: 128K)\n");
+    DISPLAY("    -o#       Output buffer size of streaming (default: ZSTD_CStreamOutSize)\n");
+    DISPLAY("    -f#       Flush policy of streaming, 0: one frame; 1: flush every input buffer; 2: a frame per input buffer (default: 0)\n");
+    DISPLAY("    -M        Map the file instead of reading it into memory, for files larger than memory use with -s\n");
+    DISPLAY("    -A#       Readahead advice of the mapped file, 0: normal; 1: sequential; 2: random; 3: willneed (default: 1)\n");
+    DISPLAY("    -B        Print the latency of the stages of the sequence producer and of zstd\n");
+    DISPLAY("    -Q        Print statistics of the sequences of QAT and of the software match finder of zstd\n");
+    DISPLAY("    -F spec   Run on the software engine, then again with the faults in spec injected, e.g.\n");
+    DISPLAY("              delay=exp:200,retry=1000,fail=100,stall=0:5000 (repeatable, see QZSTD_parseSwFaults)\n");
+    DISPLAY("    -q#       Open loop, issue # compressions of a chunk per second over all threads\n");
+    DISPLAY("    -a#       Arrivals of the open loop, 0: constant; 1: Poisson (default: 1)\n");
+    DISPLAY("    -d#       Duration of the open loop in seconds (default: 10)\n");
+    DISPLAY("    -W#       Drop the requests of the open loop not started # us after their arrival, 0: never (default: 0)\n");
+    DISPLAY("    -P        Pin every thread to its own CPU\n");
+    DISPLAY("    -N        Bind the threads to the NUMA nodes in turn\n");
+    DISPLAY("    -R file   Write the results of every point to file, as CSV if it ends with .csv, as JSON otherwise\n");
+    DISPLAY("    -G file   Compare the results with a baseline written by -R, exit with 1 on regressions\n");
+    DISPLAY("    -Z#       Tolerance of the baseline comparison, in percent (default: 5)\n");
     DISPLAY("    -h/H      Print this help message\n");
     return 0;
 }
@@ -219,6 +366,335 @@ static unsigned stringToU32(const char **s)
     return value;
 }
 
+/* Values below 2 * HDR_SUB_COUNT have their own bucket, above them every power
+ * of two is split into HDR_SUB_COUNT buckets */
+static int hdrIndex(size_t value)
+{
+    int shift;
+
+    if (value < 2 * HDR_SUB_COUNT) {
+        return (int)value;
+    }
+    shift = 63 - __builtin_clzll(value) - HDR_SUB_BITS;
+    return shift * HDR_SUB_COUNT + (int)(value >> shift);
+}
+
+/* Highest value of a bucket */
+static size_t hdrValue(int index)
+{
+    int shift;
+
+    if (index < 2 * HDR_SUB_COUNT) {
+        return (size_t)index;
+    }
+    shift = index / HDR_SUB_COUNT - 1;
+    return (((size_t)(index - shift * HDR_SUB_COUNT) + 1) << shift) - 1;
+}
+
+static void hdrAdd(HdrHistogram_t *histogram, size_t value)
+{
+    histogram->counts[hdrIndex(value)]++;
+    histogram->num++;
+    histogram->sum += value;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+/* hdrAdd for a histogram shared by threads */
+static void hdrAddShared(HdrHistogram_t *histogram, size_t value)
+{
+    size_t max = histogram->max;
+
+    __sync_fetch_and_add(&histogram->counts[hdrIndex(value)], 1);
+    __sync_fetch_and_add(&histogram->num, 1);
+    __sync_fetch_and_add(&histogram->sum, value);
+    while (value > max) {
+        max = __sync_val_compare_and_swap(&histogram->max, max, value);
+    }
+}
+
+static void hdrMerge(HdrHistogram_t *dst, const HdrHistogram_t *src)
+{
+    for (int index = 0; index < HDR_BUCKET_NUM; index++) {
+        dst->counts[index] += src->counts[index];
+    }
+    dst->num += src->num;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+static double hdrPercentile(const HdrHistogram_t *histogram, double p)
+{
+    double threshold = histogram->num * (p / 100.0);
+    size_t cumulative = 0;
+
+    for (int index = 0; index < HDR_BUCKET_NUM; index++) {
+        cumulative += histogram->counts[index];
+        if (cumulative && cumulative >= threshold) {
+            return (double)MIN(hdrValue(index), histogram->max);
+        }
+    }
+    return (double)histogram->max;
+}
+
+/* Parse a list of values, "#[-#][,#[-#]...]", a range steps by doubling if
+ * doubling is set, by one otherwise */
+static int stringToList(const char **s, sweepList_t *list, int doubling)
+{
+    unsigned first, last, value;
+
+    list->count = 0;
+    do {
+        if (list->count) {
+            (*s)++;
+        }
+        first = last = stringToU32(s);
+        if (**s == '-') {
+            (*s)++;
+            last = stringToU32(s);
+        }
+        if (last < first || (doubling && first == 0)) {
+            return 0;
+        }
+        for (value = first; value <= last; value = doubling ? value * 2 : value + 1) {
+            if (list->count >= MAX_SWEEP_VALUES) {
+                DISPLAY("Too many values, maximum is %d\n", MAX_SWEEP_VALUES);
+                return 0;
+            }
+            list->values[list->count++] = value;
+            if (value > ((unsigned)(-1)) / 2) {
+                break;
+            }
+        }
+    } while (**s == ',');
+    return 1;
+}
+
+/* Sequence producer time of the current ZSTD_compress2 call of a thread */
+static void stageTimesCallback(void *opaque, const QZSTD_StageTimes_T *times)
+{
+    unsigned long long *producerNanosec = (unsigned long long *)opaque;
+
+    hdrAddShared(&stageHistograms[0], times->grabNs);
+    hdrAddShared(&stageHistograms[1], times->submitNs);
+    hdrAddShared(&stageHistograms[2], times->waitNs);
+    hdrAddShared(&stageHistograms[3], times->decodeNs);
+    *producerNanosec += times->totalNs;
+}
+
+/* Long distance and dictionary matches are only searched in a frame started
+ * with its source and size */
+static void beginFrame(const threadArgs_t *threadArgs, void *matchState,
+                       const unsigned char *frameSrc, size_t frameSize)
+{
+    if (NULL == matchState || (!threadArgs->longDistance && !threadArgs->dictBuffer)) {
+        return;
+    }
+    QZSTD_setSeqProdParameter(matchState, QZSTD_p_longDistance, threadArgs->longDistance);
+    if (threadArgs->dictBuffer) {
+        QZSTD_refDict(matchState, threadArgs->dictBuffer, threadArgs->dictSize);
+    }
+    QZSTD_beginFrame(matchState, frameSrc, frameSize);
+}
+
+/* Decompress a piece of the stream and compare it with the source at *verifyPos */
+static int streamVerify(ZSTD_DCtx *zdc, const threadArgs_t *threadArgs,
+                        const unsigned char *cBuffer, size_t cSize,
+                        unsigned char *decompBuffer, size_t *verifyPos,
+                        size_t *decompNanosec)
+{
+    ZSTD_inBuffer input = { cBuffer, cSize, 0 };
+    ZSTD_outBuffer output;
+    struct timespec startTicks, endTicks;
+    size_t rc;
+
+    /* Calls without progress are an error of the decompressor */
+    if (cSize == 0) {
+        return 1;
+    }
+    do {
+        output.dst = decompBuffer;
+        output.size = ZSTD_DStreamOutSize();
+        output.pos = 0;
+        GETTIME(startTicks);
+        rc = ZSTD_decompressStream(zdc, &output, &input);
+        GETTIME(endTicks);
+        *decompNanosec += GETDIFFTIME(startTicks, endTicks);
+        if (ZSTD_isError(rc)) {
+            DISPLAY("Decompress failed: %s\n", ZSTD_getErrorName(rc));
+            return 0;
+        }
+        if (*verifyPos + output.pos > threadArgs->srcSize ||
+            memcmp(decompBuffer, threadArgs->srcBuffer + *verifyPos, output.pos)) {
+            return 0;
+        }
+        *verifyPos += output.pos;
+    } while (input.pos < input.size || output.pos == output.size);
+    return 1;
+}
+
+/* Compress the source with ZSTD_compressStream2 in input buffers of random sizes,
+ * every call is timed, the output is decompressed and compared as it's produced */
+static int benchStream(const threadArgs_t *threadArgs, ZSTD_CCtx *zc, ZSTD_DCtx *zdc,
+                       void *matchState, unsigned char *outBuffer,
+                       unsigned char *decompBuffer, size_t *cSize,
+                       size_t *compNanosec, size_t *compCpuNanosec,
+                       size_t *decompNanosec, unsigned long long *producerNanosec)
+{
+    struct timespec startTicks, endTicks, cpuStart, cpuEnd;
+    unsigned int seed = (unsigned int)(size_t)pthread_self();
+    size_t srcSize = threadArgs->srcSize;
+    size_t pos = 0, verifyPos = 0, remaining, nanosec, inSize;
+    ZSTD_EndDirective mode;
+    int newFrame = 1, finished;
+
+    ZSTD_CCtx_reset(zc, ZSTD_reset_session_only);
+    ZSTD_DCtx_reset(zdc, ZSTD_reset_session_only);
+    while (pos < srcSize) {
+        inSize = threadArgs->inBufferMin;
+        if (threadArgs->inBufferMax > threadArgs->inBufferMin) {
+            inSize += (size_t)rand_r(&seed) %
+                      (threadArgs->inBufferMax - threadArgs->inBufferMin + 1);
+        }
+        inSize = MIN(inSize, srcSize - pos);
+        if (pos + inSize == srcSize || threadArgs->flushPolicy == FLUSH_FRAME) {
+            mode = ZSTD_e_end;
+        } else if (threadArgs->flushPolicy == FLUSH_BUFFER) {
+            mode = ZSTD_e_flush;
+        } else {
+            mode = ZSTD_e_continue;
+        }
+        if (newFrame) {
+            /* A frame runs to the end of the input unless every buffer is a frame */
+            beginFrame(threadArgs, matchState, threadArgs->srcBuffer + pos,
+                       threadArgs->flushPolicy == FLUSH_FRAME ? inSize : srcSize - pos);
+            newFrame = 0;
+        }
+
+        ZSTD_inBuffer input = { threadArgs->srcBuffer + pos, inSize, 0 };
+        do {
+            ZSTD_outBuffer output = { outBuffer, threadArgs->outBufferSize, 0 };
+            *producerNanosec = 0;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuStart);
+            GETTIME(startTicks);
+            remaining = ZSTD_compressStream2(zc, &output, &input, mode);
+            GETTIME(endTicks);
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+            if (ZSTD_isError(remaining)) {
+                DISPLAY("Compress failed: %s\n", ZSTD_getErrorName(remaining));
+                return 0;
+            }
+            nanosec = GETDIFFTIME(startTicks, endTicks);
+            bucketAdd(&compHistogram, nanosec);
+            *compNanosec += nanosec;
+            *compCpuNanosec += GETDIFFTIME(cpuStart, cpuEnd);
+            if (threadArgs->stageTimes && matchState && *producerNanosec) {
+                hdrAddShared(&stageHistograms[4], nanosec > *producerNanosec ?
+                             nanosec - *producerNanosec : 0);
+            }
+            *cSize += output.pos;
+            if (!streamVerify(zdc, threadArgs, outBuffer, output.pos, decompBuffer,
+                              &verifyPos, decompNanosec)) {
+                DISPLAY("Decompressed data is not equal to source data\n");
+                return 0;
+            }
+            finished = mode == ZSTD_e_continue ? input.pos == input.size : remaining == 0;
+        } while (!finished);
+        newFrame = mode == ZSTD_e_end;
+        pos += inSize;
+    }
+    return verifyPos == srcSize;
+}
+
+/* Nanoseconds to the next arrival of the open loop, exponentially distributed
+ * for Poisson arrivals */
+static double nextArrival(const threadArgs_t *threadArgs, unsigned int *seed, double interval)
+{
+    if (threadArgs->poisson) {
+        return -log(1.0 - (double)rand_r(seed) / ((double)RAND_MAX + 1)) * interval;
+    }
+    return interval;
+}
+
+/* Issue a compression of the next chunk at every arrival, constant or Poisson,
+ * for threadArgs->duration seconds. The latency is measured from the arrival,
+ * which a closed loop would omit while the thread is busy, so queueing delay
+ * is part of the response time */
+static void openLoop(const threadArgs_t *threadArgs, ZSTD_CCtx *zc, void *matchState,
+                     unsigned char *destBuffer, size_t destSize)
+{
+    struct timespec startTicks, endTicks, now, wake;
+    HdrHistogram_t *response = (HdrHistogram_t *)calloc(1, sizeof(HdrHistogram_t));
+    HdrHistogram_t *service = (HdrHistogram_t *)calloc(1, sizeof(HdrHistogram_t));
+    size_t threadNb = __sync_fetch_and_add(&g_threadNum, 1);
+    unsigned int seed = (unsigned int)threadNb * 2654435761U + 1;
+    size_t nbChunks = (threadArgs->srcSize + threadArgs->chunkSize - 1) / threadArgs->chunkSize;
+    size_t chunk = threadNb % nbChunks, completed = 0, dropped = 0, failed = 0, bytes = 0;
+    /* Every thread takes an equal share of the rate */
+    double interval = (double)NANOSEC * threadArgs->nbThreads / threadArgs->targetRate;
+    double arrival = 0, elapsed;
+    size_t durationNanosec = (size_t)threadArgs->duration * NANOSEC, rc, srcSize;
+
+    if (!response || !service) {
+        DISPLAY("Fail to allocate open loop histograms\n");
+        goto exit;
+    }
+    GETTIME(startTicks);
+    /* Constant arrivals of the threads are spread over the first interval */
+    arrival = threadArgs->poisson ? nextArrival(threadArgs, &seed, interval) :
+              interval * threadNb / threadArgs->nbThreads;
+    for (; arrival < durationNanosec; arrival += nextArrival(threadArgs, &seed, interval)) {
+        wake.tv_sec = startTicks.tv_sec + (time_t)(arrival / NANOSEC);
+        wake.tv_nsec = startTicks.tv_nsec + (long)fmod(arrival, NANOSEC);
+        if (wake.tv_nsec >= (long)NANOSEC) {
+            wake.tv_sec++;
+            wake.tv_nsec -= NANOSEC;
+        }
+        GETTIME(now);
+        elapsed = (double)GETDIFFTIME(startTicks, now);
+        if (elapsed < arrival) {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+            GETTIME(now);
+        } else if (threadArgs->dropUs && elapsed - arrival > (double)threadArgs->dropUs * NANOUSEC) {
+            dropped++;
+            continue;
+        }
+
+        srcSize = MIN(threadArgs->chunkSize, threadArgs->srcSize - chunk * threadArgs->chunkSize);
+        beginFrame(threadArgs, matchState,
+                   threadArgs->srcBuffer + chunk * threadArgs->chunkSize, srcSize);
+        rc = ZSTD_compress2(zc, destBuffer, destSize,
+                            threadArgs->srcBuffer + chunk * threadArgs->chunkSize, srcSize);
+        GETTIME(endTicks);
+        if (ZSTD_isError(rc)) {
+            failed++;
+        } else {
+            completed++;
+            bytes += srcSize;
+            hdrAdd(response, GETDIFFTIME(wake, endTicks));
+            hdrAdd(service, GETDIFFTIME(now, endTicks));
+        }
+        chunk = (chunk + 1) % nbChunks;
+    }
+    GETTIME(endTicks);
+
+    pthread_mutex_lock(&g_resultMutex);
+    hdrMerge(&g_responseHdr, response);
+    hdrMerge(&g_serviceHdr, service);
+    g_openCompleted += completed;
+    g_openDropped += dropped;
+    g_openFailed += failed;
+    g_openBytes += bytes;
+    g_openElapsedNanosec = MAX(g_openElapsedNanosec, GETDIFFTIME(startTicks, endTicks));
+    pthread_mutex_unlock(&g_resultMutex);
+exit:
+    free(response);
+    free(service);
+}
+
 void *benchmark(void *args)
 {
     threadArgs_t *threadArgs = (threadArgs_t *)args;
@@ -228,10 +704,11 @@ void *benchmark(void *args)
     size_t *chunkSizes = NULL; /* The array of chunk size */
     size_t *compSizes = NULL; /* The array of compressed size */
     size_t nanosec = 0;
-    size_t compNanosecSum = 0, decompNanosecSum = 0;
+    size_t compNanosecSum = 0, decompNanosecSum = 0, compCpuNanosec = 0;
     double compSpeed = 0, decompSpeed = 0, ratio = 0;
     size_t csCount, nbChunk, destSize, cSize, dcSize;
-    struct timespec startTicks, endTicks;
+    struct timespec startTicks, endTicks, cpuStart, cpuEnd;
+    unsigned long long producerNanosec = 0;
     unsigned char *destBuffer = NULL, *decompBuffer = NULL;
     const unsigned char *srcBuffer = threadArgs->srcBuffer;
     size_t srcSize = threadArgs->srcSize;
@@ -240,28 +717,69 @@ void *benchmark(void *args)
     unsigned cLevel = threadArgs->cLevel;
     ZSTD_CCtx *const zc = ZSTD_createCCtx();
     ZSTD_DCtx *const zdc = ZSTD_createDCtx();
+    ZSTD_CDict *cdict = NULL;
+    ZSTD_DDict *ddict = NULL;
     void *matchState = NULL;
     int setUpStatus = 0, compressStatus = 0;
 
-    csCount = srcSize / chunkSize + (srcSize % chunkSize ? 1 : 0);
-    chunkSizes = (size_t *)malloc(csCount * sizeof(size_t));
-    compSizes = (size_t *)malloc(csCount * sizeof(size_t));
-    assert(chunkSizes && compSizes);
-    size_t tmpSize = srcSize;
-    for (nbChunk = 0; nbChunk < csCount; nbChunk++) {
-        chunkSizes[nbChunk] = MIN(tmpSize, chunkSize);
-        tmpSize -= chunkSizes[nbChunk];
-    }
+    /* Streaming only holds one output and one decompressed buffer in memory */
+    if (threadArgs->streaming) {
+        csCount = 0;
+        destSize = threadArgs->outBufferSize;
+        destBuffer = (unsigned char *)malloc(destSize);
+        decompBuffer = (unsigned char *)malloc(ZSTD_DStreamOutSize());
+    } else {
+        csCount = srcSize / chunkSize + (srcSize % chunkSize ? 1 : 0);
+        chunkSizes = (size_t *)malloc(csCount * sizeof(size_t));
+        compSizes = (size_t *)malloc(csCount * sizeof(size_t));
+        assert(chunkSizes && compSizes);
+        size_t tmpSize = srcSize;
+        for (nbChunk = 0; nbChunk < csCount; nbChunk++) {
+            chunkSizes[nbChunk] = MIN(tmpSize, chunkSize);
+            tmpSize -= chunkSizes[nbChunk];
+        }
 
-    destSize = ZSTD_compressBound(srcSize);
-    destBuffer = (unsigned char *)malloc(destSize);
-    decompBuffer = (unsigned char *)malloc(srcSize);
+        destSize = ZSTD_compressBound(srcSize);
+        destBuffer = (unsigned char *)malloc(destSize);
+        decompBuffer = (unsigned char *)malloc(srcSize);
+    }
     assert(destBuffer != NULL);
 
     if (threadArgs->benchMode == 1) {
         QZSTD_startQatDevice();
         matchState = QZSTD_createSeqProdState();
         ZSTD_registerSequenceProducer(zc, matchState, qatSequenceProducer);
+        if (threadArgs->postOptimize) {
+            QZSTD_setSeqProdParameter(matchState, QZSTD_p_postOptimize, 1);
+        }
+        if (threadArgs->literalSearch) {
+            QZSTD_setSeqProdParameter(matchState, QZSTD_p_literalSearch,
+                                      (int)threadArgs->literalSearch);
+        }
+        if (threadArgs->targetMBps) {
+            QZSTD_AdaptiveParams_T adaptParams;
+            memset(&adaptParams, 0, sizeof(adaptParams));
+            adaptParams.minLevel = 1;
+            adaptParams.maxLevel = (int)cLevel;
+            adaptParams.targetMBps = threadArgs->targetMBps;
+            if (QZSTD_OK != QZSTD_setAdaptiveLevel(matchState, &adaptParams)) {
+                DISPLAY("Fail to enable adaptive level\n");
+                goto setupend;
+            }
+        }
+        if (threadArgs->stageTimes) {
+            QZSTD_setStageTimesCallback(matchState, stageTimesCallback, &producerNanosec);
+        }
+        if (threadArgs->sequenceStats) {
+            QZSTD_setSeqProdParameter(matchState, QZSTD_p_sequenceStats, 1);
+        }
+        if (threadArgs->fallback) {
+            rc = ZSTD_CCtx_setParameter(zc, ZSTD_c_enableSeqProducerFallback, 1);
+            if (ZSTD_isError(rc)) {
+                DISPLAY("Fail to set parameter ZSTD_c_enableSeqProducerFallback\n");
+                goto setupend;
+            }
+        }
     } else {
         ZSTD_registerSequenceProducer(zc, NULL, NULL);
     }
@@ -286,6 +804,17 @@ void *benchmark(void *args)
         goto setupend;
     }
 
+    if (threadArgs->dictBuffer) {
+        cdict = ZSTD_createCDict(threadArgs->dictBuffer, threadArgs->dictSize, cLevel);
+        ddict = ZSTD_createDDict(threadArgs->dictBuffer, threadArgs->dictSize);
+        if (!cdict || !ddict ||
+            ZSTD_isError(ZSTD_CCtx_refCDict(zc, cdict)) ||
+            ZSTD_isError(ZSTD_DCtx_refDDict(zdc, ddict))) {
+            DISPLAY("Fail to load dictionary\n");
+            goto setupend;
+        }
+    }
+
     setUpStatus = 1;
 
 setupend:
@@ -296,12 +825,39 @@ setupend:
         goto compressend;
     }
 
+    /* Start open loop, the requests are not verified */
+    if (threadArgs->targetRate) {
+        openLoop(threadArgs, zc, matchState, destBuffer, destSize);
+        compressStatus = 1;
+        goto compressend;
+    }
+
+    /* Start streaming benchmark, decompressed along with the compression */
+    if (threadArgs->streaming) {
+        cSize = 0;
+        for (loops = 0; loops < nbIterations; loops++) {
+            if (!benchStream(threadArgs, zc, zdc, matchState, destBuffer, decompBuffer,
+                             &cSize, &compNanosecSum, &compCpuNanosec,
+                             &decompNanosecSum, &producerNanosec)) {
+                goto compressend;
+            }
+        }
+        cSize /= nbIterations;
+        verifyResult = 1;
+        compressStatus = 1;
+        goto compressend;
+    }
+
     /* Start compression benchmark */
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuStart);
     for (loops = 0; loops < nbIterations; loops++) {
         unsigned char *tmpDestBuffer = destBuffer;
         const unsigned char *tmpSrcBuffer = srcBuffer;
         size_t tmpDestSize = destSize;
         for (nbChunk = 0; nbChunk < csCount; nbChunk++) {
+            /* Every chunk is a new frame */
+            beginFrame(threadArgs, matchState, tmpSrcBuffer, chunkSizes[nbChunk]);
+            producerNanosec = 0;
             GETTIME(startTicks);
             cSize = ZSTD_compress2(zc, tmpDestBuffer, tmpDestSize, tmpSrcBuffer,
                                    chunkSizes[nbChunk]);
@@ -317,8 +873,15 @@ setupend:
             nanosec = GETDIFFTIME(startTicks, endTicks);
             bucketAdd(&compHistogram, nanosec);
             compNanosecSum += nanosec;
+            if (threadArgs->stageTimes && matchState) {
+                /* The rest of the call is zstd's own work, mostly entropy coding */
+                hdrAddShared(&stageHistograms[4], nanosec > producerNanosec ?
+                             nanosec - producerNanosec : 0);
+            }
         }
     }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuEnd);
+    compCpuNanosec = GETDIFFTIME(cpuStart, cpuEnd);
 
     cSize = 0;
     for (nbChunk = 0; nbChunk < csCount; nbChunk++) {
@@ -326,7 +889,7 @@ setupend:
     }
 
     /* Verify the compression result */
-    rc = ZSTD_decompress(decompBuffer, srcSize, destBuffer, cSize);
+    rc = ZSTD_decompressDCtx(zdc, decompBuffer, srcSize, destBuffer, cSize);
     if (rc != srcSize) {
         DISPLAY("Decompressed size is not equal to source size\n");
         goto compressend;
@@ -346,6 +909,12 @@ compressend:
     if (!setUpStatus || !compressStatus) {
         goto exit;
     }
+    if (threadArgs->targetRate) {
+        goto exit;
+    }
+    if (threadArgs->streaming) {
+        goto report;
+    }
     /* Start decompression benchmark */
     for (loops = 0; loops < nbIterations; loops++) {
         unsigned char *tmpDestBuffer = decompBuffer;
@@ -368,6 +937,7 @@ compressend:
         }
     }
 
+report:
     /*Get current thread num */
     threadNum = __sync_add_and_fetch(&g_threadNum, 1);
 
@@ -380,9 +950,21 @@ compressend:
             threadNum, srcSize, cSize, (double) compSpeed / MB, (double) decompSpeed / MB,
             ratio * 100,
             verifyResult ? "PASS" : "FAIL");
+    if (threadArgs->benchMode == 1 && threadArgs->targetMBps) {
+        DISPLAY("Thread %lu: Adaptive level: %d\n", threadNum,
+                QZSTD_getAdaptiveLevel(matchState));
+    }
+    pthread_mutex_lock(&g_resultMutex);
+    g_totalCSize += cSize;
+    g_totalCompSpeed += compSpeed;
+    g_totalCompCpuNanosec += compCpuNanosec;
+    g_totalCompNanosec += compNanosecSum;
+    pthread_mutex_unlock(&g_resultMutex);
 exit:
     ZSTD_freeCCtx(zc);
     ZSTD_freeDCtx(zdc);
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeDDict(ddict);
     if (threadArgs->benchMode == 1 && matchState) {
         QZSTD_freeSeqProdState(matchState);
     }
@@ -401,15 +983,420 @@ exit:
     return NULL;
 }
 
+/* Run the benchmark threads once, the latency histogram and the totals are reset */
+/* Parse a cpulist of sysfs, such as "0-3,8-11" */
+static void parseCpuList(const char *list, cpu_set_t *set)
+{
+    const char *s = list;
+    unsigned first, last, cpu;
+
+    CPU_ZERO(set);
+    while (*s >= '0' && *s <= '9') {
+        first = last = stringToU32(&s);
+        if (*s == '-') {
+            s++;
+            last = stringToU32(&s);
+        }
+        for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*s != ',') {
+            break;
+        }
+        s++;
+    }
+}
+
+/* Read the CPUs allowed and the NUMA nodes they belong to */
+static void initCpuTopology(void)
+{
+    char path[64], line[4096];
+    FILE *file;
+    int node;
+
+    CPU_ZERO(&g_allowedCpus);
+    if (sched_getaffinity(0, sizeof(g_allowedCpus), &g_allowedCpus)) {
+        DISPLAY("Cannot get CPU affinity\n");
+    }
+    g_nbNodes = 0;
+    for (node = 0; node < MAX_NUMA_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        file = fopen(path, "r");
+        if (!file) {
+            continue;
+        }
+        if (fgets(line, sizeof(line), file)) {
+            parseCpuList(line, &g_nodeCpus[g_nbNodes]);
+            CPU_AND(&g_nodeCpus[g_nbNodes], &g_nodeCpus[g_nbNodes], &g_allowedCpus);
+            if (CPU_COUNT(&g_nodeCpus[g_nbNodes])) {
+                g_nbNodes++;
+            }
+        }
+        fclose(file);
+    }
+    /* Without NUMA information all the CPUs are one node */
+    if (g_nbNodes == 0) {
+        g_nodeCpus[0] = g_allowedCpus;
+        g_nbNodes = 1;
+    }
+}
+
+/* Set cpu to the index-th CPU of set, modulo the CPUs in the set */
+static void pickCpu(const cpu_set_t *set, int index, cpu_set_t *cpu)
+{
+    int count = CPU_COUNT(set), i, nb = 0;
+
+    CPU_ZERO(cpu);
+    if (count == 0) {
+        return;
+    }
+    index %= count;
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, set) && nb++ == index) {
+            CPU_SET(i, cpu);
+            return;
+        }
+    }
+}
+
+/* CPUs of a thread: threads go to the NUMA nodes in turn with bindNuma,
+ * and each one to its own CPU with pinThreads */
+static int threadCpus(const threadArgs_t *threadArgs, int threadNb, cpu_set_t *cpus)
+{
+    const cpu_set_t *set = &g_allowedCpus;
+    int index = threadNb;
+
+    if (threadArgs->bindNuma) {
+        set = &g_nodeCpus[threadNb % g_nbNodes];
+        index = threadNb / g_nbNodes;
+    }
+    if (threadArgs->pinThreads) {
+        pickCpu(set, index, cpus);
+    } else {
+        *cpus = *set;
+    }
+    return CPU_COUNT(cpus) != 0;
+}
+
+static void runThreads(threadArgs_t *threadArgs, int nbThreads, pthread_t *threads)
+{
+    int threadNb;
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+
+    initHistorgram(&compHistogram);
+    memset(stageHistograms, 0, sizeof(stageHistograms));
+    threadArgs->nbThreads = nbThreads;
+    g_threadNum = 0;
+    g_totalCSize = 0;
+    g_totalCompSpeed = 0;
+    g_totalCompCpuNanosec = 0;
+    g_totalCompNanosec = 0;
+
+    pthread_barrier_init(&g_threadBarrier1, NULL, nbThreads);
+    pthread_barrier_init(&g_threadBarrier2, NULL, nbThreads);
+    for (threadNb = 0; threadNb < nbThreads; threadNb++) {
+        /* Threads start on their CPUs, so their buffers are first touched on their node */
+        pthread_attr_init(&attr);
+        if ((threadArgs->pinThreads || threadArgs->bindNuma) &&
+            threadCpus(threadArgs, threadNb, &cpus)) {
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+        pthread_create(&threads[threadNb], &attr, benchmark, threadArgs);
+        pthread_attr_destroy(&attr);
+    }
+
+    for (threadNb = 0; threadNb < nbThreads; threadNb++) {
+        pthread_join(threads[threadNb], NULL);
+    }
+    pthread_barrier_destroy(&g_threadBarrier1);
+    pthread_barrier_destroy(&g_threadBarrier2);
+}
+
+/* Relative change in percent, 0 if there is no reference */
+static double changePercent(double reference, double value)
+{
+    return reference > 0 ? (value - reference) * 100 / reference : 0;
+}
+
+/* Sequences of the software match finder of zstd on the same chunks, the
+ * reference of the sequence statistics of QAT */
+static int softwareSeqStats(const threadArgs_t *threadArgs, QZSTD_SeqStats_T *seqStats)
+{
+    size_t seqsCapacity = ZSTD_sequenceBound(threadArgs->chunkSize);
+    ZSTD_Sequence *seqs = (ZSTD_Sequence *)malloc(seqsCapacity * sizeof(ZSTD_Sequence));
+    ZSTD_CCtx *zc = ZSTD_createCCtx();
+    size_t pos, len, nbSeqs;
+    int rc = -1;
+
+    assert(seqs != NULL && zc != NULL);
+    memset(seqStats, 0, sizeof(QZSTD_SeqStats_T));
+    ZSTD_CCtx_setParameter(zc, ZSTD_c_compressionLevel, (int)threadArgs->cLevel);
+    for (pos = 0; pos < threadArgs->srcSize; pos += len) {
+        len = MIN(threadArgs->srcSize - pos, threadArgs->chunkSize);
+        nbSeqs = ZSTD_generateSequences(zc, seqs, seqsCapacity,
+                                        threadArgs->srcBuffer + pos, len);
+        if (ZSTD_isError(nbSeqs)) {
+            DISPLAY("Fail to generate sequences: %s\n", ZSTD_getErrorName(nbSeqs));
+            goto exit;
+        }
+        QZSTD_addSeqStats(seqStats, seqs, nbSeqs);
+    }
+    rc = 0;
+
+exit:
+    ZSTD_freeCCtx(zc);
+    free(seqs);
+    return rc;
+}
+
+static void displaySeqHist(const char *name, const size_t *qatHist, size_t qatNum,
+                           const size_t *swHist, size_t swNum)
+{
+    int b;
+    for (b = 0; b < QZSTD_SEQ_STATS_BUCKETS; b++) {
+        if (qatHist[b] || swHist[b]) {
+            DISPLAY("  %-12s [%6lu, %6lu]: %8.2f%% %8.2f%%\n", name, 1UL << b,
+                    (2UL << b) - 1,
+                    qatNum ? 100.0 * qatHist[b] / qatNum : 0,
+                    swNum ? 100.0 * swHist[b] / swNum : 0);
+        }
+    }
+}
+
+/* Sequence statistics of QAT between start and end, next to those of zstd.
+ * Histograms are in percent of the matches. */
+static void displaySeqStats(const QZSTD_SeqStats_T *start, const QZSTD_SeqStats_T *end,
+                            const QZSTD_SeqStats_T *sw)
+{
+    QZSTD_SeqStats_T qat;
+    size_t qatBytes, swBytes;
+    int b;
+
+    qat.blocks = end->blocks - start->blocks;
+    qat.sequences = end->sequences - start->sequences;
+    qat.literalBytes = end->literalBytes - start->literalBytes;
+    qat.matchBytes = end->matchBytes - start->matchBytes;
+    qat.matches3 = end->matches3 - start->matches3;
+    for (b = 0; b < QZSTD_SEQ_STATS_BUCKETS; b++) {
+        qat.matchLengthHist[b] = end->matchLengthHist[b] - start->matchLengthHist[b];
+        qat.offsetHist[b] = end->offsetHist[b] - start->offsetHist[b];
+    }
+    qatBytes = qat.literalBytes + qat.matchBytes;
+    swBytes = sw->literalBytes + sw->matchBytes;
+
+    DISPLAY("Sequence statistics:                  QAT      zstd\n");
+    DISPLAY("  Sequences per KB:            %9.2f %9.2f\n",
+            qatBytes ? 1024.0 * qat.sequences / qatBytes : 0,
+            swBytes ? 1024.0 * sw->sequences / swBytes : 0);
+    DISPLAY("  Literals:                    %8.2f%% %8.2f%%\n",
+            qatBytes ? 100.0 * qat.literalBytes / qatBytes : 0,
+            swBytes ? 100.0 * sw->literalBytes / swBytes : 0);
+    DISPLAY("  3-byte matches:              %8.2f%% %8.2f%%\n",
+            qat.sequences ? 100.0 * qat.matches3 / qat.sequences : 0,
+            sw->sequences ? 100.0 * sw->matches3 / sw->sequences : 0);
+    DISPLAY("  Average match length:        %9.2f %9.2f\n",
+            qat.sequences ? (double)qat.matchBytes / qat.sequences : 0,
+            sw->sequences ? (double)sw->matchBytes / sw->sequences : 0);
+    displaySeqHist("Match length", qat.matchLengthHist, qat.sequences,
+                   sw->matchLengthHist, sw->sequences);
+    displaySeqHist("Offset", qat.offsetHist, qat.sequences,
+                   sw->offsetHist, sw->sequences);
+}
+
+/* Run the benchmark at one point of the sweep and collect its results */
+static void sweepRun(threadArgs_t *threadArgs, int nbThreads, pthread_t *threads,
+                     sweepPoint_t *point)
+{
+    double *v = point->values;
+    double totalMB = (double)threadArgs->srcSize * nbThreads * threadArgs->nbIterations / MB;
+
+    runThreads(threadArgs, nbThreads, threads);
+    v[SWEEP_THREADS] = nbThreads;
+    v[SWEEP_CHUNK] = threadArgs->chunkSize;
+    v[SWEEP_LEVEL] = threadArgs->cLevel;
+    v[SWEEP_REPCODES] = threadArgs->searchForExternalRepcodes;
+    v[SWEEP_COMP_MBPS] = g_totalCompSpeed / MB;
+    v[SWEEP_RATIO] = (double)g_totalCSize / ((double)threadArgs->srcSize * nbThreads);
+    v[SWEEP_P50] = compHistogram.num ? percentile(&compHistogram, 50) / NANOUSEC : 0;
+    v[SWEEP_P99] = compHistogram.num ? percentile(&compHistogram, 99) / NANOUSEC : 0;
+    v[SWEEP_P999] = compHistogram.num ? percentile(&compHistogram, 99.9) / NANOUSEC : 0;
+    v[SWEEP_CPU] = (double)g_totalCompCpuNanosec / 1000000 / totalMB;
+    DISPLAY("Sweep: threads %d, chunk %lu, level %u, repcodes %d: Comp: %5.f MB/s, Ratio: %2.2f%%, P50: %4.2f us, P99: %4.2f us, P99.9: %4.2f us, CPU: %4.2f ms/MB\n",
+            nbThreads, threadArgs->chunkSize, threadArgs->cLevel,
+            threadArgs->searchForExternalRepcodes, v[SWEEP_COMP_MBPS],
+            v[SWEEP_RATIO] * 100, v[SWEEP_P50], v[SWEEP_P99], v[SWEEP_P999], v[SWEEP_CPU]);
+}
+
+/* Write the points as CSV if the file name ends with .csv, as JSON otherwise,
+ * one point per line in both */
+static int sweepWrite(const char *fileName, const sweepPoint_t *points, int nbPoints)
+{
+    size_t len = strlen(fileName);
+    int csv = len >= 4 && !strcmp(fileName + len - 4, ".csv");
+    FILE *file = fopen(fileName, "w");
+    int point, field;
+
+    if (!file) {
+        DISPLAY("Cannot open result file: %s\n", fileName);
+        return 0;
+    }
+    if (csv) {
+        for (field = 0; field < SWEEP_FIELDS; field++) {
+            fprintf(file, "%s%s", field ? "," : "", sweepFields[field].name);
+        }
+        fprintf(file, "\n");
+    } else {
+        fprintf(file, "[\n");
+    }
+    for (point = 0; point < nbPoints; point++) {
+        fprintf(file, csv ? "" : "  {");
+        for (field = 0; field < SWEEP_FIELDS; field++) {
+            if (!csv) {
+                fprintf(file, "%s\"%s\": ", field ? ", " : "", sweepFields[field].name);
+            } else if (field) {
+                fprintf(file, ",");
+            }
+            fprintf(file, "%.*f", sweepFields[field].precision, points[point].values[field]);
+        }
+        fprintf(file, csv ? "\n" : (point + 1 < nbPoints ? "},\n" : "}\n"));
+    }
+    if (!csv) {
+        fprintf(file, "]\n");
+    }
+    fclose(file);
+    return 1;
+}
+
+/* Read the points written by sweepWrite, in either format */
+static int sweepRead(const char *fileName, sweepPoint_t *points, int maxPoints)
+{
+    FILE *file = fopen(fileName, "r");
+    char line[1024], key[64];
+    int columns[SWEEP_FIELDS];
+    int nbPoints = 0, header = 0, field, column;
+    const char *s, *found;
+
+    if (!file) {
+        DISPLAY("Cannot open baseline file: %s\n", fileName);
+        return -1;
+    }
+    while (nbPoints < maxPoints && fgets(line, sizeof(line), file)) {
+        double *v = points[nbPoints].values;
+        if (strchr(line, '{')) {
+            for (field = 0; field < SWEEP_FIELDS; field++) {
+                snprintf(key, sizeof(key), "\"%s\":", sweepFields[field].name);
+                found = strstr(line, key);
+                v[field] = found ? strtod(found + strlen(key), NULL) : 0;
+            }
+            nbPoints++;
+        } else if (!header && strchr(line, ',')) {
+            /* Map the columns of the CSV header to the fields */
+            for (field = 0; field < SWEEP_FIELDS; field++) {
+                columns[field] = -1;
+                for (s = line, column = 0; s; s = strchr(s, ','), column++) {
+                    size_t len = strlen(sweepFields[field].name);
+                    s += (*s == ',');
+                    if (!strncmp(s, sweepFields[field].name, len) &&
+                        (s[len] == ',' || s[len] == '\n' || s[len] == '\r' || s[len] == 0)) {
+                        columns[field] = column;
+                    }
+                }
+            }
+            header = 1;
+        } else if (header && strchr(line, ',')) {
+            for (field = 0; field < SWEEP_FIELDS; field++) {
+                v[field] = 0;
+                for (s = line, column = 0; s && columns[field] >= 0; s = strchr(s, ','), column++) {
+                    s += (*s == ',');
+                    if (column == columns[field]) {
+                        v[field] = strtod(s, NULL);
+                        break;
+                    }
+                }
+            }
+            nbPoints++;
+        }
+    }
+    fclose(file);
+    return nbPoints;
+}
+
+/* Compare the points with the baseline, a change for the worse beyond
+ * tolerance percent of a gated field is a regression */
+static int sweepCompare(const sweepPoint_t *points, int nbPoints,
+                        const sweepPoint_t *baseline, int nbBaseline, double tolerance)
+{
+    int point, base, field, regressions = 0;
+    double change;
+
+    DISPLAY("-----------------------------------------------------------\n");
+    for (point = 0; point < nbPoints; point++) {
+        const double *v = points[point].values;
+        const double *b = NULL;
+        for (base = 0; base < nbBaseline && !b; base++) {
+            b = baseline[base].values;
+            for (field = 0; field < SWEEP_KEYS; field++) {
+                if (v[field] != b[field]) {
+                    b = NULL;
+                    break;
+                }
+            }
+        }
+        if (!b) {
+            DISPLAY("Not in baseline: threads %.0f, chunk %.0f, level %.0f, repcodes %.0f\n",
+                    v[SWEEP_THREADS], v[SWEEP_CHUNK], v[SWEEP_LEVEL], v[SWEEP_REPCODES]);
+            continue;
+        }
+        for (field = SWEEP_KEYS; field < SWEEP_FIELDS; field++) {
+            if (!sweepFields[field].better || b[field] == 0) {
+                continue;
+            }
+            change = changePercent(b[field], v[field]);
+            if (change * sweepFields[field].better < -tolerance) {
+                DISPLAY("Regression: threads %.0f, chunk %.0f, level %.0f, repcodes %.0f: %s: %.*f -> %.*f (%+.1f%%)\n",
+                        v[SWEEP_THREADS], v[SWEEP_CHUNK], v[SWEEP_LEVEL], v[SWEEP_REPCODES],
+                        sweepFields[field].name, sweepFields[field].precision, b[field],
+                        sweepFields[field].precision, v[field], change);
+                regressions++;
+            }
+        }
+    }
+    DISPLAY("Baseline comparison: %d points, %d regressions beyond %.1f%%\n",
+            nbPoints, regressions, tolerance);
+    return regressions;
+}
+
 int main(int argc, const char **argv)
 {
-    int argNb, threadNb;
+    int argNb;
     int nbThreads = 1;
-    pthread_t threads[2048];
+    pthread_t threads[MAX_THREADS];
+    int postOptMode = 0, pass;
+    size_t estimateBudget = 0;
+    const char *faultSpecs[MAX_FAULT_PROFILES];
+    QZSTD_SwFaultParams_T faultProfiles[MAX_FAULT_PROFILES];
+    int nbFaultProfiles = 0, profile;
+    double basePercentiles[3] = {0}, baseSpeed = 0;
+    double passRatio[2] = {0}, passSpeed[2] = {0};
+    QZSTD_Stats_T statsStart, statsEnd;
+    size_t passSeqsIn[2] = {0}, passSeqsOut[2] = {0};
     size_t srcSize, bytesRead;
     unsigned char *srcBuffer = NULL;
     const char *fileName = NULL;
+    const char *dictFileName = NULL;
+    unsigned char *dictBuffer = NULL;
     int inputFile = -1;
+    int mapInput = 0, advice = 1;
+    sweepList_t threadList = { { 1 }, 1 };
+    sweepList_t chunkList = { { DEFAULT_CHUNK_SIZE }, 1 };
+    sweepList_t levelList = { { 1 }, 1 };
+    sweepList_t repcodeList = { { ZSTD_AUTO }, 1 };
+    const char *resultFileName = NULL, *baselineFileName = NULL;
+    double tolerance = DEFAULT_TOLERANCE;
+    sweepPoint_t *points = NULL, *baseline = NULL;
+    int nbPoints = 0, nbBaseline = 0, status = 0, index;
+    int threadIdx, chunkIdx, levelIdx, repcodeIdx;
     threadArgs_t threadArgs;
 
     if (argc < 2)
@@ -421,6 +1408,25 @@ int main(int argc, const char **argv)
     threadArgs.cLevel = 1;
     threadArgs.benchMode = 1;
     threadArgs.searchForExternalRepcodes = ZSTD_AUTO;
+    threadArgs.postOptimize = 0;
+    threadArgs.literalSearch = 0;
+    threadArgs.longDistance = 0;
+    threadArgs.targetMBps = 0;
+    threadArgs.fallback = 0;
+    threadArgs.stageTimes = 0;
+    threadArgs.sequenceStats = 0;
+    threadArgs.streaming = 0;
+    threadArgs.inBufferMin = threadArgs.inBufferMax = ZSTD_BLOCKSIZE_MAX;
+    threadArgs.outBufferSize = ZSTD_CStreamOutSize();
+    threadArgs.flushPolicy = FLUSH_CONTINUE;
+    threadArgs.pinThreads = 0;
+    threadArgs.bindNuma = 0;
+    threadArgs.targetRate = 0;
+    threadArgs.poisson = 1;
+    threadArgs.duration = DEFAULT_DURATION;
+    threadArgs.dropUs = 0;
+    threadArgs.dictBuffer = NULL;
+    threadArgs.dictSize = 0;
 
     for (argNb = 1; argNb < argc; argNb++) {
         const char *arg = argv[argNb];
@@ -435,16 +1441,22 @@ int main(int argc, const char **argv)
                 /* Set maximum threads */
                 case 't':
                     arg++;
-                    nbThreads = stringToU32(&arg);
-                    if (nbThreads > 2048) {
-                        DISPLAY("Invalid thread parameter, maximum is 2048\n");
-                        return -1;
+                    if (!stringToList(&arg, &threadList, 1)) {
+                        return usage(argv[0]);
+                    }
+                    for (index = 0; index < threadList.count; index++) {
+                        if (threadList.values[index] > MAX_THREADS) {
+                            DISPLAY("Invalid thread parameter, maximum is %d\n", MAX_THREADS);
+                            return -1;
+                        }
                     }
                     break;
                 /* Set chunk size */
                 case 'c':
                     arg++;
-                    threadArgs.chunkSize = stringToU32(&arg);
+                    if (!stringToList(&arg, &chunkList, 1)) {
+                        return usage(argv[0]);
+                    }
                     break;
                 /* Set iterations */
                 case 'l':
@@ -459,18 +1471,190 @@ int main(int argc, const char **argv)
                 /* Set searchForExternalRepcodes */
                 case 'E':
                     arg++;
-                    threadArgs.searchForExternalRepcodes = stringToU32(&arg);
-                    if (threadArgs.searchForExternalRepcodes != ZSTD_AUTO &&
-                        threadArgs.searchForExternalRepcodes != ZSTD_ENABLED &&
-                        threadArgs.searchForExternalRepcodes != ZSTD_DISABLED) {
-                        DISPLAY("Invalid searchForExternalRepcodes parameter\n");
+                    if (!stringToList(&arg, &repcodeList, 0)) {
+                        return usage(argv[0]);
+                    }
+                    for (index = 0; index < repcodeList.count; index++) {
+                        if (repcodeList.values[index] > ZSTD_DISABLED) {
+                            DISPLAY("Invalid searchForExternalRepcodes parameter\n");
+                            return usage(argv[0]);
+                        }
+                    }
+                    break;
+                /* Enable long distance matching */
+                case 'r':
+                    arg++;
+                    threadArgs.longDistance = 1;
+                    break;
+                /* Set dictionary file */
+                case 'D':
+                    if (arg[1] != 0 || argNb + 1 >= argc) {
+                        return usage(argv[0]);
+                    }
+                    dictFileName = argv[++argNb];
+                    arg++;
+                    break;
+                /* Time the stages of the sequence producer */
+                case 'B':
+                    arg++;
+                    threadArgs.stageTimes = 1;
+                    break;
+                /* Print statistics of the sequences */
+                case 'Q':
+                    arg++;
+                    threadArgs.sequenceStats = 1;
+                    break;
+                /* Add a fault profile of the software engine */
+                case 'F':
+                    if (arg[1] != 0 || argNb + 1 >= argc ||
+                        nbFaultProfiles >= MAX_FAULT_PROFILES) {
+                        return usage(argv[0]);
+                    }
+                    faultSpecs[nbFaultProfiles] = argv[++argNb];
+                    if (QZSTD_OK != QZSTD_parseSwFaults(faultSpecs[nbFaultProfiles],
+                                                        &faultProfiles[nbFaultProfiles])) {
+                        DISPLAY("Invalid fault profile: %s\n", faultSpecs[nbFaultProfiles]);
+                        return usage(argv[0]);
+                    }
+                    nbFaultProfiles++;
+                    arg++;
+                    break;
+                /* Compress with the streaming API */
+                case 's':
+                    arg++;
+                    threadArgs.streaming = 1;
+                    break;
+                /* Set input buffer size of streaming, or a range of sizes */
+                case 'I':
+                    arg++;
+                    threadArgs.inBufferMin = threadArgs.inBufferMax = stringToU32(&arg);
+                    if (arg[0] == '-') {
+                        arg++;
+                        threadArgs.inBufferMax = stringToU32(&arg);
+                    }
+                    if (threadArgs.inBufferMin == 0 ||
+                        threadArgs.inBufferMax < threadArgs.inBufferMin) {
+                        DISPLAY("Invalid input buffer size\n");
+                        return usage(argv[0]);
+                    }
+                    break;
+                /* Set output buffer size of streaming */
+                case 'o':
+                    arg++;
+                    threadArgs.outBufferSize = stringToU32(&arg);
+                    if (threadArgs.outBufferSize == 0) {
+                        DISPLAY("Invalid output buffer size\n");
+                        return usage(argv[0]);
+                    }
+                    break;
+                /* Set flush policy of streaming */
+                case 'f':
+                    arg++;
+                    threadArgs.flushPolicy = stringToU32(&arg);
+                    if (threadArgs.flushPolicy > FLUSH_FRAME) {
+                        DISPLAY("Invalid flush policy\n");
+                        return usage(argv[0]);
+                    }
+                    break;
+                /* Map the input file */
+                case 'M':
+                    arg++;
+                    mapInput = 1;
+                    break;
+                /* Set readahead advice of the mapped file */
+                case 'A':
+                    arg++;
+                    advice = stringToU32(&arg);
+                    if (advice > 3) {
+                        DISPLAY("Invalid readahead advice\n");
+                        return usage(argv[0]);
+                    }
+                    break;
+                /* Set target of adaptive level */
+                case 'T':
+                    arg++;
+                    threadArgs.targetMBps = stringToU32(&arg);
+                    break;
+                /* Set literal search threshold */
+                case 'S':
+                    arg++;
+                    threadArgs.literalSearch = stringToU32(&arg);
+                    break;
+                /* Set budget of ratio estimation */
+                case 'e':
+                    arg++;
+                    estimateBudget = (size_t)stringToU32(&arg) * 1024;
+                    break;
+                /* Set sequence post-optimizer */
+                case 'O':
+                    arg++;
+                    postOptMode = stringToU32(&arg);
+                    if (postOptMode > 2) {
+                        DISPLAY("Invalid post-optimizer parameter\n");
                         return usage(argv[0]);
                     }
                     break;
                 /* Set compression level */
                 case 'L':
                     arg++;
-                    threadArgs.cLevel = stringToU32(&arg);
+                    if (!stringToList(&arg, &levelList, 0)) {
+                        return usage(argv[0]);
+                    }
+                    break;
+                /* Set request rate of the open loop */
+                case 'q':
+                    arg++;
+                    threadArgs.targetRate = stringToU32(&arg);
+                    break;
+                /* Set arrivals of the open loop */
+                case 'a':
+                    arg++;
+                    threadArgs.poisson = (char)stringToU32(&arg);
+                    if (threadArgs.poisson > 1) {
+                        DISPLAY("Invalid arrival parameter\n");
+                        return usage(argv[0]);
+                    }
+                    break;
+                /* Set duration of the open loop */
+                case 'd':
+                    arg++;
+                    threadArgs.duration = stringToU32(&arg);
+                    break;
+                /* Set drop deadline of the open loop */
+                case 'W':
+                    arg++;
+                    threadArgs.dropUs = stringToU32(&arg);
+                    break;
+                /* Pin every thread to a CPU */
+                case 'P':
+                    arg++;
+                    threadArgs.pinThreads = 1;
+                    break;
+                /* Bind the threads to the NUMA nodes in turn */
+                case 'N':
+                    arg++;
+                    threadArgs.bindNuma = 1;
+                    break;
+                /* Set result file of the sweep */
+                case 'R':
+                    if (arg[1] != 0 || argNb + 1 >= argc) {
+                        return usage(argv[0]);
+                    }
+                    resultFileName = argv[++argNb];
+                    arg++;
+                    break;
+                /* Set baseline file of the sweep */
+                case 'G':
+                    if (arg[1] != 0 || argNb + 1 >= argc) {
+                        return usage(argv[0]);
+                    }
+                    baselineFileName = argv[++argNb];
+                    arg++;
+                    break;
+                /* Set tolerance of the baseline comparison */
+                case 'Z':
+                    arg++;
+                    tolerance = stringToU32(&arg);
                     break;
                 /* Unknown argument */
                 default :
@@ -487,6 +1671,13 @@ int main(int argc, const char **argv)
     if (!fileName) {
         return usage(argv[0]);
     }
+    nbThreads = (int)threadList.values[0];
+    threadArgs.chunkSize = chunkList.values[0];
+    threadArgs.cLevel = levelList.values[0];
+    threadArgs.searchForExternalRepcodes = (char)repcodeList.values[0];
+    if (threadArgs.pinThreads || threadArgs.bindNuma) {
+        initCpuTopology();
+    }
 
     /* Load input file */
     inputFile = open(fileName, O_RDONLY);
@@ -496,59 +1687,316 @@ int main(int argc, const char **argv)
     }
     srcSize = lseek(inputFile, 0, SEEK_END);
     lseek(inputFile, 0, SEEK_SET);
-    srcBuffer = (unsigned char *)malloc(srcSize);
-    assert(srcBuffer != NULL);
+    if (mapInput) {
+        /* Pages are read on demand, the file may be larger than memory */
+        const int advices[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED };
+        srcBuffer = (unsigned char *)mmap(NULL, srcSize, PROT_READ, MAP_PRIVATE, inputFile, 0);
+        if (srcBuffer == MAP_FAILED) {
+            DISPLAY("Cannot map input file: %s\n", fileName);
+            close(inputFile);
+            return -1;
+        }
+        if (madvise(srcBuffer, srcSize, advices[advice])) {
+            DISPLAY("Fail to set readahead advice of input file\n");
+        }
+        if (!threadArgs.streaming) {
+            DISPLAY("Chunk mode holds the compressed and decompressed file in memory, use -s for large files\n");
+        }
+    } else {
+        srcBuffer = (unsigned char *)malloc(srcSize);
+        assert(srcBuffer != NULL);
 
-    bytesRead = 0;
-    while (bytesRead != srcSize) {
-        bytesRead += read(inputFile, srcBuffer + bytesRead, srcSize - bytesRead);
+        bytesRead = 0;
+        while (bytesRead != srcSize) {
+            bytesRead += read(inputFile, srcBuffer + bytesRead, srcSize - bytesRead);
+        }
+        assert(bytesRead == srcSize);
     }
-    assert(bytesRead == srcSize);
 
     threadArgs.srcBuffer = srcBuffer;
     threadArgs.srcSize = srcSize;
-    initHistorgram(&compHistogram);
 
-    pthread_barrier_init(&g_threadBarrier1, NULL, nbThreads);
-    pthread_barrier_init(&g_threadBarrier2, NULL, nbThreads);
-    for (threadNb = 0; threadNb < nbThreads; threadNb++) {
-        pthread_create(&threads[threadNb], NULL, benchmark, &threadArgs);
+    /* Load dictionary file */
+    if (dictFileName) {
+        FILE *dictFile = fopen(dictFileName, "rb");
+        if (!dictFile) {
+            DISPLAY("Cannot open dictionary file: %s\n", dictFileName);
+            return -1;
+        }
+        fseek(dictFile, 0, SEEK_END);
+        threadArgs.dictSize = ftell(dictFile);
+        fseek(dictFile, 0, SEEK_SET);
+        dictBuffer = (unsigned char *)malloc(threadArgs.dictSize);
+        assert(dictBuffer != NULL);
+        if (fread(dictBuffer, 1, threadArgs.dictSize, dictFile) != threadArgs.dictSize) {
+            DISPLAY("Cannot read dictionary file: %s\n", dictFileName);
+            fclose(dictFile);
+            return -1;
+        }
+        fclose(dictFile);
+        threadArgs.dictBuffer = dictBuffer;
     }
 
-    for (threadNb = 0; threadNb < nbThreads; threadNb++) {
-        pthread_join(threads[threadNb], NULL);
+    /* Fault profiles run on the software engine, blocks failing fall back to zstd */
+    if (nbFaultProfiles && threadArgs.benchMode == 1) {
+        QZSTD_StartOptions_T startOptions;
+        memset(&startOptions, 0, sizeof(startOptions));
+        startOptions.backend = QZSTD_BACKEND_SW;
+        QZSTD_setSwFaultParams(NULL);
+        if (QZSTD_OK != QZSTD_startQatDeviceEx(&startOptions)) {
+            DISPLAY("Fail to start the software engine\n");
+            return -1;
+        }
+        threadArgs.fallback = 1;
     }
 
-    if (compHistogram.num != 0) {
-        /* Display Latency statistics */
-        DISPLAY("-----------------------------------------------------------\n");
-        DISPLAY("Latency Percentiles: P25: %4.2f us, P50: %4.2f us, P75: %4.2f us, P99: %4.2f us, Avg: %4.2f us\n",
-                percentile(&compHistogram, 25) / NANOUSEC,
-                percentile(&compHistogram, 50) / NANOUSEC,
-                percentile(&compHistogram, 75) / NANOUSEC,
-                percentile(&compHistogram, 99) / NANOUSEC,
-                (double)(compHistogram.sum / compHistogram.num / NANOUSEC));
+    /* Estimate the ratio from QAT samples, compare it with the ratio measured */
+    if (estimateBudget && threadArgs.benchMode == 1) {
+        struct timespec estStart, estEnd;
+        double estimate;
+        QZSTD_startQatDevice();
+        GETTIME(estStart);
+        estimate = QZSTD_estimateRatio(srcBuffer, srcSize, estimateBudget);
+        GETTIME(estEnd);
+        DISPLAY("Estimated Compression Ratio: %2.2f%%, Estimation time: %4.2f us\n",
+                estimate * 100, (double)GETDIFFTIME(estStart, estEnd) / NANOUSEC);
+    }
 
-#ifdef DISPLAY_HISTOGRAM
-        DISPLAY("Latency histogram(nanosec): count: %lu\n", compHistogram.num);
-        size_t cumulativeSum = 0;
-        for (int i = 0; i < compHistogram.bucketCount; i++) {
-            if (compHistogram.bucket[i] != 0) {
-                cumulativeSum += compHistogram.bucket[i];
-                DISPLAY("[%10lu, %10lu] %10lu %7.2f%% %7.2f%%\n",
-                        i == 0 ? 0 : compHistogram.bucketValue[i - 1], compHistogram.bucketValue[i],
-                        compHistogram.bucket[i],
-                        (double)compHistogram.bucket[i] * 100 / compHistogram.num,
-                        (double)cumulativeSum * 100 / compHistogram.num);
+    /* Run the matrix of threads, chunk sizes, levels and repcode modes instead of
+     * one point, to write the results or to compare them with a baseline */
+    if (threadList.count > 1 || chunkList.count > 1 || levelList.count > 1 ||
+        repcodeList.count > 1 || resultFileName || baselineFileName) {
+        int maxPoints = threadList.count * chunkList.count * levelList.count * repcodeList.count;
+        points = (sweepPoint_t *)malloc(maxPoints * sizeof(sweepPoint_t));
+        assert(points != NULL);
+        if (baselineFileName) {
+            baseline = (sweepPoint_t *)malloc(MAX_BASELINE_POINTS * sizeof(sweepPoint_t));
+            assert(baseline != NULL);
+            nbBaseline = sweepRead(baselineFileName, baseline, MAX_BASELINE_POINTS);
+            if (nbBaseline < 0) {
+                status = -1;
+                goto cleanup;
             }
         }
+        threadArgs.postOptimize = (postOptMode == 1);
+        for (threadIdx = 0; threadIdx < threadList.count; threadIdx++) {
+            for (chunkIdx = 0; chunkIdx < chunkList.count; chunkIdx++) {
+                for (levelIdx = 0; levelIdx < levelList.count; levelIdx++) {
+                    for (repcodeIdx = 0; repcodeIdx < repcodeList.count; repcodeIdx++) {
+                        threadArgs.chunkSize = chunkList.values[chunkIdx];
+                        threadArgs.cLevel = levelList.values[levelIdx];
+                        threadArgs.searchForExternalRepcodes = (char)repcodeList.values[repcodeIdx];
+                        sweepRun(&threadArgs, (int)threadList.values[threadIdx], threads,
+                                 &points[nbPoints++]);
+                    }
+                }
+            }
+        }
+        if (resultFileName && !sweepWrite(resultFileName, points, nbPoints)) {
+            status = -1;
+        }
+        if (baselineFileName &&
+            sweepCompare(points, nbPoints, baseline, nbBaseline, tolerance)) {
+            status = 1;
+        }
+        goto cleanup;
+    }
+
+    /* Issue requests at the target rate instead of one after another, the blocks
+     * QAT fails on are compressed by zstd and counted */
+    if (threadArgs.targetRate) {
+        double elapsed;
+        memset(&g_responseHdr, 0, sizeof(g_responseHdr));
+        memset(&g_serviceHdr, 0, sizeof(g_serviceHdr));
+        g_openCompleted = g_openDropped = g_openFailed = g_openBytes = 0;
+        g_openElapsedNanosec = 0;
+        threadArgs.fallback = 1;
+        threadArgs.postOptimize = (postOptMode == 1);
+        QZSTD_getStats(&statsStart);
+        runThreads(&threadArgs, nbThreads, threads);
+        QZSTD_getStats(&statsEnd);
+        elapsed = (double)g_openElapsedNanosec / NANOSEC;
+        DISPLAY("Open loop: target: %u req/s (%s arrivals), achieved: %.0f req/s, %5.f MB/s, completed: %lu, dropped: %lu, failed: %lu, blocks fallen back to zstd: %lu\n",
+                threadArgs.targetRate, threadArgs.poisson ? "Poisson" : "constant",
+                elapsed ? g_openCompleted / elapsed : 0,
+                elapsed ? g_openBytes / elapsed / MB : 0,
+                g_openCompleted, g_openDropped, g_openFailed,
+                statsEnd.failedBlocks - statsStart.failedBlocks);
+        if (g_responseHdr.num) {
+            DISPLAY("Response time: P50: %4.2f us, P90: %4.2f us, P99: %4.2f us, P99.9: %4.2f us, P99.99: %4.2f us, Max: %4.2f us\n",
+                    hdrPercentile(&g_responseHdr, 50) / NANOUSEC,
+                    hdrPercentile(&g_responseHdr, 90) / NANOUSEC,
+                    hdrPercentile(&g_responseHdr, 99) / NANOUSEC,
+                    hdrPercentile(&g_responseHdr, 99.9) / NANOUSEC,
+                    hdrPercentile(&g_responseHdr, 99.99) / NANOUSEC,
+                    (double)g_responseHdr.max / NANOUSEC);
+            DISPLAY("Service time:  P50: %4.2f us, P90: %4.2f us, P99: %4.2f us, P99.9: %4.2f us, P99.99: %4.2f us, Max: %4.2f us\n",
+                    hdrPercentile(&g_serviceHdr, 50) / NANOUSEC,
+                    hdrPercentile(&g_serviceHdr, 90) / NANOUSEC,
+                    hdrPercentile(&g_serviceHdr, 99) / NANOUSEC,
+                    hdrPercentile(&g_serviceHdr, 99.9) / NANOUSEC,
+                    hdrPercentile(&g_serviceHdr, 99.99) / NANOUSEC,
+                    (double)g_serviceHdr.max / NANOUSEC);
+        }
+        goto cleanup;
+    }
+
+    /* Run once with the post-optimizer disabled and once enabled to compare */
+    for (pass = (postOptMode == 1); pass <= (postOptMode != 0); pass++) {
+        threadArgs.postOptimize = (char)pass;
+        QZSTD_getStats(&statsStart);
+        runThreads(&threadArgs, nbThreads, threads);
+
+        if (compHistogram.num != 0) {
+            /* Display Latency statistics */
+            DISPLAY("-----------------------------------------------------------\n");
+            DISPLAY("Latency Percentiles: P25: %4.2f us, P50: %4.2f us, P75: %4.2f us, P99: %4.2f us, Avg: %4.2f us\n",
+                    percentile(&compHistogram, 25) / NANOUSEC,
+                    percentile(&compHistogram, 50) / NANOUSEC,
+                    percentile(&compHistogram, 75) / NANOUSEC,
+                    percentile(&compHistogram, 99) / NANOUSEC,
+                    (double)(compHistogram.sum / compHistogram.num / NANOUSEC));
+            for (int stage = 0; threadArgs.stageTimes && stage < STAGE_NUM; stage++) {
+                const HdrHistogram_t *histogram = &stageHistograms[stage];
+                if (histogram->num == 0) {
+                    continue;
+                }
+                DISPLAY("  Stage %-7s P25: %4.2f us, P50: %4.2f us, P75: %4.2f us, P99: %4.2f us, Avg: %4.2f us\n",
+                        stageNames[stage],
+                        hdrPercentile(histogram, 25) / NANOUSEC,
+                        hdrPercentile(histogram, 50) / NANOUSEC,
+                        hdrPercentile(histogram, 75) / NANOUSEC,
+                        hdrPercentile(histogram, 99) / NANOUSEC,
+                        (double)histogram->sum / histogram->num / NANOUSEC);
+            }
+            /* CPU time includes polling QAT, which the compressing thread does */
+            DISPLAY("CPU time: %4.2f ms/MB, %2.2f%% of compression time\n",
+                    (double)g_totalCompCpuNanosec / 1000000 /
+                    ((double)srcSize * nbThreads * threadArgs.nbIterations / MB),
+                    g_totalCompNanosec ? (double)g_totalCompCpuNanosec * 100 / g_totalCompNanosec : 0);
+
+#ifdef DISPLAY_HISTOGRAM
+            DISPLAY("Latency histogram(nanosec): count: %lu\n", compHistogram.num);
+            size_t cumulativeSum = 0;
+            for (int i = 0; i < compHistogram.bucketCount; i++) {
+                if (compHistogram.bucket[i] != 0) {
+                    cumulativeSum += compHistogram.bucket[i];
+                    DISPLAY("[%10lu, %10lu] %10lu %7.2f%% %7.2f%%\n",
+                            i == 0 ? 0 : compHistogram.bucketValue[i - 1], compHistogram.bucketValue[i],
+                            compHistogram.bucket[i],
+                            (double)compHistogram.bucket[i] * 100 / compHistogram.num,
+                            (double)cumulativeSum * 100 / compHistogram.num);
+                }
+            }
 #endif
+        }
+
+        QZSTD_getStats(&statsEnd);
+        if (threadArgs.benchMode == 1) {
+            DISPLAY("LZ4s buffer pool: allocated: %lu (%lu bytes), high water: %lu, quarantined: %lu\n",
+                    statsEnd.bufPoolAllocated, statsEnd.bufPoolBytes, statsEnd.bufPoolHighWater,
+                    statsEnd.bufPoolQuarantined);
+        }
+
+        if (threadArgs.benchMode == 1 && threadArgs.literalSearch) {
+            DISPLAY("Literal search: runs: %lu (%lu bytes), matches: %lu (%lu bytes)\n",
+                    statsEnd.litSearchRuns - statsStart.litSearchRuns,
+                    statsEnd.litSearchRunBytes - statsStart.litSearchRunBytes,
+                    statsEnd.litSearchMatches - statsStart.litSearchMatches,
+                    statsEnd.litSearchMatchBytes - statsStart.litSearchMatchBytes);
+        }
+        if (threadArgs.benchMode == 1 && threadArgs.longDistance) {
+            DISPLAY("Long distance matching: matches: %lu (%lu bytes)\n",
+                    statsEnd.ldmMatches - statsStart.ldmMatches,
+                    statsEnd.ldmMatchBytes - statsStart.ldmMatchBytes);
+        }
+        if (threadArgs.benchMode == 1 && threadArgs.dictBuffer) {
+            DISPLAY("Dictionary: matches: %lu (%lu bytes)\n",
+                    statsEnd.dictMatches - statsStart.dictMatches,
+                    statsEnd.dictMatchBytes - statsStart.dictMatchBytes);
+        }
+        if (threadArgs.benchMode == 1 && threadArgs.sequenceStats) {
+            QZSTD_SeqStats_T swStats;
+            if (0 == softwareSeqStats(&threadArgs, &swStats)) {
+                displaySeqStats(&statsStart.seqStats, &statsEnd.seqStats, &swStats);
+            }
+        }
+        if (threadArgs.benchMode == 1 && pass == 1) {
+            DISPLAY("Post-optimizer: sequences: %lu -> %lu, extended: %lu bytes, merged: %lu, pruned: %lu (%lu bytes)\n",
+                    statsEnd.postOptSeqsIn - statsStart.postOptSeqsIn,
+                    statsEnd.postOptSeqsOut - statsStart.postOptSeqsOut,
+                    statsEnd.postOptExtendedBytes - statsStart.postOptExtendedBytes,
+                    statsEnd.postOptMerged - statsStart.postOptMerged,
+                    statsEnd.postOptPruned - statsStart.postOptPruned,
+                    statsEnd.postOptPrunedBytes - statsStart.postOptPrunedBytes);
+        }
+        passSeqsIn[pass] = statsEnd.postOptSeqsIn - statsStart.postOptSeqsIn;
+        passSeqsOut[pass] = statsEnd.postOptSeqsOut - statsStart.postOptSeqsOut;
+        passRatio[pass] = (double)g_totalCSize / ((double)srcSize * nbThreads);
+        passSpeed[pass] = g_totalCompSpeed;
     }
 
-    pthread_barrier_destroy(&g_threadBarrier1);
-    pthread_barrier_destroy(&g_threadBarrier2);
+    /* The ratio gain and the throughput change are reported separately */
+    if (postOptMode == 2 && threadArgs.benchMode == 1) {
+        DISPLAY("-----------------------------------------------------------\n");
+        DISPLAY("Post-optimizer effect: Compression Ratio: %2.2f%% -> %2.2f%%, Comp: %5.f -> %5.f MB/s, Sequences: -%2.2f%%\n",
+                passRatio[0] * 100, passRatio[1] * 100,
+                passSpeed[0] / MB, passSpeed[1] / MB,
+                passSeqsIn[1] ? 100.0 * (passSeqsIn[1] - passSeqsOut[1]) / passSeqsIn[1] : 0);
+    }
+
+    /* The last run above is the reference of the fault profiles */
+    if (nbFaultProfiles && threadArgs.benchMode == 1) {
+        baseSpeed = g_totalCompSpeed;
+        basePercentiles[0] = percentile(&compHistogram, 50);
+        basePercentiles[1] = percentile(&compHistogram, 99);
+        basePercentiles[2] = percentile(&compHistogram, 99.9);
+    }
+    for (profile = 0; profile < nbFaultProfiles && threadArgs.benchMode == 1; profile++) {
+        QZSTD_SwFaultStats_T faultStart, faultEnd;
+        double p50, p99, p999;
+
+        QZSTD_setSwFaultParams(&faultProfiles[profile]);
+        QZSTD_getSwFaultStats(&faultStart);
+        QZSTD_getStats(&statsStart);
+        runThreads(&threadArgs, nbThreads, threads);
+        QZSTD_getSwFaultStats(&faultEnd);
+        QZSTD_getStats(&statsEnd);
+        QZSTD_setSwFaultParams(NULL);
+
+        if (compHistogram.num == 0) {
+            DISPLAY("Fault profile %s: no result\n", faultSpecs[profile]);
+            continue;
+        }
+        p50 = percentile(&compHistogram, 50);
+        p99 = percentile(&compHistogram, 99);
+        p999 = percentile(&compHistogram, 99.9);
+        DISPLAY("-----------------------------------------------------------\n");
+        DISPLAY("Fault profile %s:\n", faultSpecs[profile]);
+        DISPLAY("Comp: %5.f MB/s (%+.1f%%), P50: %4.2f us (%+.1f%%), P99: %4.2f us (%+.1f%%), P99.9: %4.2f us (%+.1f%%), Max: %4.2f us\n",
+                g_totalCompSpeed / MB, changePercent(baseSpeed, g_totalCompSpeed),
+                p50 / NANOUSEC, changePercent(basePercentiles[0], p50),
+                p99 / NANOUSEC, changePercent(basePercentiles[1], p99),
+                p999 / NANOUSEC, changePercent(basePercentiles[2], p999),
+                (double)compHistogram.max / NANOUSEC);
+        DISPLAY("Injected: retries: %lu, failures: %lu, stalled: %lu, delay: %lu us, blocks fallen back to zstd: %lu\n",
+                faultEnd.retries - faultStart.retries,
+                faultEnd.failures - faultStart.failures,
+                faultEnd.stalled - faultStart.stalled,
+                faultEnd.delayUs - faultStart.delayUs,
+                statsEnd.failedBlocks - statsStart.failedBlocks);
+    }
+
+cleanup:
     QZSTD_stopQatDevice();
+    if (mapInput) {
+        munmap(srcBuffer, srcSize);
+    } else {
+        free(srcBuffer);
+    }
     close(inputFile);
-    free(srcBuffer);
-    return 0;
+    free(dictBuffer);
+    free(points);
+    free(baseline);
+    return status;
 }
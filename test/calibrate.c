@@ -0,0 +1,372 @@
+/***************************************************************************
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2024 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***************************************************************************/
+
+/* Calibration tool of the level profiles of QAT sequence producer. Every
+ * profile of a sweep compresses the sample file, and the profiles which are
+ * not beaten by another one on both compression ratio and throughput are
+ * spread over levels 1 - 12, from the fastest to the best ratio. The table is
+ * written in the format of QZSTD_loadLevelProfiles. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef ZSTD_STATIC_LINKING_ONLY
+#define ZSTD_STATIC_LINKING_ONLY
+#endif
+#include "zstd.h"
+#include "qatseqprod.h"
+
+#define NANOSEC (1000000000ULL) /* 1 second */
+#define MB (1000000)   /* 1MB */
+#define DEFAULT_CHUNK_SIZE (64 * 1024)
+#define DEFAULT_LITERAL_SEARCH 32
+#define HW_LEVEL_MAX 12
+#define MAX_CANDIDATES (HW_LEVEL_MAX * 2 * 2 * 2 * 2)
+
+#define DISPLAY(...)  fprintf(stderr, __VA_ARGS__)
+
+#define GETTIME(now) {clock_gettime(CLOCK_MONOTONIC, &now);};
+#define GETDIFFTIME(start_ticks, end_ticks) (1000000000ULL*( end_ticks.tv_sec - start_ticks.tv_sec ) + ( end_ticks.tv_nsec - start_ticks.tv_nsec ))
+
+typedef struct {
+    QZSTD_LevelProfile_T profile;
+    size_t cSize;  /* Compressed size of the sample */
+    double speed;  /* Compression throughput */
+    int pareto;    /* 1: not beaten by another candidate */
+} candidate_t;
+
+static int usage(const char *exe)
+{
+    DISPLAY("Usage:\n");
+    DISPLAY("      %s [arg] filename\n", exe);
+    DISPLAY("Options:\n");
+    DISPLAY("    -c#       Set chunk size (default: 64K)\n");
+    DISPLAY("    -l#       Set iteration loops of every profile [1 - 1000000](default: 1)\n");
+    DISPLAY("    -S#       Literal search threshold to try, 0: don't try literal search (default: 32)\n");
+    DISPLAY("    -o file   Write the profile table to file (default: stdout)\n");
+    DISPLAY("    -h/H      Print this help message\n");
+    return 0;
+}
+
+/* this function to convert string to unsigned int,
+ * the string MUST BE starting with numeric and can be
+ * end with "K" or "M".
+ */
+static unsigned stringToU32(const char **s)
+{
+    unsigned value = 0;
+    while ((**s >= '0') && (**s <= '9')) {
+        if (value > ((((unsigned)(-1)) / 10) - 1)) {
+            DISPLAY("ERROR: numeric value is too large\n");
+            exit(1);
+        }
+        value *= 10;
+        value += (unsigned)(**s - '0');
+        (*s)++ ;
+    }
+    if ((**s == 'K') || (**s == 'M')) {
+        if (value > ((unsigned)(-1)) >> 10) {
+            DISPLAY("ERROR: numeric value is too large\n");
+            exit(1);
+        }
+        value <<= 10;
+        if (**s == 'M') {
+            if (value > ((unsigned)(-1)) >> 10) {
+                DISPLAY("ERROR: numeric value is too large\n");
+                exit(1);
+            }
+            value <<= 10;
+        }
+        (*s)++;
+    }
+    return value;
+}
+
+/* Compress the sample chunk by chunk with the profile set on its QAT level,
+ * and check that it decompresses back */
+static int measureProfile(ZSTD_CCtx *zc, ZSTD_DCtx *zdc, candidate_t *cand,
+                          const unsigned char *srcBuffer, size_t srcSize, size_t chunkSize,
+                          unsigned char *destBuffer, size_t destSize,
+                          unsigned char *decompBuffer, unsigned nbIterations)
+{
+    const QZSTD_LevelProfile_T *profile = &cand->profile;
+    struct timespec startTicks, endTicks;
+    size_t nanosec = 0;
+    size_t pos, cSize, dSize;
+    unsigned loops;
+
+    if (QZSTD_OK != QZSTD_setLevelProfile(profile->hwLevel, profile) ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(zc, ZSTD_c_compressionLevel,
+                     profile->hwLevel)) ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(zc, ZSTD_c_searchForExternalRepcodes,
+                     profile->searchForExternalRepcodes))) {
+        DISPLAY("Fail to set profile\n");
+        return -1;
+    }
+
+    for (loops = 0; loops < nbIterations; loops++) {
+        cand->cSize = 0;
+        for (pos = 0; pos < srcSize; pos += chunkSize) {
+            size_t len = srcSize - pos < chunkSize ? srcSize - pos : chunkSize;
+            GETTIME(startTicks);
+            cSize = ZSTD_compress2(zc, destBuffer, destSize, srcBuffer + pos, len);
+            GETTIME(endTicks);
+            if (ZSTD_isError(cSize)) {
+                DISPLAY("Compress failed: %s\n", ZSTD_getErrorName(cSize));
+                return -1;
+            }
+            nanosec += GETDIFFTIME(startTicks, endTicks);
+            cand->cSize += cSize;
+
+            if (0 == loops) {
+                dSize = ZSTD_decompressDCtx(zdc, decompBuffer, len, destBuffer, cSize);
+                if (dSize != len || memcmp(decompBuffer, srcBuffer + pos, len)) {
+                    DISPLAY("Decompressed data is not equal to source data\n");
+                    return -1;
+                }
+            }
+        }
+    }
+    cand->speed = (double)(srcSize * nbIterations) / ((double)nanosec / NANOSEC);
+    return 0;
+}
+
+/* Fastest first */
+static int compareSpeed(const void *a, const void *b)
+{
+    const candidate_t *ca = (const candidate_t *)a;
+    const candidate_t *cb = (const candidate_t *)b;
+    return ca->speed < cb->speed ? 1 : ca->speed > cb->speed ? -1 : 0;
+}
+
+int main(int argc, const char **argv)
+{
+    int argNb;
+    size_t chunkSize = DEFAULT_CHUNK_SIZE;
+    unsigned nbIterations = 1;
+    unsigned literalSearch = DEFAULT_LITERAL_SEARCH;
+    const char *fileName = NULL;
+    const char *outFileName = NULL;
+    candidate_t cands[MAX_CANDIDATES];
+    candidate_t front[MAX_CANDIDATES];
+    int nbCands = 0, nbFront = 0;
+    int hwLevel, minMatch, postOptimize, litIdx, rep, i, j, level;
+    unsigned char *srcBuffer = NULL, *destBuffer = NULL, *decompBuffer = NULL;
+    size_t srcSize, destSize, bytesRead;
+    int inputFile;
+    FILE *outFile = stdout;
+    ZSTD_CCtx *zc = NULL;
+    ZSTD_DCtx *zdc = NULL;
+    void *matchState = NULL;
+    int rc = -1;
+
+    if (argc < 2)
+        return usage(argv[0]);
+
+    for (argNb = 1; argNb < argc; argNb++) {
+        const char *arg = argv[argNb];
+        if (arg[0] == '-') {
+            arg++;
+            while (arg[0] != 0) {
+                switch (arg[0]) {
+                /* Display help message */
+                case 'h':
+                case 'H':
+                    return usage(argv[0]);
+                /* Set chunk size */
+                case 'c':
+                    arg++;
+                    chunkSize = stringToU32(&arg);
+                    break;
+                /* Set iterations */
+                case 'l':
+                    arg++;
+                    nbIterations = stringToU32(&arg);
+                    break;
+                /* Set literal search threshold */
+                case 'S':
+                    arg++;
+                    literalSearch = stringToU32(&arg);
+                    break;
+                /* Set output file */
+                case 'o':
+                    if (arg[1] != 0 || argNb + 1 >= argc) {
+                        return usage(argv[0]);
+                    }
+                    outFileName = argv[++argNb];
+                    arg++;
+                    break;
+                /* Unknown argument */
+                default :
+                    return usage(argv[0]);
+                }
+            }
+            continue;
+        }
+        if (!fileName) {
+            fileName = arg;
+            continue;
+        }
+    }
+    if (!fileName || 0 == chunkSize || 0 == nbIterations) {
+        return usage(argv[0]);
+    }
+
+    /* Load sample file */
+    inputFile = open(fileName, O_RDONLY);
+    if (inputFile < 0) {
+        DISPLAY("Cannot open input file: %s\n", fileName);
+        return -1;
+    }
+    srcSize = lseek(inputFile, 0, SEEK_END);
+    lseek(inputFile, 0, SEEK_SET);
+    srcBuffer = (unsigned char *)malloc(srcSize);
+    assert(srcBuffer != NULL);
+    bytesRead = 0;
+    while (bytesRead != srcSize) {
+        bytesRead += read(inputFile, srcBuffer + bytesRead, srcSize - bytesRead);
+    }
+    close(inputFile);
+    if (0 == srcSize) {
+        DISPLAY("Input file is empty\n");
+        goto exit;
+    }
+
+    destSize = ZSTD_compressBound(chunkSize);
+    destBuffer = (unsigned char *)malloc(destSize);
+    decompBuffer = (unsigned char *)malloc(chunkSize);
+    assert(destBuffer != NULL && decompBuffer != NULL);
+
+    if (QZSTD_OK != QZSTD_startQatDevice()) {
+        DISPLAY("Fail to start QAT device\n");
+        goto exit;
+    }
+    zc = ZSTD_createCCtx();
+    zdc = ZSTD_createDCtx();
+    matchState = QZSTD_createSeqProdState();
+    assert(zc != NULL && zdc != NULL && matchState != NULL);
+    ZSTD_registerSequenceProducer(zc, matchState, qatSequenceProducer);
+
+    /* Sweep the profiles */
+    for (hwLevel = 1; hwLevel <= HW_LEVEL_MAX; hwLevel++) {
+        for (minMatch = 3; minMatch <= 4; minMatch++) {
+            for (postOptimize = 0; postOptimize <= 1; postOptimize++) {
+                for (litIdx = 0; litIdx <= (literalSearch ? 1 : 0); litIdx++) {
+                    for (rep = ZSTD_ps_enable; rep <= ZSTD_ps_disable; rep++) {
+                        candidate_t *cand = &cands[nbCands];
+                        memset(cand, 0, sizeof(candidate_t));
+                        cand->profile.hwLevel = hwLevel;
+                        cand->profile.minMatch = minMatch;
+                        cand->profile.postOptimize = postOptimize;
+                        cand->profile.literalSearch = litIdx ? (int)literalSearch : 0;
+                        cand->profile.searchForExternalRepcodes = rep;
+                        if (measureProfile(zc, zdc, cand, srcBuffer, srcSize, chunkSize,
+                                           destBuffer, destSize, decompBuffer, nbIterations)) {
+                            goto exit;
+                        }
+                        nbCands++;
+                    }
+                }
+            }
+        }
+        /* Restore the default profile of the level */
+        QZSTD_setLevelProfile(hwLevel, NULL);
+    }
+
+    /* Keep the candidates no other candidate beats on both ratio and speed */
+    for (i = 0; i < nbCands; i++) {
+        cands[i].pareto = 1;
+        for (j = 0; j < nbCands; j++) {
+            if (cands[j].cSize <= cands[i].cSize && cands[j].speed >= cands[i].speed &&
+                (cands[j].cSize < cands[i].cSize || cands[j].speed > cands[i].speed)) {
+                cands[i].pareto = 0;
+                break;
+            }
+        }
+        DISPLAY("hwLevel %2d minMatch %d postOptimize %d literalSearch %3d repcodes %d: Compression Ratio: %2.2f%%, Comp: %5.f MB/s%s\n",
+                cands[i].profile.hwLevel, cands[i].profile.minMatch,
+                cands[i].profile.postOptimize, cands[i].profile.literalSearch,
+                cands[i].profile.searchForExternalRepcodes,
+                (double)cands[i].cSize * 100 / srcSize, cands[i].speed / MB,
+                cands[i].pareto ? " *" : "");
+        if (cands[i].pareto) {
+            front[nbFront++] = cands[i];
+        }
+    }
+    qsort(front, nbFront, sizeof(candidate_t), compareSpeed);
+
+    if (outFileName) {
+        outFile = fopen(outFileName, "w");
+        if (!outFile) {
+            DISPLAY("Cannot open output file: %s\n", outFileName);
+            goto exit;
+        }
+    }
+
+    /* Spread the Pareto front over levels 1 - 12, fastest first */
+    fprintf(outFile, "# Level profiles calibrated on %s, chunk size: %lu\n",
+            fileName, chunkSize);
+    fprintf(outFile, "# level hwLevel minMatch postOptimize literalSearch searchForExternalRepcodes\n");
+    for (level = 1; level <= HW_LEVEL_MAX; level++) {
+        const candidate_t *cand = &front[nbFront > 1 ?
+                                         ((level - 1) * (nbFront - 1) + (HW_LEVEL_MAX - 1) / 2) / (HW_LEVEL_MAX - 1) : 0];
+        fprintf(outFile, "%d %d %d %d %d %d # Compression Ratio: %2.2f%%, Comp: %5.f MB/s\n",
+                level, cand->profile.hwLevel, cand->profile.minMatch,
+                cand->profile.postOptimize, cand->profile.literalSearch,
+                cand->profile.searchForExternalRepcodes,
+                (double)cand->cSize * 100 / srcSize, cand->speed / MB);
+    }
+    if (outFile != stdout) {
+        fclose(outFile);
+    }
+    rc = 0;
+
+exit:
+    ZSTD_freeCCtx(zc);
+    ZSTD_freeDCtx(zdc);
+    QZSTD_freeSeqProdState(matchState);
+    QZSTD_stopQatDevice();
+    free(srcBuffer);
+    free(destBuffer);
+    free(decompBuffer);
+    return rc;
+}
@@ -59,6 +59,25 @@ size_t FUZZ_freeSeqProdState(void *state)
     return 0;
 }
 
+/* Parameters of the state picked by the block, so the fuzzer input drives them.
+ * zstd doesn't tell where its frames start, so long distance matches are
+ * searched in a frame of the block alone. */
+static void FUZZ_setSeqProdParams(void *state, const unsigned char *src, size_t srcSize)
+{
+    unsigned int select = (unsigned int)srcSize;
+
+    if (srcSize > 0) {
+        select ^= (src[0] | (unsigned int)src[srcSize - 1] << 8) * 2654435761U;
+    }
+    QZSTD_setSeqProdParameter(state, QZSTD_p_postOptimize, select & 1);
+    QZSTD_setSeqProdParameter(state, QZSTD_p_literalSearch,
+                              (select >> 1) & 1 ? 8 + (int)((select >> 2) & 63) : 0);
+    QZSTD_setSeqProdParameter(state, QZSTD_p_longDistance, (select >> 8) & 1);
+    QZSTD_setSeqProdParameter(state, QZSTD_p_blockChecksum, (select >> 9) & 1);
+    QZSTD_setSeqProdParameter(state, QZSTD_p_sequenceStats, (select >> 10) & 1);
+    QZSTD_beginFrame(state, src, srcSize);
+}
+
 size_t FUZZ_thirdPartySeqProd(
     void *sequenceProducerState,
     ZSTD_Sequence *outSeqs, size_t outSeqsCapacity,
@@ -68,6 +87,7 @@ size_t FUZZ_thirdPartySeqProd(
     size_t windowSize
 )
 {
+    FUZZ_setSeqProdParams(sequenceProducerState, (const unsigned char *)src, srcSize);
     return qatSequenceProducer(sequenceProducerState, outSeqs,
                                outSeqsCapacity, src, srcSize, dict, dictSize,
                                compressionLevel, windowSize);
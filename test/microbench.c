@@ -0,0 +1,659 @@
+/***************************************************************************
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2024 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***************************************************************************/
+
+/* Microbenchmark of the CPU side of QAT sequence producer. Chunks of the
+ * input are encoded to LZ4s once with the LZ4s encoder of the software
+ * engine, then the decoder and the passes on its sequences run on the same
+ * chunks in a loop, without device. The library sources are built in, so
+ * the static functions can be timed and no QAT is needed. Cycles and branch
+ * misses come from perf events when the kernel allows them. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#ifndef ZSTD_STATIC_LINKING_ONLY
+#define ZSTD_STATIC_LINKING_ONLY
+#endif
+#include "zstd.h"
+#include "qatseqprod.c"
+#include "qatseqprod_sw.c"
+
+#define NANOSEC (1000000000ULL) /* 1 second */
+#define MB (1000000)   /* 1MB */
+#define DEFAULT_CHUNK_SIZE (64 * 1024)
+#define DEFAULT_LOOPS 10
+#define DEFAULT_WINDOW (4 * 1024)
+#define DEFAULT_LITERAL_SEARCH 32
+#define DEFAULT_GEN_SIZE (16 * 1024 * 1024)
+#define MAX_INPUT_FILES 64
+
+#define DISPLAY(...)  fprintf(stderr, __VA_ARGS__)
+
+#define GETTIME(now) {clock_gettime(CLOCK_MONOTONIC, &now);};
+#define GETDIFFTIME(start_ticks, end_ticks) (1000000000ULL*( end_ticks.tv_sec - start_ticks.tv_sec ) + ( end_ticks.tv_nsec - start_ticks.tv_nsec ))
+
+/* Timed paths */
+typedef enum {
+    VARIANT_DECODE,    /* QZSTD_decLz4s, all matches in the window */
+    VARIANT_WINDOW,    /* QZSTD_decLz4s, matches beyond a small window */
+    VARIANT_LITSEARCH, /* Decode, then the literal search */
+    VARIANT_POSTOPT,   /* Decode, then the post optimization */
+    VARIANT_SETUP,     /* Copy of the block to the source buffer of a request */
+    VARIANT_SEQCOMP,   /* ZSTD_compressSequences of the decoded sequences */
+    VARIANT_VALIDATE,  /* Same, with sequence validation */
+    VARIANT_NUM
+} variant_e;
+
+static const char *const variantNames[VARIANT_NUM] = {
+    "decode", "decode-window", "litsearch", "postopt", "setup", "zstd-seq",
+    "zstd-seq-val"
+};
+
+/* Perf events, read as one group */
+typedef enum {
+    EVENT_CYCLES,
+    EVENT_INSTRUCTIONS,
+    EVENT_BRANCHES,
+    EVENT_BRANCH_MISSES,
+    EVENT_NUM
+} event_e;
+
+typedef struct {
+    const unsigned char *src;  /* Chunk of the input */
+    size_t srcSize;
+    unsigned char *lz4s;       /* Its LZ4s encoding */
+    size_t lz4sSize;
+    ZSTD_Sequence *seqs;       /* Its decoded sequences */
+    size_t nbSeqs;
+} chunk_t;
+
+typedef struct {
+    unsigned long long nanosec;
+    unsigned long long ticks;  /* TSC */
+    unsigned long long bytes;
+    unsigned long long seqs;   /* Sequences out of the timed path */
+    unsigned long long counters[EVENT_NUM];
+    int hasCounters;
+} result_t;
+
+static size_t g_chunkSize = DEFAULT_CHUNK_SIZE;
+static unsigned g_loops = DEFAULT_LOOPS;
+static int g_level = 1;
+static unsigned g_minMatch = 3;
+static size_t g_window = DEFAULT_WINDOW;
+static int g_literalSearch = DEFAULT_LITERAL_SEARCH;
+static int g_zstdLevel = ZSTD_CLEVEL_DEFAULT;
+static int g_perfFds[EVENT_NUM] = { -1, -1, -1, -1 };
+
+static int usage(const char *exe)
+{
+    DISPLAY("Usage:\n");
+    DISPLAY("      %s [arg] [filename...]\n", exe);
+    DISPLAY("Options:\n");
+    DISPLAY("    -c#       Set chunk size, max 128K (default: 64K)\n");
+    DISPLAY("    -l#       Set iteration loops of every variant (default: %d)\n", DEFAULT_LOOPS);
+    DISPLAY("    -L#       Set level of the LZ4s encoder [1 - 12] (default: 1)\n");
+    DISPLAY("    -m#       Set min match of the LZ4s encoder [3 - 4] (default: 3)\n");
+    DISPLAY("    -w#       Set window size of decode-window (default: 4K)\n");
+    DISPLAY("    -S#       Set run length of litsearch (default: %d)\n", DEFAULT_LITERAL_SEARCH);
+    DISPLAY("    -z#       Set zstd level of zstd-seq (default: %d)\n", ZSTD_CLEVEL_DEFAULT);
+    DISPLAY("    -g#       Size of the generated text without filename (default: 16M)\n");
+    DISPLAY("    -h/H      Print this help message\n");
+    return 0;
+}
+
+/* this function to convert string to unsigned int,
+ * the string MUST BE starting with numeric and can be
+ * end with "K" or "M".
+ */
+static unsigned stringToU32(const char **s)
+{
+    unsigned value = 0;
+    while ((**s >= '0') && (**s <= '9')) {
+        if (value > ((((unsigned)(-1)) / 10) - 1)) {
+            DISPLAY("ERROR: numeric value is too large\n");
+            exit(1);
+        }
+        value *= 10;
+        value += (unsigned)(**s - '0');
+        (*s)++ ;
+    }
+    if ((**s == 'K') || (**s == 'M')) {
+        if (value > ((unsigned)(-1)) >> 10) {
+            DISPLAY("ERROR: numeric value is too large\n");
+            exit(1);
+        }
+        value <<= 10;
+        if (**s == 'M') {
+            if (value > ((unsigned)(-1)) >> 10) {
+                DISPLAY("ERROR: numeric value is too large\n");
+                exit(1);
+            }
+            value <<= 10;
+        }
+        (*s)++;
+    }
+    return value;
+}
+
+/* Text of words from a small vocabulary, compressible like logs, the same
+ * on every run */
+static unsigned char *generateText(size_t size)
+{
+    static const char *const words[] = {
+        "request", "response", "status", "error", "user", "session", "time",
+        "value", "count", "id", "server", "client", "data", "ok", "the", "of"
+    };
+    unsigned char *text = (unsigned char *)malloc(size);
+    unsigned int seed = 1;
+    size_t pos = 0, len;
+    const char *word;
+
+    assert(text != NULL);
+    while (pos < size) {
+        seed = seed * 1103515245 + 12345;
+        word = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+        len = strlen(word);
+        len = len < size - pos ? len : size - pos;
+        memcpy(text + pos, word, len);
+        pos += len;
+        if (pos < size) {
+            text[pos++] = (seed >> 8) % 7 ? ' ' : '\n';
+        }
+    }
+    return text;
+}
+
+static unsigned char *loadFiles(const char **fileNames, int nbFiles, size_t *size)
+{
+    unsigned char *buffer = NULL;
+    size_t total = 0, fileSize, bytesRead;
+    ssize_t rc;
+    int i, fd;
+
+    for (i = 0; i < nbFiles; i++) {
+        fd = open(fileNames[i], O_RDONLY);
+        if (fd < 0) {
+            DISPLAY("Cannot open input file: %s\n", fileNames[i]);
+            free(buffer);
+            return NULL;
+        }
+        fileSize = lseek(fd, 0, SEEK_END);
+        lseek(fd, 0, SEEK_SET);
+        buffer = (unsigned char *)realloc(buffer, total + fileSize + 1);
+        assert(buffer != NULL);
+        bytesRead = 0;
+        while (bytesRead != fileSize) {
+            rc = read(fd, buffer + total + bytesRead, fileSize - bytesRead);
+            if (rc <= 0) {
+                DISPLAY("Cannot read input file: %s\n", fileNames[i]);
+                close(fd);
+                free(buffer);
+                return NULL;
+            }
+            bytesRead += rc;
+        }
+        close(fd);
+        total += fileSize;
+    }
+    *size = total;
+    return buffer;
+}
+
+/* Cycles, instructions, branches and branch misses of this thread in user
+ * space, as one group so they cover the same instructions */
+static int perfOpen(void)
+{
+    static const unsigned long long configs[EVENT_NUM] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    struct perf_event_attr attr;
+    int i;
+
+    for (i = 0; i < EVENT_NUM; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.disabled = 0 == i;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        g_perfFds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1,
+                                    0 == i ? -1 : g_perfFds[0], 0);
+        if (g_perfFds[i] < 0) {
+            while (i-- > 0) {
+                close(g_perfFds[i]);
+                g_perfFds[i] = -1;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void perfClose(void)
+{
+    int i;
+    for (i = 0; i < EVENT_NUM; i++) {
+        if (g_perfFds[i] >= 0) {
+            close(g_perfFds[i]);
+            g_perfFds[i] = -1;
+        }
+    }
+}
+
+static void perfStart(void)
+{
+    if (g_perfFds[0] >= 0) {
+        ioctl(g_perfFds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(g_perfFds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+static void perfStop(result_t *result)
+{
+    unsigned long long values[1 + EVENT_NUM];
+    int i;
+
+    if (g_perfFds[0] < 0) {
+        return;
+    }
+    ioctl(g_perfFds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(g_perfFds[0], values, sizeof(values)) == (ssize_t)sizeof(values) &&
+        EVENT_NUM == values[0]) {
+        for (i = 0; i < EVENT_NUM; i++) {
+            result->counters[i] = values[1 + i];
+        }
+        result->hasCounters = 1;
+    }
+}
+
+static unsigned long long readTicks(void)
+{
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static size_t matchLenBase(void)
+{
+    return 4 == g_minMatch ? LZ4MINMATCH + 1 : LZ4MINMATCH;
+}
+
+/* Decode the chunk like the sequence producer, 0 on decode error */
+static size_t decodeChunk(const chunk_t *chunk, ZSTD_Sequence *seqs,
+                          size_t seqsCapacity, size_t windowSize)
+{
+    size_t nbSeqs = QZSTD_decLz4s(seqs, seqsCapacity, chunk->lz4s,
+                                  (unsigned int)chunk->lz4sSize, windowSize,
+                                  matchLenBase(), NULL);
+    if (ZSTD_SEQUENCE_PRODUCER_ERROR == nbSeqs || nbSeqs >= seqsCapacity - 1) {
+        return 0;
+    }
+    return nbSeqs;
+}
+
+/* One pass of the variant over every chunk, the number of sequences it
+ * produced is added to seqs, -1 on error */
+static int runOnce(variant_e variant, const chunk_t *chunks, size_t nbChunks,
+                   QZSTD_Session_T *zstdSess, ZSTD_CCtx *zc,
+                   ZSTD_Sequence *seqs, size_t seqsCapacity,
+                   unsigned char *buffer, size_t bufferSize,
+                   unsigned long long *nbSeqsOut)
+{
+    const chunk_t *chunk;
+    size_t i, nbSeqs = 0, rc;
+
+    for (i = 0; i < nbChunks; i++) {
+        chunk = &chunks[i];
+        switch (variant) {
+        case VARIANT_DECODE:
+            nbSeqs = decodeChunk(chunk, seqs, seqsCapacity, chunk->srcSize);
+            break;
+        case VARIANT_WINDOW:
+            nbSeqs = decodeChunk(chunk, seqs, seqsCapacity, g_window);
+            break;
+        case VARIANT_LITSEARCH:
+            nbSeqs = decodeChunk(chunk, seqs, seqsCapacity, chunk->srcSize);
+            if (nbSeqs) {
+                nbSeqs = QZSTD_searchLiterals(zstdSess, seqs, nbSeqs, seqsCapacity,
+                                              chunk->src, chunk->srcSize,
+                                              chunk->srcSize, g_literalSearch);
+            }
+            nbSeqs = ZSTD_SEQUENCE_PRODUCER_ERROR == nbSeqs ? 0 : nbSeqs;
+            break;
+        case VARIANT_POSTOPT:
+            nbSeqs = decodeChunk(chunk, seqs, seqsCapacity, chunk->srcSize);
+            if (nbSeqs) {
+                nbSeqs = QZSTD_postOptimize(seqs, nbSeqs, chunk->src);
+            }
+            break;
+        case VARIANT_SETUP:
+            memcpy(buffer, chunk->src, chunk->srcSize);
+            nbSeqs = 1;
+            break;
+        case VARIANT_SEQCOMP:
+        case VARIANT_VALIDATE:
+            rc = ZSTD_compressSequences(zc, buffer, bufferSize, chunk->seqs,
+                                        chunk->nbSeqs, chunk->src, chunk->srcSize);
+            nbSeqs = ZSTD_isError(rc) ? 0 : chunk->nbSeqs;
+            break;
+        default:
+            return -1;
+        }
+        if (0 == nbSeqs) {
+            DISPLAY("%s failed on chunk %lu\n", variantNames[variant], (unsigned long)i);
+            return -1;
+        }
+        *nbSeqsOut += VARIANT_SETUP == variant ? 0 : nbSeqs;
+    }
+    return 0;
+}
+
+static void displayResult(variant_e variant, const result_t *result, int cyclesFromPerf)
+{
+    double bytes = (double)result->bytes;
+    double cycles = 0;
+    char cycleStr[16] = "n/a", seqStr[16] = "n/a", ipcStr[16] = "n/a";
+    char missStr[16] = "n/a", perSeqStr[16] = "n/a";
+
+    if (cyclesFromPerf && result->hasCounters) {
+        cycles = (double)result->counters[EVENT_CYCLES];
+    } else if (HAVE_TSC) {
+        cycles = (double)result->ticks;
+    }
+    if (cycles > 0) {
+        snprintf(cycleStr, sizeof(cycleStr), "%.3f", cycles / bytes);
+    }
+    if (result->seqs) {
+        snprintf(seqStr, sizeof(seqStr), "%.2f",
+                 (double)result->seqs / ((double)result->nanosec / NANOSEC) / MB);
+    }
+    if (result->hasCounters && result->counters[EVENT_CYCLES]) {
+        snprintf(ipcStr, sizeof(ipcStr), "%.2f",
+                 (double)result->counters[EVENT_INSTRUCTIONS] / result->counters[EVENT_CYCLES]);
+    }
+    if (result->hasCounters && result->counters[EVENT_BRANCHES]) {
+        snprintf(missStr, sizeof(missStr), "%.2f%%",
+                 100.0 * result->counters[EVENT_BRANCH_MISSES] / result->counters[EVENT_BRANCHES]);
+        if (result->seqs) {
+            snprintf(perSeqStr, sizeof(perSeqStr), "%.3f",
+                     (double)result->counters[EVENT_BRANCH_MISSES] / result->seqs);
+        }
+    }
+    DISPLAY("%-13s %10.1f %8.3f %8s %9s %6s %8s %9s\n", variantNames[variant],
+            bytes / ((double)result->nanosec / NANOSEC) / MB,
+            (double)result->nanosec / bytes, cycleStr, seqStr, ipcStr, missStr, perSeqStr);
+}
+
+int main(int argc, const char **argv)
+{
+    int argNb, nbFiles = 0, cyclesFromPerf, rc = -1;
+    const char *fileNames[MAX_INPUT_FILES];
+    size_t genSize = DEFAULT_GEN_SIZE;
+    unsigned char *srcBuffer = NULL, *lz4sBuffer = NULL, *buffer = NULL;
+    unsigned char *decompBuffer = NULL;
+    ZSTD_Sequence *seqs = NULL;
+    size_t srcSize = 0, lz4sCapacity, lz4sSize = 0, seqsCapacity, bufferSize;
+    size_t nbChunks = 0, totalSeqs = 0, pos, i, cSize, dSize;
+    chunk_t *chunks = NULL;
+    QZSTD_SwInstance_T *swInst = NULL;
+    QZSTD_Session_T *zstdSess = NULL;
+    ZSTD_CCtx *zc = NULL;
+    ZSTD_DCtx *zdc = NULL;
+    result_t result;
+    unsigned loops;
+    int variant;
+    struct timespec startTicks, endTicks;
+    unsigned long long startTsc;
+
+    for (argNb = 1; argNb < argc; argNb++) {
+        const char *arg = argv[argNb];
+        if (arg[0] == '-') {
+            arg++;
+            while (arg[0] != 0) {
+                switch (arg[0]) {
+                /* Display help message */
+                case 'h':
+                case 'H':
+                    return usage(argv[0]);
+                /* Set chunk size */
+                case 'c':
+                    arg++;
+                    g_chunkSize = stringToU32(&arg);
+                    break;
+                /* Set iterations */
+                case 'l':
+                    arg++;
+                    g_loops = stringToU32(&arg);
+                    break;
+                /* Set level of the LZ4s encoder */
+                case 'L':
+                    arg++;
+                    g_level = (int)stringToU32(&arg);
+                    break;
+                /* Set min match of the LZ4s encoder */
+                case 'm':
+                    arg++;
+                    g_minMatch = stringToU32(&arg);
+                    break;
+                /* Set window size of decode-window */
+                case 'w':
+                    arg++;
+                    g_window = stringToU32(&arg);
+                    break;
+                /* Set run length of litsearch */
+                case 'S':
+                    arg++;
+                    g_literalSearch = (int)stringToU32(&arg);
+                    break;
+                /* Set zstd level of zstd-seq */
+                case 'z':
+                    arg++;
+                    g_zstdLevel = (int)stringToU32(&arg);
+                    break;
+                /* Set size of the generated text */
+                case 'g':
+                    arg++;
+                    genSize = stringToU32(&arg);
+                    break;
+                /* Unknown argument */
+                default :
+                    return usage(argv[0]);
+                }
+            }
+            continue;
+        }
+        if (nbFiles >= MAX_INPUT_FILES) {
+            DISPLAY("Too many input files\n");
+            return -1;
+        }
+        fileNames[nbFiles++] = arg;
+    }
+    if (0 == g_chunkSize || g_chunkSize > ZSTD_BLOCKSIZE_MAX || 0 == g_loops ||
+        g_level < 1 || g_level > 12 || g_minMatch < 3 || g_minMatch > 4 ||
+        0 == g_window || g_literalSearch <= 0 || 0 == genSize) {
+        return usage(argv[0]);
+    }
+
+    /* Fixed input: the files, or generated text */
+    if (nbFiles) {
+        srcBuffer = loadFiles(fileNames, nbFiles, &srcSize);
+        if (NULL == srcBuffer) {
+            goto exit;
+        }
+    } else {
+        srcBuffer = generateText(genSize);
+        srcSize = genSize;
+    }
+    if (0 == srcSize) {
+        DISPLAY("Input is empty\n");
+        goto exit;
+    }
+
+    /* Encode every chunk to LZ4s and decode it once, the sequences are
+     * checked with a round trip through zstd */
+    nbChunks = (srcSize + g_chunkSize - 1) / g_chunkSize;
+    lz4sCapacity = g_chunkSize + g_chunkSize / 16 + 64;
+    seqsCapacity = ZSTD_sequenceBound(g_chunkSize);
+    bufferSize = ZSTD_compressBound(g_chunkSize);
+    chunks = (chunk_t *)calloc(nbChunks, sizeof(chunk_t));
+    lz4sBuffer = (unsigned char *)malloc(nbChunks * lz4sCapacity);
+    seqs = (ZSTD_Sequence *)malloc(seqsCapacity * sizeof(ZSTD_Sequence));
+    buffer = (unsigned char *)malloc(bufferSize);
+    decompBuffer = (unsigned char *)malloc(g_chunkSize);
+    swInst = (QZSTD_SwInstance_T *)calloc(1, sizeof(QZSTD_SwInstance_T));
+    zstdSess = (QZSTD_Session_T *)QZSTD_createSeqProdState();
+    zc = ZSTD_createCCtx();
+    zdc = ZSTD_createDCtx();
+    assert(chunks != NULL && lz4sBuffer != NULL &&
+           seqs != NULL && buffer != NULL && decompBuffer != NULL &&
+           swInst != NULL && zstdSess != NULL && zc != NULL && zdc != NULL);
+    ZSTD_CCtx_setParameter(zc, ZSTD_c_compressionLevel, g_zstdLevel);
+    ZSTD_CCtx_setParameter(zc, ZSTD_c_blockDelimiters, ZSTD_sf_explicitBlockDelimiters);
+    ZSTD_CCtx_setParameter(zc, ZSTD_c_validateSequences, 1);
+    /* Without sequence producer, 3 byte matches are only valid with min match 3 */
+    ZSTD_CCtx_setParameter(zc, ZSTD_c_minMatch, 3);
+
+    for (i = 0, pos = 0; i < nbChunks; i++, pos += g_chunkSize) {
+        chunk_t *chunk = &chunks[i];
+        chunk->src = srcBuffer + pos;
+        chunk->srcSize = srcSize - pos < g_chunkSize ? srcSize - pos : g_chunkSize;
+        chunk->lz4s = lz4sBuffer + i * lz4sCapacity;
+        chunk->lz4sSize = QZSTD_swCompressLz4s(swInst, chunk->src, chunk->srcSize,
+                                               chunk->lz4s, lz4sCapacity, g_level,
+                                               g_minMatch);
+        chunk->nbSeqs = 0 == chunk->lz4sSize ? 0 :
+                        decodeChunk(chunk, seqs, seqsCapacity, chunk->srcSize);
+        if (0 == chunk->nbSeqs) {
+            DISPLAY("Fail to encode chunk %lu to LZ4s\n", (unsigned long)i);
+            goto exit;
+        }
+        chunk->seqs = (ZSTD_Sequence *)malloc(chunk->nbSeqs * sizeof(ZSTD_Sequence));
+        assert(chunk->seqs != NULL);
+        memcpy(chunk->seqs, seqs, chunk->nbSeqs * sizeof(ZSTD_Sequence));
+        cSize = ZSTD_compressSequences(zc, buffer, bufferSize, chunk->seqs,
+                                       chunk->nbSeqs, chunk->src, chunk->srcSize);
+        dSize = ZSTD_isError(cSize) ? 0 :
+                ZSTD_decompressDCtx(zdc, decompBuffer, g_chunkSize, buffer, cSize);
+        if (dSize != chunk->srcSize || memcmp(decompBuffer, chunk->src, dSize)) {
+            DISPLAY("Sequences of chunk %lu don't decompress to the chunk\n",
+                    (unsigned long)i);
+            goto exit;
+        }
+        lz4sSize += chunk->lz4sSize;
+        totalSeqs += chunk->nbSeqs;
+    }
+
+    cyclesFromPerf = 0 == perfOpen();
+    DISPLAY("Input: %lu bytes in %lu chunks of %lu, LZ4s level %d min match %u: "
+            "%lu bytes (%.2f%%), %.1f sequences per chunk\n",
+            (unsigned long)srcSize, (unsigned long)nbChunks, (unsigned long)g_chunkSize,
+            g_level, g_minMatch, (unsigned long)lz4sSize, 100.0 * lz4sSize / srcSize,
+            (double)totalSeqs / nbChunks);
+    DISPLAY("Cycles: %s, %u loops\n", cyclesFromPerf ? "perf events" :
+            HAVE_TSC ? "TSC reference cycles, no perf events" : "n/a", g_loops);
+    DISPLAY("%-13s %10s %8s %8s %9s %6s %8s %9s\n", "variant", "MB/s", "ns/B",
+            "cyc/B", "Mseq/s", "IPC", "br-miss", "miss/seq");
+
+    for (variant = 0; variant < VARIANT_NUM; variant++) {
+        unsigned long long nbSeqs = 0;
+        ZSTD_CCtx_setParameter(zc, ZSTD_c_validateSequences, VARIANT_VALIDATE == variant);
+        /* Warm up the caches and the branch predictor */
+        if (runOnce((variant_e)variant, chunks, nbChunks, zstdSess, zc, seqs,
+                    seqsCapacity, buffer, bufferSize, &nbSeqs)) {
+            goto exit;
+        }
+        memset(&result, 0, sizeof(result));
+        perfStart();
+        GETTIME(startTicks);
+        startTsc = readTicks();
+        for (loops = 0; loops < g_loops; loops++) {
+            if (runOnce((variant_e)variant, chunks, nbChunks, zstdSess, zc, seqs,
+                        seqsCapacity, buffer, bufferSize, &result.seqs)) {
+                perfStop(&result);
+                goto exit;
+            }
+        }
+        result.ticks = readTicks() - startTsc;
+        GETTIME(endTicks);
+        perfStop(&result);
+        result.nanosec = GETDIFFTIME(startTicks, endTicks);
+        result.nanosec = result.nanosec ? result.nanosec : 1;
+        result.bytes = (unsigned long long)srcSize * g_loops;
+        displayResult((variant_e)variant, &result, cyclesFromPerf);
+    }
+    rc = 0;
+
+exit:
+    perfClose();
+    ZSTD_freeCCtx(zc);
+    ZSTD_freeDCtx(zdc);
+    QZSTD_freeSeqProdState(zstdSess);
+    free(swInst);
+    free(decompBuffer);
+    free(buffer);
+    free(seqs);
+    free(lz4sBuffer);
+    for (i = 0; NULL != chunks && i < nbChunks; i++) {
+        free(chunks[i].seqs);
+    }
+    free(chunks);
+    free(srcBuffer);
+    return rc;
+}
@@ -0,0 +1,729 @@
+/***************************************************************************
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2024 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***************************************************************************/
+
+/* Command line compressor of files with QAT sequence producer. The input is
+ * read, or mapped, in jobs by a reader thread, compressed by a pool of worker
+ * threads which own a CCtx and a sequence producer state each, and written in
+ * order by the main thread, so reading, compressing and writing overlap. Every
+ * job has two slots per worker to move between the stages. The output is one
+ * frame, a frame per job, or a frame per job with the seek table of the zstd
+ * seekable format. Blocks QAT fails on are compressed by zstd, and the whole
+ * file is if QAT can't be started. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifndef ZSTD_STATIC_LINKING_ONLY
+#define ZSTD_STATIC_LINKING_ONLY
+#endif
+#include "zstd.h"
+#include "qatseqprod.h"
+
+#define NANOSEC (1000000000ULL) /* 1 second */
+#define MB (1000000)   /* 1MB */
+#define DEFAULT_JOB_SIZE (4 * 1024 * 1024)
+#define MAX_JOB_SIZE (1024 * 1024 * 1024) /* Sizes of the seek table are 32 bits */
+#define MAX_WORKERS 256
+#define SLOTS_PER_WORKER 2
+#define DIRECT_IO_ALIGN 4096
+
+/* Seekable format of zstd, contrib/seekable_format */
+#define SEEK_TABLE_MAGIC 0x184D2A5EU /* Skippable frame of the seek table */
+#define SEEKABLE_MAGIC 0x8F92EAB1U
+#define SEEK_TABLE_CHECKSUM_FLAG 0x80
+#define SEEK_TABLE_FOOTER_SIZE 9
+#define SEEK_ENTRY_SIZE 12 /* Compressed size, decompressed size, checksum */
+
+#define DISPLAY(...)  fprintf(stderr, __VA_ARGS__)
+
+#define GETTIME(now) {clock_gettime(CLOCK_MONOTONIC, &now);};
+#define GETDIFFTIME(start_ticks, end_ticks) (1000000000ULL*( end_ticks.tv_sec - start_ticks.tv_sec ) + ( end_ticks.tv_nsec - start_ticks.tv_nsec ))
+
+typedef enum {
+    FORMAT_FRAME,       /* One zstd frame */
+    FORMAT_MULTI_FRAME, /* A zstd frame per job */
+    FORMAT_SEEKABLE     /* A zstd frame per job and a seek table */
+} format_e;
+
+typedef enum {
+    INPUT_READ,   /* read into the slots */
+    INPUT_MMAP,   /* Map the file, no copy */
+    INPUT_DIRECT  /* O_DIRECT read into the slots, bypassing the page cache */
+} inputMode_e;
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_READ,  /* Input of the job is ready */
+    SLOT_BUSY,  /* Taken by a worker */
+    SLOT_DONE   /* Compressed, to be written */
+} slotState_e;
+
+typedef struct {
+    slotState_e state;
+    size_t job;
+    const unsigned char *src;
+    size_t srcSize;
+    unsigned char *readBuffer; /* Input of the job, NULL if mapped */
+    unsigned char *dst;
+    size_t dstCapacity;
+    size_t dstSize;
+} slot_t;
+
+typedef struct {
+    unsigned int cSize;
+    unsigned int dSize;
+    unsigned int checksum;
+} seekEntry_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; /* Broadcast on every change of a slot */
+    slot_t *slots;
+    int nbSlots;
+    size_t jobSize;
+    size_t nbJobs;
+    size_t nextRead;
+    size_t nextCompress;
+    int failed;
+    int inputFile;
+    inputMode_e inputMode;
+    const unsigned char *map;
+    size_t srcSize;
+    format_e format;
+    int level;
+    int useQat;
+} pipeline_t;
+
+static int usage(const char *exe)
+{
+    DISPLAY("Usage:\n");
+    DISPLAY("      %s [arg] filename\n", exe);
+    DISPLAY("Options:\n");
+    DISPLAY("    -L#       Set compression level [1 - 22] (default: %d)\n", ZSTD_CLEVEL_DEFAULT);
+    DISPLAY("    -T#       Set worker threads [1 - %d] (default: online CPUs)\n", MAX_WORKERS);
+    DISPLAY("    -B#       Set job size, the frame size of -F1 and -F2 (default: 4M)\n");
+    DISPLAY("    -F#       Output format, 0: one frame, compressed by one worker; 1: a frame per job;\n");
+    DISPLAY("              2: a frame per job and a seek table of the zstd seekable format (default: 1)\n");
+    DISPLAY("    -i#       Input, 0: read; 1: map the file; 2: read with O_DIRECT (default: 0)\n");
+    DISPLAY("    -o file   Write the output to file (default: filename.zst)\n");
+    DISPLAY("    -f        Overwrite the output file\n");
+    DISPLAY("    -s        Compress with zstd only, without QAT\n");
+    DISPLAY("    -q        Don't print the summary\n");
+    DISPLAY("    -h/H      Print this help message\n");
+    return 0;
+}
+
+/* this function to convert string to unsigned int,
+ * the string MUST BE starting with numeric and can be
+ * end with "K" or "M".
+ */
+static unsigned stringToU32(const char **s)
+{
+    unsigned value = 0;
+    while ((**s >= '0') && (**s <= '9')) {
+        if (value > ((((unsigned)(-1)) / 10) - 1)) {
+            DISPLAY("ERROR: numeric value is too large\n");
+            exit(1);
+        }
+        value *= 10;
+        value += (unsigned)(**s - '0');
+        (*s)++ ;
+    }
+    if ((**s == 'K') || (**s == 'M')) {
+        if (value > ((unsigned)(-1)) >> 10) {
+            DISPLAY("ERROR: numeric value is too large\n");
+            exit(1);
+        }
+        value <<= 10;
+        if (**s == 'M') {
+            if (value > ((unsigned)(-1)) >> 10) {
+                DISPLAY("ERROR: numeric value is too large\n");
+                exit(1);
+            }
+            value <<= 10;
+        }
+        (*s)++;
+    }
+    return value;
+}
+
+static void writeLE32(unsigned char *p, unsigned int value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    p[3] = (unsigned char)(value >> 24);
+}
+
+static unsigned int readLE32(const unsigned char *p)
+{
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+           ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static int writeAll(int fd, const unsigned char *buffer, size_t size)
+{
+    ssize_t rc;
+    while (size) {
+        rc = write(fd, buffer, size);
+        if (rc < 0 && EINTR == errno) {
+            continue;
+        }
+        if (rc <= 0) {
+            return -1;
+        }
+        buffer += rc;
+        size -= (size_t)rc;
+    }
+    return 0;
+}
+
+/* Read size bytes at offset, O_DIRECT reads whole aligned blocks into the
+ * aligned buffer and stops short at the end of file */
+static int readJob(const pipeline_t *pipeline, unsigned char *buffer, size_t offset,
+                   size_t size)
+{
+    size_t done = 0, request;
+    ssize_t rc;
+
+    while (done < size) {
+        request = size - done;
+        if (INPUT_DIRECT == pipeline->inputMode) {
+            request = (request + DIRECT_IO_ALIGN - 1) & ~((size_t)DIRECT_IO_ALIGN - 1);
+        }
+        rc = pread(pipeline->inputFile, buffer + done, request, (off_t)(offset + done));
+        if (rc < 0 && EINTR == errno) {
+            continue;
+        }
+        if (rc <= 0) {
+            return -1;
+        }
+        done += (size_t)rc;
+    }
+    return 0;
+}
+
+static void *readerThread(void *arg)
+{
+    pipeline_t *pipeline = (pipeline_t *)arg;
+    slot_t *slot;
+    size_t job, offset, size;
+
+    for (job = 0; job < pipeline->nbJobs; job++) {
+        slot = &pipeline->slots[job % pipeline->nbSlots];
+        pthread_mutex_lock(&pipeline->mutex);
+        while (SLOT_FREE != slot->state && !pipeline->failed) {
+            pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+        }
+        pthread_mutex_unlock(&pipeline->mutex);
+        if (pipeline->failed) {
+            break;
+        }
+
+        offset = job * pipeline->jobSize;
+        size = pipeline->srcSize - offset < pipeline->jobSize ?
+               pipeline->srcSize - offset : pipeline->jobSize;
+        if (NULL != pipeline->map) {
+            slot->src = pipeline->map + offset;
+        } else if (readJob(pipeline, slot->readBuffer, offset, size)) {
+            DISPLAY("Fail to read input: %s\n", strerror(errno));
+            pthread_mutex_lock(&pipeline->mutex);
+            pipeline->failed = 1;
+            pthread_cond_broadcast(&pipeline->cond);
+            pthread_mutex_unlock(&pipeline->mutex);
+            break;
+        } else {
+            slot->src = slot->readBuffer;
+        }
+        slot->srcSize = size;
+        slot->job = job;
+
+        pthread_mutex_lock(&pipeline->mutex);
+        slot->state = SLOT_READ;
+        pipeline->nextRead = job + 1;
+        pthread_cond_broadcast(&pipeline->cond);
+        pthread_mutex_unlock(&pipeline->mutex);
+    }
+    return NULL;
+}
+
+/* Compress a job to a frame, or to the next part of the frame of FORMAT_FRAME,
+ * 0 on error */
+static size_t compressJob(ZSTD_CCtx *zc, const pipeline_t *pipeline, slot_t *slot)
+{
+    ZSTD_inBuffer input = { slot->src, slot->srcSize, 0 };
+    ZSTD_outBuffer output = { slot->dst, slot->dstCapacity, 0 };
+    ZSTD_EndDirective mode;
+    size_t rc;
+
+    if (FORMAT_FRAME != pipeline->format) {
+        rc = ZSTD_compress2(zc, slot->dst, slot->dstCapacity, slot->src, slot->srcSize);
+        if (ZSTD_isError(rc)) {
+            DISPLAY("Compress failed: %s\n", ZSTD_getErrorName(rc));
+            return 0;
+        }
+        return rc;
+    }
+
+    /* Every job is flushed, so its output is complete and bounded */
+    mode = slot->job + 1 == pipeline->nbJobs ? ZSTD_e_end : ZSTD_e_flush;
+    do {
+        rc = ZSTD_compressStream2(zc, &output, &input, mode);
+        if (ZSTD_isError(rc)) {
+            DISPLAY("Compress failed: %s\n", ZSTD_getErrorName(rc));
+            return 0;
+        }
+        if (rc && output.pos == output.size) {
+            DISPLAY("Output buffer is too small\n");
+            return 0;
+        }
+    } while (rc);
+    return output.pos;
+}
+
+static void *workerThread(void *arg)
+{
+    pipeline_t *pipeline = (pipeline_t *)arg;
+    ZSTD_CCtx *zc = ZSTD_createCCtx();
+    void *matchState = NULL;
+    slot_t *slot;
+    size_t dstSize;
+
+    assert(zc != NULL);
+    ZSTD_CCtx_setParameter(zc, ZSTD_c_compressionLevel, pipeline->level);
+    ZSTD_CCtx_setParameter(zc, ZSTD_c_checksumFlag, 1);
+    if (FORMAT_FRAME == pipeline->format) {
+        ZSTD_CCtx_setPledgedSrcSize(zc, pipeline->srcSize);
+    }
+    if (pipeline->useQat) {
+        matchState = QZSTD_createSeqProdState();
+        assert(matchState != NULL);
+        ZSTD_registerSequenceProducer(zc, matchState, qatSequenceProducer);
+        /* Blocks QAT fails on are compressed by zstd */
+        ZSTD_CCtx_setParameter(zc, ZSTD_c_enableSeqProducerFallback, 1);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&pipeline->mutex);
+        for (;;) {
+            slot = &pipeline->slots[pipeline->nextCompress % pipeline->nbSlots];
+            if (pipeline->failed || pipeline->nextCompress == pipeline->nbJobs ||
+                (SLOT_READ == slot->state && slot->job == pipeline->nextCompress)) {
+                break;
+            }
+            pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+        }
+        if (pipeline->failed || pipeline->nextCompress == pipeline->nbJobs) {
+            pthread_mutex_unlock(&pipeline->mutex);
+            break;
+        }
+        slot->state = SLOT_BUSY;
+        pipeline->nextCompress++;
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        dstSize = compressJob(zc, pipeline, slot);
+
+        pthread_mutex_lock(&pipeline->mutex);
+        slot->dstSize = dstSize;
+        slot->state = SLOT_DONE;
+        pipeline->failed |= 0 == dstSize;
+        pthread_cond_broadcast(&pipeline->cond);
+        pthread_mutex_unlock(&pipeline->mutex);
+    }
+
+    ZSTD_freeCCtx(zc);
+    QZSTD_freeSeqProdState(matchState);
+    return NULL;
+}
+
+/* Skippable frame of the seek table, checksums are the low 32 bits of the
+ * XXH64 at the end of every frame */
+static int writeSeekTable(int outputFile, const seekEntry_t *entries, size_t nbEntries,
+                          size_t *written)
+{
+    size_t tableSize = nbEntries * SEEK_ENTRY_SIZE + SEEK_TABLE_FOOTER_SIZE;
+    unsigned char *table = (unsigned char *)malloc(8 + tableSize);
+    unsigned char *p = table;
+    size_t i;
+    int rc;
+
+    assert(table != NULL);
+    writeLE32(p, SEEK_TABLE_MAGIC);
+    writeLE32(p + 4, (unsigned int)tableSize);
+    p += 8;
+    for (i = 0; i < nbEntries; i++) {
+        writeLE32(p, entries[i].cSize);
+        writeLE32(p + 4, entries[i].dSize);
+        writeLE32(p + 8, entries[i].checksum);
+        p += SEEK_ENTRY_SIZE;
+    }
+    writeLE32(p, (unsigned int)nbEntries);
+    p[4] = SEEK_TABLE_CHECKSUM_FLAG;
+    writeLE32(p + 5, SEEKABLE_MAGIC);
+    rc = writeAll(outputFile, table, 8 + tableSize);
+    *written += 8 + tableSize;
+    free(table);
+    return rc;
+}
+
+int main(int argc, const char **argv)
+{
+    int argNb, i, rc = -1;
+    int nbWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int force = 0, softwareOnly = 0, quiet = 0;
+    const char *fileName = NULL, *outFileName = NULL;
+    char *defaultOutFileName = NULL;
+    pipeline_t pipeline;
+    pthread_t reader, workers[MAX_WORKERS];
+    int nbStarted = 0, readerStarted = 0;
+    seekEntry_t *entries = NULL;
+    struct stat inputStat;
+    int outputFile = -1, outputCreated = 0;
+    size_t job = 0, written = 0, bufferSize;
+    slot_t *slot;
+    struct timespec startTicks, endTicks;
+    unsigned long long nanosec;
+    QZSTD_Stats_T statsStart, statsEnd;
+
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.jobSize = DEFAULT_JOB_SIZE;
+    pipeline.format = FORMAT_MULTI_FRAME;
+    pipeline.inputMode = INPUT_READ;
+    pipeline.level = ZSTD_CLEVEL_DEFAULT;
+    pipeline.inputFile = -1;
+
+    if (argc < 2)
+        return usage(argv[0]);
+
+    for (argNb = 1; argNb < argc; argNb++) {
+        const char *arg = argv[argNb];
+        if (arg[0] == '-') {
+            arg++;
+            while (arg[0] != 0) {
+                switch (arg[0]) {
+                /* Display help message */
+                case 'h':
+                case 'H':
+                    return usage(argv[0]);
+                /* Set compression level */
+                case 'L':
+                    arg++;
+                    pipeline.level = (int)stringToU32(&arg);
+                    break;
+                /* Set worker threads */
+                case 'T':
+                    arg++;
+                    nbWorkers = (int)stringToU32(&arg);
+                    break;
+                /* Set job size */
+                case 'B':
+                    arg++;
+                    pipeline.jobSize = stringToU32(&arg);
+                    break;
+                /* Set output format */
+                case 'F':
+                    arg++;
+                    pipeline.format = (format_e)stringToU32(&arg);
+                    break;
+                /* Set input mode */
+                case 'i':
+                    arg++;
+                    pipeline.inputMode = (inputMode_e)stringToU32(&arg);
+                    break;
+                /* Set output file */
+                case 'o':
+                    if (arg[1] != 0 || argNb + 1 >= argc) {
+                        return usage(argv[0]);
+                    }
+                    outFileName = argv[++argNb];
+                    arg++;
+                    break;
+                case 'f':
+                    arg++;
+                    force = 1;
+                    break;
+                case 's':
+                    arg++;
+                    softwareOnly = 1;
+                    break;
+                case 'q':
+                    arg++;
+                    quiet = 1;
+                    break;
+                /* Unknown argument */
+                default :
+                    return usage(argv[0]);
+                }
+            }
+            continue;
+        }
+        if (!fileName) {
+            fileName = arg;
+            continue;
+        }
+    }
+    if (nbWorkers > MAX_WORKERS) {
+        nbWorkers = MAX_WORKERS;
+    }
+    if (!fileName || pipeline.level < 1 || pipeline.level > ZSTD_maxCLevel() ||
+        nbWorkers < 1 || 0 == pipeline.jobSize || pipeline.jobSize > MAX_JOB_SIZE ||
+        pipeline.format > FORMAT_SEEKABLE || pipeline.inputMode > INPUT_DIRECT) {
+        return usage(argv[0]);
+    }
+    /* zstd can't split a frame between threads with a sequence producer */
+    if (FORMAT_FRAME == pipeline.format) {
+        nbWorkers = 1;
+    }
+
+    /* Open the input */
+    pipeline.inputFile = open(fileName, O_RDONLY |
+                              (INPUT_DIRECT == pipeline.inputMode ? O_DIRECT : 0));
+    if (pipeline.inputFile < 0 && INPUT_DIRECT == pipeline.inputMode) {
+        DISPLAY("O_DIRECT isn't supported for %s, reading it through the page cache\n",
+                fileName);
+        pipeline.inputMode = INPUT_READ;
+        pipeline.inputFile = open(fileName, O_RDONLY);
+    }
+    if (pipeline.inputFile < 0 || fstat(pipeline.inputFile, &inputStat) ||
+        !S_ISREG(inputStat.st_mode)) {
+        DISPLAY("Cannot open input file: %s\n", fileName);
+        goto exit;
+    }
+    pipeline.srcSize = (size_t)inputStat.st_size;
+    if (INPUT_DIRECT == pipeline.inputMode) {
+        pipeline.jobSize = (pipeline.jobSize + DIRECT_IO_ALIGN - 1) &
+                           ~((size_t)DIRECT_IO_ALIGN - 1);
+    }
+    if (INPUT_MMAP == pipeline.inputMode && pipeline.srcSize) {
+        pipeline.map = (const unsigned char *)mmap(NULL, pipeline.srcSize, PROT_READ,
+                       MAP_PRIVATE, pipeline.inputFile, 0);
+        if (MAP_FAILED == pipeline.map) {
+            DISPLAY("Cannot map input file: %s\n", fileName);
+            pipeline.map = NULL;
+            goto exit;
+        }
+        madvise((void *)pipeline.map, pipeline.srcSize, MADV_SEQUENTIAL);
+    }
+    /* An empty file is one empty job, for a valid frame */
+    pipeline.nbJobs = pipeline.srcSize ?
+                      (pipeline.srcSize + pipeline.jobSize - 1) / pipeline.jobSize : 1;
+    /* More workers than jobs would only hold idle sessions and buffers */
+    if ((size_t)nbWorkers > pipeline.nbJobs) {
+        nbWorkers = (int)pipeline.nbJobs;
+    }
+    if (pipeline.jobSize > pipeline.srcSize && pipeline.srcSize) {
+        pipeline.jobSize = INPUT_DIRECT == pipeline.inputMode ?
+                           (pipeline.srcSize + DIRECT_IO_ALIGN - 1) & ~((size_t)DIRECT_IO_ALIGN - 1) :
+                           pipeline.srcSize;
+    }
+
+    /* Open the output */
+    if (NULL == outFileName) {
+        defaultOutFileName = (char *)malloc(strlen(fileName) + 5);
+        assert(defaultOutFileName != NULL);
+        sprintf(defaultOutFileName, "%s.zst", fileName);
+        outFileName = defaultOutFileName;
+    }
+    outputFile = open(outFileName, O_WRONLY | O_CREAT | O_TRUNC | (force ? 0 : O_EXCL), 0644);
+    if (outputFile < 0) {
+        DISPLAY("Cannot create output file: %s%s\n", outFileName,
+                EEXIST == errno ? ", already exists, use -f to overwrite" : "");
+        goto exit;
+    }
+    outputCreated = 1;
+
+    /* Fall back to zstd for the whole file without QAT */
+    if (!softwareOnly) {
+        pipeline.useQat = QZSTD_OK == QZSTD_startQatDevice();
+        if (!pipeline.useQat && !quiet) {
+            DISPLAY("QAT is not available, compressing with zstd only\n");
+        }
+    }
+
+    /* Two slots per worker, one compressing and one reading or writing */
+    pipeline.nbSlots = nbWorkers * SLOTS_PER_WORKER;
+    pipeline.slots = (slot_t *)calloc(pipeline.nbSlots, sizeof(slot_t));
+    entries = (seekEntry_t *)calloc(pipeline.nbJobs, sizeof(seekEntry_t));
+    assert(pipeline.slots != NULL && entries != NULL);
+    bufferSize = pipeline.jobSize ? pipeline.jobSize : 1;
+    for (i = 0; i < pipeline.nbSlots; i++) {
+        slot = &pipeline.slots[i];
+        slot->dstCapacity = ZSTD_compressBound(bufferSize) + ZSTD_BLOCKSIZE_MAX;
+        slot->dst = (unsigned char *)malloc(slot->dstCapacity);
+        assert(slot->dst != NULL);
+        if (NULL == pipeline.map && pipeline.srcSize &&
+            posix_memalign((void **)&slot->readBuffer, DIRECT_IO_ALIGN, bufferSize)) {
+            DISPLAY("Fail to allocate buffers\n");
+            goto exit;
+        }
+    }
+    pthread_mutex_init(&pipeline.mutex, NULL);
+    pthread_cond_init(&pipeline.cond, NULL);
+
+    QZSTD_getStats(&statsStart);
+    GETTIME(startTicks);
+    if (pthread_create(&reader, NULL, readerThread, &pipeline)) {
+        DISPLAY("Fail to create the reader thread\n");
+        goto stop;
+    }
+    readerStarted = 1;
+    for (; nbStarted < nbWorkers; nbStarted++) {
+        if (pthread_create(&workers[nbStarted], NULL, workerThread, &pipeline)) {
+            DISPLAY("Fail to create worker threads\n");
+            break;
+        }
+    }
+    if (0 == nbStarted) {
+        pthread_mutex_lock(&pipeline.mutex);
+        pipeline.failed = 1;
+        pthread_cond_broadcast(&pipeline.cond);
+        pthread_mutex_unlock(&pipeline.mutex);
+    }
+
+    /* Write the jobs in order as they are compressed */
+    for (job = 0; job < pipeline.nbJobs; job++) {
+        slot = &pipeline.slots[job % pipeline.nbSlots];
+        pthread_mutex_lock(&pipeline.mutex);
+        while ((SLOT_DONE != slot->state || slot->job != job) && !pipeline.failed) {
+            pthread_cond_wait(&pipeline.cond, &pipeline.mutex);
+        }
+        pthread_mutex_unlock(&pipeline.mutex);
+        if (pipeline.failed) {
+            break;
+        }
+        if (writeAll(outputFile, slot->dst, slot->dstSize)) {
+            DISPLAY("Fail to write output: %s\n", strerror(errno));
+            pthread_mutex_lock(&pipeline.mutex);
+            pipeline.failed = 1;
+            pthread_cond_broadcast(&pipeline.cond);
+            pthread_mutex_unlock(&pipeline.mutex);
+            break;
+        }
+        written += slot->dstSize;
+        entries[job].cSize = (unsigned int)slot->dstSize;
+        entries[job].dSize = (unsigned int)slot->srcSize;
+        entries[job].checksum = slot->dstSize >= 4 ?
+                                readLE32(slot->dst + slot->dstSize - 4) : 0;
+        pthread_mutex_lock(&pipeline.mutex);
+        slot->state = SLOT_FREE;
+        pthread_cond_broadcast(&pipeline.cond);
+        pthread_mutex_unlock(&pipeline.mutex);
+    }
+
+stop:
+    if (readerStarted) {
+        pthread_join(reader, NULL);
+    }
+    for (i = 0; i < nbStarted; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    if (pipeline.failed || job != pipeline.nbJobs) {
+        goto exit;
+    }
+    if (FORMAT_SEEKABLE == pipeline.format &&
+        writeSeekTable(outputFile, entries, pipeline.nbJobs, &written)) {
+        DISPLAY("Fail to write output: %s\n", strerror(errno));
+        goto exit;
+    }
+    if (close(outputFile)) {
+        outputFile = -1;
+        DISPLAY("Fail to write output: %s\n", strerror(errno));
+        goto exit;
+    }
+    outputFile = -1;
+    GETTIME(endTicks);
+    QZSTD_getStats(&statsEnd);
+    nanosec = GETDIFFTIME(startTicks, endTicks);
+
+    if (!quiet) {
+        DISPLAY("%s: %lu -> %lu (%.2f%%), %.1f MB/s, %lu frame%s, %d worker%s, %s",
+                fileName, (unsigned long)pipeline.srcSize, (unsigned long)written,
+                pipeline.srcSize ? 100.0 * written / pipeline.srcSize : 0,
+                nanosec ? (double)pipeline.srcSize / MB / ((double)nanosec / NANOSEC) : 0,
+                FORMAT_FRAME == pipeline.format ? 1UL : (unsigned long)pipeline.nbJobs,
+                FORMAT_FRAME == pipeline.format || 1 == pipeline.nbJobs ? "" : "s",
+                nbWorkers, 1 == nbWorkers ? "" : "s",
+                !pipeline.useQat ? "zstd" :
+                QZSTD_BACKEND_SW == QZSTD_getBackend() ? "software engine" : "QAT");
+        if (pipeline.useQat) {
+            DISPLAY(", blocks fallen back to zstd: %lu",
+                    (unsigned long)(statsEnd.failedBlocks - statsStart.failedBlocks));
+        }
+        DISPLAY("\n");
+    }
+    rc = 0;
+
+exit:
+    if (outputFile >= 0) {
+        close(outputFile);
+    }
+    if (0 != rc && outputCreated) {
+        unlink(outFileName);
+    }
+    if (NULL != pipeline.slots) {
+        for (i = 0; i < pipeline.nbSlots; i++) {
+            free(pipeline.slots[i].dst);
+            free(pipeline.slots[i].readBuffer);
+        }
+        free(pipeline.slots);
+        pthread_mutex_destroy(&pipeline.mutex);
+        pthread_cond_destroy(&pipeline.cond);
+    }
+    if (!softwareOnly) {
+        QZSTD_stopQatDevice();
+    }
+    if (NULL != pipeline.map) {
+        munmap((void *)pipeline.map, pipeline.srcSize);
+    }
+    if (pipeline.inputFile >= 0) {
+        close(pipeline.inputFile);
+    }
+    free(entries);
+    free(defaultOutFileName);
+    return rc;
+}
@@ -0,0 +1,558 @@
+/***************************************************************************
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2024 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***************************************************************************/
+
+/* Replay tool of the captures of QAT sequence producer. The calls recorded by
+ * QZSTD_startCapture are issued again on the same schedule, one replay thread
+ * per captured thread, against QAT or the software engine, and the throughput
+ * and latency are compared with the capture. Blocks are made of their sample,
+ * completed from an input file, or from generated text without one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef ZSTD_STATIC_LINKING_ONLY
+#define ZSTD_STATIC_LINKING_ONLY
+#endif
+#include "zstd.h"
+#include "qatseqprod.h"
+
+#define NANOSEC (1000000000ULL) /* 1 second */
+#define NANOUSEC (1000) /* 1 usec */
+#define MB (1000000)   /* 1MB */
+#define MAX_THREADS 2048
+
+#define DISPLAY(...)  fprintf(stderr, __VA_ARGS__)
+
+#define GETTIME(now) {clock_gettime(CLOCK_MONOTONIC, &now);};
+#define GETDIFFTIME(start_ticks, end_ticks) (1000000000ULL*( end_ticks.tv_sec - start_ticks.tv_sec ) + ( end_ticks.tv_nsec - start_ticks.tv_nsec ))
+
+typedef struct {
+    QZSTD_CaptureRecord_T record;
+    size_t sampleOffset; /* Sample of the block in the sample buffer */
+} replayCall_t;
+
+typedef struct {
+    const replayCall_t *calls; /* All the calls of the capture */
+    size_t *indexes; /* Calls of this thread, in order */
+    size_t nbCalls;
+    unsigned long long firstNs; /* Earliest call of the capture */
+    unsigned long long loopNs; /* Duration of the capture, between loops */
+    unsigned speed; /* Percent of the captured speed */
+    int asap; /* 1: issue the calls one after another, ignoring the schedule */
+    unsigned nbLoops;
+    size_t maxSrcSize;
+    unsigned long long *response; /* Latency from the scheduled start of every call */
+    unsigned long long *service; /* Latency from the actual start of every call */
+    size_t nbDone;
+    size_t failed;
+    size_t bytes;
+    pthread_t thread;
+} replayThread_t;
+
+static const unsigned char *g_samples = NULL;
+static const unsigned char *g_fill = NULL; /* Data completing the samples */
+static size_t g_fillSize = 0;
+static pthread_barrier_t g_startBarrier;
+
+static int usage(const char *exe)
+{
+    DISPLAY("Usage:\n");
+    DISPLAY("      %s [arg] capture\n", exe);
+    DISPLAY("Options:\n");
+    DISPLAY("    -s        Replay on the software engine instead of QAT\n");
+    DISPLAY("    -i file   Complete the blocks beyond their sample with data of file\n");
+    DISPLAY("    -x#       Replay at # percent of the captured speed (default: 100)\n");
+    DISPLAY("    -a        Issue the calls of a thread one after another, ignoring the schedule\n");
+    DISPLAY("    -l#       Replay the capture # times (default: 1)\n");
+    DISPLAY("    -h/H      Print this help message\n");
+    return 0;
+}
+
+/* this function to convert string to unsigned int,
+ * the string MUST BE starting with numeric and can be
+ * end with "K" or "M".
+ */
+static unsigned stringToU32(const char **s)
+{
+    unsigned value = 0;
+    while ((**s >= '0') && (**s <= '9')) {
+        if (value > ((((unsigned)(-1)) / 10) - 1)) {
+            DISPLAY("ERROR: numeric value is too large\n");
+            exit(1);
+        }
+        value *= 10;
+        value += (unsigned)(**s - '0');
+        (*s)++ ;
+    }
+    if ((**s == 'K') || (**s == 'M')) {
+        if (value > ((unsigned)(-1)) >> 10) {
+            DISPLAY("ERROR: numeric value is too large\n");
+            exit(1);
+        }
+        value <<= 10;
+        if (**s == 'M') {
+            if (value > ((unsigned)(-1)) >> 10) {
+                DISPLAY("ERROR: numeric value is too large\n");
+                exit(1);
+            }
+            value <<= 10;
+        }
+        (*s)++;
+    }
+    return value;
+}
+
+static int compareU64(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Percentile of sorted values */
+static double percentile(const unsigned long long *values, size_t num, double p)
+{
+    size_t index;
+
+    if (num == 0) {
+        return 0;
+    }
+    index = (size_t)(num * p / 100);
+    return (double)values[index < num ? index : num - 1];
+}
+
+static void displayLatency(const char *name, unsigned long long *values, size_t num)
+{
+    qsort(values, num, sizeof(*values), compareU64);
+    DISPLAY("%-9s P50: %4.2f us, P90: %4.2f us, P99: %4.2f us, P99.9: %4.2f us, Max: %4.2f us\n",
+            name, percentile(values, num, 50) / NANOUSEC, percentile(values, num, 90) / NANOUSEC,
+            percentile(values, num, 99) / NANOUSEC, percentile(values, num, 99.9) / NANOUSEC,
+            num ? (double)values[num - 1] / NANOUSEC : 0);
+}
+
+/* Text of words from a small vocabulary, compressible like logs, for blocks
+ * without sample and input file */
+static unsigned char *generateText(size_t size)
+{
+    static const char *const words[] = {
+        "request", "response", "status", "error", "user", "session", "time",
+        "value", "count", "id", "server", "client", "data", "ok", "the", "of"
+    };
+    unsigned char *text = (unsigned char *)malloc(size);
+    unsigned int seed = 1;
+    size_t pos = 0, len;
+    const char *word;
+
+    assert(text != NULL);
+    while (pos < size) {
+        seed = seed * 1103515245 + 12345;
+        word = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+        len = strlen(word);
+        len = len < size - pos ? len : size - pos;
+        memcpy(text + pos, word, len);
+        pos += len;
+        if (pos < size) {
+            text[pos++] = (seed >> 8) % 7 ? ' ' : '\n';
+        }
+    }
+    return text;
+}
+
+/* The block of a call: its sample, then the fill data from fillPos */
+static void makeBlock(const replayCall_t *call, unsigned char *block, size_t *fillPos)
+{
+    size_t size = call->record.srcSize, pos = call->record.sampleSize, len;
+
+    memcpy(block, g_samples + call->sampleOffset, pos);
+    while (pos < size) {
+        if (g_fill) {
+            len = g_fillSize - *fillPos < size - pos ? g_fillSize - *fillPos : size - pos;
+            memcpy(block + pos, g_fill + *fillPos, len);
+            *fillPos = (*fillPos + len) % g_fillSize;
+        } else {
+            /* Without fill data the sample is repeated */
+            len = pos < size - pos ? pos : size - pos;
+            memcpy(block + pos, block, len);
+        }
+        pos += len;
+    }
+}
+
+static void *replay(void *args)
+{
+    replayThread_t *thread = (replayThread_t *)args;
+    void *state = QZSTD_createSeqProdState();
+    size_t seqCapacity = ZSTD_sequenceBound(thread->maxSrcSize);
+    ZSTD_Sequence *seqs = (ZSTD_Sequence *)malloc(seqCapacity * sizeof(ZSTD_Sequence));
+    unsigned char *block = (unsigned char *)malloc(thread->maxSrcSize);
+    struct timespec start, scheduled, actual, end;
+    size_t i, fillPos = 0, rc;
+    unsigned loop;
+    unsigned long long offset;
+
+    assert(state && seqs && block);
+    pthread_barrier_wait(&g_startBarrier);
+    GETTIME(start);
+    for (loop = 0; loop < thread->nbLoops; loop++) {
+        for (i = 0; i < thread->nbCalls; i++) {
+            const replayCall_t *call = &thread->calls[thread->indexes[i]];
+            makeBlock(call, block, &fillPos);
+            offset = (call->record.timeNs - thread->firstNs + loop * thread->loopNs) * 100 / thread->speed;
+            scheduled.tv_sec = start.tv_sec + (time_t)(offset / NANOSEC);
+            scheduled.tv_nsec = start.tv_nsec + (long)(offset % NANOSEC);
+            if (scheduled.tv_nsec >= (long)NANOSEC) {
+                scheduled.tv_sec++;
+                scheduled.tv_nsec -= NANOSEC;
+            }
+            if (!thread->asap) {
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &scheduled, NULL);
+            }
+            GETTIME(actual);
+            rc = qatSequenceProducer(state, seqs, seqCapacity, block, call->record.srcSize,
+                                     NULL, 0, call->record.level,
+                                     (size_t)call->record.windowSize);
+            GETTIME(end);
+            if (rc == ZSTD_SEQUENCE_PRODUCER_ERROR) {
+                thread->failed++;
+            }
+            thread->service[thread->nbDone] = GETDIFFTIME(actual, end);
+            thread->response[thread->nbDone] = thread->asap ? thread->service[thread->nbDone] :
+                                               GETDIFFTIME(scheduled, end);
+            thread->bytes += call->record.srcSize;
+            thread->nbDone++;
+        }
+    }
+    QZSTD_freeSeqProdState(state);
+    free(seqs);
+    free(block);
+    return NULL;
+}
+
+/* Read the records of a capture and their samples */
+static replayCall_t *loadCapture(const char *fileName, size_t *nbCalls, unsigned char **samples)
+{
+    FILE *file = fopen(fileName, "rb");
+    QZSTD_CaptureHeader_T header;
+    replayCall_t *calls = NULL, *tmpCalls;
+    unsigned char *tmpSamples;
+    size_t capacity = 0, samplesSize = 0, samplesCapacity = 0;
+
+    *nbCalls = 0;
+    *samples = NULL;
+    if (!file) {
+        DISPLAY("Cannot open capture file: %s\n", fileName);
+        return NULL;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != QZSTD_CAPTURE_MAGIC || header.version != QZSTD_CAPTURE_VERSION ||
+        header.recordSize != sizeof(QZSTD_CaptureRecord_T)) {
+        DISPLAY("Invalid capture file: %s\n", fileName);
+        goto error;
+    }
+    for (;;) {
+        QZSTD_CaptureRecord_T record;
+        if (fread(&record, sizeof(record), 1, file) != 1) {
+            break;
+        }
+        if (record.sampleSize > record.srcSize || record.thread >= MAX_THREADS) {
+            DISPLAY("Invalid record %lu in capture file\n", *nbCalls);
+            goto error;
+        }
+        if (*nbCalls == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            tmpCalls = (replayCall_t *)realloc(calls, capacity * sizeof(replayCall_t));
+            assert(tmpCalls != NULL);
+            calls = tmpCalls;
+        }
+        if (samplesSize + record.sampleSize > samplesCapacity) {
+            samplesCapacity = (samplesSize + record.sampleSize) * 2;
+            tmpSamples = (unsigned char *)realloc(*samples, samplesCapacity);
+            assert(tmpSamples != NULL);
+            *samples = tmpSamples;
+        }
+        if (record.sampleSize &&
+            fread(*samples + samplesSize, record.sampleSize, 1, file) != 1) {
+            DISPLAY("Truncated capture file, sample of record %lu\n", *nbCalls);
+            break;
+        }
+        calls[*nbCalls].record = record;
+        calls[*nbCalls].sampleOffset = samplesSize;
+        samplesSize += record.sampleSize;
+        (*nbCalls)++;
+    }
+    fclose(file);
+    return calls;
+
+error:
+    fclose(file);
+    free(calls);
+    free(*samples);
+    *samples = NULL;
+    *nbCalls = 0;
+    return NULL;
+}
+
+int main(int argc, const char **argv)
+{
+    int argNb, nbThreads = 0, useSw = 0;
+    unsigned speed = 100, nbLoops = 1;
+    int asap = 0, needFill = 0;
+    const char *fileName = NULL, *fillFileName = NULL;
+    replayCall_t *calls;
+    unsigned char *samples = NULL, *fill = NULL;
+    size_t nbCalls, i, maxSrcSize = 0, totalDone = 0, totalBytes = 0, totalFailed = 0;
+    size_t capturedFailed = 0, capturedBytes = 0;
+    unsigned long long firstNs = (unsigned long long)-1, lastNs = 0;
+    unsigned long long *captured, *response, *service;
+    replayThread_t *threads;
+    struct timespec startTicks, endTicks;
+    QZSTD_StartOptions_T startOptions;
+    double elapsed, capturedElapsed;
+    int t;
+
+    if (argc < 2)
+        return usage(argv[0]);
+
+    for (argNb = 1; argNb < argc; argNb++) {
+        const char *arg = argv[argNb];
+        if (arg[0] == '-') {
+            arg++;
+            while (arg[0] != 0) {
+                switch (arg[0]) {
+                /* Display help message */
+                case 'h':
+                case 'H':
+                    return usage(argv[0]);
+                /* Replay on the software engine */
+                case 's':
+                    arg++;
+                    useSw = 1;
+                    break;
+                /* Set fill data */
+                case 'i':
+                    if (arg[1] != 0 || argNb + 1 >= argc) {
+                        return usage(argv[0]);
+                    }
+                    fillFileName = argv[++argNb];
+                    arg++;
+                    break;
+                /* Set speed */
+                case 'x':
+                    arg++;
+                    speed = stringToU32(&arg);
+                    if (speed == 0) {
+                        return usage(argv[0]);
+                    }
+                    break;
+                /* Ignore the schedule */
+                case 'a':
+                    arg++;
+                    asap = 1;
+                    break;
+                /* Set loops */
+                case 'l':
+                    arg++;
+                    nbLoops = stringToU32(&arg);
+                    if (nbLoops == 0) {
+                        return usage(argv[0]);
+                    }
+                    break;
+                /* Unknown argument */
+                default :
+                    return usage(argv[0]);
+                }
+            }
+            continue;
+        }
+        if (!fileName) {
+            fileName = arg;
+            continue;
+        }
+    }
+    if (!fileName) {
+        return usage(argv[0]);
+    }
+
+    calls = loadCapture(fileName, &nbCalls, &samples);
+    if (!calls || nbCalls == 0) {
+        DISPLAY("No call to replay in %s\n", fileName);
+        free(calls);
+        free(samples);
+        return -1;
+    }
+    g_samples = samples;
+
+    /* Load fill data, or generate it for blocks without sample */
+    if (fillFileName) {
+        FILE *fillFile = fopen(fillFileName, "rb");
+        if (!fillFile) {
+            DISPLAY("Cannot open input file: %s\n", fillFileName);
+            return -1;
+        }
+        fseek(fillFile, 0, SEEK_END);
+        g_fillSize = ftell(fillFile);
+        fseek(fillFile, 0, SEEK_SET);
+        fill = (unsigned char *)malloc(g_fillSize ? g_fillSize : 1);
+        assert(fill != NULL);
+        if (g_fillSize == 0 || fread(fill, 1, g_fillSize, fillFile) != g_fillSize) {
+            DISPLAY("Cannot read input file: %s\n", fillFileName);
+            fclose(fillFile);
+            return -1;
+        }
+        fclose(fillFile);
+    }
+
+    captured = (unsigned long long *)malloc(nbCalls * sizeof(unsigned long long));
+    assert(captured != NULL);
+    for (i = 0; i < nbCalls; i++) {
+        const QZSTD_CaptureRecord_T *record = &calls[i].record;
+        if (record->srcSize > maxSrcSize) {
+            maxSrcSize = record->srcSize;
+        }
+        if ((int)record->thread + 1 > nbThreads) {
+            nbThreads = (int)record->thread + 1;
+        }
+        if (record->timeNs < firstNs) {
+            firstNs = record->timeNs;
+        }
+        if (record->timeNs + record->latencyNs > lastNs) {
+            lastNs = record->timeNs + record->latencyNs;
+        }
+        /* A block without sample is made of fill data only */
+        if (record->sampleSize == 0 && record->srcSize) {
+            needFill = 1;
+        }
+        captured[i] = record->latencyNs;
+        capturedBytes += record->srcSize;
+        capturedFailed += record->failed;
+    }
+    if (!fillFileName && needFill) {
+        g_fillSize = maxSrcSize;
+        fill = generateText(g_fillSize);
+    }
+    g_fill = fill;
+
+    /* Every captured thread is replayed by a thread */
+    threads = (replayThread_t *)calloc(nbThreads, sizeof(replayThread_t));
+    assert(threads != NULL);
+    for (t = 0; t < nbThreads; t++) {
+        threads[t].indexes = (size_t *)malloc(nbCalls * sizeof(size_t));
+        assert(threads[t].indexes != NULL);
+    }
+    for (i = 0; i < nbCalls; i++) {
+        replayThread_t *thread = &threads[calls[i].record.thread];
+        thread->indexes[thread->nbCalls++] = i;
+    }
+
+    memset(&startOptions, 0, sizeof(startOptions));
+    startOptions.backend = useSw ? QZSTD_BACKEND_SW : QZSTD_BACKEND_DEFAULT;
+    if (QZSTD_OK != QZSTD_startQatDeviceEx(&startOptions)) {
+        DISPLAY("Fail to start %s\n", useSw ? "the software engine" : "QAT");
+        return -1;
+    }
+
+    pthread_barrier_init(&g_startBarrier, NULL, nbThreads + 1);
+    for (t = 0; t < nbThreads; t++) {
+        replayThread_t *thread = &threads[t];
+        thread->calls = calls;
+        thread->firstNs = firstNs;
+        thread->loopNs = lastNs - firstNs;
+        thread->speed = speed;
+        thread->asap = asap;
+        thread->nbLoops = nbLoops;
+        thread->maxSrcSize = maxSrcSize;
+        thread->response = (unsigned long long *)malloc(
+                               (thread->nbCalls * nbLoops + 1) * sizeof(unsigned long long));
+        thread->service = (unsigned long long *)malloc(
+                              (thread->nbCalls * nbLoops + 1) * sizeof(unsigned long long));
+        assert(thread->response && thread->service);
+        pthread_create(&thread->thread, NULL, replay, thread);
+    }
+    pthread_barrier_wait(&g_startBarrier);
+    GETTIME(startTicks);
+    for (t = 0; t < nbThreads; t++) {
+        pthread_join(threads[t].thread, NULL);
+    }
+    GETTIME(endTicks);
+    pthread_barrier_destroy(&g_startBarrier);
+
+    response = (unsigned long long *)malloc(nbCalls * nbLoops * sizeof(unsigned long long));
+    service = (unsigned long long *)malloc(nbCalls * nbLoops * sizeof(unsigned long long));
+    assert(response && service);
+    for (t = 0; t < nbThreads; t++) {
+        memcpy(response + totalDone, threads[t].response,
+               threads[t].nbDone * sizeof(unsigned long long));
+        memcpy(service + totalDone, threads[t].service,
+               threads[t].nbDone * sizeof(unsigned long long));
+        totalDone += threads[t].nbDone;
+        totalBytes += threads[t].bytes;
+        totalFailed += threads[t].failed;
+    }
+
+    elapsed = (double)GETDIFFTIME(startTicks, endTicks) / NANOSEC;
+    capturedElapsed = (double)(lastNs - firstNs) / NANOSEC;
+    DISPLAY("Capture: %lu calls, %d threads, %lu bytes in %4.2f s, %5.f MB/s, %.0f calls/s, failed: %lu\n",
+            nbCalls, nbThreads, capturedBytes, capturedElapsed,
+            capturedElapsed ? capturedBytes / capturedElapsed / MB : 0,
+            capturedElapsed ? nbCalls / capturedElapsed : 0, capturedFailed);
+    DISPLAY("Replay on %s at %u%%%s: %lu calls, %lu bytes in %4.2f s, %5.f MB/s, %.0f calls/s, failed: %lu\n",
+            useSw ? "software engine" : "QAT", speed, asap ? " ignoring the schedule" : "",
+            totalDone, totalBytes, elapsed, elapsed ? totalBytes / elapsed / MB : 0,
+            elapsed ? totalDone / elapsed : 0, totalFailed);
+    displayLatency("Captured", captured, nbCalls);
+    displayLatency("Service", service, totalDone);
+    if (!asap) {
+        displayLatency("Response", response, totalDone);
+    }
+
+    QZSTD_stopQatDevice();
+    for (t = 0; t < nbThreads; t++) {
+        free(threads[t].indexes);
+        free(threads[t].response);
+        free(threads[t].service);
+    }
+    free(threads);
+    free(response);
+    free(service);
+    free(captured);
+    free(calls);
+    free(samples);
+    free(fill);
+    return 0;
+}
@@ -0,0 +1,1532 @@
+/***************************************************************************
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c) 2024 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***************************************************************************/
+
+/* Round trip tests of QAT sequence producer. QAT is started with the software
+ * engine, so they run without QAT device. Every test compresses generated
+ * data and checks every frame decompresses to its source on its own. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifndef ZSTD_STATIC_LINKING_ONLY
+#define ZSTD_STATIC_LINKING_ONLY
+#endif
+#include "zstd.h"
+#include "qatseqprod.h"
+
+#define KB (1024)
+#define BUF_SIZE (4 * 1024 * KB)
+#define LDM_CHUNK_SIZE (256 * KB) /* Beyond the 64KB reach of QAT */
+#define DICT_SIZE (110 * KB)
+#define DICT_CHUNK_SIZE (32 * KB)
+#define TEXT_SIZE (512 * KB)
+#define MAX_BLOCKS 64 /* Blocks of a frame recorded by the checksum callback */
+#define ADAPT_FRAMES 20 /* Frames of TEXT_SIZE, enough blocks to climb the range */
+#define POOL_STATES 80
+#define CAPTURE_SAMPLE 1000 /* Bytes of every block sampled by the capture */ /* More than the state pool and the thread cache hold */
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME32_4 0x27D4EB2FU
+#define XXH_PRIME32_5 0x165667B1U
+
+#define DISPLAY(...)  fprintf(stderr, __VA_ARGS__)
+
+/* Fail the current test */
+#define CHECK(cond, ...)                                      \
+    do {                                                      \
+        if (!(cond)) {                                        \
+            DISPLAY("%s:%d: %s: ", __FILE__, __LINE__, __func__); \
+            DISPLAY(__VA_ARGS__);                             \
+            DISPLAY("\n");                                    \
+            return 0;                                         \
+        }                                                     \
+    } while (0)
+
+typedef struct {
+    const char *name;
+    int (*run)(void);
+} testCase_t;
+
+/* Allocations of a custom allocator */
+typedef struct {
+    size_t allocs;
+    size_t frees;
+} countingMem_t;
+
+/* Blocks given to the checksum callback */
+typedef struct {
+    unsigned char records[MAX_BLOCKS * 8]; /* Checksum and size of every block */
+    unsigned int nbBlocks;
+    unsigned long long size;
+    int mismatch; /* 1: a checksum differs from the XXH32 of its block */
+} checksumBlocks_t;
+
+static ZSTD_CCtx *g_zc = NULL;
+static ZSTD_DCtx *g_zdc = NULL;
+static void *g_matchState = NULL;
+static unsigned char *g_src = NULL;
+static unsigned char *g_dst = NULL;
+static unsigned char *g_decomp = NULL;
+static unsigned char *g_dict = NULL;
+static unsigned int g_seed = 1;
+
+/* xorshift32, the low bits of an LCG would repeat within a chunk */
+static unsigned int nextRand(void)
+{
+    g_seed ^= g_seed << 13;
+    g_seed ^= g_seed >> 17;
+    g_seed ^= g_seed << 5;
+    return g_seed;
+}
+
+/* Words of a small vocabulary, QAT finds matches in it but not everywhere */
+static void genText(unsigned char *buf, size_t size)
+{
+    static const char *const words[] = {
+        "compression ", "sequence ", "producer ", "offload ", "literal ",
+        "match ", "offset ", "window ", "dictionary ", "frame ", "block ",
+        "entropy ", "the ", "of ", "and ", "QAT ", "zstd ", "\n"
+    };
+    size_t pos = 0;
+
+    while (pos < size) {
+        const char *word = words[nextRand() % (sizeof(words) / sizeof(words[0]))];
+        size_t len = strlen(word);
+        if (nextRand() % 8 == 0) {
+            buf[pos++] = (unsigned char)('0' + nextRand() % 10);
+            continue;
+        }
+        len = len < size - pos ? len : size - pos;
+        memcpy(buf + pos, word, len);
+        pos += len;
+    }
+}
+
+/* Random letters repeated every LDM_CHUNK_SIZE, only long distance matches
+ * find the repeats */
+static void genRepeats(unsigned char *buf, size_t size)
+{
+    size_t pos;
+
+    for (pos = 0; pos < size && pos < LDM_CHUNK_SIZE; pos++) {
+        buf[pos] = (unsigned char)('a' + nextRand() % 16);
+    }
+    for (; pos < size; pos++) {
+        buf[pos] = buf[pos - LDM_CHUNK_SIZE];
+    }
+}
+
+/* Random bytes, not compressible */
+static void genRandom(unsigned char *buf, size_t size)
+{
+    size_t pos;
+
+    for (pos = 0; pos < size; pos++) {
+        buf[pos] = (unsigned char)(nextRand() >> 24);
+    }
+}
+
+/* Pieces of g_dict between random letters, matches QAT can't find in the frame */
+static void genDictData(unsigned char *buf, size_t size)
+{
+    size_t pos = 0;
+
+    while (pos < size) {
+        size_t len = 32 + nextRand() % 256, start = nextRand() % (DICT_SIZE - len);
+        size_t i, gap = nextRand() % 64;
+        for (i = 0; i < gap && pos < size; i++) {
+            buf[pos++] = (unsigned char)('a' + nextRand() % 26);
+        }
+        len = len < size - pos ? len : size - pos;
+        memcpy(buf + pos, g_dict + start, len);
+        pos += len;
+    }
+}
+
+static unsigned int readLE32(const unsigned char *p)
+{
+    return p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) |
+           ((unsigned int)p[3] << 24);
+}
+
+static void writeLE32(unsigned char *p, unsigned int value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    p[3] = (unsigned char)(value >> 24);
+}
+
+static unsigned int rotl32(unsigned int x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+static unsigned int xxh32Round(unsigned int acc, unsigned int input)
+{
+    return rotl32(acc + input * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
+}
+
+/* XXH32 with seed 0, to check the checksums of the sequence producer */
+static unsigned int xxh32(const unsigned char *p, size_t len)
+{
+    const unsigned char *end = p + len;
+    unsigned int h;
+
+    if (len >= 16) {
+        unsigned int v1 = XXH_PRIME32_1 + XXH_PRIME32_2, v2 = XXH_PRIME32_2;
+        unsigned int v3 = 0, v4 = 0 - XXH_PRIME32_1;
+        for (; p + 16 <= end; p += 16) {
+            v1 = xxh32Round(v1, readLE32(p));
+            v2 = xxh32Round(v2, readLE32(p + 4));
+            v3 = xxh32Round(v3, readLE32(p + 8));
+            v4 = xxh32Round(v4, readLE32(p + 12));
+        }
+        h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+    } else {
+        h = XXH_PRIME32_5;
+    }
+    h += (unsigned int)len;
+    for (; p + 4 <= end; p += 4) {
+        h = rotl32(h + readLE32(p) * XXH_PRIME32_3, 17) * XXH_PRIME32_4;
+    }
+    for (; p < end; p++) {
+        h = rotl32(h + *p * XXH_PRIME32_5, 11) * XXH_PRIME32_1;
+    }
+    h ^= h >> 15;
+    h *= XXH_PRIME32_2;
+    h ^= h >> 13;
+    h *= XXH_PRIME32_3;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Decode a LZ4 block to dst + dstPos, matches can reach the previous blocks
+ * in dst. Returns the decoded size, or 0 if the block is invalid. */
+static size_t lz4DecodeBlock(const unsigned char *src, size_t srcSize,
+                             unsigned char *dst, size_t dstPos, size_t dstCapacity)
+{
+    size_t ip = 0, op = dstPos;
+
+    while (ip < srcSize) {
+        unsigned int token = src[ip++];
+        size_t litLen = token >> 4, matchLen = token & 15, offset;
+        if (15 == litLen) {
+            unsigned int b;
+            do {
+                if (ip >= srcSize) {
+                    return 0;
+                }
+                b = src[ip++];
+                litLen += b;
+            } while (255 == b);
+        }
+        if (litLen > srcSize - ip || litLen > dstCapacity - op) {
+            return 0;
+        }
+        memcpy(dst + op, src + ip, litLen);
+        ip += litLen;
+        op += litLen;
+        /* The last sequence has no match */
+        if (ip == srcSize) {
+            break;
+        }
+        if (srcSize - ip < 2) {
+            return 0;
+        }
+        offset = src[ip] | ((size_t)src[ip + 1] << 8);
+        ip += 2;
+        if (15 == matchLen) {
+            unsigned int b;
+            do {
+                if (ip >= srcSize) {
+                    return 0;
+                }
+                b = src[ip++];
+                matchLen += b;
+            } while (255 == b);
+        }
+        matchLen += 4;
+        if (0 == offset || offset > op || matchLen > dstCapacity - op) {
+            return 0;
+        }
+        for (; matchLen > 0; matchLen--, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return op - dstPos;
+}
+
+/* Decode a LZ4 frame to g_decomp. Returns the decoded size, or (size_t)-1 if
+ * the frame is invalid. */
+static size_t lz4DecodeFrame(const unsigned char *src, size_t srcSize)
+{
+    size_t pos = 7, op = 0, contentSize = (size_t)-1;
+    unsigned int flg;
+
+    if (srcSize < 7 || 0x184D2204 != readLE32(src)) {
+        return (size_t)-1;
+    }
+    flg = src[4];
+    if (flg & 0x08) {
+        contentSize = readLE32(src + 6) | ((size_t)readLE32(src + 10) << 32);
+        pos += 8;
+    }
+    if (flg & 0x01) {
+        pos += 4;
+    }
+    for (;;) {
+        unsigned int blockSize;
+        if (pos + 4 > srcSize) {
+            return (size_t)-1;
+        }
+        blockSize = readLE32(src + pos);
+        pos += 4;
+        if (0 == blockSize) {
+            break;
+        }
+        if ((blockSize & 0x7FFFFFFF) > srcSize - pos) {
+            return (size_t)-1;
+        }
+        if (blockSize & 0x80000000) {
+            blockSize &= 0x7FFFFFFF;
+            if (blockSize > BUF_SIZE - op) {
+                return (size_t)-1;
+            }
+            memcpy(g_decomp + op, src + pos, blockSize);
+            op += blockSize;
+        } else {
+            size_t dSize = lz4DecodeBlock(src + pos, blockSize, g_decomp, op, BUF_SIZE);
+            if (0 == dSize) {
+                return (size_t)-1;
+            }
+            op += dSize;
+        }
+        pos += blockSize + (flg & 0x10 ? 4 : 0);
+    }
+    pos += flg & 0x04 ? 4 : 0;
+    if (pos != srcSize || (contentSize != (size_t)-1 && contentSize != op)) {
+        return (size_t)-1;
+    }
+    return op;
+}
+
+/* A CCtx with the sequence producer and without fallback, so a failing
+ * sequence producer fails the test */
+static int resetCCtx(int level)
+{
+    ZSTD_CCtx_reset(g_zc, ZSTD_reset_session_and_parameters);
+    ZSTD_registerSequenceProducer(g_zc, g_matchState, qatSequenceProducer);
+    CHECK(!ZSTD_isError(ZSTD_CCtx_setParameter(g_zc, ZSTD_c_compressionLevel, level)),
+          "Cannot set level %d", level);
+    CHECK(!ZSTD_isError(ZSTD_CCtx_setParameter(g_zc, ZSTD_c_enableSeqProducerFallback, 0)),
+          "Cannot disable fallback");
+    return 1;
+}
+
+/* Stop QAT and start it again on the software engine with the options */
+static int restartQat(QZSTD_StartOptions_T *options)
+{
+    QZSTD_stopQatDevice();
+    options->backend = QZSTD_BACKEND_SW;
+    CHECK(QZSTD_OK == QZSTD_startQatDeviceEx(options), "Cannot restart the software engine");
+    return 1;
+}
+
+/* Decompress a frame on its own, with dict if it's not NULL */
+static int checkFrame(const unsigned char *src, size_t srcSize,
+                      const unsigned char *cBuf, size_t cSize,
+                      const void *dict, size_t dictSize)
+{
+    size_t dSize;
+
+    CHECK(!ZSTD_isError(cSize), "Compression failed: %s", ZSTD_getErrorName(cSize));
+    CHECK(ZSTD_findFrameCompressedSize(cBuf, cSize) == cSize, "Not one frame");
+    ZSTD_DCtx_reset(g_zdc, ZSTD_reset_session_and_parameters);
+    ZSTD_DCtx_loadDictionary(g_zdc, dict, dictSize);
+    dSize = ZSTD_decompressDCtx(g_zdc, g_decomp, BUF_SIZE, cBuf, cSize);
+    CHECK(!ZSTD_isError(dSize), "Decompression failed: %s", ZSTD_getErrorName(dSize));
+    CHECK(dSize == srcSize && 0 == memcmp(g_decomp, src, srcSize),
+          "Decompressed data differs from the source");
+    return 1;
+}
+
+/* Compress consecutive chunks of g_src with ZSTD_compress2, a frame each */
+static int compressChunks(size_t srcSize, size_t chunkSize, int beginEveryFrame,
+                          const void *dict, size_t dictSize)
+{
+    size_t pos, cSize;
+
+    for (pos = 0; pos < srcSize; pos += chunkSize) {
+        size_t size = chunkSize < srcSize - pos ? chunkSize : srcSize - pos;
+        if (beginEveryFrame || 0 == pos) {
+            CHECK(QZSTD_OK == QZSTD_beginFrame(g_matchState, g_src + pos, size),
+                  "Cannot begin a frame");
+        }
+        cSize = ZSTD_compress2(g_zc, g_dst, ZSTD_compressBound(size), g_src + pos, size);
+        if (!checkFrame(g_src + pos, size, g_dst, cSize, dict, dictSize)) {
+            DISPLAY("Frame at %lu, begin every frame: %d\n", (unsigned long)pos,
+                    beginEveryFrame);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static size_t ldmMatches(void)
+{
+    QZSTD_Stats_T stats;
+
+    QZSTD_getStats(&stats);
+    return stats.ldmMatches;
+}
+
+static QZSTD_Stats_T getStats(void)
+{
+    QZSTD_Stats_T stats;
+
+    QZSTD_getStats(&stats);
+    return stats;
+}
+
+static size_t dictMatches(void)
+{
+    QZSTD_Stats_T stats;
+
+    QZSTD_getStats(&stats);
+    return stats.dictMatches;
+}
+
+/* The dictionary in the CCtx and the sequence producer state, without
+ * checksum, so offsets beyond the frame only show by comparing the data */
+static int resetDictCCtx(void)
+{
+    if (!resetCCtx(3)) {
+        return 0;
+    }
+    CHECK(!ZSTD_isError(ZSTD_CCtx_setParameter(g_zc, ZSTD_c_checksumFlag, 0)),
+          "Cannot disable the checksum");
+    CHECK(!ZSTD_isError(ZSTD_CCtx_loadDictionary(g_zc, g_dict, DICT_SIZE)),
+          "Cannot load the dictionary");
+    CHECK(QZSTD_OK == QZSTD_refDict(g_matchState, g_dict, DICT_SIZE),
+          "Cannot reference the dictionary");
+    return 1;
+}
+
+/* Long distance matches within one frame */
+static int testLdm(void)
+{
+    size_t srcSize = 4 * LDM_CHUNK_SIZE, matches = ldmMatches(), cSize;
+
+    genRepeats(g_src, srcSize);
+    if (!resetCCtx(3)) {
+        return 0;
+    }
+    ZSTD_CCtx_setParameter(g_zc, ZSTD_c_windowLog, 22);
+    QZSTD_setSeqProdParameter(g_matchState, QZSTD_p_longDistance, 1);
+    CHECK(QZSTD_OK == QZSTD_beginFrame(g_matchState, g_src, srcSize),
+          "Cannot begin a frame");
+    cSize = ZSTD_compress2(g_zc, g_dst, BUF_SIZE, g_src, srcSize);
+    if (!checkFrame(g_src, srcSize, g_dst, cSize, NULL, 0)) {
+        return 0;
+    }
+    CHECK(ldmMatches() > matches, "No long distance match");
+    CHECK(cSize < srcSize / 2, "Repeats not compressed: %lu", (unsigned long)cSize);
+    return 1;
+}
+
+/* Frames of consecutive chunks follow each other in memory, but matches must
+ * not reach into the previous frame */
+static int testLdmFrames(void)
+{
+    size_t srcSize = 4 * LDM_CHUNK_SIZE, pos, cSize;
+    int beginEveryFrame;
+
+    genRepeats(g_src, srcSize);
+    for (beginEveryFrame = 0; beginEveryFrame <= 1; beginEveryFrame++) {
+        if (!resetCCtx(3)) {
+            return 0;
+        }
+        ZSTD_CCtx_setParameter(g_zc, ZSTD_c_windowLog, 22);
+        QZSTD_setSeqProdParameter(g_matchState, QZSTD_p_longDistance, 1);
+        if (!compressChunks(srcSize, LDM_CHUNK_SIZE, beginEveryFrame, NULL, 0) ||
+            !compressChunks(srcSize, LDM_CHUNK_SIZE + 3 * KB, beginEveryFrame, NULL, 0)) {
+            return 0;
+        }
+    }
+
+    /* Without a frame started, no match is searched */
+    QZSTD_beginFrame(g_matchState, NULL, 0);
+    for (pos = 0; pos < srcSize; pos += LDM_CHUNK_SIZE) {
+        cSize = ZSTD_compress2(g_zc, g_dst, BUF_SIZE, g_src + pos, LDM_CHUNK_SIZE);
+        if (!checkFrame(g_src + pos, LDM_CHUNK_SIZE, g_dst, cSize, NULL, 0)) {
+            return 0;
+        }
+    }
+    CHECK(QZSTD_FAIL == QZSTD_beginFrame(g_matchState, g_src, ZSTD_CONTENTSIZE_ERROR),
+          "Invalid frame size accepted");
+    return 1;
+}
+
+/* Stream g_src as a frame of unknown size, every piece flushed. The window
+ * buffer of zstd wraps several times, and tiny pieces make blocks zstd doesn't
+ * pass to the sequence producer */
+static int streamLdmFrame(size_t srcSize, size_t *cSize)
+{
+    static const size_t pieces[] = { 100 * KB, 5, 37 * KB, 3, 6, 200 * KB, 1 };
+    ZSTD_outBuffer output = { g_dst, ZSTD_compressBound(srcSize), 0 };
+    size_t i, pos = 0, rc;
+
+    CHECK(QZSTD_OK == QZSTD_beginFrame(g_matchState, NULL, ZSTD_CONTENTSIZE_UNKNOWN),
+          "Cannot begin a frame of unknown size");
+    for (i = 0; pos < srcSize; i++) {
+        size_t piece = pieces[i % (sizeof(pieces) / sizeof(pieces[0]))];
+        ZSTD_EndDirective mode = piece < srcSize - pos ? ZSTD_e_flush : ZSTD_e_end;
+        ZSTD_inBuffer input = { g_src, mode == ZSTD_e_end ? srcSize : pos + piece, pos };
+        do {
+            rc = ZSTD_compressStream2(g_zc, &output, &input, mode);
+            CHECK(!ZSTD_isError(rc), "Compression failed: %s", ZSTD_getErrorName(rc));
+        } while (rc != 0 || input.pos < input.size);
+        pos = input.pos;
+    }
+    *cSize = output.pos;
+    return checkFrame(g_src, srcSize, g_dst, output.pos, NULL, 0);
+}
+
+/* Long distance matches in streamed frames reach across the wraps of the
+ * window buffer, as well as in a frame compressed in one call */
+static int testLdmStream(void)
+{
+    size_t srcSize = BUF_SIZE, matches, cSize, streamed;
+    int frame;
+
+    genRepeats(g_src, srcSize);
+    if (!resetCCtx(3)) {
+        return 0;
+    }
+    ZSTD_CCtx_setParameter(g_zc, ZSTD_c_windowLog, 20);
+    QZSTD_setSeqProdParameter(g_matchState, QZSTD_p_longDistance, 1);
+    CHECK(QZSTD_OK == QZSTD_beginFrame(g_matchState, g_src, srcSize),
+          "Cannot begin a frame");
+    cSize = ZSTD_compress2(g_zc, g_dst, BUF_SIZE, g_src, srcSize);
+    if (!checkFrame(g_src, srcSize, g_dst, cSize, NULL, 0)) {
+        return 0;
+    }
+
+    /* Frames streamed back to back, each started */
+    for (frame = 0; frame < 2; frame++) {
+        matches = ldmMatches();
+        if (!streamLdmFrame(srcSize, &streamed)) {
+            DISPLAY("Frame %d\n", frame);
+            return 0;
+        }
+        CHECK(ldmMatches() > matches, "No long distance match");
+        CHECK(streamed < cSize + cSize / 4, "Streamed frame of %lu bytes, %lu in one call",
+              (unsigned long)streamed, (unsigned long)cSize);
+    }
+    return 1;
+}
+
+/* Dictionary matches in frames of one block and of several blocks */
+static int testDict(void)
+{
+    size_t srcSize = 8 * DICT_CHUNK_SIZE, matches = dictMatches(), cSize;
+
+    genDictData(g_src, srcSize);
+    if (!resetDictCCtx() || !compressChunks(srcSize, DICT_CHUNK_SIZE, 1, g_dict, DICT_SIZE)) {
+        return 0;
+    }
+    CHECK(dictMatches() > matches, "No dictionary match");
+
+    matches = dictMatches();
+    CHECK(QZSTD_OK == QZSTD_beginFrame(g_matchState, g_src, srcSize), "Cannot begin a frame");
+    cSize = ZSTD_compress2(g_zc, g_dst, BUF_SIZE, g_src, srcSize);
+    if (!checkFrame(g_src, srcSize, g_dst, cSize, g_dict, DICT_SIZE)) {
+        return 0;
+    }
+    CHECK(dictMatches() > matches, "No dictionary match in a frame of several blocks");
+    return 1;
+}
+
+/* The dictionary referenced and a frame started once, then several frames */
+static int testDictFrames(void)
+{
+    size_t srcSize = 8 * DICT_CHUNK_SIZE, memBytes, grown;
+    void *other;
+    int rc;
+
+    genDictData(g_src, srcSize);
+    if (!resetDictCCtx() ||
+        !compressChunks(srcSize, DICT_CHUNK_SIZE, 0, g_dict, DICT_SIZE) ||
+        !compressChunks(srcSize, 3 * DICT_CHUNK_SIZE, 0, g_dict, DICT_SIZE)) {
+        return 0;
+    }
+    /* Only referenced */
+    if (!resetDictCCtx() ||
+        !compressChunks(DICT_CHUNK_SIZE, DICT_CHUNK_SIZE, 1, g_dict, DICT_SIZE) ||
+        QZSTD_OK != QZSTD_refDict(g_matchState, g_dict, DICT_SIZE) ||
+        !compressChunks(srcSize, DICT_CHUNK_SIZE, 1, g_dict, DICT_SIZE)) {
+        return 0;
+    }
+
+    /* Another state referencing the dictionary shares its index */
+    memBytes = getStats().memBytes;
+    other = QZSTD_createSeqProdState();
+    CHECK(NULL != other, "Cannot create a sequence producer state");
+    rc = QZSTD_refDict(other, g_dict, DICT_SIZE);
+    grown = getStats().memBytes - memBytes;
+    QZSTD_freeSeqProdState(other);
+    CHECK(QZSTD_OK == rc, "Cannot reference the dictionary");
+    CHECK(grown < 64 * KB, "Dictionary indexed again, %lu bytes allocated",
+          (unsigned long)grown);
+    CHECK(getStats().memBytes == memBytes, "Memory not freed");
+    return 1;
+}
+
+/* Stream a frame in pieces, each flushed, with a frame of srcSize started */
+static int streamFrame(size_t srcSize, const size_t *pieces, size_t nbPieces)
+{
+    ZSTD_outBuffer output = { g_dst, ZSTD_compressBound(srcSize), 0 };
+    size_t i, pos = 0, rc;
+
+    CHECK(QZSTD_OK == QZSTD_beginFrame(g_matchState, g_src, srcSize), "Cannot begin a frame");
+    for (i = 0; i <= nbPieces; i++) {
+        ZSTD_inBuffer input = { g_src, i < nbPieces ? pos + pieces[i] : srcSize, pos };
+        do {
+            rc = ZSTD_compressStream2(g_zc, &output, &input,
+                                      i < nbPieces ? ZSTD_e_flush : ZSTD_e_end);
+            CHECK(!ZSTD_isError(rc), "Compression failed: %s", ZSTD_getErrorName(rc));
+        } while (rc != 0);
+        pos = input.pos;
+    }
+    return checkFrame(g_src, srcSize, g_dst, output.pos, g_dict, DICT_SIZE);
+}
+
+/* zstd doesn't pass blocks smaller than 7 bytes to the sequence producer, the
+ * blocks after them must still get their frame positions right */
+static int testDictFlush(void)
+{
+    static const size_t firstTiny[] = { 5 };
+    static const size_t middleTiny[] = { 20 * KB, 5, 3 };
+    static const size_t firstBlocks[] = { 5, 16 * KB };
+    size_t sizes[] = { DICT_CHUNK_SIZE, 6 * DICT_CHUNK_SIZE }, i;
+
+    genDictData(g_src, 6 * DICT_CHUNK_SIZE);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (!resetDictCCtx() ||
+            !streamFrame(sizes[i], firstTiny, 1) ||
+            !streamFrame(sizes[i], middleTiny, 3) ||
+            !streamFrame(sizes[i], firstBlocks, 2) ||
+            !streamFrame(sizes[i], NULL, 0)) {
+            DISPLAY("Frame of %lu bytes\n", (unsigned long)sizes[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Compress g_src as one frame at the level and window, 0: default window */
+static int roundTrip(size_t srcSize, int level, int windowLog)
+{
+    size_t cSize;
+
+    if (!resetCCtx(level)) {
+        return 0;
+    }
+    CHECK(!ZSTD_isError(ZSTD_CCtx_setParameter(g_zc, ZSTD_c_windowLog, windowLog)),
+          "Cannot set window log %d", windowLog);
+    cSize = ZSTD_compress2(g_zc, g_dst, ZSTD_compressBound(srcSize), g_src, srcSize);
+    if (!checkFrame(g_src, srcSize, g_dst, cSize, NULL, 0)) {
+        DISPLAY("Level %d, window log %d\n", level, windowLog);
+        return 0;
+    }
+    return 1;
+}
+
+/* Levels offloaded to QAT, the sequences as they are */
+static int testLevels(void)
+{
+    int level;
+
+    genText(g_src, TEXT_SIZE);
+    for (level = 1; level <= 12; level++) {
+        if (!roundTrip(TEXT_SIZE, level, 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Levels refined on CPU by the optimal parse seeded by QAT */
+static int testHybridLevels(void)
+{
+    int level;
+
+    genText(g_src, TEXT_SIZE / 2);
+    genRandom(g_src + TEXT_SIZE / 2, TEXT_SIZE / 4);
+    genText(g_src + 3 * TEXT_SIZE / 4, TEXT_SIZE / 4);
+    for (level = 13; level <= 22; level++) {
+        if (!roundTrip(TEXT_SIZE, level, 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Instances set up and sessions created when QAT starts, invalid levels are
+ * skipped */
+static int testEagerInit(void)
+{
+    static const int levels[] = { 1, 0, 3, 23, 12, 16 };
+    QZSTD_StartOptions_T options;
+    size_t i;
+
+    memset(&options, 0, sizeof(options));
+    options.eagerInit = 1;
+    options.levels = levels;
+    options.nbLevels = sizeof(levels) / sizeof(levels[0]);
+    if (!restartQat(&options)) {
+        return 0;
+    }
+    CHECK(getStats().bufPoolAllocated > 0, "Instances not set up at start");
+
+    genText(g_src, TEXT_SIZE);
+    for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        if (levels[i] >= 1 && levels[i] <= 22 && !roundTrip(TEXT_SIZE, levels[i], 0)) {
+            return 0;
+        }
+    }
+    /* Without it, an instance is set up by its first request */
+    memset(&options, 0, sizeof(options));
+    if (!restartQat(&options)) {
+        return 0;
+    }
+    CHECK(0 == getStats().bufPoolAllocated, "Instances set up without eager init");
+    return 1;
+}
+
+/* Post-optimizer and literal search of the sequences of QAT */
+static int testPostOptimize(void)
+{
+    QZSTD_Stats_T before = getStats(), after;
+    int level;
+
+    genText(g_src, TEXT_SIZE);
+    QZSTD_setSeqProdParameter(g_matchState, QZSTD_p_postOptimize, 1);
+    QZSTD_setSeqProdParameter(g_matchState, QZSTD_p_literalSearch, 16);
+    for (level = 1; level <= 12; level += 3) {
+        if (!roundTrip(TEXT_SIZE, level, 0)) {
+            return 0;
+        }
+    }
+    after = getStats();
+    CHECK(after.postOptSeqsIn > before.postOptSeqsIn, "Post-optimizer not run");
+    CHECK(after.litSearchRuns > before.litSearchRuns, "No literal run searched");
+    return 1;
+}
+
+/* Windows smaller than the 64KB reach of QAT drop the matches beyond them */
+static int testSmallWindows(void)
+{
+    static const int levels[] = { 1, 9, 16 };
+    int windowLog;
+    size_t i;
+
+    genText(g_src, TEXT_SIZE);
+    QZSTD_setSeqProdParameter(g_matchState, QZSTD_p_postOptimize, 1);
+    QZSTD_setSeqProdParameter(g_matchState, QZSTD_p_literalSearch, 16);
+    for (windowLog = ZSTD_WINDOWLOG_MIN; windowLog <= 17; windowLog++) {
+        for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+            if (!roundTrip(TEXT_SIZE, levels[i], windowLog)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void recordBlock(void *opaque, const void *src, size_t srcSize,
+                        unsigned int checksum, int computedByQat)
+{
+    checksumBlocks_t *blocks = (checksumBlocks_t *)opaque;
+
+    (void)computedByQat;
+    if (checksum != xxh32((const unsigned char *)src, srcSize)) {
+        blocks->mismatch = 1;
+    }
+    if (blocks->nbBlocks < MAX_BLOCKS) {
+        writeLE32(blocks->records + blocks->nbBlocks * 8, checksum);
+        writeLE32(blocks->records + blocks->nbBlocks * 8 + 4, (unsigned int)srcSize);
+    }
+    blocks->nbBlocks++;
+    blocks->size += srcSize;
+}
+
+/* Block checksums and the digest of the frame against XXH32 on CPU */
+static int testChecksum(void)
+{
+    static const size_t sizes[] = { 1000, 200 * KB, TEXT_SIZE + 123 };
+    checksumBlocks_t blocks;
+    QZSTD_FrameChecksum_T frameChecksum;
+    size_t i, cSize;
+
+    genText(g_src, TEXT_SIZE + 123);
+    if (!resetCCtx(3)) {
+        return 0;
+    }
+    QZSTD_setBlockChecksumCallback(g_matchState, recordBlock, &blocks);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        memset(&blocks, 0, sizeof(blocks));
+        /* Setting the parameter starts a frame */
+        QZSTD_setSeqProdParameter(g_matchState, QZSTD_p_blockChecksum, 1);
+        cSize = ZSTD_compress2(g_zc, g_dst, BUF_SIZE, g_src, sizes[i]);
+        if (!checkFrame(g_src, sizes[i], g_dst, cSize, NULL, 0)) {
+            return 0;
+        }
+        CHECK(QZSTD_OK == QZSTD_getFrameChecksum(g_matchState, &frameChecksum),
+              "No frame checksum");
+        CHECK(!blocks.mismatch, "Block checksum differs from XXH32");
+        CHECK(blocks.nbBlocks == frameChecksum.nbBlocks && blocks.size == sizes[i] &&
+              frameChecksum.size == sizes[i], "%u blocks of %llu bytes, %u in the digest",
+              blocks.nbBlocks, blocks.size, frameChecksum.nbBlocks);
+        CHECK(frameChecksum.digest == xxh32(blocks.records, blocks.nbBlocks * 8),
+              "Digest differs from the XXH32 of the block records");
+        CHECK(frameChecksum.lastChecksum ==
+              readLE32(blocks.records + (blocks.nbBlocks - 1) * 8),
+              "Last checksum differs");
+    }
+    QZSTD_setSeqProdParameter(g_matchState, QZSTD_p_blockChecksum, 0);
+    CHECK(QZSTD_FAIL == QZSTD_getFrameChecksum(g_matchState, &frameChecksum),
+          "Frame checksum without QZSTD_p_blockChecksum");
+    return 1;
+}
+
+/* LZ4 blocks and frames converted from LZ4s */
+static int testLz4(void)
+{
+    static const size_t sizes[] = { 1, 100, 64 * KB, 128 * KB };
+    static const int levels[] = { 1, 9, 12 };
+    size_t i, j, dSize, cSize = 0;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (j = 0; j < sizeof(levels) / sizeof(levels[0]); j++) {
+            genText(g_src, sizes[i]);
+            if (i & 1) {
+                genRandom(g_src, sizes[i] / 2);
+            }
+            CHECK(QZSTD_OK == QZSTD_compressLz4Block(g_dst, BUF_SIZE, &cSize, g_src,
+                                                     sizes[i], levels[j]),
+                  "Block of %lu bytes at level %d failed", (unsigned long)sizes[i], levels[j]);
+            dSize = lz4DecodeBlock(g_dst, cSize, g_decomp, 0, BUF_SIZE);
+            CHECK(dSize == sizes[i] && 0 == memcmp(g_decomp, g_src, sizes[i]),
+                  "Block of %lu bytes at level %d differs", (unsigned long)sizes[i],
+                  levels[j]);
+        }
+    }
+
+    genText(g_src, TEXT_SIZE);
+    genRandom(g_src + 100 * KB, 100 * KB);
+    for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        size_t srcSizes[] = { 0, 1000, TEXT_SIZE + 7 };
+        for (j = 0; j < sizeof(srcSizes) / sizeof(srcSizes[0]); j++) {
+            CHECK(QZSTD_OK == QZSTD_compressLz4Frame(g_dst, QZSTD_lz4FrameBound(srcSizes[j]),
+                                                     &cSize, g_src, srcSizes[j], levels[i]),
+                  "Frame of %lu bytes at level %d failed", (unsigned long)srcSizes[j],
+                  levels[i]);
+            dSize = lz4DecodeFrame(g_dst, cSize);
+            CHECK(dSize == srcSizes[j] && 0 == memcmp(g_decomp, g_src, srcSizes[j]),
+                  "Frame of %lu bytes at level %d differs", (unsigned long)srcSizes[j],
+                  levels[i]);
+        }
+    }
+    return 1;
+}
+
+/* Estimated ratios are ordered like the ratios of zstd */
+static int testEstimate(void)
+{
+    size_t srcSize = 2 * 1024 * KB;
+    double text, random, actual;
+
+    genText(g_src, srcSize);
+    text = QZSTD_estimateRatio(g_src, srcSize, 256 * KB);
+    actual = (double)ZSTD_compress(g_dst, BUF_SIZE, g_src, srcSize, ZSTD_CLEVEL_DEFAULT) /
+             srcSize;
+    CHECK(text > actual / 2 && text < actual * 2, "Estimated %.3f, zstd %.3f", text, actual);
+
+    genRandom(g_src, srcSize);
+    random = QZSTD_estimateRatio(g_src, srcSize, 256 * KB);
+    CHECK(random > 0.9, "Random data estimated to %.3f", random);
+    CHECK(QZSTD_estimateRatio(g_src, 1000, 256 * KB) > 0.9, "Short random data");
+    return 1;
+}
+
+/* A request timing out keeps its buffer out of the pool until it's answered */
+static int testTimeout(void)
+{
+    QZSTD_SwFaultParams_T faults;
+    size_t srcSize = 16 * KB, cSize;
+    size_t quarantined = getStats().bufPoolQuarantined;
+
+    genText(g_src, srcSize);
+    if (!resetCCtx(3)) {
+        return 0;
+    }
+    /* A new state starts on instance 0, stalled beyond the polling timeout */
+    CHECK(QZSTD_OK == QZSTD_parseSwFaults("stall=0:2500000", &faults), "Invalid faults");
+    QZSTD_setSwFaultParams(&faults);
+    cSize = ZSTD_compress2(g_zc, g_dst, BUF_SIZE, g_src, srcSize);
+    QZSTD_setSwFaultParams(NULL);
+    CHECK(ZSTD_isError(cSize), "Stalled request didn't fail");
+    CHECK(getStats().bufPoolQuarantined == quarantined + 1, "Buffer not quarantined");
+
+    /* The next request on the instance also polls the stalled response */
+    cSize = ZSTD_compress2(g_zc, g_dst, BUF_SIZE, g_src, srcSize);
+    if (!checkFrame(g_src, srcSize, g_dst, cSize, NULL, 0)) {
+        return 0;
+    }
+    CHECK(getStats().bufPoolQuarantined == quarantined, "Buffer not given back");
+    return 1;
+}
+
+static void *countingAlloc(void *opaque, size_t size)
+{
+    ((countingMem_t *)opaque)->allocs++;
+    return malloc(size);
+}
+
+static void countingFree(void *opaque, void *address)
+{
+    if (NULL != address) {
+        ((countingMem_t *)opaque)->frees++;
+    }
+    free(address);
+}
+
+/* Every allocation of a state and of QAT goes through the custom allocator,
+ * and is freed with it */
+static int testCustomMem(void)
+{
+    countingMem_t counts = { 0, 0 };
+    QZSTD_StartOptions_T options;
+    QZSTD_customMem customMem;
+    void *state;
+    size_t memBytes = getStats().memBytes, pooled, cSize;
+
+    memset(&customMem, 0, sizeof(customMem));
+    customMem.customAlloc = countingAlloc;
+    customMem.opaque = &counts;
+    CHECK(NULL == QZSTD_createSeqProdState_advanced(customMem), "Allocator without free accepted");
+    customMem.customFree = countingFree;
+
+    /* The workspaces of hybrid levels, long distance matching and the
+     * dictionary index of the state */
+    state = QZSTD_createSeqProdState_advanced(customMem);
+    CHECK(NULL != state && counts.allocs > 0, "State not allocated by the custom allocator");
+    genDictData(g_src, TEXT_SIZE);
+    if (!resetCCtx(16)) {
+        return 0;
+    }
+    ZSTD_CCtx_setParameter(g_zc, ZSTD_c_checksumFlag, 0);
+    CHECK(!ZSTD_isError(ZSTD_CCtx_loadDictionary(g_zc, g_dict, DICT_SIZE)),
+          "Cannot load the dictionary");
+    ZSTD_registerSequenceProducer(g_zc, state, qatSequenceProducer);
+    QZSTD_setSeqProdParameter(state, QZSTD_p_longDistance, 1);
+    CHECK(QZSTD_OK == QZSTD_refDict(state, g_dict, DICT_SIZE) &&
+          QZSTD_OK == QZSTD_beginFrame(state, g_src, TEXT_SIZE), "Cannot begin a frame");
+    cSize = ZSTD_compress2(g_zc, g_dst, BUF_SIZE, g_src, TEXT_SIZE);
+    if (!checkFrame(g_src, TEXT_SIZE, g_dst, cSize, g_dict, DICT_SIZE) || !resetCCtx(3)) {
+        return 0;
+    }
+    CHECK(counts.allocs >= 4, "%lu allocations", (unsigned long)counts.allocs);
+    QZSTD_freeSeqProdState(state);
+    CHECK(counts.frees == counts.allocs, "%lu of %lu allocations freed",
+          (unsigned long)counts.frees, (unsigned long)counts.allocs);
+
+    /* Released, it's freed instead of pooled */
+    pooled = getStats().statePoolStates;
+    QZSTD_releaseSeqProdState(QZSTD_createSeqProdState_advanced(customMem));
+    CHECK(counts.frees == counts.allocs && getStats().statePoolStates == pooled,
+          "State of a custom allocator pooled");
+
+    /* Device resources */
+    memset(&options, 0, sizeof(options));
+    options.customMem = customMem;
+    counts.allocs = 0;
+    counts.frees = 0;
+    if (!restartQat(&options)) {
+        return 0;
+    }
+    genText(g_src, TEXT_SIZE);
+    if (!roundTrip(TEXT_SIZE, 3, 0)) {
+        return 0;
+    }
+    CHECK(counts.allocs > 0, "Device resources not allocated by the custom allocator");
+    memset(&options, 0, sizeof(options));
+    if (!restartQat(&options)) {
+        return 0;
+    }
+    CHECK(counts.frees == counts.allocs, "%lu of %lu device allocations freed",
+          (unsigned long)counts.frees, (unsigned long)counts.allocs);
+    CHECK(getStats().memBytes == memBytes, "Memory not freed");
+    return 1;
+}
+
+/* Fault profiles of the software engine */
+static int testParseSwFaults(void)
+{
+    static const char *const invalid[] = {
+        "bogus", "retry=", "retry=1000001", "fail=1000001", "delay=gauss:5",
+        "delay=exp", "stall=1", "stall=1:", "seed=-", "retry=5;", "retry=5,,fail=5",
+        "fail=5 ", "none,", "retry=99999999999"
+    };
+    QZSTD_SwFaultParams_T faults;
+    size_t i;
+
+    CHECK(QZSTD_OK == QZSTD_parseSwFaults(
+              "delay=pareto:40,retry=1000,fail=1000000,stall=2:300,seed=9", &faults) &&
+          QZSTD_SW_DELAY_PARETO == faults.delayDist && 40 == faults.delayUs &&
+          1000 == faults.retryPpm && 1000000 == faults.failPpm &&
+          2 == faults.stallInstance && 300 == faults.stallUs && 9 == faults.seed,
+          "Profile parsed wrong");
+    CHECK(QZSTD_OK == QZSTD_parseSwFaults("delay=uniform:5", &faults) &&
+          QZSTD_SW_DELAY_UNIFORM == faults.delayDist && 0 == faults.retryPpm,
+          "Uniform delay parsed wrong");
+    CHECK(QZSTD_OK == QZSTD_parseSwFaults("delay=exp:7", &faults) &&
+          QZSTD_SW_DELAY_EXPONENTIAL == faults.delayDist && 7 == faults.delayUs,
+          "Exponential delay parsed wrong");
+    CHECK(QZSTD_OK == QZSTD_parseSwFaults("none", &faults) &&
+          QZSTD_SW_DELAY_NONE == faults.delayDist && 0 == faults.delayUs,
+          "No faults parsed wrong");
+    faults.seed = 5;
+    CHECK(QZSTD_OK == QZSTD_parseSwFaults("", &faults) && 0 == faults.seed,
+          "Empty profile parsed wrong");
+    for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        faults.seed = 5;
+        CHECK(QZSTD_FAIL == QZSTD_parseSwFaults(invalid[i], &faults) && 5 == faults.seed,
+              "Invalid profile \"%s\" accepted", invalid[i]);
+    }
+    CHECK(QZSTD_FAIL == QZSTD_parseSwFaults(NULL, &faults), "NULL profile accepted");
+    return 1;
+}
+
+/* Compress frames with faults injected, the blocks zstd falls back for must
+ * still decompress */
+static int compressFaulty(const char *spec, int frames)
+{
+    QZSTD_SwFaultParams_T faults;
+    size_t cSize;
+    int frame;
+
+    CHECK(QZSTD_OK == QZSTD_parseSwFaults(spec, &faults), "Invalid faults %s", spec);
+    QZSTD_setSwFaultParams(&faults);
+    for (frame = 0; frame < frames; frame++) {
+        if (!resetCCtx(3)) {
+            break;
+        }
+        ZSTD_CCtx_setParameter(g_zc, ZSTD_c_enableSeqProducerFallback, 1);
+        cSize = ZSTD_compress2(g_zc, g_dst, BUF_SIZE, g_src, TEXT_SIZE);
+        if (!checkFrame(g_src, TEXT_SIZE, g_dst, cSize, NULL, 0)) {
+            break;
+        }
+    }
+    QZSTD_setSwFaultParams(NULL);
+    CHECK(frame == frames, "Frame %d with faults %s", frame, spec);
+    return 1;
+}
+
+/* Retries and failures of the engine go through the fallback of zstd */
+static int testSwFaults(void)
+{
+    QZSTD_SwFaultParams_T faults;
+    QZSTD_SwFaultStats_T before, after;
+    size_t failedBlocks = getStats().failedBlocks, cSize;
+
+    genText(g_src, TEXT_SIZE);
+    QZSTD_getSwFaultStats(&before);
+    if (!compressFaulty("retry=500000,seed=3", 4)) {
+        return 0;
+    }
+    QZSTD_getSwFaultStats(&after);
+    CHECK(after.retries > before.retries && after.submitted > before.submitted,
+          "No retries injected");
+
+    before = after;
+    if (!compressFaulty("fail=300000,delay=uniform:20,seed=5", 4)) {
+        return 0;
+    }
+    QZSTD_getSwFaultStats(&after);
+    CHECK(after.failures > before.failures && after.delayUs > before.delayUs,
+          "No failures injected");
+    CHECK(getStats().failedBlocks >= failedBlocks + after.failures - before.failures,
+          "%lu failed blocks for %lu failures",
+          (unsigned long)(getStats().failedBlocks - failedBlocks),
+          (unsigned long)(after.failures - before.failures));
+
+    /* Without fallback, a failed block fails the frame */
+    failedBlocks = getStats().failedBlocks;
+    if (!compressFaulty("none", 1)) {
+        return 0;
+    }
+    CHECK(getStats().failedBlocks == failedBlocks, "Block failed without faults");
+    CHECK(QZSTD_OK == QZSTD_parseSwFaults("fail=1000000", &faults), "Invalid faults");
+    if (!resetCCtx(3)) {
+        return 0;
+    }
+    QZSTD_setSwFaultParams(&faults);
+    cSize = ZSTD_compress2(g_zc, g_dst, BUF_SIZE, g_src, TEXT_SIZE);
+    QZSTD_setSwFaultParams(NULL);
+    CHECK(ZSTD_isError(cSize), "Failed blocks compressed without fallback");
+    return 1;
+}
+
+/* Compress ADAPT_FRAMES frames with the adaptive level controller, the level
+ * must stay in [minLevel, maxLevel] and end at endLevel */
+static int adaptFrames(QZSTD_AdaptiveParams_T *params, int endLevel)
+{
+    int frame, level = 0;
+
+    CHECK(QZSTD_OK == QZSTD_setAdaptiveLevel(g_matchState, params) &&
+          params->minLevel == QZSTD_getAdaptiveLevel(g_matchState),
+          "Controller not started at level %d", params->minLevel);
+    for (frame = 0; frame < ADAPT_FRAMES; frame++) {
+        if (!roundTrip(TEXT_SIZE, 1, 0)) {
+            return 0;
+        }
+        level = QZSTD_getAdaptiveLevel(g_matchState);
+        CHECK(level >= params->minLevel && level <= params->maxLevel,
+              "Level %d out of [%d, %d]", level, params->minLevel, params->maxLevel);
+    }
+    CHECK(endLevel == level, "Ended at level %d instead of %d", level, endLevel);
+    return 1;
+}
+
+/* The adaptive level controller moves within its range */
+static int testAdaptiveLevel(void)
+{
+    QZSTD_AdaptiveParams_T params = { 0, 5, 0, 1000 * 1000 * 1000 };
+
+    CHECK(QZSTD_FAIL == QZSTD_setAdaptiveLevel(g_matchState, &params),
+          "Level 0 accepted");
+    params.minLevel = 6;
+    CHECK(QZSTD_FAIL == QZSTD_setAdaptiveLevel(g_matchState, &params),
+          "Empty range accepted");
+    params.minLevel = 3;
+    params.maxLevel = 23;
+    CHECK(QZSTD_FAIL == QZSTD_setAdaptiveLevel(g_matchState, &params),
+          "Level 23 accepted");
+    params.maxLevel = 5;
+    params.targetLatencyUs = 0;
+    CHECK(QZSTD_FAIL == QZSTD_setAdaptiveLevel(g_matchState, &params),
+          "No target accepted");
+
+    /* Always within the latency target, it climbs to maxLevel and stays */
+    genText(g_src, TEXT_SIZE);
+    params.targetLatencyUs = 1000 * 1000 * 1000;
+    if (!adaptFrames(&params, 5)) {
+        return 0;
+    }
+
+    /* Never meeting the throughput target, it stays at minLevel */
+    params.targetLatencyUs = 0;
+    params.targetMBps = 1000 * 1000 * 1000;
+    if (!adaptFrames(&params, 3)) {
+        return 0;
+    }
+    CHECK(QZSTD_OK == QZSTD_setAdaptiveLevel(g_matchState, NULL) &&
+          0 == QZSTD_getAdaptiveLevel(g_matchState), "Controller not disabled");
+    return 1;
+}
+
+/* Write text to a new temporary file, name is filled with its name */
+static int writeTempFile(char *name, const char *text)
+{
+    int fd;
+    FILE *file;
+
+    strcpy(name, "/tmp/qzstdtestXXXXXX");
+    fd = mkstemp(name);
+    CHECK(fd >= 0, "Cannot create a temporary file");
+    file = fdopen(fd, "w");
+    if (NULL == file) {
+        close(fd);
+        unlink(name);
+        CHECK(0, "Cannot open %s", name);
+    }
+    fputs(text, file);
+    fclose(file);
+    return 1;
+}
+
+/* Sequences of the producer for one block match the block, and none is
+ * shorter than minMatch */
+static int checkSequences(int level, size_t minMatch)
+{
+    size_t srcSize = ZSTD_BLOCKSIZE_MAX, capacity = ZSTD_sequenceBound(srcSize);
+    size_t nbSeqs, covered = 0, shortMatch = 0, i;
+    ZSTD_Sequence *seqs = (ZSTD_Sequence *)malloc(capacity * sizeof(ZSTD_Sequence));
+
+    CHECK(NULL != seqs, "Cannot allocate sequences");
+    nbSeqs = qatSequenceProducer(g_matchState, seqs, capacity, g_src, srcSize,
+                                 NULL, 0, level, (size_t)1 << 17);
+    for (i = 0; i < nbSeqs && ZSTD_SEQUENCE_PRODUCER_ERROR != nbSeqs; i++) {
+        if (0 != seqs[i].matchLength && seqs[i].matchLength < minMatch) {
+            shortMatch = seqs[i].matchLength;
+        }
+        covered += seqs[i].litLength + seqs[i].matchLength;
+    }
+    free(seqs);
+    CHECK(ZSTD_SEQUENCE_PRODUCER_ERROR != nbSeqs && nbSeqs > 1, "No sequences");
+    CHECK(0 == shortMatch, "Match of %lu bytes", (unsigned long)shortMatch);
+    CHECK(covered == srcSize, "Sequences cover %lu of %lu bytes",
+          (unsigned long)covered, (unsigned long)srcSize);
+    return 1;
+}
+
+/* Load a profile file, expecting rc and level 3 to get hwLevel after */
+static int loadProfiles(const char *text, int rc, int hwLevel)
+{
+    QZSTD_LevelProfile_T profile;
+    char name[32];
+    int loaded;
+
+    if (!writeTempFile(name, text)) {
+        return 0;
+    }
+    loaded = QZSTD_loadLevelProfiles(name);
+    unlink(name);
+    CHECK(rc == loaded, "Loading \"%s\" returned %d", text, loaded);
+    CHECK(QZSTD_OK == QZSTD_getLevelProfile(3, &profile) && hwLevel == profile.hwLevel,
+          "Level 3 at QAT level %d after loading \"%s\"", profile.hwLevel, text);
+    return 1;
+}
+
+/* Profiles set, loaded from files, and offloaded with 4-byte min match */
+static int testLevelProfiles(void)
+{
+    QZSTD_LevelProfile_T profile = { 5, 4, 0, 0, 0 }, got;
+
+    CHECK(QZSTD_OK == QZSTD_getLevelProfile(16, &got) && 12 == got.hwLevel &&
+          3 == got.minMatch, "Default profile of level 16 at QAT level %d", got.hwLevel);
+    CHECK(QZSTD_FAIL == QZSTD_getLevelProfile(0, &got) &&
+          QZSTD_FAIL == QZSTD_setLevelProfile(23, &profile), "Invalid level accepted");
+    profile.minMatch = 5;
+    CHECK(QZSTD_FAIL == QZSTD_setLevelProfile(3, &profile), "Min match 5 accepted");
+    profile.minMatch = 4;
+    profile.hwLevel = 13;
+    CHECK(QZSTD_FAIL == QZSTD_setLevelProfile(3, &profile), "QAT level 13 accepted");
+    profile.hwLevel = 5;
+    CHECK(QZSTD_OK == QZSTD_setLevelProfile(3, &profile) &&
+          QZSTD_OK == QZSTD_getLevelProfile(3, &got) &&
+          0 == memcmp(&profile, &got, sizeof(got)), "Profile not set");
+
+    /* LZ4s of QAT with 4-byte min match */
+    genText(g_src, TEXT_SIZE);
+    if (!checkSequences(3, 4) || !roundTrip(TEXT_SIZE, 3, 0)) {
+        return 0;
+    }
+    CHECK(QZSTD_OK == QZSTD_setLevelProfile(3, NULL) &&
+          QZSTD_OK == QZSTD_getLevelProfile(3, &got) && 3 == got.hwLevel &&
+          3 == got.minMatch, "Default profile not restored");
+    if (!checkSequences(3, 3)) {
+        return 0;
+    }
+
+    /* Files, invalid ones leave the profiles unchanged */
+    if (!loadProfiles("# level hwLevel minMatch ...\n\n3 7 4 1 0 0 # comment\n", QZSTD_OK, 7) ||
+        !loadProfiles("3 13 4 0 0 0\n", QZSTD_FAIL, 7) ||
+        !loadProfiles("3 5 4 0 0\n", QZSTD_FAIL, 7) ||
+        !loadProfiles("3 5 4 0 0 0 x\n", QZSTD_FAIL, 7) ||
+        !loadProfiles("23 5 4 0 0 0\n", QZSTD_FAIL, 7) ||
+        !loadProfiles("5 5 4 0 0 0\n3 5 2 0 0 0\n", QZSTD_FAIL, 7)) {
+        return 0;
+    }
+    CHECK(QZSTD_FAIL == QZSTD_loadLevelProfiles("/nonexistent/profiles"),
+          "Missing file accepted");
+    if (!checkSequences(3, 4) || !roundTrip(TEXT_SIZE, 3, 0)) {
+        return 0;
+    }
+
+    /* Levels not in a file get the default */
+    if (!loadProfiles("\n", QZSTD_OK, 3)) {
+        return 0;
+    }
+    CHECK(QZSTD_OK == QZSTD_getLevelProfile(3, &got) && 3 == got.minMatch,
+          "Default profile not loaded");
+    return 1;
+}
+
+/* Records of a capture, one for every block of g_src in order */
+static int checkCapture(FILE *file, size_t srcSize, int level, unsigned int sampleBytes)
+{
+    QZSTD_CaptureHeader_T header;
+    QZSTD_CaptureRecord_T record;
+    unsigned char sample[CAPTURE_SAMPLE];
+    unsigned long long timeNs = 0;
+    unsigned int thread = 0;
+    size_t pos = 0, records = 0;
+
+    CHECK(1 == fread(&header, sizeof(header), 1, file), "No header");
+    CHECK(QZSTD_CAPTURE_MAGIC == header.magic && QZSTD_CAPTURE_VERSION == header.version &&
+          sizeof(QZSTD_CaptureRecord_T) == header.recordSize &&
+          sampleBytes == header.sampleBytes && 1 == header.hash, "Invalid header");
+    while (1 == fread(&record, sizeof(record), 1, file)) {
+        size_t expected = srcSize - pos < ZSTD_BLOCKSIZE_MAX ? srcSize - pos :
+                          ZSTD_BLOCKSIZE_MAX;
+
+        CHECK(record.srcSize == expected && record.level == level && 0 == record.dictSize &&
+              0 == record.failed && record.windowSize >= srcSize,
+              "Record %lu of block size %u, level %d", (unsigned long)records,
+              record.srcSize, record.level);
+        CHECK(record.timeNs >= timeNs && (0 == records || record.thread == thread),
+              "Record %lu out of order", (unsigned long)records);
+        CHECK(record.hash == xxh32(g_src + pos, record.srcSize),
+              "Hash of record %lu differs", (unsigned long)records);
+        CHECK(record.sampleSize == (sampleBytes < record.srcSize ? sampleBytes : record.srcSize) &&
+              1 == fread(sample, record.sampleSize, 1, file) &&
+              0 == memcmp(sample, g_src + pos, record.sampleSize),
+              "Sample of record %lu differs", (unsigned long)records);
+        timeNs = record.timeNs;
+        thread = record.thread;
+        pos += record.srcSize;
+        records++;
+    }
+    CHECK(pos == srcSize && feof(file), "%lu of %lu bytes recorded",
+          (unsigned long)pos, (unsigned long)srcSize);
+    return 1;
+}
+
+/* Every call of the sequence producer recorded with its hash and sample */
+static int testCapture(void)
+{
+    QZSTD_CaptureOptions_T options = { NULL, 1, CAPTURE_SAMPLE };
+    char name[32];
+    FILE *file;
+    size_t cSize;
+    int second, ok = 0;
+
+    CHECK(QZSTD_FAIL == QZSTD_startCapture(NULL) && QZSTD_FAIL == QZSTD_startCapture(&options),
+          "Capture without file accepted");
+    options.path = "/nonexistent/capture";
+    CHECK(QZSTD_FAIL == QZSTD_startCapture(&options), "Unwritable file accepted");
+    if (!writeTempFile(name, "")) {
+        return 0;
+    }
+    options.path = name;
+    if (QZSTD_OK != QZSTD_startCapture(&options)) {
+        unlink(name);
+        CHECK(0, "Cannot start the capture");
+    }
+    second = QZSTD_startCapture(&options);
+    genText(g_src, TEXT_SIZE);
+    if (resetCCtx(5)) {
+        cSize = ZSTD_compress2(g_zc, g_dst, BUF_SIZE, g_src, TEXT_SIZE);
+        ok = checkFrame(g_src, TEXT_SIZE, g_dst, cSize, NULL, 0);
+    }
+    QZSTD_stopCapture();
+    file = fopen(name, "rb");
+    unlink(name);
+    if (!ok) {
+        if (NULL != file) {
+            fclose(file);
+        }
+        return 0;
+    }
+    CHECK(NULL != file, "Cannot read the capture");
+    if (QZSTD_FAIL != second) {
+        fclose(file);
+        CHECK(0, "Second capture started");
+    }
+    ok = checkCapture(file, TEXT_SIZE, 5, CAPTURE_SAMPLE);
+    fclose(file);
+    return ok;
+}
+
+/* Thread taking a state from the pool and giving it back before it exits */
+static void *acquireState(void *state)
+{
+    *(void **)state = QZSTD_acquireSeqProdState();
+    QZSTD_releaseSeqProdState(*(void **)state);
+    return NULL;
+}
+
+/* Released states are reused by their thread, and by other threads once it
+ * exits. The pool drops their workspaces, holds at most 64 of them and is
+ * freed when QAT stops */
+static int testStatePool(void)
+{
+    QZSTD_StartOptions_T options;
+    void *states[POOL_STATES];
+    void *exited = NULL;
+    pthread_t thread;
+    size_t memBytes, cSize, i;
+
+    /* Start with the pool and the cache of this thread empty */
+    memset(&options, 0, sizeof(options));
+    if (!restartQat(&options)) {
+        return 0;
+    }
+    memBytes = getStats().memBytes;
+
+    states[0] = QZSTD_acquireSeqProdState();
+    CHECK(NULL != states[0], "Cannot acquire a state");
+    QZSTD_releaseSeqProdState(states[0]);
+    CHECK(QZSTD_acquireSeqProdState() == states[0], "State not reused by the thread");
+
+    /* A hybrid level allocates a workspace of several MB */
+    genText(g_src, TEXT_SIZE);
+    if (!resetCCtx(16)) {
+        return 0;
+    }
+    ZSTD_registerSequenceProducer(g_zc, states[0], qatSequenceProducer);
+    cSize = ZSTD_compress2(g_zc, g_dst, BUF_SIZE, g_src, TEXT_SIZE);
+    if (!checkFrame(g_src, TEXT_SIZE, g_dst, cSize, NULL, 0)) {
+        return 0;
+    }
+    i = getStats().memBytes;
+    QZSTD_releaseSeqProdState(states[0]);
+    CHECK(i - getStats().memBytes > 1024 * KB, "Workspace kept by a released state");
+    if (!resetCCtx(3) || !restartQat(&options)) {
+        return 0;
+    }
+    CHECK(getStats().memBytes == memBytes, "Cached state not freed at stop");
+
+    CHECK(0 == pthread_create(&thread, NULL, acquireState, &exited) &&
+          0 == pthread_join(thread, NULL), "Cannot run a thread");
+    CHECK(1 == getStats().statePoolStates, "State of an exited thread not pooled");
+    CHECK(QZSTD_acquireSeqProdState() == exited, "State of an exited thread not reused");
+    QZSTD_releaseSeqProdState(exited);
+
+    for (i = 0; i < POOL_STATES; i++) {
+        states[i] = QZSTD_acquireSeqProdState();
+        CHECK(NULL != states[i], "Cannot acquire a state");
+    }
+    for (i = 0; i < POOL_STATES; i++) {
+        QZSTD_releaseSeqProdState(states[i]);
+    }
+    CHECK(64 == getStats().statePoolStates, "%lu states pooled",
+          (unsigned long)getStats().statePoolStates);
+    if (!restartQat(&options)) {
+        return 0;
+    }
+    CHECK(0 == getStats().statePoolStates && getStats().memBytes == memBytes,
+          "State pool not freed at stop");
+    return 1;
+}
+
+static const testCase_t g_tests[] = {
+    { "levels", testLevels },
+    { "hybridLevels", testHybridLevels },
+    { "postOptimize", testPostOptimize },
+    { "smallWindows", testSmallWindows },
+    { "checksum", testChecksum },
+    { "lz4", testLz4 },
+    { "estimate", testEstimate },
+    { "ldm", testLdm },
+    { "ldmFrames", testLdmFrames },
+    { "ldmStream", testLdmStream },
+    { "dict", testDict },
+    { "dictFrames", testDictFrames },
+    { "dictFlush", testDictFlush },
+    { "timeout", testTimeout },
+    { "eagerInit", testEagerInit },
+    { "statePool", testStatePool },
+    { "customMem", testCustomMem },
+    { "levelProfiles", testLevelProfiles },
+    { "adaptiveLevel", testAdaptiveLevel },
+    { "parseSwFaults", testParseSwFaults },
+    { "swFaults", testSwFaults },
+    { "capture", testCapture },
+};
+
+int main(void)
+{
+    QZSTD_StartOptions_T options;
+    size_t i, failed = 0;
+
+    memset(&options, 0, sizeof(options));
+    options.backend = QZSTD_BACKEND_SW;
+    if (QZSTD_OK != QZSTD_startQatDeviceEx(&options)) {
+        DISPLAY("Cannot start the software engine\n");
+        return 1;
+    }
+    g_zc = ZSTD_createCCtx();
+    g_zdc = ZSTD_createDCtx();
+    g_src = (unsigned char *)malloc(BUF_SIZE);
+    g_dst = (unsigned char *)malloc(ZSTD_compressBound(BUF_SIZE));
+    g_decomp = (unsigned char *)malloc(BUF_SIZE);
+    g_dict = (unsigned char *)malloc(DICT_SIZE);
+    if (NULL == g_zc || NULL == g_zdc || NULL == g_src || NULL == g_dst ||
+        NULL == g_decomp || NULL == g_dict) {
+        DISPLAY("Out of memory\n");
+        return 1;
+    }
+    genText(g_dict, DICT_SIZE);
+
+    for (i = 0; i < sizeof(g_tests) / sizeof(g_tests[0]); i++) {
+        /* Every test starts with a state of default parameters */
+        g_matchState = QZSTD_createSeqProdState();
+        if (NULL == g_matchState) {
+            DISPLAY("Cannot create a sequence producer state\n");
+            return 1;
+        }
+        if (g_tests[i].run()) {
+            DISPLAY("%-16s PASS\n", g_tests[i].name);
+        } else {
+            DISPLAY("%-16s FAIL\n", g_tests[i].name);
+            failed++;
+        }
+        QZSTD_freeSeqProdState(g_matchState);
+    }
+
+    ZSTD_freeCCtx(g_zc);
+    ZSTD_freeDCtx(g_zdc);
+    free(g_src);
+    free(g_dst);
+    free(g_decomp);
+    free(g_dict);
+    QZSTD_stopQatDevice();
+    if (failed) {
+        DISPLAY("%lu of %lu tests failed\n", (unsigned long)failed,
+                (unsigned long)(sizeof(g_tests) / sizeof(g_tests[0])));
+        return 1;
+    }
+    return 0;
+}